@@ -0,0 +1,68 @@
+#include "adc.h"
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+Adc_input_t *adc_create(void) {
+  Adc_input_t *input = calloc(1, sizeof(Adc_input_t));
+  if (input != NULL) {
+    input->avcc = ADC_AVCC;
+  }
+  return input;
+}
+
+bool adc_map(Adc_input_t *input, uint8_t channel, const char *filename, Adc_format_t format, uint32_t rate) {
+  // The kernel pages the file in as the emulated time reaches it, hours of samples cost no memory up front
+  size_t sample_size = format == ADC_INT16 ? sizeof(int16_t) : sizeof(float);
+  if (channel >= ADC_CHANNELS || rate == 0) {
+    return false;
+  }
+  int file = open(filename, O_RDONLY);
+  if (file == -1) {
+    return false;
+  }
+  struct stat info;
+  if (fstat(file, &info) != 0 || info.st_size < (off_t)sample_size) {
+    close(file);
+    return false;
+  }
+  void *samples = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+  close(file);
+  if (samples == MAP_FAILED) {
+    return false;
+  }
+  madvise(samples, info.st_size, MADV_SEQUENTIAL);
+  adc_unmap(input, channel);
+  Adc_channel_t *mapped = input->channels + channel;
+  mapped->samples = samples;
+  mapped->size = info.st_size;
+  mapped->count = info.st_size / sample_size;
+  mapped->rate = rate;
+  mapped->format = format;
+  return true;
+}
+
+void adc_unmap(Adc_input_t *input, uint8_t channel) {
+  if (channel >= ADC_CHANNELS || input->channels[channel].samples == NULL) {
+    return;
+  }
+  munmap((void *)input->channels[channel].samples, input->channels[channel].size);
+  input->channels[channel].samples = NULL;
+  input->channels[channel].count = 0;
+}
+
+void adc_attach(ATmega328p_t *instance, const Adc_input_t *input) {
+  instance->host.adc = input;
+}
+
+void adc_destroy(Adc_input_t *input) {
+  if (input == NULL) {
+    return;
+  }
+  for (uint8_t channel = 0; channel < ADC_CHANNELS; channel++) {
+    adc_unmap(input, channel);
+  }
+  free(input);
+}
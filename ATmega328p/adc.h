@@ -0,0 +1,23 @@
+#ifndef __ADC_
+#define __ADC_
+
+/*
+  Analog inputs for the ADC. Every channel reads a memory mapped file of raw samples,
+  either int16 ADC results or float volts, at a fixed sample rate of emulated time.
+  Conversions look the sample up directly, so no host code runs per sample
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "atmega328p.h"
+
+#define ADC_AVCC 5.0f // default supply and reference voltage
+
+Adc_input_t *adc_create(void); // all channels unconnected
+bool adc_map(Adc_input_t *input, uint8_t channel, const char *filename, Adc_format_t format, uint32_t rate);
+void adc_unmap(Adc_input_t *input, uint8_t channel);
+void adc_attach(ATmega328p_t *instance, const Adc_input_t *input); // NULL disconnects, inputs can be shared
+void adc_destroy(Adc_input_t *input); // unmaps every channel
+
+#endif // __ADC_
@@ -1,5 +1,10 @@
 #include "atmega328p.h"
 #include "instructions.h"
+#include "trace.h"
+#include "vcd.h"
+#include "log.h"
+#include "snapshot.h"
+#include "inbox.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,6 +14,7 @@
 #include <stdarg.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <pthread.h>
 
 #if defined(SHARED)
 
@@ -26,17 +32,48 @@
 
 #endif
 
-#define DEBUG_MODE 1
+#ifndef DEBUG_MODE
+  #define DEBUG_MODE 1
+#endif
 #define BUFFER_LENGTH 1024
 
+static ATmega328p_t mcu_instance; // used until mcu_select picks another instance
+static __thread ATmega328p_t *mcu __attribute__((tls_model("initial-exec"))) = &mcu_instance;
+
+static int log_args(const Log_level_t level, const char *format, va_list args) {
+  // Into the log of the instance if it has one, levels it does not record are not even formatted
+  if (mcu->host.log == NULL) {
+    int a = printf(level == LOG_ERROR ? RED "MCU exception!\n" : CYAN "[Debug] ");
+    a += vfprintf(stdout, format, args);
+    return a + printf(RESET);
+  }
+  if (level > mcu->host.log->level) {
+    return 0;
+  }
+  char text[BUFFER_LENGTH];
+  int length = vsnprintf(text, sizeof(text), format, args);
+  length = length < 0 ? 0 : length < (int)sizeof(text) ? length : (int)sizeof(text) - 1;
+  log_write(mcu->host.log, level, text, length);
+  return length;
+}
+
 static inline int print(const char *format, ...) {
   int a = 0;
   #if DEBUG_MODE == 1
     va_list args;
     va_start(args, format);
-    a += printf(CYAN "[Debug] ");
-    a += vfprintf(stdout, format, args);
-    a += printf(RESET);
+    a = log_args(LOG_INFO, format, args);
+    va_end(args);
+  #endif
+  return a;
+}
+
+static inline int print_verbose(const char *format, ...) {
+  int a = 0;
+  #if DEBUG_MODE == 1
+    va_list args;
+    va_start(args, format);
+    a = log_args(LOG_VERBOSE, format, args);
     va_end(args);
   #endif
   return a;
@@ -51,6 +88,98 @@ static inline int print(const char *format, ...) {
 #define CLOCK_SPEED (KHz)
 #define CLOCK_FREQ (SEC / CLOCK_SPEED)
 #define TMP "./tmp/"
+#define ELF_MAGIC "\x7F" "ELF"
+#define ELF_CLASS_32 1
+#define ELF_LITTLE_ENDIAN 1
+#define ELF_MACHINE_AVR 83
+#define ELF_HEADER_SIZE 52
+#define ELF_SEGMENT_SIZE 32 // program header
+#define ELF_SEGMENT_LOAD 1
+#define ELF_DATA_START 0x800000 // physical addresses avr-gcc gives data memory
+#define ELF_EEPROM_START 0x810000
+#define INTERRUPT_CYCLES 4 // pushing PC and jumping to the vector
+#define WAKE_UP_CYCLES 4 // added to the interrupt response in sleep mode
+#define WATCHDOG_FREQUENCY (128 * KHz)
+#define WATCHDOG_CHANGE_CYCLES 4 // length of the timed sequence
+#define MCUSR_ADDRESS 0x54
+#define MCUSR_WDRF (1 << 3)
+#define WDTCSR_ADDRESS 0x60
+#define WDTCSR_WDIF (1 << 7)
+#define WDTCSR_WDIE (1 << 6)
+#define WDTCSR_WDP3 (1 << 5)
+#define WDTCSR_WDCE (1 << 4)
+#define WDTCSR_WDE (1 << 3)
+#define WDTCSR_WDP 0b111
+#define ADCL_ADDRESS 0x78
+#define ADCH_ADDRESS 0x79
+#define ADCSRA_ADDRESS 0x7A
+#define ADCSRA_ADEN (1 << 7)
+#define ADCSRA_ADSC (1 << 6)
+#define ADCSRA_ADATE (1 << 5)
+#define ADCSRA_ADIF (1 << 4)
+#define ADCSRA_ADIE (1 << 3)
+#define ADCSRA_ADPS 0b111
+#define ADCSRB_ADDRESS 0x7B
+#define ADCSRB_ADTS 0b111
+#define ADMUX_ADDRESS 0x7C
+#define ADMUX_REFS 0b11000000
+#define ADMUX_ADLAR (1 << 5)
+#define ADMUX_MUX 0b1111
+#define PINB_ADDRESS 0x23 // PINx, DDRx and PORTx of port B, C and D follow each other
+#define PCIFR_ADDRESS 0x3B
+#define EIFR_ADDRESS 0x3C
+#define EIMSK_ADDRESS 0x3D
+#define PCICR_ADDRESS 0x68
+#define EICRA_ADDRESS 0x69
+#define PCMSK0_ADDRESS 0x6B // PCMSK1 and PCMSK2 follow
+#define INT0_PIN 2 // on port D, INT1 is the next pin
+#define SPCR_ADDRESS 0x4C
+#define SPCR_SPIE (1 << 7)
+#define SPCR_SPE (1 << 6)
+#define SPCR_DORD (1 << 5)
+#define SPCR_MSTR (1 << 4)
+#define SPCR_SPR 0b11
+#define SPSR_ADDRESS 0x4D
+#define SPSR_SPIF (1 << 7)
+#define SPSR_WCOL (1 << 6)
+#define SPSR_SPI2X (1 << 0)
+#define SPDR_ADDRESS 0x4E
+#define TWBR_ADDRESS 0xB8
+#define TWSR_ADDRESS 0xB9
+#define TWSR_TWPS 0b11
+#define TWDR_ADDRESS 0xBB
+#define TWCR_ADDRESS 0xBC
+#define TWCR_TWINT (1 << 7)
+#define TWCR_TWEA (1 << 6)
+#define TWCR_TWSTA (1 << 5)
+#define TWCR_TWSTO (1 << 4)
+#define TWCR_TWWC (1 << 3)
+#define TWCR_TWEN (1 << 2)
+#define TWCR_TWIE (1 << 0)
+#define TWI_NO_INFO 0xF8 // TWSR status while TWINT is clear
+#define UCSR0A_ADDRESS 0xC0
+#define UCSR0A_RXC0 (1 << 7)
+#define UCSR0A_TXC0 (1 << 6)
+#define UCSR0A_UDRE0 (1 << 5)
+#define UCSR0A_DOR0 (1 << 3)
+#define UCSR0A_WRITABLE 0b11 // U2X0 and MPCM0
+#define UCSR0B_ADDRESS 0xC1
+#define UCSR0B_RXCIE0 (1 << 7)
+#define UCSR0B_TXCIE0 (1 << 6)
+#define UCSR0B_UDRIE0 (1 << 5)
+#define UCSR0B_RXEN0 (1 << 4)
+#define UCSR0B_TXEN0 (1 << 3)
+#define UDR0_ADDRESS 0xC6
+#define SS_PIN 2 // on port B, selects the SPI slave
+// Running TWI actions
+#define TWI_IDLE 0
+#define TWI_START 1
+#define TWI_ADDRESS 2
+#define TWI_WRITE 3
+#define TWI_READ 4
+#define ADC_BANDGAP 1.1f // volts, also the internal reference
+#define ADC_CLOCKS 13 // per conversion
+#define ADC_FIRST_CLOCKS 25 // first conversion after enabling
 
 typedef struct {
   int16_t number : 12;
@@ -73,7 +202,7 @@ static inline void print_bits(uint32_t number) {
   print("0x%.8X bits\n%s\n", number, bits);
 }
 
-static ATmega328p_t mcu;
+static pthread_once_t lookup_once = PTHREAD_ONCE_INIT;
 static const Instruction_t *opcode_lookup[LOOKUP_SIZE];
 
 static inline void ADD(const uint32_t opcode) {
@@ -82,15 +211,15 @@ static inline void ADD(const uint32_t opcode) {
   reg_d |= B_GET(opcode, 8) >> 4;
   uint8_t reg_r = (opcode & 0xF);
   reg_r |= B_GET(opcode, 9) >> 5;
-  uint8_t result = mcu.R[reg_d] + mcu.R[reg_r];
-  mcu.SREG.flags.H = !!(B_GET(mcu.R[reg_d], 3) & B_GET(mcu.R[reg_r], 3) | B_GET(mcu.R[reg_r], 3) & ~B_GET(result, 3) | ~B_GET(result, 3) & B_GET(mcu.R[reg_d], 3));
-  mcu.SREG.flags.V = !!(B_GET(mcu.R[reg_d], 7) & B_GET(mcu.R[reg_r], 7) & ~B_GET(result, 7) | ~B_GET(mcu.R[reg_d], 7) & ~B_GET(mcu.R[reg_r], 7) & B_GET(result, 7));
-  mcu.SREG.flags.N = !!B_GET(result, 7);
-  mcu.SREG.flags.S = mcu.SREG.flags.N ^ mcu.SREG.flags.V;
-  mcu.SREG.flags.Z = (result == 0);
-  mcu.SREG.flags.C = !!(B_GET(mcu.R[reg_d], 7) & B_GET(mcu.R[reg_r], 7) | B_GET(mcu.R[reg_r], 7) & ~B_GET(result, 7) | ~B_GET(result, 7) & B_GET(mcu.R[reg_d], 7));
-  mcu.R[reg_d] = result;
-  mcu.pc += 1;
+  uint8_t result = mcu->R[reg_d] + mcu->R[reg_r];
+  mcu->SREG.flags.H = !!(B_GET(mcu->R[reg_d], 3) & B_GET(mcu->R[reg_r], 3) | B_GET(mcu->R[reg_r], 3) & ~B_GET(result, 3) | ~B_GET(result, 3) & B_GET(mcu->R[reg_d], 3));
+  mcu->SREG.flags.V = !!(B_GET(mcu->R[reg_d], 7) & B_GET(mcu->R[reg_r], 7) & ~B_GET(result, 7) | ~B_GET(mcu->R[reg_d], 7) & ~B_GET(mcu->R[reg_r], 7) & B_GET(result, 7));
+  mcu->SREG.flags.N = !!B_GET(result, 7);
+  mcu->SREG.flags.S = mcu->SREG.flags.N ^ mcu->SREG.flags.V;
+  mcu->SREG.flags.Z = (result == 0);
+  mcu->SREG.flags.C = !!(B_GET(mcu->R[reg_d], 7) & B_GET(mcu->R[reg_r], 7) | B_GET(mcu->R[reg_r], 7) & ~B_GET(result, 7) | ~B_GET(result, 7) & B_GET(mcu->R[reg_d], 7));
+  mcu->R[reg_d] = result;
+  mcu->pc += 1;
 }
 
 static inline void ADC(const uint32_t opcode) {
@@ -99,15 +228,15 @@ static inline void ADC(const uint32_t opcode) {
   reg_d |= B_GET(opcode, 8) >> 4;
   uint8_t reg_r = (opcode & 0xF);
   reg_r |= B_GET(opcode, 9) >> 5;
-  uint8_t result = mcu.R[reg_d] + mcu.R[reg_r] + mcu.SREG.flags.C;
-  mcu.SREG.flags.H = !!(B_GET(mcu.R[reg_d], 3) & B_GET(mcu.R[reg_r], 3) | B_GET(mcu.R[reg_r], 3) & ~B_GET(result, 3) | ~B_GET(result, 3) & B_GET(mcu.R[reg_d], 3));
-  mcu.SREG.flags.V = !!(B_GET(mcu.R[reg_d], 7) & B_GET(mcu.R[reg_r], 7) & ~B_GET(result, 7) | ~B_GET(mcu.R[reg_d], 7) & ~B_GET(mcu.R[reg_r], 7) & B_GET(result, 7));
-  mcu.SREG.flags.N = !!B_GET(result, 7);
-  mcu.SREG.flags.S = mcu.SREG.flags.N ^ mcu.SREG.flags.V;
-  mcu.SREG.flags.Z = (result == 0);
-  mcu.SREG.flags.C = !!(B_GET(mcu.R[reg_d], 7) & B_GET(mcu.R[reg_r], 7) | B_GET(mcu.R[reg_r], 7) & ~B_GET(result, 7) | ~B_GET(result, 7) & B_GET(mcu.R[reg_d], 7));
-  mcu.R[reg_d] = result;
-  mcu.pc += 1;
+  uint8_t result = mcu->R[reg_d] + mcu->R[reg_r] + mcu->SREG.flags.C;
+  mcu->SREG.flags.H = !!(B_GET(mcu->R[reg_d], 3) & B_GET(mcu->R[reg_r], 3) | B_GET(mcu->R[reg_r], 3) & ~B_GET(result, 3) | ~B_GET(result, 3) & B_GET(mcu->R[reg_d], 3));
+  mcu->SREG.flags.V = !!(B_GET(mcu->R[reg_d], 7) & B_GET(mcu->R[reg_r], 7) & ~B_GET(result, 7) | ~B_GET(mcu->R[reg_d], 7) & ~B_GET(mcu->R[reg_r], 7) & B_GET(result, 7));
+  mcu->SREG.flags.N = !!B_GET(result, 7);
+  mcu->SREG.flags.S = mcu->SREG.flags.N ^ mcu->SREG.flags.V;
+  mcu->SREG.flags.Z = (result == 0);
+  mcu->SREG.flags.C = !!(B_GET(mcu->R[reg_d], 7) & B_GET(mcu->R[reg_r], 7) | B_GET(mcu->R[reg_r], 7) & ~B_GET(result, 7) | ~B_GET(result, 7) & B_GET(mcu->R[reg_d], 7));
+  mcu->R[reg_d] = result;
+  mcu->pc += 1;
 }
 
 static inline void ADIW(const uint32_t opcode) {
@@ -119,13 +248,13 @@ static inline void ADIW(const uint32_t opcode) {
   reg_d = reg_d * 2 + 24;
   uint16_t rd = word_reg_get(reg_d);
   uint16_t result = rd + k;
-  mcu.SREG.flags.V = !B_GET(rd, 15) & !!B_GET(result, 15);
-  mcu.SREG.flags.N = !!B_GET(result, 15);
-  mcu.SREG.flags.Z = (result == 0);
-  mcu.SREG.flags.C = !B_GET(result, 15) & !!B_GET(rd, 15);
-  mcu.SREG.flags.S = mcu.SREG.flags.N ^ mcu.SREG.flags.V;
+  mcu->SREG.flags.V = !B_GET(rd, 15) & !!B_GET(result, 15);
+  mcu->SREG.flags.N = !!B_GET(result, 15);
+  mcu->SREG.flags.Z = (result == 0);
+  mcu->SREG.flags.C = !B_GET(result, 15) & !!B_GET(rd, 15);
+  mcu->SREG.flags.S = mcu->SREG.flags.N ^ mcu->SREG.flags.V;
   word_reg_set(reg_d, result);
-  mcu.pc += 1;
+  mcu->pc += 1;
 }
 
 static inline void SUB(const uint32_t opcode) {
@@ -134,15 +263,15 @@ static inline void SUB(const uint32_t opcode) {
   reg_d |= B_GET(opcode, 8) >> 4;
   uint8_t reg_r = (opcode & 0xF);
   reg_r |= B_GET(opcode, 9) >> 5;
-  uint8_t result = mcu.R[reg_d] - mcu.R[reg_r];
-  mcu.SREG.flags.H = !!(~B_GET(mcu.R[reg_d], 3) & B_GET(mcu.R[reg_r], 3) | B_GET(mcu.R[reg_r], 3) & B_GET(result, 3) | B_GET(result, 3) & ~B_GET(mcu.R[reg_d], 3));
-  mcu.SREG.flags.V = !!(B_GET(mcu.R[reg_d], 7) & ~B_GET(mcu.R[reg_r], 7) & ~B_GET(result, 7) | ~B_GET(mcu.R[reg_d], 7) & B_GET(mcu.R[reg_r], 7) & B_GET(result, 7));
-  mcu.SREG.flags.N = !!B_GET(result, 7);
-  mcu.SREG.flags.Z = (result == 0);
-  mcu.SREG.flags.C = !!(~B_GET(mcu.R[reg_d], 7) & B_GET(mcu.R[reg_r], 7) | B_GET(mcu.R[reg_r], 7) & B_GET(result, 7) | B_GET(result, 7) & ~B_GET(mcu.R[reg_d], 7));
-  mcu.SREG.flags.S = mcu.SREG.flags.N ^ mcu.SREG.flags.V;
-  mcu.R[reg_d] = result;
-  mcu.pc += 1;
+  uint8_t result = mcu->R[reg_d] - mcu->R[reg_r];
+  mcu->SREG.flags.H = !!(~B_GET(mcu->R[reg_d], 3) & B_GET(mcu->R[reg_r], 3) | B_GET(mcu->R[reg_r], 3) & B_GET(result, 3) | B_GET(result, 3) & ~B_GET(mcu->R[reg_d], 3));
+  mcu->SREG.flags.V = !!(B_GET(mcu->R[reg_d], 7) & ~B_GET(mcu->R[reg_r], 7) & ~B_GET(result, 7) | ~B_GET(mcu->R[reg_d], 7) & B_GET(mcu->R[reg_r], 7) & B_GET(result, 7));
+  mcu->SREG.flags.N = !!B_GET(result, 7);
+  mcu->SREG.flags.Z = (result == 0);
+  mcu->SREG.flags.C = !!(~B_GET(mcu->R[reg_d], 7) & B_GET(mcu->R[reg_r], 7) | B_GET(mcu->R[reg_r], 7) & B_GET(result, 7) | B_GET(result, 7) & ~B_GET(mcu->R[reg_d], 7));
+  mcu->SREG.flags.S = mcu->SREG.flags.N ^ mcu->SREG.flags.V;
+  mcu->R[reg_d] = result;
+  mcu->pc += 1;
 }
 
 static inline void SUBI(const uint32_t opcode) {
@@ -150,15 +279,15 @@ static inline void SUBI(const uint32_t opcode) {
   uint8_t reg_d = (opcode & 0xF0) >> 4;
   reg_d += 16;
   uint8_t k = (opcode & 0xF) | ((opcode & 0xF00) >> 4);
-  uint8_t result = mcu.R[reg_d] - k;
-  mcu.SREG.flags.H = !!(~B_GET(mcu.R[reg_d], 3) & B_GET(k, 3) | B_GET(k, 3) & B_GET(result, 3) | B_GET(result, 3) & ~B_GET(mcu.R[reg_d], 3));
-  mcu.SREG.flags.V = !!(B_GET(mcu.R[reg_d], 7) & ~B_GET(k, 7) & ~B_GET(result, 7) | ~B_GET(mcu.R[reg_d], 7) & B_GET(k, 7) & B_GET(result, 7));
-  mcu.SREG.flags.N = !!B_GET(result, 7);
-  mcu.SREG.flags.Z = (result == 0);
-  mcu.SREG.flags.C = !!(~B_GET(mcu.R[reg_d], 7) & B_GET(k, 7) | B_GET(k, 7) & B_GET(result, 7) | B_GET(result, 7) & ~B_GET(mcu.R[reg_d], 7));
-  mcu.SREG.flags.S = mcu.SREG.flags.N ^ mcu.SREG.flags.V;
-  mcu.R[reg_d] = result;
-  mcu.pc += 1;
+  uint8_t result = mcu->R[reg_d] - k;
+  mcu->SREG.flags.H = !!(~B_GET(mcu->R[reg_d], 3) & B_GET(k, 3) | B_GET(k, 3) & B_GET(result, 3) | B_GET(result, 3) & ~B_GET(mcu->R[reg_d], 3));
+  mcu->SREG.flags.V = !!(B_GET(mcu->R[reg_d], 7) & ~B_GET(k, 7) & ~B_GET(result, 7) | ~B_GET(mcu->R[reg_d], 7) & B_GET(k, 7) & B_GET(result, 7));
+  mcu->SREG.flags.N = !!B_GET(result, 7);
+  mcu->SREG.flags.Z = (result == 0);
+  mcu->SREG.flags.C = !!(~B_GET(mcu->R[reg_d], 7) & B_GET(k, 7) | B_GET(k, 7) & B_GET(result, 7) | B_GET(result, 7) & ~B_GET(mcu->R[reg_d], 7));
+  mcu->SREG.flags.S = mcu->SREG.flags.N ^ mcu->SREG.flags.V;
+  mcu->R[reg_d] = result;
+  mcu->pc += 1;
 }
 
 static inline void SBC(const uint32_t opcode) {
@@ -167,15 +296,15 @@ static inline void SBC(const uint32_t opcode) {
   reg_d |= B_GET(opcode, 8) >> 4;
   uint8_t reg_r = (opcode & 0xF);
   reg_r |= B_GET(opcode, 9) >> 5;
-  uint8_t result = mcu.R[reg_d] - mcu.R[reg_r] - mcu.SREG.flags.C;
-  mcu.SREG.flags.H = !!(~B_GET(mcu.R[reg_d], 3) & B_GET(mcu.R[reg_r], 3) | B_GET(mcu.R[reg_r], 3) & B_GET(result, 3) | B_GET(result, 3) & ~B_GET(mcu.R[reg_d], 3));
-  mcu.SREG.flags.V = !!(B_GET(mcu.R[reg_d], 7) & ~B_GET(mcu.R[reg_r], 7) & ~B_GET(result, 7) | ~B_GET(mcu.R[reg_d], 7) & B_GET(mcu.R[reg_r], 7) & B_GET(result, 7));
-  mcu.SREG.flags.N = !!B_GET(result, 7);
-  mcu.SREG.flags.Z = (result == 0) & mcu.SREG.flags.Z;
-  mcu.SREG.flags.C = !!(~B_GET(mcu.R[reg_d], 7) & B_GET(mcu.R[reg_r], 7) | B_GET(mcu.R[reg_r], 7) & B_GET(result, 7) | B_GET(result, 7) & ~B_GET(mcu.R[reg_d], 7));
-  mcu.SREG.flags.S = mcu.SREG.flags.N ^ mcu.SREG.flags.V;
-  mcu.R[reg_d] = result;
-  mcu.pc += 1;
+  uint8_t result = mcu->R[reg_d] - mcu->R[reg_r] - mcu->SREG.flags.C;
+  mcu->SREG.flags.H = !!(~B_GET(mcu->R[reg_d], 3) & B_GET(mcu->R[reg_r], 3) | B_GET(mcu->R[reg_r], 3) & B_GET(result, 3) | B_GET(result, 3) & ~B_GET(mcu->R[reg_d], 3));
+  mcu->SREG.flags.V = !!(B_GET(mcu->R[reg_d], 7) & ~B_GET(mcu->R[reg_r], 7) & ~B_GET(result, 7) | ~B_GET(mcu->R[reg_d], 7) & B_GET(mcu->R[reg_r], 7) & B_GET(result, 7));
+  mcu->SREG.flags.N = !!B_GET(result, 7);
+  mcu->SREG.flags.Z = (result == 0) & mcu->SREG.flags.Z;
+  mcu->SREG.flags.C = !!(~B_GET(mcu->R[reg_d], 7) & B_GET(mcu->R[reg_r], 7) | B_GET(mcu->R[reg_r], 7) & B_GET(result, 7) | B_GET(result, 7) & ~B_GET(mcu->R[reg_d], 7));
+  mcu->SREG.flags.S = mcu->SREG.flags.N ^ mcu->SREG.flags.V;
+  mcu->R[reg_d] = result;
+  mcu->pc += 1;
 }
 
 static inline void SBCI(const uint32_t opcode) {
@@ -183,15 +312,15 @@ static inline void SBCI(const uint32_t opcode) {
   uint8_t reg_d = (opcode & 0xF0) >> 4;
   reg_d += 16;
   uint8_t k = (opcode & 0xF) | ((opcode & 0xF00) >> 4);
-  uint8_t result = mcu.R[reg_d] - k - mcu.SREG.flags.C;
-  mcu.SREG.flags.H = !!(~B_GET(mcu.R[reg_d], 3) & B_GET(k, 3) | B_GET(k, 3) & B_GET(result, 3) | B_GET(result, 3) & ~B_GET(mcu.R[reg_d], 3));
-  mcu.SREG.flags.V = !!(B_GET(mcu.R[reg_d], 7) & ~B_GET(k, 7) & ~B_GET(result, 7) | ~B_GET(mcu.R[reg_d], 7) & B_GET(k, 7) & B_GET(result, 7));
-  mcu.SREG.flags.N = !!B_GET(result, 7);
-  mcu.SREG.flags.Z = (result == 0) & mcu.SREG.flags.Z;
-  mcu.SREG.flags.C = !!(~B_GET(mcu.R[reg_d], 7) & B_GET(k, 7) | B_GET(k, 7) & B_GET(result, 7) | B_GET(result, 7) & ~B_GET(mcu.R[reg_d], 7));
-  mcu.SREG.flags.S = mcu.SREG.flags.N ^ mcu.SREG.flags.V;
-  mcu.R[reg_d] = result;
-  mcu.pc += 1;
+  uint8_t result = mcu->R[reg_d] - k - mcu->SREG.flags.C;
+  mcu->SREG.flags.H = !!(~B_GET(mcu->R[reg_d], 3) & B_GET(k, 3) | B_GET(k, 3) & B_GET(result, 3) | B_GET(result, 3) & ~B_GET(mcu->R[reg_d], 3));
+  mcu->SREG.flags.V = !!(B_GET(mcu->R[reg_d], 7) & ~B_GET(k, 7) & ~B_GET(result, 7) | ~B_GET(mcu->R[reg_d], 7) & B_GET(k, 7) & B_GET(result, 7));
+  mcu->SREG.flags.N = !!B_GET(result, 7);
+  mcu->SREG.flags.Z = (result == 0) & mcu->SREG.flags.Z;
+  mcu->SREG.flags.C = !!(~B_GET(mcu->R[reg_d], 7) & B_GET(k, 7) | B_GET(k, 7) & B_GET(result, 7) | B_GET(result, 7) & ~B_GET(mcu->R[reg_d], 7));
+  mcu->SREG.flags.S = mcu->SREG.flags.N ^ mcu->SREG.flags.V;
+  mcu->R[reg_d] = result;
+  mcu->pc += 1;
 }
 
 static inline void SBIW(const uint32_t opcode) {
@@ -203,13 +332,13 @@ static inline void SBIW(const uint32_t opcode) {
   reg_d = reg_d * 2 + 24;
   uint16_t rd = word_reg_get(reg_d);
   uint16_t result = rd - k;
-  mcu.SREG.flags.V = !!B_GET(result, 15) & !B_GET(rd, 15);
-  mcu.SREG.flags.N = !!B_GET(result, 15);
-  mcu.SREG.flags.Z = (result == 0);
-  mcu.SREG.flags.C = !!B_GET(result, 15) & !B_GET(rd, 15);
-  mcu.SREG.flags.S = mcu.SREG.flags.N ^ mcu.SREG.flags.V;
+  mcu->SREG.flags.V = !!B_GET(result, 15) & !B_GET(rd, 15);
+  mcu->SREG.flags.N = !!B_GET(result, 15);
+  mcu->SREG.flags.Z = (result == 0);
+  mcu->SREG.flags.C = !!B_GET(result, 15) & !B_GET(rd, 15);
+  mcu->SREG.flags.S = mcu->SREG.flags.N ^ mcu->SREG.flags.V;
   word_reg_set(reg_d, result);
-  mcu.pc += 1;
+  mcu->pc += 1;
 }
 
 static inline void AND(const uint32_t opcode) {
@@ -218,13 +347,13 @@ static inline void AND(const uint32_t opcode) {
   reg_d |= B_GET(opcode, 8) >> 4;
   uint8_t reg_r = (opcode & 0xF);
   reg_r |= B_GET(opcode, 9) >> 5;
-  uint8_t result = mcu.R[reg_d] & mcu.R[reg_r];
-  mcu.SREG.flags.V = 0;
-  mcu.SREG.flags.N = !!B_GET(result, 7);
-  mcu.SREG.flags.Z = (result == 0);
-  mcu.SREG.flags.S = mcu.SREG.flags.N ^ mcu.SREG.flags.V;
-  mcu.R[reg_d] = result;
-  mcu.pc += 1;
+  uint8_t result = mcu->R[reg_d] & mcu->R[reg_r];
+  mcu->SREG.flags.V = 0;
+  mcu->SREG.flags.N = !!B_GET(result, 7);
+  mcu->SREG.flags.Z = (result == 0);
+  mcu->SREG.flags.S = mcu->SREG.flags.N ^ mcu->SREG.flags.V;
+  mcu->R[reg_d] = result;
+  mcu->pc += 1;
 }
 
 static inline void ANDI(const uint32_t opcode) {
@@ -233,13 +362,13 @@ static inline void ANDI(const uint32_t opcode) {
   k |= (opcode & 0xF00) >> 4;
   uint8_t reg_d = (opcode & 0xF0) >> 4;
   reg_d += 16;
-  uint16_t result = mcu.R[reg_d] & k;
-  mcu.SREG.flags.V = 0;
-  mcu.SREG.flags.N = !!B_GET(result, 7);
-  mcu.SREG.flags.Z = (result == 0);
-  mcu.SREG.flags.S = mcu.SREG.flags.N ^ mcu.SREG.flags.V;
-  mcu.R[reg_d] = result;
-  mcu.pc += 1;
+  uint16_t result = mcu->R[reg_d] & k;
+  mcu->SREG.flags.V = 0;
+  mcu->SREG.flags.N = !!B_GET(result, 7);
+  mcu->SREG.flags.Z = (result == 0);
+  mcu->SREG.flags.S = mcu->SREG.flags.N ^ mcu->SREG.flags.V;
+  mcu->R[reg_d] = result;
+  mcu->pc += 1;
 }
 
 static inline void OR(const uint32_t opcode) {
@@ -248,13 +377,13 @@ static inline void OR(const uint32_t opcode) {
   reg_d |= B_GET(opcode, 8) >> 4;
   uint8_t reg_r = (opcode & 0xF);
   reg_r |= B_GET(opcode, 9) >> 5;
-  uint8_t result = mcu.R[reg_d] | mcu.R[reg_r];
-  mcu.SREG.flags.V = 0;
-  mcu.SREG.flags.N = !!B_GET(result, 7);
-  mcu.SREG.flags.Z = (result == 0);
-  mcu.SREG.flags.S = mcu.SREG.flags.N ^ mcu.SREG.flags.V;
-  mcu.R[reg_d] = result;
-  mcu.pc += 1;
+  uint8_t result = mcu->R[reg_d] | mcu->R[reg_r];
+  mcu->SREG.flags.V = 0;
+  mcu->SREG.flags.N = !!B_GET(result, 7);
+  mcu->SREG.flags.Z = (result == 0);
+  mcu->SREG.flags.S = mcu->SREG.flags.N ^ mcu->SREG.flags.V;
+  mcu->R[reg_d] = result;
+  mcu->pc += 1;
 }
 
 static inline void ORI(const uint32_t opcode) {
@@ -263,13 +392,13 @@ static inline void ORI(const uint32_t opcode) {
   k |= (opcode & 0xF00) >> 4;
   uint8_t reg_d = (opcode & 0xF0) >> 4;
   reg_d += 16;
-  uint16_t result = mcu.R[reg_d] | k;
-  mcu.SREG.flags.V = 0;
-  mcu.SREG.flags.N = !!B_GET(result, 7);
-  mcu.SREG.flags.Z = (result == 0);
-  mcu.SREG.flags.S = mcu.SREG.flags.N ^ mcu.SREG.flags.V;
-  mcu.R[reg_d] = result;
-  mcu.pc += 1;
+  uint16_t result = mcu->R[reg_d] | k;
+  mcu->SREG.flags.V = 0;
+  mcu->SREG.flags.N = !!B_GET(result, 7);
+  mcu->SREG.flags.Z = (result == 0);
+  mcu->SREG.flags.S = mcu->SREG.flags.N ^ mcu->SREG.flags.V;
+  mcu->R[reg_d] = result;
+  mcu->pc += 1;
 }
 
 static inline void EOR(const uint32_t opcode) {
@@ -278,74 +407,74 @@ static inline void EOR(const uint32_t opcode) {
   reg_d |= B_GET(opcode, 8) >> 4;
   uint8_t reg_r = (opcode & 0xF);
   reg_r |= B_GET(opcode, 9) >> 5;
-  uint8_t result = mcu.R[reg_d] ^ mcu.R[reg_r];
-  mcu.SREG.flags.V = 0;
-  mcu.SREG.flags.N = !!B_GET(result, 7);
-  mcu.SREG.flags.Z = (result == 0);
-  mcu.SREG.flags.S = mcu.SREG.flags.N ^ mcu.SREG.flags.V;
-  mcu.R[reg_d] = result;
-  mcu.pc += 1;
+  uint8_t result = mcu->R[reg_d] ^ mcu->R[reg_r];
+  mcu->SREG.flags.V = 0;
+  mcu->SREG.flags.N = !!B_GET(result, 7);
+  mcu->SREG.flags.Z = (result == 0);
+  mcu->SREG.flags.S = mcu->SREG.flags.N ^ mcu->SREG.flags.V;
+  mcu->R[reg_d] = result;
+  mcu->pc += 1;
 }
 
 static inline void COM(const uint32_t opcode) {
   // 1001 010d dddd 0000
   uint8_t reg_d = (opcode & 0xF0) >> 4;
   reg_d |= B_GET(opcode, 8) >> 4;
-  uint8_t result = 0xFF - mcu.R[reg_d];
-  mcu.SREG.flags.V = 0;
-  mcu.SREG.flags.N = !!B_GET(result, 7);
-  mcu.SREG.flags.Z = (result == 0);
-  mcu.SREG.flags.C = 1;
-  mcu.SREG.flags.S = mcu.SREG.flags.N ^ mcu.SREG.flags.V;
-  mcu.R[reg_d] = result;
-  mcu.pc += 1;
+  uint8_t result = 0xFF - mcu->R[reg_d];
+  mcu->SREG.flags.V = 0;
+  mcu->SREG.flags.N = !!B_GET(result, 7);
+  mcu->SREG.flags.Z = (result == 0);
+  mcu->SREG.flags.C = 1;
+  mcu->SREG.flags.S = mcu->SREG.flags.N ^ mcu->SREG.flags.V;
+  mcu->R[reg_d] = result;
+  mcu->pc += 1;
 }
 
 static inline void NEG(const uint32_t opcode) {
   // 1001 010d dddd 0001
   uint8_t reg_d = (opcode & 0xF0) >> 4;
   reg_d |= B_GET(opcode, 8) >> 4;
-  uint8_t result = 0x00 - mcu.R[reg_d];
-  mcu.SREG.flags.H = !!B_GET(result, 3) | !B_GET(mcu.R[reg_d], 3); //TD: check H
-  mcu.SREG.flags.V = !!B_GET(result, 7) & ((result & 0b01111111) == 0);
-  mcu.SREG.flags.N = !!B_GET(result, 7);
-  mcu.SREG.flags.Z = (result == 0);
-  mcu.SREG.flags.C = (result != 0);
-  mcu.SREG.flags.S = mcu.SREG.flags.N ^ mcu.SREG.flags.V;
-  mcu.R[reg_d] = result;
-  mcu.pc += 1;
+  uint8_t result = 0x00 - mcu->R[reg_d];
+  mcu->SREG.flags.H = !!B_GET(result, 3) | !B_GET(mcu->R[reg_d], 3); //TD: check H
+  mcu->SREG.flags.V = !!B_GET(result, 7) & ((result & 0b01111111) == 0);
+  mcu->SREG.flags.N = !!B_GET(result, 7);
+  mcu->SREG.flags.Z = (result == 0);
+  mcu->SREG.flags.C = (result != 0);
+  mcu->SREG.flags.S = mcu->SREG.flags.N ^ mcu->SREG.flags.V;
+  mcu->R[reg_d] = result;
+  mcu->pc += 1;
 }
 
 static inline void INC(const uint32_t opcode) {
   // 1001 010d dddd 0011
   uint8_t reg_d = (opcode & 0xF0) >> 4;
   reg_d |= B_GET(opcode, 8) >> 4;
-  mcu.R[reg_d] = mcu.R[reg_d] + 1;
-  mcu.SREG.flags.V = !!B_GET(mcu.R[reg_d], 7) & ((mcu.R[reg_d] & 0b01111111) == 0);
-  mcu.SREG.flags.N = !!B_GET(mcu.R[reg_d], 7);
-  mcu.SREG.flags.Z = (mcu.R[reg_d] == 0);
-  mcu.SREG.flags.S = mcu.SREG.flags.N ^ mcu.SREG.flags.V;
-  mcu.pc += 1;
+  mcu->R[reg_d] = mcu->R[reg_d] + 1;
+  mcu->SREG.flags.V = !!B_GET(mcu->R[reg_d], 7) & ((mcu->R[reg_d] & 0b01111111) == 0);
+  mcu->SREG.flags.N = !!B_GET(mcu->R[reg_d], 7);
+  mcu->SREG.flags.Z = (mcu->R[reg_d] == 0);
+  mcu->SREG.flags.S = mcu->SREG.flags.N ^ mcu->SREG.flags.V;
+  mcu->pc += 1;
 }
 
 static inline void DEC(const uint32_t opcode) {
   // 1001 010d dddd 1010
   uint8_t reg_d = (opcode & 0xF0) >> 4;
   reg_d |= B_GET(opcode, 8) >> 4;
-  mcu.R[reg_d] = mcu.R[reg_d] - 1;
-  mcu.SREG.flags.V = !B_GET(mcu.R[reg_d], 7) & ((mcu.R[reg_d] & 0b01111111) == 0b01111111);
-  mcu.SREG.flags.N = !!B_GET(mcu.R[reg_d], 7);
-  mcu.SREG.flags.Z = (mcu.R[reg_d] == 0);
-  mcu.SREG.flags.S = mcu.SREG.flags.N ^ mcu.SREG.flags.V;
-  mcu.pc += 1;
+  mcu->R[reg_d] = mcu->R[reg_d] - 1;
+  mcu->SREG.flags.V = !B_GET(mcu->R[reg_d], 7) & ((mcu->R[reg_d] & 0b01111111) == 0b01111111);
+  mcu->SREG.flags.N = !!B_GET(mcu->R[reg_d], 7);
+  mcu->SREG.flags.Z = (mcu->R[reg_d] == 0);
+  mcu->SREG.flags.S = mcu->SREG.flags.N ^ mcu->SREG.flags.V;
+  mcu->pc += 1;
 }
 
 static inline void SER(const uint32_t opcode) {
   // 1110 1111 dddd 1111
   uint8_t reg_d = (opcode & 0xF0) >> 4;
   reg_d += 16;
-  mcu.R[reg_d] = 0xFF;
-  mcu.pc += 1;
+  mcu->R[reg_d] = 0xFF;
+  mcu->pc += 1;
 }
 
 static inline void MUL(const uint32_t opcode) {
@@ -354,11 +483,11 @@ static inline void MUL(const uint32_t opcode) {
   reg_d |= B_GET(opcode, 8) >> 4;
   uint8_t reg_r = (opcode & 0xF);
   reg_r |= B_GET(opcode, 9) >> 5;
-  uint16_t result = mcu.R[reg_d] * mcu.R[reg_r];
-  mcu.SREG.flags.C = !!B_GET(result, 15);
-  mcu.SREG.flags.Z = (result == 0);
+  uint16_t result = mcu->R[reg_d] * mcu->R[reg_r];
+  mcu->SREG.flags.C = !!B_GET(result, 15);
+  mcu->SREG.flags.Z = (result == 0);
   word_reg_set(0, result);
-  mcu.pc += 1;
+  mcu->pc += 1;
 }
 
 static inline void MULS(const uint32_t opcode) {
@@ -367,11 +496,11 @@ static inline void MULS(const uint32_t opcode) {
   reg_d += 16;
   uint8_t reg_r = (opcode & 0xF);
   reg_r += 16;
-  int16_t result = (int8_t)mcu.R[reg_d] * (int8_t)mcu.R[reg_r];
-  mcu.SREG.flags.C = !!B_GET(result, 15);
-  mcu.SREG.flags.Z = (result == 0);
+  int16_t result = (int8_t)mcu->R[reg_d] * (int8_t)mcu->R[reg_r];
+  mcu->SREG.flags.C = !!B_GET(result, 15);
+  mcu->SREG.flags.Z = (result == 0);
   word_reg_set(0, (uint16_t)result);
-  mcu.pc += 1;
+  mcu->pc += 1;
 }
 
 static inline void MULSU(const uint32_t opcode) {
@@ -380,11 +509,11 @@ static inline void MULSU(const uint32_t opcode) {
   reg_d += 16;
   uint8_t reg_r = (opcode & 0x7);
   reg_r += 16;
-  int16_t result = (int8_t)mcu.R[reg_d] * mcu.R[reg_r];
-  mcu.SREG.flags.C = !!B_GET(result, 15);
-  mcu.SREG.flags.Z = (result == 0);
+  int16_t result = (int8_t)mcu->R[reg_d] * mcu->R[reg_r];
+  mcu->SREG.flags.C = !!B_GET(result, 15);
+  mcu->SREG.flags.Z = (result == 0);
   word_reg_set(0, (uint16_t)result);
-  mcu.pc += 1;
+  mcu->pc += 1;
 }
 
 static inline void FMUL(const uint32_t opcode) {
@@ -393,15 +522,15 @@ static inline void FMUL(const uint32_t opcode) {
   reg_d += 16;
   uint8_t reg_r = (opcode & 0x7);
   reg_r += 16;
-  double d = (mcu.R[reg_d] / (double)(1 << 7));
-  double r = (mcu.R[reg_r] / (double)(1 << 7));
+  double d = (mcu->R[reg_d] / (double)(1 << 7));
+  double r = (mcu->R[reg_r] / (double)(1 << 7));
   double res = d * r;
   uint16_t result = round(res * (1 << 14));
-  mcu.SREG.flags.C = B_GET(result, 15) >> 15;
-  mcu.SREG.flags.Z = (result == 0);
+  mcu->SREG.flags.C = B_GET(result, 15) >> 15;
+  mcu->SREG.flags.Z = (result == 0);
   result <<= 1;
   word_reg_set(0, result);
-  mcu.pc += 1;
+  mcu->pc += 1;
 }
 
 static inline void FMULS(const uint32_t opcode) {
@@ -410,15 +539,15 @@ static inline void FMULS(const uint32_t opcode) {
   reg_d += 16;
   uint8_t reg_r = (opcode & 0x7);
   reg_r += 16;
-  double d = ((int8_t)mcu.R[reg_d] / (double)(1 << 7));
-  double r = ((int8_t)mcu.R[reg_r] / (double)(1 << 7));
+  double d = ((int8_t)mcu->R[reg_d] / (double)(1 << 7));
+  double r = ((int8_t)mcu->R[reg_r] / (double)(1 << 7));
   double res = d * r;
   uint16_t result = round(res * (1 << 14));
-  mcu.SREG.flags.C = B_GET(result, 15) >> 15;
-  mcu.SREG.flags.Z = (result == 0);
+  mcu->SREG.flags.C = B_GET(result, 15) >> 15;
+  mcu->SREG.flags.Z = (result == 0);
   result <<= 1;
   word_reg_set(0, result);
-  mcu.pc += 1;
+  mcu->pc += 1;
 }
 
 static inline void FMULSU(const uint32_t opcode) {
@@ -427,15 +556,15 @@ static inline void FMULSU(const uint32_t opcode) {
   reg_d += 16;
   uint8_t reg_r = (opcode & 0x7);
   reg_r += 16;
-  double d = ((int8_t)mcu.R[reg_d] / (double)(1 << 7));
-  double r = (mcu.R[reg_r] / (double)(1 << 7));
+  double d = ((int8_t)mcu->R[reg_d] / (double)(1 << 7));
+  double r = (mcu->R[reg_r] / (double)(1 << 7));
   double res = d * r;
   uint16_t result = round(res * (1 << 14));
-  mcu.SREG.flags.C = B_GET(result, 15) >> 15;
-  mcu.SREG.flags.Z = (result == 0);
+  mcu->SREG.flags.C = B_GET(result, 15) >> 15;
+  mcu->SREG.flags.Z = (result == 0);
   result <<= 1;
   word_reg_set(0, result);
-  mcu.pc += 1;
+  mcu->pc += 1;
 }
 
 static inline void MOV(const uint32_t opcode) {
@@ -444,8 +573,8 @@ static inline void MOV(const uint32_t opcode) {
   reg_d |= B_GET(opcode, 8) >> 4;
   uint8_t reg_r = (opcode & 0xF);
   reg_r |= B_GET(opcode, 9) >> 5;
-  mcu.R[reg_d] = mcu.R[reg_r];
-  mcu.pc += 1;  
+  mcu->R[reg_d] = mcu->R[reg_r];
+  mcu->pc += 1;  
 }
 
 static inline void MOVW(const uint32_t opcode) {
@@ -453,7 +582,7 @@ static inline void MOVW(const uint32_t opcode) {
   uint8_t reg_d = ((opcode & 0xF0) >> 4) * 2;
   uint8_t reg_r = (opcode & 0xF) * 2;
   word_reg_set(reg_d, word_reg_get(reg_r));
-  mcu.pc += 1;
+  mcu->pc += 1;
 }
 
 static inline void LDI(const uint32_t opcode) {
@@ -462,8 +591,8 @@ static inline void LDI(const uint32_t opcode) {
   reg_d += 16;
   uint8_t k = (opcode & 0xF);
   k |= (opcode & 0xF00) >> 4;
-  mcu.R[reg_d] = k;
-  mcu.pc += 1;  
+  mcu->R[reg_d] = k;
+  mcu->pc += 1;  
 }
 
 static inline void ST_X(const uint32_t opcode) {
@@ -475,17 +604,17 @@ static inline void ST_X(const uint32_t opcode) {
   uint16_t X = X_reg_get();
   if (version == 0) {
     // X unchanged
-    mcu.data_memory[X] = mcu.R[r];
+    data_write(X, mcu->R[r]);
   } else if (version == 1) {
     // X post incremented
-    mcu.data_memory[X] = mcu.R[r];
+    data_write(X, mcu->R[r]);
     X_reg_set(X + 1);
   } else {
     // X Pre decremented
     X_reg_set(X - 1);
-    mcu.data_memory[X - 1] = mcu.R[r];
+    data_write(X - 1, mcu->R[r]);
   }
-  mcu.pc += 1;
+  mcu->pc += 1;
 }
 
 static inline void ST_Y(const uint32_t opcode) {
@@ -500,20 +629,20 @@ static inline void ST_Y(const uint32_t opcode) {
   uint16_t Y = Y_reg_get();
   if (q > 2) {
     // with q displacement
-    mcu.data_memory[Y + q] = mcu.R[r];
+    data_write(Y + q, mcu->R[r]);
   } else if (version == 0) {
     // Y unchanged
-    mcu.data_memory[Y] = mcu.R[r];
+    data_write(Y, mcu->R[r]);
   } else if (version == 1) {
     // Y post incremented
-    mcu.data_memory[Y] = mcu.R[r];
+    data_write(Y, mcu->R[r]);
     Y_reg_set(Y + 1);
   } else {
     // Y pre decremented
     Y_reg_set(Y - 1);
-    mcu.data_memory[Y - 1] = mcu.R[r];
+    data_write(Y - 1, mcu->R[r]);
   }
-  mcu.pc += 1;
+  mcu->pc += 1;
 }
 
 static inline void ST_Z(const uint32_t opcode) {
@@ -528,20 +657,20 @@ static inline void ST_Z(const uint32_t opcode) {
   uint16_t Z = Z_reg_get();
   if (q > 2) {
     // with q displacement
-    mcu.data_memory[Z + q] = mcu.R[r];
+    data_write(Z + q, mcu->R[r]);
   } else if (version == 0) {
     // Y unchanged
-    mcu.data_memory[Z] = mcu.R[r];
+    data_write(Z, mcu->R[r]);
   } else if (version == 1) {
     // Y post incremented
-    mcu.data_memory[Z] = mcu.R[r];
+    data_write(Z, mcu->R[r]);
     Z_reg_set(Z + 1);
   } else {
     // Y pre decremented
     Z_reg_set(Z - 1);
-    mcu.data_memory[Z - 1] = mcu.R[r];
+    data_write(Z - 1, mcu->R[r]);
   }
-  mcu.pc += 1;
+  mcu->pc += 1;
 }
 
 static inline void STS(const uint32_t opcode) {
@@ -549,9 +678,9 @@ static inline void STS(const uint32_t opcode) {
   // kkkk kkkk kkkk kkkk
   uint16_t k = opcode & 0xFFFF;
   uint8_t d = ((opcode & 0xF00000) | B_GET(opcode, 24)) >> 20;
-  mcu.data_memory[k] = mcu.R[d];
-  mcu.data_memory_change = (int16_t)k;
-  mcu.pc += 2;
+  data_write(k, mcu->R[d]);
+  mcu->data_memory_change = (int16_t)k;
+  mcu->pc += 2;
 }
 
 static inline void LPM(const uint32_t opcode) {
@@ -563,16 +692,16 @@ static inline void LPM(const uint32_t opcode) {
   uint16_t Z = Z_reg_get();
   if (version == 8) {
     // R0 implied
-    mcu.R[0] = mcu.program_memory[Z];
+    mcu->R[0] = mcu->flash[Z];
   } else if (version == 4) {
     // Z unchanged
-    mcu.R[d] = mcu.program_memory[Z];
+    mcu->R[d] = mcu->flash[Z];
   } else {
     // Z post incremented
-    mcu.R[d] = mcu.program_memory[Z];
+    mcu->R[d] = mcu->flash[Z];
     Z_reg_set(Z + 1);
   }
-  mcu.pc += 1;
+  mcu->pc += 1;
 }
 
 static inline void LD_X(const uint32_t opcode) {
@@ -584,17 +713,17 @@ static inline void LD_X(const uint32_t opcode) {
   uint16_t X = X_reg_get();
   if (version == 0) {
     // X unchanged
-    mcu.R[d] = mcu.data_memory[X];
+    mcu->R[d] = data_read(X);
   } else if (version == 1) {
     // X post incremented
-    mcu.R[d] = mcu.data_memory[X];
+    mcu->R[d] = data_read(X);
     X_reg_set(X + 1);
   } else {
     // X Pre decremented
     X_reg_set(X - 1);
-    mcu.R[d] = mcu.data_memory[X - 1];
+    mcu->R[d] = data_read(X - 1);
   }
-  mcu.pc += 1;
+  mcu->pc += 1;
 }
 
 static inline void LD_Y(const uint32_t opcode) {
@@ -609,20 +738,20 @@ static inline void LD_Y(const uint32_t opcode) {
   uint16_t Y = Y_reg_get();
   if (q > 2) {
     // with q displacement
-    mcu.R[d] = mcu.data_memory[Y + q];
+    mcu->R[d] = data_read(Y + q);
   } else if (version == 0) {
     // Y unchanged
-    mcu.R[d] = mcu.data_memory[Y];
+    mcu->R[d] = data_read(Y);
   } else if (version == 1) {
     // Y post incremented
-    mcu.R[d] = mcu.data_memory[Y];
+    mcu->R[d] = data_read(Y);
     Y_reg_set(Y + 1);
   } else {
     // Y pre decremented
     Y_reg_set(Y - 1);
-    mcu.R[d] = mcu.data_memory[Y - 1];
+    mcu->R[d] = data_read(Y - 1);
   }
-  mcu.pc += 1;
+  mcu->pc += 1;
 }
 
 static inline void LD_Z(const uint32_t opcode) {
@@ -637,20 +766,20 @@ static inline void LD_Z(const uint32_t opcode) {
   uint16_t Z = Z_reg_get();
   if (q > 2) {
     // with q displacement
-    mcu.R[d] = mcu.data_memory[Z + q];
+    mcu->R[d] = data_read(Z + q);
   } else if (version == 0) {
     // Y unchanged
-    mcu.R[d] = mcu.data_memory[Z];
+    mcu->R[d] = data_read(Z);
   } else if (version == 1) {
     // Y post incremented
-    mcu.R[d] = mcu.data_memory[Z];
+    mcu->R[d] = data_read(Z);
     Z_reg_set(Z + 1);
   } else {
     // Y pre decremented
     Z_reg_set(Z - 1);
-    mcu.R[d] = mcu.data_memory[Z - 1];
+    mcu->R[d] = data_read(Z - 1);
   }
-  mcu.pc += 1;
+  mcu->pc += 1;
 }
 
 static inline void LDS(const uint32_t opcode) {
@@ -658,58 +787,64 @@ static inline void LDS(const uint32_t opcode) {
   // kkkk kkkk kkkk kkkk
   uint16_t k = opcode & 0xFFFF;
   uint8_t d = ((opcode & 0xF00000) | B_GET(opcode, 24)) >> 20;
-  mcu.R[d] = mcu.data_memory[k];
-  mcu.pc += 2;
+  mcu->R[d] = data_read(k);
+  mcu->pc += 2;
 }
 
 static inline void SPM(const uint32_t opcode) {
   // 1001 0101 1110 1000
-  *((uint16_t *)(mcu.program_memory + Z_reg_get())) = word_reg_get(0);
-  mcu.pc += 1;
+  if (mcu->flash != mcu->program_memory) {
+    // copy on write, the image may be shared with other instances
+    memcpy(mcu->program_memory, mcu->flash, PROGRAM_MEMORY_SIZE);
+    mcu->flash = mcu->program_memory;
+  }
+  *((uint16_t *)(mcu->program_memory + Z_reg_get())) = word_reg_get(0);
+  invalidate_fusion();
+  mcu->pc += 1;
 }
 static inline void IN(const uint32_t opcode) {
   // 1011 0AAd dddd AAAA
   uint8_t reg_d = (opcode & 0xF0) >> 4;
   reg_d |= B_GET(opcode, 8) >> 4;
   uint8_t a = (opcode & 0xF) | ((opcode & 0x600) >> 5);
-  mcu.R[reg_d] = mcu.IO[a];
-  mcu.pc += 1;
+  mcu->R[reg_d] = data_read(REGISTER_COUNT + a);
+  mcu->pc += 1;
 }
 
 static inline void OUT(const uint32_t opcode) {
   // 1011 1AAr rrrr AAAA
   uint8_t reg_r = (opcode & 0b111110000) >> 4;
   uint8_t a = (opcode & 0xF) | ((opcode & 0b11000000000) >> 5);
-  mcu.IO[a] = mcu.R[reg_r];
-  mcu.pc += 1;
+  data_write(REGISTER_COUNT + a, mcu->R[reg_r]);
+  mcu->pc += 1;
 }
 
 static inline void PUSH(const uint32_t opcode) {
   // 1001 001d dddd 1111
   uint8_t reg_d = (opcode & 0xF0) >> 4;
   reg_d |= B_GET(opcode, 8) >> 4;
-  stack_push8(mcu.R[reg_d]);
-  mcu.pc += 1; 
+  stack_push8(mcu->R[reg_d]);
+  mcu->pc += 1; 
 }
 
 static inline void POP(const uint32_t opcode) {
   // 1001 000d dddd 1111
   uint8_t reg_d = (opcode & 0xF0) >> 4;
   reg_d |= B_GET(opcode, 8) >> 4;
-  mcu.R[reg_d] = stack_pop8();
-  mcu.pc += 1; 
+  mcu->R[reg_d] = stack_pop8();
+  mcu->pc += 1; 
 }
 
 static inline void RJMP(const uint32_t opcode) {
   // 1100 kkkk kkkk kkkk
   // Relative jump to PC + k + 1
   int12_t k = {.number = (opcode & 0x0FFF)};
-  mcu.pc += k.number + 1;
+  mcu->pc += k.number + 1;
 }
 
 static inline void IJMP(const uint32_t opcode) {
   // Indirect jump to address at Z register
-  mcu.pc = Z_reg_get();
+  mcu->pc = Z_reg_get();
 }
 
 static inline void JMP(const uint32_t opcode) {
@@ -719,21 +854,21 @@ static inline void JMP(const uint32_t opcode) {
   uint32_t k = opcode & 0b11111111111111111;
   k |= (opcode & 0xF00000) >> 3;
   k |= B_GET(opcode, 24) >> 3;
-  mcu.pc = k;
+  mcu->pc = k;
 }
 
 static inline void RCALL(const uint32_t opcode) {
   // 1101 kkkk kkkk kkkk
   // Jump to address + 1 + PC, push current PC + 1 onto stack (relative call)
   uint16_t k = opcode & 0xFFF;
-  stack_push16(mcu.pc + 1);
-  mcu.pc += k + 1;
+  stack_push16(mcu->pc + 1);
+  mcu->pc += k + 1;
 }
 
 static inline void ICALL(const uint32_t opcode) {
   // Indirect call, PC = Z, push PC + 1 to stack
-  stack_push16(mcu.pc + 1);
-  mcu.pc = Z_reg_get();
+  stack_push16(mcu->pc + 1);
+  mcu->pc = Z_reg_get();
 }
 
 static inline void CALL(const uint32_t opcode) {
@@ -744,19 +879,19 @@ static inline void CALL(const uint32_t opcode) {
   k |= B_GET(opcode, 16);
   k |= (opcode & 0xF00000) >> 3;
   k |= B_GET(opcode, 24) >> 3;
-  stack_push16(mcu.pc + 2);
-  mcu.pc = k;
+  stack_push16(mcu->pc + 2);
+  mcu->pc = k;
 }
 
 static inline void RET(const uint32_t opcode) {
   // Return from subroutine, PC = stack
-  mcu.pc = stack_pop16();
+  mcu->pc = stack_pop16();
 }
 
 static inline void RETI(const uint32_t opcode) {
   // Return from interrupt and set I to 1
-  mcu.pc = stack_pop16();
-  mcu.SREG.flags.I = 1;
+  mcu->pc = stack_pop16();
+  mcu->SREG.flags.I = 1;
 }
 
 static inline void CPSE(const uint32_t opcode) {
@@ -764,10 +899,10 @@ static inline void CPSE(const uint32_t opcode) {
   // Compare, skip if equal
   uint16_t r = (opcode & 0xF) | (B_GET(opcode, 9) >> 5);
   uint16_t d = (opcode & 0b111110000) >> 4;
-  if (mcu.R[r] == mcu.R[d]) {
-    mcu.skip_next = true;
+  if (mcu->R[r] == mcu->R[d]) {
+    mcu->skip_next = true;
   }
-  mcu.pc += 1;
+  mcu->pc += 1;
 }
 
 static inline void CP(const uint32_t opcode) {
@@ -775,15 +910,15 @@ static inline void CP(const uint32_t opcode) {
   // Compare two registers
   uint16_t r = (opcode & 0xF) | (B_GET(opcode, 9) >> 5);
   uint16_t d = (opcode & 0b111110000) >> 4;
-  byte *R = mcu.R;
+  byte *R = mcu->R;
   uint8_t res = R[d] - R[r];
-  mcu.SREG.flags.H = !B_GET(R[d], 3) && B_GET(R[r], 3) || B_GET(R[r], 3) && B_GET(res, 3) || B_GET(res, 3) && !B_GET(R[d], 3);
-  mcu.SREG.flags.V = B_GET(R[d], 7) && !B_GET(R[r], 7) && B_GET(res, 7) || !B_GET(R[d], 7) && B_GET(R[r], 7) && B_GET(res, 7);
-  mcu.SREG.flags.N = !!B_GET(res, 7);
-  mcu.SREG.flags.S = mcu.SREG.flags.N ^ mcu.SREG.flags.V;
-  mcu.SREG.flags.Z = (res == 0);
-  mcu.SREG.flags.C = !B_GET(R[d], 7) && B_GET(R[r], 7) || B_GET(R[r], 7) && B_GET(res, 7) || B_GET(res, 7) && !B_GET(R[d], 7);
-  mcu.pc += 1;
+  mcu->SREG.flags.H = !B_GET(R[d], 3) && B_GET(R[r], 3) || B_GET(R[r], 3) && B_GET(res, 3) || B_GET(res, 3) && !B_GET(R[d], 3);
+  mcu->SREG.flags.V = B_GET(R[d], 7) && !B_GET(R[r], 7) && B_GET(res, 7) || !B_GET(R[d], 7) && B_GET(R[r], 7) && B_GET(res, 7);
+  mcu->SREG.flags.N = !!B_GET(res, 7);
+  mcu->SREG.flags.S = mcu->SREG.flags.N ^ mcu->SREG.flags.V;
+  mcu->SREG.flags.Z = (res == 0);
+  mcu->SREG.flags.C = !B_GET(R[d], 7) && B_GET(R[r], 7) || B_GET(R[r], 7) && B_GET(res, 7) || B_GET(res, 7) && !B_GET(R[d], 7);
+  mcu->pc += 1;
 }
 
 static inline void CPC(const uint32_t opcode) {
@@ -791,15 +926,15 @@ static inline void CPC(const uint32_t opcode) {
   // Compare with carry
   uint16_t r = (opcode & 0xF) | (B_GET(opcode, 9) >> 5);
   uint16_t d = (opcode & 0b111110000) >> 4;
-  byte *R = mcu.R;
-  uint8_t res = R[d] - R[r] - mcu.SREG.flags.C;
-  mcu.SREG.flags.H = !B_GET(R[d], 3) && B_GET(R[r], 3) || B_GET(R[r], 3) && B_GET(res, 3) || B_GET(res, 3) && !B_GET(R[d], 3);
-  mcu.SREG.flags.V = B_GET(R[d], 7) && !B_GET(R[r], 7) && B_GET(res, 7) || !B_GET(R[d], 7) && B_GET(R[r], 7) && B_GET(res, 7);
-  mcu.SREG.flags.N = !!B_GET(res, 7);
-  mcu.SREG.flags.S = mcu.SREG.flags.N ^ mcu.SREG.flags.V;
-  mcu.SREG.flags.C = !B_GET(R[d], 7) && B_GET(R[r], 7) || B_GET(R[r], 7) && B_GET(res, 7) || B_GET(res, 7) && !B_GET(R[d], 7);
-  mcu.SREG.flags.Z = (res == 0) && mcu.SREG.flags.Z;
-  mcu.pc += 1;
+  byte *R = mcu->R;
+  uint8_t res = R[d] - R[r] - mcu->SREG.flags.C;
+  mcu->SREG.flags.H = !B_GET(R[d], 3) && B_GET(R[r], 3) || B_GET(R[r], 3) && B_GET(res, 3) || B_GET(res, 3) && !B_GET(R[d], 3);
+  mcu->SREG.flags.V = B_GET(R[d], 7) && !B_GET(R[r], 7) && B_GET(res, 7) || !B_GET(R[d], 7) && B_GET(R[r], 7) && B_GET(res, 7);
+  mcu->SREG.flags.N = !!B_GET(res, 7);
+  mcu->SREG.flags.S = mcu->SREG.flags.N ^ mcu->SREG.flags.V;
+  mcu->SREG.flags.C = !B_GET(R[d], 7) && B_GET(R[r], 7) || B_GET(R[r], 7) && B_GET(res, 7) || B_GET(res, 7) && !B_GET(R[d], 7);
+  mcu->SREG.flags.Z = (res == 0) && mcu->SREG.flags.Z;
+  mcu->pc += 1;
 }
 
 static inline void CPI(const uint32_t opcode) {
@@ -807,15 +942,15 @@ static inline void CPI(const uint32_t opcode) {
   // Compare with immediate
   uint16_t k = (opcode & 0xF) | ((opcode & 0xF00) >> 4);
   uint16_t d = ((opcode & 0xF0) >> 4) + 16;
-  byte *R = mcu.R;
+  byte *R = mcu->R;
   uint8_t res = R[d] - k;
-  mcu.SREG.flags.H = !B_GET(R[d], 3) && B_GET(k, 3) || B_GET(k, 3) && B_GET(res, 3) || B_GET(res, 3) && !B_GET(R[d], 3);
-  mcu.SREG.flags.V = B_GET(R[d], 7) && !B_GET(k, 7) && !B_GET(res, 7) || !B_GET(R[d], 7) && B_GET(k, 7) && B_GET(res, 7);
-  mcu.SREG.flags.N = !!B_GET(res, 7);
-  mcu.SREG.flags.S = mcu.SREG.flags.N ^ mcu.SREG.flags.V;
-  mcu.SREG.flags.Z = (res == 0);
-  mcu.SREG.flags.C = !B_GET(R[d], 7) && B_GET(k, 7) || B_GET(k, 7) && B_GET(res, 7) || B_GET(res, 7) && !B_GET(R[d], 7);
-  mcu.pc += 1;
+  mcu->SREG.flags.H = !B_GET(R[d], 3) && B_GET(k, 3) || B_GET(k, 3) && B_GET(res, 3) || B_GET(res, 3) && !B_GET(R[d], 3);
+  mcu->SREG.flags.V = B_GET(R[d], 7) && !B_GET(k, 7) && !B_GET(res, 7) || !B_GET(R[d], 7) && B_GET(k, 7) && B_GET(res, 7);
+  mcu->SREG.flags.N = !!B_GET(res, 7);
+  mcu->SREG.flags.S = mcu->SREG.flags.N ^ mcu->SREG.flags.V;
+  mcu->SREG.flags.Z = (res == 0);
+  mcu->SREG.flags.C = !B_GET(R[d], 7) && B_GET(k, 7) || B_GET(k, 7) && B_GET(res, 7) || B_GET(res, 7) && !B_GET(R[d], 7);
+  mcu->pc += 1;
 }
 
 static inline void SBRC(const uint32_t opcode) {
@@ -823,10 +958,10 @@ static inline void SBRC(const uint32_t opcode) {
   // Skip if R[r](b) is cleared
   uint8_t b = (opcode & 0b111);
   uint8_t r = (opcode & 0b111110000) >> 4;
-  if (!B_GET(mcu.R[r], b)) {
-    mcu.skip_next = true;
+  if (!B_GET(mcu->R[r], b)) {
+    mcu->skip_next = true;
   }
-  mcu.pc += 1;
+  mcu->pc += 1;
 }
 
 static inline void SBRS(const uint32_t opcode) {
@@ -834,10 +969,10 @@ static inline void SBRS(const uint32_t opcode) {
   // Skip if R[r](b) is set
   uint8_t b = (opcode & 0b111);
   uint8_t r = (opcode & 0b111110000) >> 4;
-  if (B_GET(mcu.R[r], b)) {
-    mcu.skip_next = true;
+  if (B_GET(mcu->R[r], b)) {
+    mcu->skip_next = true;
   }
-  mcu.pc += 1;
+  mcu->pc += 1;
 }
 
 static inline void SBIC(const uint32_t opcode) {
@@ -845,10 +980,10 @@ static inline void SBIC(const uint32_t opcode) {
   // Skip if I/O[A](b) is cleared
   uint8_t b = (opcode & 0b111);
   uint8_t A = (opcode & 0b11111000) >> 3;
-  if (!B_GET(mcu.IO[A], b)) {
-    mcu.skip_next = true;
+  if (!B_GET(data_read(REGISTER_COUNT + A), b)) {
+    mcu->skip_next = true;
   }
-  mcu.pc += 1;
+  mcu->pc += 1;
 }
 
 static inline void SBIS(const uint32_t opcode) {
@@ -856,10 +991,10 @@ static inline void SBIS(const uint32_t opcode) {
   // Skip if I/O[A](b) is set
   uint8_t b = (opcode & 0b111);
   uint8_t A = (opcode & 0b11111000) >> 3;
-  if (B_GET(mcu.IO[A], b)) {
-    mcu.skip_next = true;
+  if (B_GET(data_read(REGISTER_COUNT + A), b)) {
+    mcu->skip_next = true;
   }
-  mcu.pc += 1;
+  mcu->pc += 1;
 }
 
 static inline void BRBS(const uint32_t opcode) {
@@ -867,11 +1002,12 @@ static inline void BRBS(const uint32_t opcode) {
   // Branch if SREG(s) is set (PC += k + 1), k is in U2
   uint8_t s = opcode & 0b111;
   int7_t k = {.number = ((opcode & 0b1111111000) >> 3)};
-  if (B_GET(mcu.SREG.value, s)) {
-    mcu.pc += k.number + 1;
+  if (B_GET(mcu->SREG.value, s)) {
+    mcu->cycles += 1; // taken
+    mcu->pc += k.number + 1;
     return;
   }
-  mcu.pc += 1;
+  mcu->pc += 1;
 }
 
 static inline void BRBC(const uint32_t opcode) {
@@ -879,11 +1015,12 @@ static inline void BRBC(const uint32_t opcode) {
   // Branch if SREG(s) is cleared (PC += k + 1), k is in U2
   uint8_t s = opcode & 0b111;
   int7_t k = {.number = ((opcode & 0b1111111000) >> 3)};
-  if (!B_GET(mcu.SREG.value, s)) {
-    mcu.pc += k.number + 1;
+  if (!B_GET(mcu->SREG.value, s)) {
+    mcu->cycles += 1; // taken
+    mcu->pc += k.number + 1;
     return;
   }
-  mcu.pc += 1;
+  mcu->pc += 1;
 }
 
 static inline void SBI(const uint32_t opcode) {
@@ -891,8 +1028,9 @@ static inline void SBI(const uint32_t opcode) {
   // Set I/O[A](b)
   uint8_t b = opcode & 0b111;
   uint8_t A = (opcode & 0b11111000) >> 3;
-  mcu.IO[A] |= (1 << b);
-  mcu.pc += 1;
+  // Only bit b is written, PINx would toggle and the flag registers clear every other bit read as one
+  data_write(REGISTER_COUNT + A, single_bit_register(REGISTER_COUNT + A) ? 1 << b : mcu->IO[A] | (1 << b));
+  mcu->pc += 1;
 }
 
 static inline void CBI(const uint32_t opcode) {
@@ -900,75 +1038,75 @@ static inline void CBI(const uint32_t opcode) {
   // Clear I/O[A](b)
   uint8_t b = opcode & 0b111;
   uint8_t A = (opcode & 0b11111000) >> 3;
-  mcu.IO[A] &= ~(1 << b);
-  mcu.pc += 1;
+  data_write(REGISTER_COUNT + A, single_bit_register(REGISTER_COUNT + A) ? 0 : mcu->IO[A] & ~(1 << b));
+  mcu->pc += 1;
 }
 
 static inline void LSR(const uint32_t opcode) {
   // 1001 010d dddd 0110
   // C = R[d](0), R[d] >> 1
   uint8_t d = (opcode & 0b111110000) >> 4;
-  mcu.SREG.flags.C = !!B_GET(mcu.R[d], 0);
-  mcu.R[d] >>= 1;
-  mcu.SREG.flags.Z = (mcu.R[d] == 0);
-  mcu.SREG.flags.N = 0;
-  mcu.SREG.flags.V = mcu.SREG.flags.N ^ mcu.SREG.flags.C;
-  mcu.SREG.flags.S = mcu.SREG.flags.N ^ mcu.SREG.flags.V;
-  mcu.pc += 1;
+  mcu->SREG.flags.C = !!B_GET(mcu->R[d], 0);
+  mcu->R[d] >>= 1;
+  mcu->SREG.flags.Z = (mcu->R[d] == 0);
+  mcu->SREG.flags.N = 0;
+  mcu->SREG.flags.V = mcu->SREG.flags.N ^ mcu->SREG.flags.C;
+  mcu->SREG.flags.S = mcu->SREG.flags.N ^ mcu->SREG.flags.V;
+  mcu->pc += 1;
 }
 
 static inline void ROR(const uint32_t opcode) {
   // 1001 010d dddd 0111
   // C = R[d](0), R[d] >> 1, R[d](7) = C
   uint8_t d = (opcode & 0b111110000) >> 4;
-  bit carry = !!mcu.SREG.flags.C;
-  mcu.SREG.flags.C = !!B_GET(mcu.R[d], 0);
-  mcu.R[d] >>= 1;
-  mcu.R[d] |= (carry << 7);
-  mcu.SREG.flags.Z = (mcu.R[d] == 0);
-  mcu.SREG.flags.N = !!B_GET(mcu.R[d], 7);
-  mcu.SREG.flags.V = mcu.SREG.flags.N ^ mcu.SREG.flags.C;
-  mcu.SREG.flags.S = mcu.SREG.flags.N ^ mcu.SREG.flags.V;
-  mcu.pc += 1;
+  bit carry = !!mcu->SREG.flags.C;
+  mcu->SREG.flags.C = !!B_GET(mcu->R[d], 0);
+  mcu->R[d] >>= 1;
+  mcu->R[d] |= (carry << 7);
+  mcu->SREG.flags.Z = (mcu->R[d] == 0);
+  mcu->SREG.flags.N = !!B_GET(mcu->R[d], 7);
+  mcu->SREG.flags.V = mcu->SREG.flags.N ^ mcu->SREG.flags.C;
+  mcu->SREG.flags.S = mcu->SREG.flags.N ^ mcu->SREG.flags.V;
+  mcu->pc += 1;
 }
 
 static inline void ASR(const uint32_t opcode) {
   // 1001 010d dddd 0101
   // Shift right without changing R[d](7), C = R[d](0)
   uint8_t d = (opcode & 0b111110000) >> 4;
-  bit b7 = B_GET(mcu.R[d], 7);
-  mcu.SREG.flags.C = !!B_GET(mcu.R[d], 0);
-  mcu.R[d] >>= 1;
-  mcu.R[d] |= b7;
-  mcu.SREG.flags.Z = (mcu.R[d] == 0);
-  mcu.SREG.flags.N = !!B_GET(mcu.R[d], 7);
-  mcu.SREG.flags.V = mcu.SREG.flags.N ^ mcu.SREG.flags.C;
-  mcu.SREG.flags.S = mcu.SREG.flags.N ^ mcu.SREG.flags.V;
-  mcu.pc += 1;
+  bit b7 = B_GET(mcu->R[d], 7);
+  mcu->SREG.flags.C = !!B_GET(mcu->R[d], 0);
+  mcu->R[d] >>= 1;
+  mcu->R[d] |= b7;
+  mcu->SREG.flags.Z = (mcu->R[d] == 0);
+  mcu->SREG.flags.N = !!B_GET(mcu->R[d], 7);
+  mcu->SREG.flags.V = mcu->SREG.flags.N ^ mcu->SREG.flags.C;
+  mcu->SREG.flags.S = mcu->SREG.flags.N ^ mcu->SREG.flags.V;
+  mcu->pc += 1;
 }
 
 static inline void SWAP(const uint32_t opcode) {
   // 1001 010d dddd 0010
   // Swap nibbles
   uint8_t d = (opcode & 0b111110000) >> 4;
-  mcu.R[d] = ((mcu.R[d] & 0x0F) << 4) | ((mcu.R[d] & 0xF0) >> 4);
-  mcu.pc += 1;
+  mcu->R[d] = ((mcu->R[d] & 0x0F) << 4) | ((mcu->R[d] & 0xF0) >> 4);
+  mcu->pc += 1;
 }
 
 static inline void BSET(const uint32_t opcode) {
   // 1001 0100 0sss 1000
   // SREG(s) = 1
   uint8_t s = (opcode & 0b1110000) >> 4;
-  mcu.SREG.value |= (1 << s);
-  mcu.pc += 1;
+  mcu->SREG.value |= (1 << s);
+  mcu->pc += 1;
 }
 
 static inline void BCLR(const uint32_t opcode) {
   // 1001 0100 1sss 1000
   // SREG(s) = 0
   uint8_t s = (opcode & 0b1110000) >> 4;
-  mcu.SREG.value &= ~(1 << s);
-  mcu.pc += 1;
+  mcu->SREG.value &= ~(1 << s);
+  mcu->pc += 1;
 }
 
 static inline void BST(const uint32_t opcode) {
@@ -976,8 +1114,8 @@ static inline void BST(const uint32_t opcode) {
   // T = R[d](b)
   uint8_t b = opcode & 0b111;
   uint8_t d = (opcode & 0b111110000) >> 4;
-  mcu.SREG.flags.T = !!B_GET(mcu.R[d], b);
-  mcu.pc += 1;
+  mcu->SREG.flags.T = !!B_GET(mcu->R[d], b);
+  mcu->pc += 1;
 }
 
 static inline void BLD(const uint32_t opcode) {
@@ -985,34 +1123,40 @@ static inline void BLD(const uint32_t opcode) {
   // R[d](b) = T
   uint8_t b = opcode & 0b111;
   uint8_t d = (opcode & 0b111110000) >> 4;
-  mcu.R[d] |= ((!!mcu.SREG.flags.T) << b);
-  mcu.pc += 1;
+  mcu->R[d] |= ((!!mcu->SREG.flags.T) << b);
+  mcu->pc += 1;
 }
 
 static inline void NOP(const uint32_t opcode) {
-  mcu.pc += 1;
+  mcu->pc += 1;
 }
 
 static inline void SLEEP(const uint32_t opcode) {
   print("Switching to sleep mode\n");
-  mcu.sleeping = true;
-  mcu.pc += 1;
+  mcu->sleeping = true;
+  mcu->pc += 1;
 }
 
 static inline void WDR(const uint32_t opcode) {
   // Reset watchdog timer
-  mcu.pc += 1;
+  byte control = mcu->data_memory[WDTCSR_ADDRESS];
+  if (control & (WDTCSR_WDE | WDTCSR_WDIE)) {
+    mcu->watchdog_start = mcu->cycle_count;
+    schedule_event(EVENT_WATCHDOG, mcu->watchdog_start + watchdog_period(control));
+  }
+  mcu->pc += 1;
 }
 
 static inline void BREAK(const uint32_t opcode) {
-  mcu.stopped = true;
+  mcu->stopped = true;
+  mcu->stop_reason = STOP_BREAK;
 }
 
 static inline void XXX(const uint32_t opcode) {
   // Unknown opcode
   print("Unknown opcode! 0x%.4X\n", opcode);
   print_bits(opcode);
-  mcu.pc += 1;
+  mcu->pc += 1;
 }
 
 static const Instruction_t opcodes[] = {
@@ -1091,22 +1235,22 @@ static const Instruction_t opcodes[] = {
 
   {"STS", STS, 0b1111111000001111, 0b1001001000000000, 2, 2},
 
-  {"LPM", LPM, 0b1111111111111111, 0b1001010111001000, 2, 1},
-  {"LPM Z", LPM, 0b1111111000001111, 0b1001000000000100, 2, 1},
-  {"LPM Z+", LPM, 0b1111111000001111, 0b1001000000000101, 2, 1},
+  {"LPM", LPM, 0b1111111111111111, 0b1001010111001000, 3, 1},
+  {"LPM Z", LPM, 0b1111111000001111, 0b1001000000000100, 3, 1},
+  {"LPM Z+", LPM, 0b1111111000001111, 0b1001000000000101, 3, 1},
 
-  {"LD X", LD_X, 0b1111111000001111, 0b1001000000001100, 1, 1},
+  {"LD X", LD_X, 0b1111111000001111, 0b1001000000001100, 2, 1},
   {"LD X+", LD_X, 0b1111111000001111, 0b1001000000001101, 2, 1},
   {"LD -X", LD_X, 0b1111111000001111, 0b1001000000001110, 3, 1},
 
   {"LD Y", LD_Y, 0b1111111000001111, 0b1000000000001000, 2, 1},
   {"LD Y+", LD_Y, 0b1111111000001111, 0b1001000000001001, 2, 1},
-  {"LD -Y", LD_Y, 0b1111111000001111, 0b1001000000001010, 2, 1},
+  {"LD -Y", LD_Y, 0b1111111000001111, 0b1001000000001010, 3, 1},
   {"LDD Y", LD_Y, 0b1101001000001000, 0b1000000000001000, 2, 1},
 
   {"LD Z", LD_Z, 0b1111111000001111, 0b1000000000000000, 2, 1},
   {"LD Z+", LD_Z, 0b1111111000001111, 0b1001000000000001, 2, 1},
-  {"LD -Z", LD_Z, 0b1111111000001111, 0b1001000000000010, 2, 1},
+  {"LD -Z", LD_Z, 0b1111111000001111, 0b1001000000000010, 3, 1},
   {"LDD Z", LD_Z, 0b1101001000001000, 0b1000000000000000, 2, 1},
 
   {"LDS", LDS, 0b1111111000001111, 0b1001000000000000, 2, 2},
@@ -1121,7 +1265,7 @@ static const Instruction_t opcodes[] = {
   {"NOP", NOP, 0b1111111111111111, 0b0000000000000000, 1, 1},
   {"SLEEP", SLEEP, 0b1111111111111111, 0b1001010110001000, 1, 1},
   {"WDR", WDR, 0b1111111111111111, 0b1001010110101000, 1, 1},
-  {"BREAK", BREAK, 0b1111111111111111, 0b1001010110011000, 0, 1},
+  {"BREAK", BREAK, 0b1111111111111111, 0b1001010110011000, 1, 1},
 
   {"XXX", XXX, 0b1111111111111111, 0b1111111111111111, 1, 1}
 };
@@ -1129,19 +1273,19 @@ static const Instruction_t opcodes[] = {
 static const int opcodes_count = sizeof(opcodes) / sizeof(Instruction_t);
 
 static inline uint16_t get_opcode16(void) {
-  if ((mcu.pc + 1) * WORD_SIZE >= PROGRAM_MEMORY_SIZE - 1) {
+  if ((mcu->pc + 1) * WORD_SIZE >= PROGRAM_MEMORY_SIZE - 1) {
     throw_exception("Out of memory bounds!\n");
     return 0;
   }
-  return *((uint16_t *)(mcu.program_memory + mcu.pc * WORD_SIZE));
+  return *((uint16_t *)(mcu->flash + mcu->pc * WORD_SIZE));
 }
 
 static inline uint32_t get_opcode32(void) {
-  if ((mcu.pc + 2) * WORD_SIZE  >= PROGRAM_MEMORY_SIZE - 1) {
+  if ((mcu->pc + 2) * WORD_SIZE  >= PROGRAM_MEMORY_SIZE - 1) {
     throw_exception("Out of memory bounds!\n");
     return 0;
   }
-  return (get_opcode16() << 16) | *(uint16_t *)(mcu.program_memory + (mcu.pc + 1) * WORD_SIZE);
+  return (get_opcode16() << 16) | *(uint16_t *)(mcu->flash + (mcu->pc + 1) * WORD_SIZE);
 }
 
 static void create_lookup_table(void) {
@@ -1161,68 +1305,862 @@ static const Instruction_t *find_instruction(const uint16_t opcode) {
 
 void mcu_init(void) {
   mkdir(TMP, 0777);
-  memset(&mcu, 0, sizeof(mcu));
-  set_mcu_pointers(&mcu);
-  create_lookup_table();
+  Attachments_t host = mcu->host; // breakpoints, traces and coverage survive a reset
+  memset(mcu, 0, sizeof(*mcu));
+  mcu->host = host;
+  reset_io();
+  invalidate_fusion();
+  clear_events();
+  schedule_stimulus();
+  schedule_snapshot();
+  set_mcu_pointers(mcu);
+  mcu->sp = RAM_SIZE - 1;
+  if (mcu->host.vcd != NULL) {
+    vcd_sync(mcu->host.vcd, mcu->cycle_count, mcu->data_memory);
+  }
+  pthread_once(&lookup_once, create_lookup_table);
   print("MCU initialized\n");
 }
 
 void mcu_send_interrupt(Interrupt_vector_t vector) {
   print("Sending an interrupt: %d\n", (int)vector);
-  mcu.handle_interrupt = true;
-  mcu.interrupt_address = (uint16_t)vector;
+  mcu->handle_interrupt = true;
+  mcu->interrupt_address = (uint16_t)vector;
 }
 
 static inline void handle_interrupt(void) {
-  print("Received an interrupt (%d)\n", mcu.interrupt_address);
-  if (mcu.sleeping) {
+  // The handler runs on the following cycles and returns to the pushed address with RETI
+  print("Received an interrupt (%d)\n", mcu->interrupt_address);
+  mcu->cycles += INTERRUPT_CYCLES;
+  if (mcu->sleeping) {
     print("Waking up from sleep mode\n");
-    mcu.sleeping = false;
+    mcu->sleeping = false;
+    mcu->cycles += WAKE_UP_CYCLES;
+  }
+  if (mcu->host.trace != NULL) {
+    trace_interrupt(mcu->host.trace, mcu->interrupt_address);
   }
-  uint16_t return_address = mcu.pc;
-  stack_push16(return_address);
-  mcu.pc = mcu.interrupt_address * WORD_SIZE;
-  do {
-    mcu_execute_cycle();
-  } while (mcu.pc != return_address);
-  print("Interrupt finished\n");
-  mcu.interrupt_address = 0;
+  stack_push16(mcu->pc);
+  mcu->pc = mcu->interrupt_address * WORD_SIZE;
+  mcu->interrupt_address = 0;
+  mcu->SREG.flags.I = 0; // RETI enables interrupts again
 }
 
 static inline void execute_instruction(void) {
-  mcu.opcode = get_opcode16();
-  mcu.instruction = opcode_lookup[mcu.opcode];
-  if (mcu.skip_next) {
-    mcu.pc += mcu.instruction->length;
-    mcu.skip_next = false;
+  if (mcu->host.fusion != NULL && !mcu->skip_next && mcu->host.debug == NULL && mcu->host.trace == NULL && mcu->host.coverage == NULL && execute_fused()) {
     return;
   }
-  print("Executing %s, PC = 0x%x\n", mcu.instruction->name, mcu.pc * WORD_SIZE);
-  if (mcu.instruction->length == 2) {
-    mcu.opcode = get_opcode32();
+  mcu->opcode = get_opcode16();
+  mcu->instruction = opcode_lookup[mcu->opcode];
+  if (mcu->skip_next) {
+    // The skipping instruction took one cycle, skipping costs one more per skipped word
+    if (mcu->host.trace != NULL) {
+      trace_instruction(mcu->host.trace, mcu->pc, mcu->opcode, mcu->instruction->length, true);
+    }
+    mcu->pc += mcu->instruction->length;
+    mcu->cycles += mcu->instruction->length;
+    mcu->skip_next = false;
+    return;
+  }
+  print_verbose("Executing %s, PC = 0x%x\n", mcu->instruction->name, mcu->pc * WORD_SIZE);
+  if (mcu->instruction->length == 2) {
+    mcu->opcode = get_opcode32();
+  }
+  if (mcu->host.trace != NULL) {
+    trace_instruction(mcu->host.trace, mcu->pc, mcu->opcode, mcu->instruction->length, false);
+  }
+  mcu->cycles += mcu->instruction->cycles; // handlers add the cycles that depend on the outcome
+  uint16_t pc = mcu->pc, cycles = mcu->cycles;
+  mcu->instruction->execute(mcu->opcode);
+  if (mcu->host.coverage != NULL) {
+    cover_instruction(pc, mcu->skip_next || mcu->cycles != cycles);
   }
-  mcu.instruction->execute(mcu.opcode);
-  mcu.cycles = mcu.instruction->cycles - 1;
 }
 
-bool mcu_execute_cycle(void) {
-  uint64_t time_start = get_micro_time();
-  mcu.data_memory_change = -1; // indicate no change
-  if (mcu.cycles > 0) {
-    usleep(CLOCK_FREQ);
-    mcu.cycles--;
+static inline void fused_branch(const uint16_t opcode) {
+  if (opcode & 0x0400) {
+    BRBC(opcode);
+  } else {
+    BRBS(opcode);
+  }
+}
+
+static inline bool execute_fused(void) {
+  // Groups are found by the PC of their first instruction, so jumping into the middle
+  // of one simply runs the remaining instructions one by one
+  if (mcu->pc >= PROGRAM_MEMORY_SIZE / WORD_SIZE - 1) {
+    return false; // get_opcode16 raises the exception
+  }
+  Fused_t *group = mcu->host.fusion->groups + mcu->pc;
+  if (group->kind == FUSE_UNKNOWN) {
+    find_group(mcu->pc);
+  }
+  if (group->kind == FUSE_NONE) {
+    return false;
+  }
+  // Events and interrupts are only looked at between steps, so a group that one falls due in
+  // runs unfused. Stack runs that leave RAM could write the IO registers and raise an interrupt
+  if (mcu->next_event < mcu->cycle_count + mcu->cycles + group->cycles) {
+    return false;
+  }
+  if ((group->kind == FUSE_PUSH_RUN && mcu->sp < group->count) || (group->kind == FUSE_POP_RUN && mcu->sp + group->count >= RAM_SIZE)) {
+    return false;
+  }
+  print_verbose("Executing %d fused instructions, PC = 0x%x\n", group->count, mcu->pc * WORD_SIZE);
+  const uint16_t *words = (const uint16_t *)mcu->flash + mcu->pc;
+  switch ((Fuse_kind_t)group->kind) {
+    case FUSE_CP_BRANCH:
+      CP(words[0]);
+      fused_branch(words[1]);
+      break;
+    case FUSE_CPC_BRANCH:
+      CPC(words[0]);
+      fused_branch(words[1]);
+      break;
+    case FUSE_CPI_BRANCH:
+      CPI(words[0]);
+      fused_branch(words[1]);
+      break;
+    case FUSE_CP_CPC_BRANCH:
+      CP(words[0]);
+      CPC(words[1]);
+      fused_branch(words[2]);
+      break;
+    case FUSE_CPI_CPC_BRANCH:
+      CPI(words[0]);
+      CPC(words[1]);
+      fused_branch(words[2]);
+      break;
+    case FUSE_SBIW_BRANCH:
+      SBIW(words[0]);
+      fused_branch(words[1]);
+      break;
+    case FUSE_LDI_PAIR:
+      LDI(words[0]); // SER is LDI with 0xFF
+      LDI(words[1]);
+      break;
+    case FUSE_PUSH_RUN:
+      for (int i = 0; i < group->count; i++) {
+        PUSH(words[i]);
+      }
+      break;
+    case FUSE_POP_RUN:
+      for (int i = 0; i < group->count; i++) {
+        POP(words[i]);
+      }
+      break;
+    default:
+      return false;
+  }
+  mcu->cycles += group->cycles;
+  mcu->opcode = words[group->count - 1];
+  mcu->instruction = opcode_lookup[mcu->opcode];
+  return true;
+}
+
+static void find_group(const uint16_t pc) {
+  Fused_t *group = mcu->host.fusion->groups + pc;
+  void (*execute[FUSE_MAX_RUN])(uint32_t) = {NULL};
+  byte cycles[FUSE_MAX_RUN] = {0};
+  // The last word can not be fetched, get_opcode16 stops there
+  for (int i = 0; i < FUSE_MAX_RUN && pc + i < PROGRAM_MEMORY_SIZE / WORD_SIZE - 1; i++) {
+    const Instruction_t *instruction = find_instruction(((const uint16_t *)mcu->flash)[pc + i]);
+    execute[i] = instruction->execute == SER ? LDI : instruction->execute;
+    cycles[i] = instruction->cycles;
+  }
+  bool compare = execute[0] == CP || execute[0] == CPC || execute[0] == CPI;
+  bool branch1 = execute[1] == BRBS || execute[1] == BRBC;
+  bool branch2 = execute[2] == BRBS || execute[2] == BRBC;
+  byte count = 2;
+  group->kind = FUSE_NONE;
+  if (compare && branch1) {
+    group->kind = execute[0] == CP ? FUSE_CP_BRANCH : execute[0] == CPC ? FUSE_CPC_BRANCH : FUSE_CPI_BRANCH;
+  } else if ((execute[0] == CP || execute[0] == CPI) && execute[1] == CPC && branch2) {
+    group->kind = execute[0] == CP ? FUSE_CP_CPC_BRANCH : FUSE_CPI_CPC_BRANCH;
+    count = 3;
+  } else if (execute[0] == SBIW && branch1) {
+    group->kind = FUSE_SBIW_BRANCH;
+  } else if (execute[0] == LDI && execute[1] == LDI) {
+    group->kind = FUSE_LDI_PAIR;
+  } else if ((execute[0] == PUSH || execute[0] == POP) && execute[1] == execute[0]) {
+    group->kind = execute[0] == PUSH ? FUSE_PUSH_RUN : FUSE_POP_RUN;
+    while (count < FUSE_MAX_RUN && execute[count] == execute[0]) {
+      count++;
+    }
+  }
+  group->count = group->kind == FUSE_NONE ? 1 : count;
+  group->cycles = 0;
+  for (int i = 0; i < group->count; i++) {
+    group->cycles += cycles[i];
+  }
+}
+
+static inline void invalidate_fusion(void) {
+  if (mcu->host.fusion != NULL) {
+    memset(mcu->host.fusion, 0, sizeof(Fusion_t));
+  }
+}
+
+bool mcu_set_fusion(bool enabled) {
+  if (!enabled) {
+    free(mcu->host.fusion);
+    mcu->host.fusion = NULL;
     return true;
   }
-  if (mcu.handle_interrupt) {
-    mcu.handle_interrupt = false;
+  if (mcu->host.fusion == NULL) {
+    mcu->host.fusion = calloc(1, sizeof(Fusion_t));
+  }
+  return mcu->host.fusion != NULL;
+}
+
+static inline uint16_t sleep_cycles(void) {
+  // Nothing but an event or the host can wake the MCU, so it sleeps until the next event in one step
+  if (mcu->next_event == UINT64_MAX || mcu->next_event <= mcu->cycle_count + 1) {
+    return 1;
+  }
+  uint64_t idle = mcu->next_event - mcu->cycle_count;
+  return idle < UINT16_MAX ? idle : UINT16_MAX;
+}
+
+static void clear_events(void) {
+  for (int i = 0; i < EVENT_COUNT; i++) {
+    mcu->events[i] = UINT64_MAX;
+  }
+  mcu->next_event = UINT64_MAX;
+}
+
+static void reset_io(void) {
+  // IO registers that are not 0 after a reset, the caller has cleared the rest
+  mcu->data_memory[TWSR_ADDRESS] = TWI_NO_INFO;
+  mcu->data_memory[UCSR0A_ADDRESS] = UCSR0A_UDRE0;
+  mcu->twi_device = -1;
+  if (mcu->host.inbox != NULL) {
+    mcu->host.inbox->uart_count = 0; // the receiver drops what was waiting for it
+  }
+}
+
+static void schedule_event(const Event_t event, const uint64_t cycle) {
+  // UINT64_MAX cancels the event
+  mcu->events[event] = cycle;
+  mcu->next_event = UINT64_MAX;
+  for (int i = 0; i < EVENT_COUNT; i++) {
+    mcu->next_event = mcu->events[i] < mcu->next_event ? mcu->events[i] : mcu->next_event;
+  }
+}
+
+static void run_events(void) {
+  static void (*const handlers[EVENT_COUNT])(void) = {watchdog_timeout, adc_complete, apply_stimulus, spi_complete, twi_complete, raise_interrupts, publish_snapshot};
+  for (int i = 0; i < EVENT_COUNT; i++) {
+    if (mcu->events[i] <= mcu->cycle_count) {
+      schedule_event((Event_t)i, UINT64_MAX); // handlers schedule the next one themselves
+      handlers[i]();
+    }
+  }
+}
+
+static inline uint64_t watchdog_period(const byte control) {
+  // 2K to 1024K cycles of the watchdog oscillator, larger prescalers are reserved
+  uint8_t prescaler = (control & WDTCSR_WDP) | (control & WDTCSR_WDP3 ? 8 : 0);
+  return (2048ULL << (prescaler < 9 ? prescaler : 9)) * (CPU_FREQUENCY / WATCHDOG_FREQUENCY);
+}
+
+static void watchdog_write(const byte value) {
+  // WDE can only be cleared and the prescaler only changed within 4 cycles of writing WDCE and WDE
+  byte control = mcu->data_memory[WDTCSR_ADDRESS];
+  byte config = WDTCSR_WDE | WDTCSR_WDP3 | WDTCSR_WDP;
+  bool running = control & (WDTCSR_WDE | WDTCSR_WDIE);
+  if (mcu->cycle_count < mcu->watchdog_change) {
+    control = (control & ~config) | (value & config);
+    mcu->watchdog_change = 0;
+  } else {
+    control |= value & WDTCSR_WDE;
+    if ((value & WDTCSR_WDCE) && (value & WDTCSR_WDE)) {
+      mcu->watchdog_change = mcu->cycle_count + WATCHDOG_CHANGE_CYCLES;
+    }
+  }
+  if (mcu->SR.flags.WDRF) {
+    control |= WDTCSR_WDE; // cleared only after WDRF
+  }
+  control = (control & ~WDTCSR_WDIE) | (value & WDTCSR_WDIE);
+  control &= ~(value & WDTCSR_WDIF); // writing one clears the flag
+  mcu->data_memory[WDTCSR_ADDRESS] = control;
+  if (!(control & (WDTCSR_WDE | WDTCSR_WDIE))) {
+    schedule_event(EVENT_WATCHDOG, UINT64_MAX);
+    return;
+  }
+  if (!running) {
+    mcu->watchdog_start = mcu->cycle_count;
+  }
+  schedule_event(EVENT_WATCHDOG, mcu->watchdog_start + watchdog_period(control));
+  raise_interrupts();
+}
+
+static void watchdog_timeout(void) {
+  byte control = mcu->data_memory[WDTCSR_ADDRESS];
+  bool reset_mode = control & WDTCSR_WDE;
+  if (!(control & WDTCSR_WDIE) || (reset_mode && (control & WDTCSR_WDIF))) {
+    // Reset mode, or interrupt and system reset mode with the interrupt still not executed
+    watchdog_reset();
+    return;
+  }
+  print("Watchdog timeout\n");
+  mcu->data_memory[WDTCSR_ADDRESS] |= WDTCSR_WDIF;
+  mcu->watchdog_start += watchdog_period(control);
+  schedule_event(EVENT_WATCHDOG, mcu->watchdog_start + watchdog_period(control));
+  raise_interrupts();
+}
+
+static void watchdog_reset(void) {
+  // Registers and IO are cleared, RAM keeps its contents like on the real part
+  print("Watchdog reset\n");
+  byte status = mcu->data_memory[MCUSR_ADDRESS] | MCUSR_WDRF;
+  memset(mcu->data_memory, 0, RAM_START);
+  mcu->SREG.value = 0;
+  mcu->SR.flags.WDRF = 1;
+  mcu->data_memory[MCUSR_ADDRESS] = status;
+  mcu->data_memory[WDTCSR_ADDRESS] = WDTCSR_WDE; // WDRF keeps the watchdog running at the shortest timeout
+  reset_io();
+  mcu->sp = RAM_SIZE - 1;
+  mcu->pc = 0;
+  mcu->skip_next = false;
+  mcu->sleeping = false;
+  mcu->handle_interrupt = false;
+  mcu->interrupt_address = 0;
+  mcu->watchdog_start = mcu->cycle_count;
+  mcu->watchdog_change = 0;
+  mcu->adc_ready = false;
+  mcu->spi_status_read = false;
+  mcu->twi_bus_owned = false; // devices see the bus released without a STOP
+  clear_events();
+  schedule_event(EVENT_WATCHDOG, mcu->cycle_count + watchdog_period(WDTCSR_WDE));
+  schedule_stimulus(); // the outside keeps driving the pins
+  schedule_snapshot();
+  for (byte port = 0; port < PORT_COUNT; port++) {
+    update_pins(port);
+  }
+  if (mcu->host.vcd != NULL) {
+    vcd_sync(mcu->host.vcd, mcu->cycle_count, mcu->data_memory);
+  }
+}
+
+static void adc_write(const byte value) {
+  // ADSC can only be set, a conversion keeps running until it is done or the ADC is disabled
+  byte control = mcu->data_memory[ADCSRA_ADDRESS];
+  bool converting = control & ADCSRA_ADSC;
+  control = (value & ~(ADCSRA_ADIF | ADCSRA_ADSC)) | (control & ADCSRA_ADIF & ~value) | (control & ADCSRA_ADSC);
+  mcu->data_memory[ADCSRA_ADDRESS] = control;
+  if (!(control & ADCSRA_ADEN)) {
+    mcu->data_memory[ADCSRA_ADDRESS] &= ~ADCSRA_ADSC;
+    mcu->adc_ready = false;
+    schedule_event(EVENT_ADC, UINT64_MAX);
+  } else if (!converting && (value & ADCSRA_ADSC)) {
+    mcu->data_memory[ADCSRA_ADDRESS] |= ADCSRA_ADSC;
+    adc_start();
+  }
+  raise_interrupts();
+}
+
+static void adc_start(void) {
+  // The input is held 1.5 ADC clocks into a conversion, 13.5 into the first one
+  byte prescaler = mcu->data_memory[ADCSRA_ADDRESS] & ADCSRA_ADPS;
+  uint64_t clock = 1ULL << (prescaler > 0 ? prescaler : 1);
+  uint64_t clocks = mcu->adc_ready ? ADC_CLOCKS : ADC_FIRST_CLOCKS;
+  mcu->adc_sample = mcu->cycle_count + (mcu->adc_ready ? 1 : 13) * clock + clock / 2;
+  schedule_event(EVENT_ADC, mcu->cycle_count + clocks * clock);
+}
+
+static void adc_complete(void) {
+  byte control = mcu->data_memory[ADCSRA_ADDRESS];
+  if (!(control & ADCSRA_ADEN)) {
+    return;
+  }
+  uint16_t result = adc_convert();
+  if (mcu->data_memory[ADMUX_ADDRESS] & ADMUX_ADLAR) {
+    result <<= 6;
+  }
+  mcu->data_memory[ADCL_ADDRESS] = result & 0xFF;
+  mcu->data_memory[ADCH_ADDRESS] = result >> 8;
+  mcu->adc_ready = true;
+  control |= ADCSRA_ADIF;
+  if ((control & ADCSRA_ADATE) && !(mcu->data_memory[ADCSRB_ADDRESS] & ADCSRB_ADTS)) {
+    mcu->data_memory[ADCSRA_ADDRESS] = control; // free running, the next conversion starts right away
+    adc_start();
+  } else {
+    mcu->data_memory[ADCSRA_ADDRESS] = control & ~ADCSRA_ADSC;
+  }
+  raise_interrupts();
+}
+
+static uint16_t adc_convert(void) {
+  // Samples are picked by the emulated time, the last one holds after the end of the file
+  byte mux = mcu->data_memory[ADMUX_ADDRESS] & ADMUX_MUX;
+  byte refs = (mcu->data_memory[ADMUX_ADDRESS] & ADMUX_REFS) >> 6;
+  float reference = refs == 3 ? ADC_BANDGAP : mcu->host.adc != NULL ? mcu->host.adc->avcc : 5.0f;
+  float volts = mux == 14 ? ADC_BANDGAP : 0;
+  if (mux < ADC_CHANNELS && mcu->host.adc != NULL && mcu->host.adc->channels[mux].samples != NULL) {
+    const Adc_channel_t *channel = mcu->host.adc->channels + mux;
+    uint64_t seconds = mcu->adc_sample / CPU_FREQUENCY;
+    uint64_t index = seconds * channel->rate + (mcu->adc_sample % CPU_FREQUENCY) * channel->rate / CPU_FREQUENCY;
+    index = index < channel->count ? index : channel->count - 1;
+    if (channel->format == ADC_INT16) {
+      int16_t sample = ((const int16_t *)channel->samples)[index];
+      return sample < 0 ? 0 : sample > 1023 ? 1023 : sample;
+    }
+    volts = ((const float *)channel->samples)[index];
+  }
+  float result = volts * 1024 / reference;
+  return result < 0 ? 0 : result > 1023 ? 1023 : (uint16_t)result;
+}
+
+static void schedule_stimulus(void) {
+  // Records before the current cycle are skipped, so a stimulus can be attached at any point
+  const Stimulus_t *stimulus = mcu->host.stimulus;
+  uint64_t low = 0, high = stimulus != NULL ? stimulus->count : 0;
+  while (low < high) {
+    uint64_t middle = low + (high - low) / 2;
+    if (stimulus->records[middle].cycle < mcu->cycle_count) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  mcu->stimulus_next = low;
+  schedule_event(EVENT_STIMULUS, stimulus != NULL && low < stimulus->count ? stimulus->records[low].cycle : UINT64_MAX);
+}
+
+void mcu_set_stimulus(const Stimulus_t *stimulus) {
+  mcu->host.stimulus = stimulus;
+  schedule_stimulus();
+}
+
+static void apply_stimulus(void) {
+  // Every transition goes through the edge detection on its own, even several in one step
+  const Stimulus_t *stimulus = mcu->host.stimulus;
+  if (stimulus == NULL) {
+    return;
+  }
+  for (; mcu->stimulus_next < stimulus->count && stimulus->records[mcu->stimulus_next].cycle <= mcu->cycle_count; mcu->stimulus_next++) {
+    const Stimulus_record_t *record = stimulus->records + mcu->stimulus_next;
+    byte port = record->pin / 8, bit = 1 << (record->pin % 8);
+    if (port >= PORT_COUNT) {
+      continue;
+    }
+    mcu->pin_driven[port] = record->level == STIMULUS_RELEASE ? mcu->pin_driven[port] & ~bit : mcu->pin_driven[port] | bit;
+    mcu->pin_levels[port] = record->level == STIMULUS_HIGH ? mcu->pin_levels[port] | bit : mcu->pin_levels[port] & ~bit;
+    update_pins(port);
+  }
+  schedule_event(EVENT_STIMULUS, mcu->stimulus_next < stimulus->count ? stimulus->records[mcu->stimulus_next].cycle : UINT64_MAX);
+}
+
+static void update_pins(const byte port) {
+  // Outputs read back PORTx, driven inputs the outside level, the others their pull-up
+  byte *registers = mcu->data_memory + PINB_ADDRESS + port * 3;
+  byte ddr = registers[1], out = registers[2], driven = mcu->pin_driven[port];
+  byte pins = (ddr & out) | (~ddr & driven & mcu->pin_levels[port]) | (~ddr & ~driven & out);
+  byte old = registers[0];
+  if (pins == old) {
+    return;
+  }
+  registers[0] = pins;
+  if (mcu->host.vcd != NULL) {
+    vcd_change(mcu->host.vcd, mcu->cycle_count, PINB_ADDRESS + port * 3, pins);
+  }
+  if (mcu->host.bus != NULL) {
+    select_devices(port, old ^ pins, pins);
+  }
+  pin_change(port, old, pins);
+}
+
+static void pin_change(const byte port, const byte old, const byte pins) {
+  byte changed = old ^ pins;
+  if (changed & mcu->data_memory[PCMSK0_ADDRESS + port]) {
+    mcu->data_memory[PCIFR_ADDRESS] |= 1 << port;
+  }
+  for (byte i = 0; port == 2 && i < 2; i++) {
+    // ISCn: 1 any change, 2 falling, 3 rising, the low level is checked by raise_interrupts
+    byte bit = 1 << (INT0_PIN + i);
+    byte sense = (mcu->data_memory[EICRA_ADDRESS] >> (i * 2)) & 0b11;
+    if ((changed & bit) && (sense == 1 || (sense == 2 && !(pins & bit)) || (sense == 3 && (pins & bit)))) {
+      mcu->data_memory[EIFR_ADDRESS] |= 1 << i;
+    }
+  }
+  raise_interrupts();
+}
+
+static inline uint64_t spi_byte_cycles(void) {
+  // SCK is the clock divided by 4 to 128, SPI2X doubles it
+  static const uint8_t dividers[] = {4, 16, 64, 128};
+  uint8_t divider = dividers[mcu->data_memory[SPCR_ADDRESS] & SPCR_SPR];
+  return 8 * (mcu->data_memory[SPSR_ADDRESS] & SPSR_SPI2X ? divider / 2 : divider);
+}
+
+static inline byte reverse_bits(byte value) {
+  value = (value & 0xF0) >> 4 | (value & 0x0F) << 4;
+  value = (value & 0xCC) >> 2 | (value & 0x33) << 2;
+  return (value & 0xAA) >> 1 | (value & 0x55) << 1;
+}
+
+static inline bool device_selected(const Spi_device_t *device) {
+  byte port = device->select_pin / 8;
+  return port < PORT_COUNT && !(mcu->data_memory[PINB_ADDRESS + port * 3] & (1 << (device->select_pin % 8)));
+}
+
+static void spi_clear_flags(void) {
+  // Reading SPSR with SPIF set and then accessing SPDR clears SPIF and WCOL
+  if (mcu->spi_status_read) {
+    mcu->data_memory[SPSR_ADDRESS] &= ~(SPSR_SPIF | SPSR_WCOL);
+    mcu->spi_status_read = false;
+  }
+}
+
+static void spi_write_data(const byte value) {
+  // In master mode the write starts the transfer, in slave mode the byte waits for the master
+  spi_clear_flags();
+  if (mcu->events[EVENT_SPI] != UINT64_MAX) {
+    mcu->data_memory[SPSR_ADDRESS] |= SPSR_WCOL; // the byte being shifted out is kept
+    return;
+  }
+  mcu->data_memory[SPDR_ADDRESS] = value;
+  byte control = mcu->data_memory[SPCR_ADDRESS];
+  if ((control & SPCR_SPE) && (control & SPCR_MSTR)) {
+    schedule_event(EVENT_SPI, mcu->cycle_count + spi_byte_cycles());
+  }
+}
+
+static void spi_complete(void) {
+  // Devices see the bits in the order they are on the wire, MISO floats high without a selected device
+  bool lsb_first = mcu->data_memory[SPCR_ADDRESS] & SPCR_DORD;
+  byte mosi = mcu->data_memory[SPDR_ADDRESS], miso = 0xFF;
+  mosi = lsb_first ? reverse_bits(mosi) : mosi;
+  for (uint32_t i = 0; mcu->host.bus != NULL && i < mcu->host.bus->spi_count; i++) {
+    const Spi_device_t *device = mcu->host.bus->spi + i;
+    if (device_selected(device)) {
+      miso &= device->transfer(device->context, mosi); // several selected devices pull MISO low together
+    }
+  }
+  mcu->data_memory[SPDR_ADDRESS] = lsb_first ? reverse_bits(miso) : miso;
+  mcu->data_memory[SPSR_ADDRESS] |= SPSR_SPIF;
+  mcu->spi_status_read = false; // the new flag needs another SPSR read
+  raise_interrupts();
+}
+
+bool mcu_spi_slave_transfer(byte mosi, byte *miso) {
+  // The byte in SPDR goes out as the master's byte comes in, the timing is up to the host
+  byte control = mcu->data_memory[SPCR_ADDRESS];
+  if (!(control & SPCR_SPE) || (control & SPCR_MSTR) || (mcu->data_memory[PINB_ADDRESS] & (1 << SS_PIN))) {
+    return false;
+  }
+  bool lsb_first = control & SPCR_DORD;
+  byte out = mcu->data_memory[SPDR_ADDRESS];
+  *miso = lsb_first ? reverse_bits(out) : out;
+  mcu->data_memory[SPDR_ADDRESS] = lsb_first ? reverse_bits(mosi) : mosi;
+  mcu->data_memory[SPSR_ADDRESS] |= SPSR_SPIF;
+  mcu->spi_status_read = false;
+  raise_interrupts();
+  return true;
+}
+
+static void select_devices(const byte port, const byte changed, const byte pins) {
+  for (uint32_t i = 0; i < mcu->host.bus->spi_count; i++) {
+    const Spi_device_t *device = mcu->host.bus->spi + i;
+    byte bit = 1 << (device->select_pin % 8);
+    if (device->select != NULL && device->select_pin / 8 == port && (changed & bit)) {
+      device->select(device->context, !(pins & bit));
+    }
+  }
+}
+
+static inline uint64_t twi_bit_cycles(void) {
+  // One SCL period, the clock divided by 16 + 2 * TWBR * 4^TWPS
+  byte prescaler = mcu->data_memory[TWSR_ADDRESS] & TWSR_TWPS;
+  return 16 + 2 * (uint64_t)mcu->data_memory[TWBR_ADDRESS] * (1 << (2 * prescaler));
+}
+
+static void twi_release(void) {
+  const Twi_device_t *device = mcu->host.bus != NULL && mcu->twi_device >= 0 ? mcu->host.bus->twi + mcu->twi_device : NULL;
+  if (device != NULL && device->stop != NULL) {
+    device->stop(device->context);
+  }
+  mcu->twi_device = -1;
+  mcu->twi_bus_owned = false;
+}
+
+static void twi_write_control(const byte value) {
+  // Writing one to TWINT clears it and starts the next action, which one follows from TWSTA, TWSTO and the status
+  byte control = mcu->data_memory[TWCR_ADDRESS];
+  bool cleared = value & TWCR_TWINT;
+  mcu->data_memory[TWCR_ADDRESS] = (value & ~(TWCR_TWINT | TWCR_TWWC)) | (control & TWCR_TWWC) | (cleared ? 0 : control & TWCR_TWINT);
+  if (!(value & TWCR_TWEN)) {
+    // Disabling ends any transmission at once
+    schedule_event(EVENT_TWI, UINT64_MAX);
+    mcu->twi_action = TWI_IDLE;
+    twi_release();
+    mcu->data_memory[TWCR_ADDRESS] &= ~TWCR_TWSTO;
+    mcu->data_memory[TWSR_ADDRESS] = TWI_NO_INFO | (mcu->data_memory[TWSR_ADDRESS] & TWSR_TWPS);
+  } else if (cleared && mcu->twi_action == TWI_IDLE) {
+    if (value & TWCR_TWSTO) {
+      // STOP takes effect at once, a START requested with it follows
+      twi_release();
+      mcu->data_memory[TWCR_ADDRESS] &= ~TWCR_TWSTO;
+      mcu->data_memory[TWSR_ADDRESS] = TWI_NO_INFO | (mcu->data_memory[TWSR_ADDRESS] & TWSR_TWPS);
+    }
+    byte status = mcu->data_memory[TWSR_ADDRESS] & ~TWSR_TWPS;
+    byte action = TWI_IDLE;
+    if (value & TWCR_TWSTA) {
+      action = TWI_START;
+    } else if (status == 0x08 || status == 0x10) {
+      action = TWI_ADDRESS; // SLA+R/W in TWDR
+    } else if (status == 0x18 || status == 0x20 || status == 0x28 || status == 0x30) {
+      action = TWI_WRITE;
+    } else if (status == 0x40 || status == 0x50) {
+      action = TWI_READ; // TWEA decides whether the byte is acknowledged
+    }
+    if (action != TWI_IDLE) {
+      mcu->twi_action = action;
+      mcu->data_memory[TWSR_ADDRESS] = TWI_NO_INFO | (mcu->data_memory[TWSR_ADDRESS] & TWSR_TWPS);
+      schedule_event(EVENT_TWI, mcu->cycle_count + twi_bit_cycles() * (action == TWI_START ? 1 : 9));
+    }
+  }
+  raise_interrupts();
+}
+
+static void twi_complete(void) {
+  // Each action ends with a status code and TWINT set
+  const Twi_device_t *device = mcu->host.bus != NULL && mcu->twi_device >= 0 ? mcu->host.bus->twi + mcu->twi_device : NULL;
+  byte *data = mcu->data_memory + TWDR_ADDRESS;
+  byte status = TWI_NO_INFO;
+  bool ack;
+  switch (mcu->twi_action) {
+    case TWI_START:
+      status = mcu->twi_bus_owned ? 0x10 : 0x08;
+      mcu->twi_bus_owned = true;
+      break;
+    case TWI_ADDRESS:
+      mcu->twi_device = -1;
+      for (uint32_t i = 0; mcu->host.bus != NULL && i < mcu->host.bus->twi_count; i++) {
+        if (mcu->host.bus->twi[i].address == *data >> 1) {
+          device = mcu->host.bus->twi + i;
+          mcu->twi_device = i;
+          break;
+        }
+      }
+      ack = mcu->twi_device >= 0 && device->start(device->context, *data & 1);
+      mcu->twi_device = ack ? mcu->twi_device : -1;
+      status = *data & 1 ? (ack ? 0x40 : 0x48) : (ack ? 0x18 : 0x20);
+      break;
+    case TWI_WRITE:
+      ack = device != NULL && device->write(device->context, *data);
+      status = ack ? 0x28 : 0x30;
+      break;
+    case TWI_READ:
+      ack = mcu->data_memory[TWCR_ADDRESS] & TWCR_TWEA;
+      *data = device != NULL ? device->read(device->context, ack) : 0xFF;
+      status = ack ? 0x50 : 0x58;
+      break;
+  }
+  mcu->twi_action = TWI_IDLE;
+  mcu->data_memory[TWSR_ADDRESS] = status | (mcu->data_memory[TWSR_ADDRESS] & TWSR_TWPS);
+  mcu->data_memory[TWCR_ADDRESS] |= TWCR_TWINT;
+  raise_interrupts();
+}
+
+static void raise_interrupts(void) {
+  // Peripheral interrupts wait for the I flag, pending ones are retried after every step.
+  // Sources are in vector order, the lowest vector goes first
+  static const struct {
+    uint16_t address;
+    byte flag;
+    uint16_t enable_address;
+    byte enable;
+    Interrupt_vector_t vector;
+  } sources[] = {
+    {EIFR_ADDRESS, 1 << 0, EIMSK_ADDRESS, 1 << 0, INT0_vect},
+    {EIFR_ADDRESS, 1 << 1, EIMSK_ADDRESS, 1 << 1, INT1_vect},
+    {PCIFR_ADDRESS, 1 << 0, PCICR_ADDRESS, 1 << 0, PCINT0_vect},
+    {PCIFR_ADDRESS, 1 << 1, PCICR_ADDRESS, 1 << 1, PCINT1_vect},
+    {PCIFR_ADDRESS, 1 << 2, PCICR_ADDRESS, 1 << 2, PCINT2_vect},
+    {WDTCSR_ADDRESS, WDTCSR_WDIF, WDTCSR_ADDRESS, WDTCSR_WDIE, WDT_vect},
+    {SPSR_ADDRESS, SPSR_SPIF, SPCR_ADDRESS, SPCR_SPIE, SPI_STC_vect},
+    {UCSR0A_ADDRESS, UCSR0A_RXC0, UCSR0B_ADDRESS, UCSR0B_RXCIE0, USART_RX_vect},
+    {UCSR0A_ADDRESS, UCSR0A_UDRE0, UCSR0B_ADDRESS, UCSR0B_UDRIE0, USART_UDRE_vect},
+    {UCSR0A_ADDRESS, UCSR0A_TXC0, UCSR0B_ADDRESS, UCSR0B_TXCIE0, USART_TX_vect},
+    {ADCSRA_ADDRESS, ADCSRA_ADIF, ADCSRA_ADDRESS, ADCSRA_ADIE, ADC_vect},
+    {TWCR_ADDRESS, TWCR_TWINT, TWCR_ADDRESS, TWCR_TWIE, TWI_vect}
+  };
+  bool pending = false;
+  for (byte i = 0; i < 2; i++) {
+    // A low level keeps requesting the interrupt for as long as it lasts
+    byte sense = (mcu->data_memory[EICRA_ADDRESS] >> (i * 2)) & 0b11;
+    bool low = !(mcu->data_memory[PINB_ADDRESS + 2 * 3] & (1 << (INT0_PIN + i)));
+    if (sense == 0 && low && (mcu->data_memory[EIMSK_ADDRESS] & (1 << i))) {
+      mcu->data_memory[EIFR_ADDRESS] |= 1 << i;
+      pending = true;
+    }
+  }
+  for (int i = 0; i < sizeof(sources) / sizeof(sources[0]); i++) {
+    byte *control = mcu->data_memory + sources[i].address;
+    if (!(*control & sources[i].flag) || !(mcu->data_memory[sources[i].enable_address] & sources[i].enable)) {
+      continue;
+    }
+    if (!mcu->SREG.flags.I || mcu->handle_interrupt) {
+      pending = true;
+      continue;
+    }
+    mcu->handle_interrupt = true;
+    mcu->interrupt_address = sources[i].vector;
+    if (sources[i].vector == TWI_vect || sources[i].vector == USART_RX_vect || sources[i].vector == USART_UDRE_vect) {
+      pending = true; // TWINT, RXC0 and UDRE0 stay set until the handler acts, a RETI before that enters again
+      continue;
+    }
+    *control &= ~sources[i].flag;
+    if (sources[i].vector == WDT_vect && (*control & WDTCSR_WDE)) {
+      *control &= ~WDTCSR_WDIE; // the next timeout resets
+    }
+  }
+  schedule_event(EVENT_INTERRUPTS, pending ? mcu->cycle_count + 1 : UINT64_MAX);
+}
+
+static void schedule_snapshot(void) {
+  schedule_event(EVENT_SNAPSHOT, mcu->host.snapshot != NULL ? mcu->cycle_count + mcu->host.snapshot->interval : UINT64_MAX);
+}
+
+static void publish_snapshot(void) {
+  mcu_publish();
+  schedule_snapshot();
+}
+
+void mcu_set_snapshot(struct Snapshot_t *snapshot) {
+  mcu->host.snapshot = snapshot;
+  mcu_publish();
+  schedule_snapshot();
+}
+
+void mcu_set_inbox(struct Inbox_t *inbox) {
+  mcu->host.inbox = inbox;
+}
+
+static void take_inbox(void) {
+  // Before a step, an interrupt is entered and a stop request is seen right away
+  Inbox_event_t event;
+  while (inbox_take(mcu->host.inbox, &event)) {
+    byte port = event.pin / 8, bit = 1 << (event.pin % 8);
+    switch ((Inbox_kind_t)event.kind) {
+      case INBOX_INTERRUPT:
+        mcu_send_interrupt((Interrupt_vector_t)event.value);
+        break;
+      case INBOX_PIN:
+        if (port >= PORT_COUNT) {
+          break;
+        }
+        mcu->pin_driven[port] = event.value == STIMULUS_RELEASE ? mcu->pin_driven[port] & ~bit : mcu->pin_driven[port] | bit;
+        mcu->pin_levels[port] = event.value == STIMULUS_HIGH ? mcu->pin_levels[port] | bit : mcu->pin_levels[port] & ~bit;
+        update_pins(port);
+        break;
+      case INBOX_UART:
+        uart_receive(event.value);
+        break;
+      case INBOX_STOP:
+        mcu->stopped = true;
+        mcu->stop_reason = STOP_HOST;
+        break;
+    }
+  }
+}
+
+static void uart_receive(const byte value) {
+  // Bytes arrive as fast as the firmware reads them, the host paces them if it needs to.
+  // The inbox buffers a few, beyond that they overrun like a full receive buffer
+  Inbox_t *inbox = mcu->host.inbox;
+  if (!(mcu->data_memory[UCSR0B_ADDRESS] & UCSR0B_RXEN0)) {
+    return; // nobody listens
+  }
+  if (inbox->uart_count == INBOX_UART_BUFFER) {
+    mcu->data_memory[UCSR0A_ADDRESS] |= UCSR0A_DOR0;
+    return;
+  }
+  inbox->uart[(inbox->uart_first + inbox->uart_count++) % INBOX_UART_BUFFER] = value;
+  uart_fill();
+}
+
+static bool uart_transmit(const byte value) {
+  // The frame completes at once, so the data register is empty again right away.
+  // Without the transmitter the byte is just stored, for hosts that watch the writes
+  if (!(mcu->data_memory[UCSR0B_ADDRESS] & UCSR0B_TXEN0)) {
+    return false;
+  }
+  if (mcu->host.uart_output != NULL) {
+    mcu->host.uart_output(value);
+  }
+  mcu->data_memory[UCSR0A_ADDRESS] |= UCSR0A_TXC0;
+  raise_interrupts();
+  return true;
+}
+
+static void uart_fill(void) {
+  // The next buffered byte moves into UDR0 once the previous one was read
+  Inbox_t *inbox = mcu->host.inbox;
+  if (inbox == NULL || inbox->uart_count == 0 || (mcu->data_memory[UCSR0A_ADDRESS] & UCSR0A_RXC0)) {
+    return;
+  }
+  mcu->data_memory[UDR0_ADDRESS] = inbox->uart[inbox->uart_first];
+  inbox->uart_first = (inbox->uart_first + 1) % INBOX_UART_BUFFER;
+  inbox->uart_count--;
+  mcu->data_memory[UCSR0A_ADDRESS] |= UCSR0A_RXC0;
+  raise_interrupts();
+}
+
+void mcu_publish(void) {
+  if (mcu->host.snapshot != NULL) {
+    Mcu_status_t status;
+    mcu_get_status(&status);
+    snapshot_write(mcu->host.snapshot, &status, mcu->data_memory, mcu->ROM);
+  }
+}
+
+static inline bool execute_step(const bool fast_forward) {
+  mcu->cycles = 0; // collects the cycles of the whole step
+  if (mcu->host.inbox != NULL && inbox_pending(mcu->host.inbox)) {
+    take_inbox();
+    if (mcu->stopped) {
+      return false;
+    }
+  }
+  if (mcu->host.trace != NULL) {
+    trace_begin(mcu->host.trace, mcu->cycle_count);
+  }
+  if (mcu->handle_interrupt) {
+    mcu->handle_interrupt = false;
     handle_interrupt();
-    time_start = get_micro_time();
   }
-  if (!mcu.sleeping) {
+  if (mcu->sleeping) {
+    mcu->cycles += fast_forward ? sleep_cycles() : 1;
+  } else if (mcu->host.debug == NULL || mcu->skip_next || !breakpoint_hit()) {
     execute_instruction();
   }
-  if (mcu.stopped) {
-    mcu.cycles = 0; // fix BREAK
+  mcu->cycle_count += mcu->cycles;
+  if (mcu->host.trace != NULL) {
+    trace_end(mcu->host.trace, mcu->cycles, mcu->stopped, mcu->stop_reason);
+  }
+  if (mcu->cycle_count >= mcu->next_event) {
+    run_events();
+  }
+  mcu->cycles -= 1; // the first cycle is the current one
+  if (mcu->stopped) {
+    mcu->cycles = 0;
+    return false;
+  }
+  return true;
+}
+
+bool mcu_execute_cycle(void) {
+  uint64_t time_start = get_micro_time();
+  mcu->data_memory_change = -1; // indicate no change
+  if (mcu->cycles > 0) {
+    usleep(CLOCK_FREQ);
+    mcu->cycles--;
+    return true;
+  }
+  if (!execute_step(false)) {
     return false;
   }
   uint64_t sleep_time = (CLOCK_FREQ - (get_micro_time() - time_start)) % CLOCK_FREQ;
@@ -1232,15 +2170,67 @@ bool mcu_execute_cycle(void) {
   return true;
 }
 
+bool mcu_step(void) {
+  // Executes a whole instruction at once, without waiting for the clock. Sleep lasts until the next event
+  mcu->data_memory_change = -1;
+  bool running = execute_step(true);
+  mcu->cycles = 0;
+  return running;
+}
+
+bool mcu_run_cycles(uint64_t cycles) {
+  // One call per slice of time instead of one per cycle, for hosts that call across a language boundary
+  uint64_t end = mcu->cycle_count + cycles;
+  bool running = !mcu->stopped;
+  while (running && mcu->cycle_count < end) {
+    running = mcu_step();
+  }
+  return running;
+}
+
+void mcu_select(ATmega328p_t *instance) {
+  mcu = instance != NULL ? instance : &mcu_instance;
+}
+
+ATmega328p_t *mcu_create(void) {
+  ATmega328p_t *instance = calloc(1, sizeof(ATmega328p_t));
+  if (instance != NULL) {
+    ATmega328p_t *selected = mcu;
+    mcu = instance;
+    mcu_init();
+    mcu = selected;
+  }
+  return instance;
+}
+
+void mcu_destroy(ATmega328p_t *instance) {
+  // Debug points and fused groups belong to the instance, the other attachments to the host
+  if (instance == NULL) {
+    return;
+  }
+  free(instance->host.debug);
+  free(instance->host.fusion);
+  instance->host.debug = NULL;
+  instance->host.fusion = NULL;
+  if (instance != &mcu_instance) {
+    free(instance);
+  }
+}
+
 void mcu_run(void) {
-  mcu.auto_execute = true;
+  mcu->auto_execute = true;
   while (mcu_execute_cycle());
 }
 
 void mcu_resume(void) {
-  mcu.stopped = false;
-  mcu.pc += 1; // skip BREAK
-  if (mcu.auto_execute) {
+  if (mcu->stop_reason == STOP_BREAK) {
+    mcu->pc += 1; // skip BREAK
+  } else if (mcu->stop_reason == STOP_BREAKPOINT && mcu->host.debug != NULL) {
+    mcu->host.debug->skip_breakpoint = true;
+  }
+  mcu->stopped = false;
+  mcu->stop_reason = STOP_NONE;
+  if (mcu->auto_execute) {
     mcu_run();
   }
 }
@@ -1254,6 +2244,8 @@ bool mcu_load_ihex(const char *filename) {
   char buffer[BUFFER_LENGTH];
   memset(buffer, 0, BUFFER_LENGTH);
   int memory_index = 0;
+  mcu->flash = mcu->program_memory;
+  invalidate_fusion();
   while (fgets(buffer, BUFFER_LENGTH, file)) {
     char *line = buffer + 1;
     char number_buffer[2];
@@ -1284,7 +2276,7 @@ bool mcu_load_ihex(const char *filename) {
         return false;
       }
       print("Writing 0x%.4X to memory\n", word);
-      memcpy(mcu.program_memory + memory_index, &word, sizeof(word));
+      memcpy(mcu->program_memory + memory_index, &word, sizeof(word));
       memory_index += sizeof(word);
     }
     free(data_buffer);
@@ -1293,6 +2285,64 @@ bool mcu_load_ihex(const char *filename) {
   return true;
 }
 
+bool mcu_load_elf(const char *filename) {
+  // Loadable segments go where their physical address says, flash from 0 and EEPROM from 0x810000.
+  // The initial values of .data are stored in flash after the code, as avr-objcopy does for hex files
+  FILE *file = fopen(filename, "rb");
+  if (file == NULL) {
+    print("Could not open %s\n", filename);
+    return false;
+  }
+  byte header[ELF_HEADER_SIZE];
+  bool loaded = fread(header, 1, ELF_HEADER_SIZE, file) == ELF_HEADER_SIZE && memcmp(header, ELF_MAGIC, 4) == 0
+    && header[4] == ELF_CLASS_32 && header[5] == ELF_LITTLE_ENDIAN && read_little_endian(header + 18, 2) == ELF_MACHINE_AVR;
+  if (!loaded) {
+    print("%s is not an AVR ELF file\n", filename);
+    fclose(file);
+    return false;
+  }
+  uint32_t table = read_little_endian(header + 28, 4);
+  uint32_t entry_size = read_little_endian(header + 42, 2);
+  uint32_t count = read_little_endian(header + 44, 2);
+  mcu->flash = mcu->program_memory;
+  invalidate_fusion();
+  for (uint32_t i = 0; loaded && i < count; i++) {
+    byte segment[ELF_SEGMENT_SIZE];
+    loaded = fseek(file, table + i * entry_size, SEEK_SET) == 0 && fread(segment, 1, ELF_SEGMENT_SIZE, file) == ELF_SEGMENT_SIZE;
+    uint32_t offset = read_little_endian(segment + 4, 4);
+    uint32_t address = read_little_endian(segment + 12, 4);
+    uint32_t size = read_little_endian(segment + 16, 4); // in the file, .bss has none
+    if (!loaded || read_little_endian(segment, 4) != ELF_SEGMENT_LOAD || size == 0) {
+      continue;
+    }
+    byte *memory = mcu->program_memory;
+    uint32_t memory_size = PROGRAM_MEMORY_SIZE;
+    if (address >= ELF_EEPROM_START) {
+      memory = mcu->ROM;
+      memory_size = KB;
+      address -= ELF_EEPROM_START;
+    } else if (address >= ELF_DATA_START) {
+      continue; // data memory is set up by the startup code
+    }
+    if ((uint64_t)address + size > memory_size) {
+      print("Cannot fit the whole program in memory\n");
+      loaded = false;
+      break;
+    }
+    loaded = fseek(file, offset, SEEK_SET) == 0 && fread(memory + address, 1, size, file) == size;
+  }
+  fclose(file);
+  return loaded;
+}
+
+static uint32_t read_little_endian(const byte *bytes, const byte size) {
+  uint32_t value = 0;
+  for (byte i = 0; i < size; i++) {
+    value |= (uint32_t)bytes[i] << (i * 8);
+  }
+  return value;
+}
+
 bool mcu_load_asm(const char *code) {
   FILE *file = fopen(TMP"_t.asm", "w");
   if (file == NULL) {
@@ -1344,51 +2394,408 @@ bool mcu_load_c(const char *code) {
   return loaded;
 }
 
+void mcu_load_image(const byte *image) {
+  // The image is only read, so any number of instances can run from it at once
+  mcu->flash = image;
+  invalidate_fusion();
+}
+
 void mcu_get_copy(ATmega328p_t *_mcu) {
-  *_mcu = mcu;
+  *_mcu = *mcu;
+  memset(&_mcu->host, 0, sizeof(_mcu->host)); // stays with the instance
+  if (mcu->flash != mcu->program_memory) {
+    memcpy(_mcu->program_memory, mcu->flash, PROGRAM_MEMORY_SIZE);
+  }
   set_mcu_pointers(_mcu);
 }
 
+uint32_t mcu_abi_version(void) {
+  return MCU_ABI_VERSION;
+}
+
+uint32_t mcu_state_size(void) {
+  return sizeof(ATmega328p_t);
+}
+
+Memory_region_t mcu_region(Region_t region) {
+  // Writes to flash go around the fused groups, mcu_set_fusion has to find them again
+  Memory_region_t result = {NULL, 0, true};
+  switch (region) {
+    case REGION_REGISTERS:
+      result.data = mcu->R;
+      result.size = REGISTER_COUNT;
+      break;
+    case REGION_IO:
+      result.data = mcu->IO;
+      result.size = IO_REGISTER_COUNT;
+      break;
+    case REGION_EXT_IO:
+      result.data = mcu->ext_IO;
+      result.size = EXT_IO_REGISTER_COUNT;
+      break;
+    case REGION_RAM:
+      result.data = mcu->RAM;
+      result.size = RAM_SIZE;
+      break;
+    case REGION_DATA_MEMORY:
+      result.data = mcu->data_memory;
+      result.size = DATA_MEMORY_SIZE;
+      break;
+    case REGION_FLASH:
+      result.data = (byte *)mcu->flash;
+      result.size = PROGRAM_MEMORY_SIZE;
+      result.writable = mcu->flash == mcu->program_memory;
+      break;
+    case REGION_EEPROM:
+      result.data = mcu->ROM;
+      result.size = sizeof(mcu->ROM);
+      break;
+    default:
+      result.writable = false;
+  }
+  return result;
+}
+
+void mcu_get_status(Mcu_status_t *status) {
+  status->cycle_count = mcu->cycle_count;
+  status->pc = mcu->pc;
+  status->sp = mcu->sp;
+  status->SREG = mcu->SREG.value;
+  status->stop_reason = mcu->stop_reason;
+  status->stopped = mcu->stopped;
+  status->sleeping = mcu->sleeping;
+  status->data_memory_change = mcu->data_memory_change;
+  status->opcode = mcu->opcode;
+}
+
+void mcu_restore(const ATmega328p_t *state) {
+  // The exception handler belongs to the host and is kept, the instruction is looked up again
+  // so states that were written to a file by another process can be restored too
+  void (*handler)(void) = mcu->exception_handler;
+  Attachments_t host = mcu->host;
+  *mcu = *state;
+  set_mcu_pointers(mcu);
+  mcu->exception_handler = handler;
+  mcu->host = host;
+  schedule_snapshot(); // the state may come from an instance that was not publishing
+  invalidate_fusion(); // the flash may be a different one
+  if (mcu->host.vcd != NULL) {
+    vcd_sync(mcu->host.vcd, mcu->cycle_count, mcu->data_memory);
+  }
+  if (mcu->instruction != NULL) {
+    mcu->instruction = find_instruction(mcu->opcode > 0xFFFF ? mcu->opcode >> 16 : mcu->opcode);
+  }
+}
+
 static inline void set_mcu_pointers(ATmega328p_t *const mcu) {
   mcu->boot_section = &mcu->program_memory[PROGRAM_MEMORY_SIZE - BOOTLOADER_SIZE];
   mcu->R = &mcu->data_memory[0];
   mcu->IO = &mcu->R[REGISTER_COUNT];
   mcu->ext_IO = &mcu->IO[IO_REGISTER_COUNT];
   mcu->RAM = &mcu->ext_IO[EXT_IO_REGISTER_COUNT];
-  mcu->sp = RAM_SIZE - 1;
+  mcu->flash = mcu->program_memory;
+}
+
+static inline byte data_read(const uint16_t address) {
+  if (mcu->host.debug != NULL && address < DATA_MEMORY_SIZE) {
+    watchpoint_access(address, WATCH_READ, 0);
+  }
+  byte value = mcu->data_memory[address];
+  if (address >= REGISTER_COUNT && address < RAM_START) {
+    io_read(address); // after taking the value, reading UDR0 brings in the next byte
+  }
+  return value;
+}
+
+static void io_read(const uint16_t address) {
+  // Only registers with side effects on reads are listed
+  switch (address) {
+    case SPSR_ADDRESS:
+      mcu->spi_status_read = mcu->data_memory[address] & SPSR_SPIF;
+      break;
+    case SPDR_ADDRESS:
+      spi_clear_flags();
+      break;
+    case UDR0_ADDRESS:
+      mcu->data_memory[UCSR0A_ADDRESS] &= ~(UCSR0A_RXC0 | UCSR0A_DOR0);
+      uart_fill();
+      break;
+  }
+}
+
+static inline void data_write(const uint16_t address, const byte value) {
+  if (mcu->host.debug != NULL && address < DATA_MEMORY_SIZE) {
+    watchpoint_access(address, WATCH_WRITE, value);
+  }
+  if (mcu->host.trace != NULL) {
+    trace_write(mcu->host.trace, address, value);
+  }
+  if (address >= REGISTER_COUNT && address < RAM_START) {
+    io_write(address, value); // peripherals decide what is stored
+    if (mcu->host.vcd != NULL) {
+      vcd_change(mcu->host.vcd, mcu->cycle_count, address, address == UDR0_ADDRESS ? value : mcu->data_memory[address]); // UDR0 reads the receiver
+    }
+    return;
+  }
+  mcu->data_memory[address] = value;
+}
+
+static inline bool single_bit_register(const uint16_t address) {
+  // Writing one toggles or clears a bit, writing zero leaves it alone
+  return address == PINB_ADDRESS || address == PINB_ADDRESS + 3 || address == PINB_ADDRESS + 6 ||
+    address == EIFR_ADDRESS || address == PCIFR_ADDRESS;
+}
+
+static void io_write(const uint16_t address, byte value) {
+  switch (address) {
+    case MCUSR_ADDRESS:
+      value &= mcu->data_memory[address]; // reset flags can only be cleared
+      mcu->SR.flags.WDRF = !!(value & MCUSR_WDRF);
+      break;
+    case WDTCSR_ADDRESS:
+      watchdog_write(value);
+      return;
+    case ADCSRA_ADDRESS:
+      adc_write(value);
+      return;
+    case ADCL_ADDRESS:
+    case ADCH_ADDRESS:
+      return; // read only
+    case PINB_ADDRESS:
+    case PINB_ADDRESS + 3:
+    case PINB_ADDRESS + 6:
+      // Writing ones toggles PORTx
+      mcu->data_memory[address + 2] ^= value;
+      if (mcu->host.vcd != NULL) {
+        vcd_change(mcu->host.vcd, mcu->cycle_count, address + 2, mcu->data_memory[address + 2]);
+      }
+      update_pins((address - PINB_ADDRESS) / 3);
+      return;
+    case PINB_ADDRESS + 1:
+    case PINB_ADDRESS + 2:
+    case PINB_ADDRESS + 4:
+    case PINB_ADDRESS + 5:
+    case PINB_ADDRESS + 7:
+    case PINB_ADDRESS + 8:
+      mcu->data_memory[address] = value;
+      update_pins((address - PINB_ADDRESS) / 3);
+      return;
+    case EIFR_ADDRESS:
+    case PCIFR_ADDRESS:
+      mcu->data_memory[address] &= ~value; // writing one clears a flag
+      return;
+    case EIMSK_ADDRESS:
+    case EICRA_ADDRESS:
+    case PCICR_ADDRESS:
+      mcu->data_memory[address] = value;
+      raise_interrupts();
+      return;
+    case SPCR_ADDRESS:
+      mcu->data_memory[address] = value;
+      if (!(value & SPCR_SPE)) {
+        schedule_event(EVENT_SPI, UINT64_MAX); // a disabled SPI drops the byte it was shifting
+      }
+      raise_interrupts();
+      return;
+    case SPSR_ADDRESS:
+      value = (mcu->data_memory[address] & ~SPSR_SPI2X) | (value & SPSR_SPI2X);
+      break;
+    case SPDR_ADDRESS:
+      spi_write_data(value);
+      return;
+    case TWSR_ADDRESS:
+      value = (mcu->data_memory[address] & ~TWSR_TWPS) | (value & TWSR_TWPS);
+      break;
+    case TWDR_ADDRESS:
+      if (!(mcu->data_memory[TWCR_ADDRESS] & TWCR_TWINT)) {
+        mcu->data_memory[TWCR_ADDRESS] |= TWCR_TWWC; // the bus is busy
+        return;
+      }
+      mcu->data_memory[TWCR_ADDRESS] &= ~TWCR_TWWC;
+      break;
+    case TWCR_ADDRESS:
+      twi_write_control(value);
+      return;
+    case UCSR0A_ADDRESS:
+      // The flags are read only, except for TXC0 which writing one clears
+      value = (mcu->data_memory[address] & ~UCSR0A_WRITABLE & ~(value & UCSR0A_TXC0)) | (value & UCSR0A_WRITABLE);
+      break;
+    case UCSR0B_ADDRESS:
+      mcu->data_memory[address] = value;
+      raise_interrupts();
+      return;
+    case UDR0_ADDRESS:
+      if (uart_transmit(value)) {
+        return; // the register reads the receiver
+      }
+      break;
+  }
+  mcu->data_memory[address] = value;
+}
+
+static inline bool bitmap_get(const uint64_t *bitmap, const uint16_t index) {
+  return (bitmap[index / 64] >> (index % 64)) & 1;
+}
+
+static bool point_hit(Debug_point_t *point) {
+  point->hits++;
+  if (point->ignore > 0) {
+    point->ignore--;
+    return false;
+  }
+  return true;
+}
+
+static bool breakpoint_hit(void) {
+  // Only called while there are debug points, the bitmap keeps it O(1) for every other PC
+  Debug_t *debug = mcu->host.debug;
+  bool skip = debug->skip_breakpoint;
+  debug->skip_breakpoint = false;
+  if (skip || mcu->pc >= PROGRAM_MEMORY_SIZE / WORD_SIZE || !bitmap_get(debug->breakpoints, mcu->pc)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < debug->point_count; i++) {
+    Debug_point_t *point = debug->points + i;
+    if (point->kind == 0 && point->address == mcu->pc && point_hit(point)) {
+      print("Breakpoint at 0x%x\n", mcu->pc * WORD_SIZE);
+      mcu->stopped = true;
+      mcu->stop_reason = STOP_BREAKPOINT;
+      debug->stop_address = mcu->pc;
+      return true;
+    }
+  }
+  return false;
+}
+
+static void watchpoint_access(const uint16_t address, const byte access, const byte value) {
+  // The access still completes, the MCU stops after the instruction
+  Debug_t *debug = mcu->host.debug;
+  if (!bitmap_get(debug->watchpoints, address)) {
+    return;
+  }
+  for (uint32_t i = 0; i < debug->point_count; i++) {
+    Debug_point_t *point = debug->points + i;
+    // With WATCH_VALUE only writes of the value count, whether WATCH_WRITE is set or not
+    bool write = access == WATCH_WRITE && (point->kind & (WATCH_WRITE | WATCH_VALUE));
+    bool matches = write ? !(point->kind & WATCH_VALUE) || value == point->value : (point->kind & access);
+    if (point->kind != 0 && point->address == address && matches && point_hit(point)) {
+      print("Watchpoint at 0x%x\n", address);
+      mcu->stopped = true;
+      mcu->stop_reason = STOP_WATCHPOINT;
+      debug->stop_address = address;
+    }
+  }
+}
+
+static bool add_point(const uint16_t address, const byte kind, const byte value, const uint32_t ignore) {
+  if (address >= (kind == 0 ? PROGRAM_MEMORY_SIZE / WORD_SIZE : DATA_MEMORY_SIZE)) {
+    return false;
+  }
+  if (mcu->host.debug == NULL && (mcu->host.debug = calloc(1, sizeof(Debug_t))) == NULL) {
+    return false;
+  }
+  Debug_t *debug = mcu->host.debug;
+  uint32_t i = 0;
+  while (i < debug->point_count && (debug->points[i].address != address || (debug->points[i].kind == 0) != (kind == 0))) {
+    i++;
+  }
+  if (i == DEBUG_POINTS) {
+    return false;
+  }
+  debug->point_count += i == debug->point_count;
+  debug->points[i] = (Debug_point_t){address, kind, value, ignore, 0};
+  uint64_t *bitmap = kind == 0 ? debug->breakpoints : debug->watchpoints;
+  bitmap[address / 64] |= 1LLU << (address % 64);
+  return true;
+}
+
+static bool remove_point(const uint16_t address, const bool watch) {
+  Debug_t *debug = mcu->host.debug;
+  if (debug == NULL) {
+    return false;
+  }
+  for (uint32_t i = 0; i < debug->point_count; i++) {
+    if (debug->points[i].address == address && (debug->points[i].kind != 0) == watch) {
+      debug->points[i] = debug->points[--debug->point_count];
+      uint64_t *bitmap = watch ? debug->watchpoints : debug->breakpoints;
+      bitmap[address / 64] &= ~(1LLU << (address % 64));
+      if (debug->point_count == 0) {
+        mcu_clear_debug(); // back to no checks at all
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+bool mcu_add_breakpoint(uint16_t address, uint32_t ignore) {
+  return add_point(address, 0, 0, ignore);
+}
+
+bool mcu_remove_breakpoint(uint16_t address) {
+  return remove_point(address, false);
+}
+
+bool mcu_add_watchpoint(uint16_t address, byte kind, byte value, uint32_t ignore) {
+  return kind != 0 && add_point(address, kind, value, ignore);
+}
+
+bool mcu_remove_watchpoint(uint16_t address) {
+  return remove_point(address, true);
+}
+
+void mcu_clear_debug(void) {
+  free(mcu->host.debug);
+  mcu->host.debug = NULL;
+}
+
+static void cover_instruction(const uint16_t pc, const bool taken) {
+  // Branches are taken when they cost the extra cycle, skips when the next instruction is skipped
+  Coverage_t *coverage = mcu->host.coverage;
+  void (*execute)(uint32_t) = mcu->instruction->execute;
+  coverage->executed[pc / 64] |= 1LLU << (pc % 64);
+  if (execute == BRBS || execute == BRBC || execute == CPSE || execute == SBRC || execute == SBRS || execute == SBIC || execute == SBIS) {
+    uint64_t *bitmap = taken ? coverage->taken : coverage->not_taken;
+    bitmap[pc / 64] |= 1LLU << (pc % 64);
+  }
+}
+
+const Instruction_t *mcu_decode(uint16_t opcode) {
+  return find_instruction(opcode);
 }
 
 static inline void stack_push16(const uint16_t value) {
-  *((uint16_t *)(mcu.RAM + mcu.sp)) = value;
-  mcu.sp -= 2;
+  data_write(RAM_START + mcu->sp, value & 0xFF);
+  data_write(RAM_START + mcu->sp + 1, value >> 8);
+  mcu->sp -= 2;
 }
 
 static inline void stack_push8(const uint8_t value) {
-  mcu.RAM[mcu.sp] = value;
-  mcu.sp -= 1;
+  data_write(RAM_START + mcu->sp, value);
+  mcu->sp -= 1;
 }
 
 static inline uint16_t stack_pop16(void) {
-  mcu.sp += 2;
-  return *(uint16_t *)(mcu.RAM + mcu.sp);
+  mcu->sp += 2;
+  return data_read(RAM_START + mcu->sp) | (data_read(RAM_START + mcu->sp + 1) << 8);
 }
 
 static inline uint8_t stack_pop8(void) {
-  mcu.sp += 1;
-  return mcu.RAM[mcu.sp];
+  mcu->sp += 1;
+  return data_read(RAM_START + mcu->sp);
 }
 
 static inline uint16_t word_reg_get(const uint8_t d) {
-  uint16_t low = mcu.R[d];
-  uint16_t high = mcu.R[d + 1];
+  uint16_t low = mcu->R[d];
+  uint16_t high = mcu->R[d + 1];
   return (high << 8) | low;
 }
 
 static inline void word_reg_set(const uint8_t d, const uint16_t value) {
   uint16_t low = value & 0x00FF;
   uint16_t high = (value & 0xFF00) >> 8;
-  mcu.R[d] = low;
-  mcu.R[d + 1] = high;
+  mcu->R[d] = low;
+  mcu->R[d + 1] = high;
 }
 
 static inline uint16_t X_reg_get(void) {
@@ -1421,19 +2828,25 @@ static inline uint64_t get_micro_time(void) {
   return tv.tv_sec * ((uint64_t)1000000) + tv.tv_usec;
 }
 
+void mcu_set_log(struct Log_t *log) {
+  mcu->host.log = log;
+}
+
 void mcu_set_exception_handler(void (*handler)(void)) {
-  mcu.exception_handler = handler;
+  mcu->exception_handler = handler;
+}
+
+void mcu_set_uart_output(void (*output)(byte value)) {
+  mcu->host.uart_output = output;
 }
 
 static inline void throw_exception(const char *cause, ...) {
-  printf(RED "MCU exception!\n");
   va_list args;
   va_start(args, cause);
-  vfprintf(stdout, cause, args);
+  log_args(LOG_ERROR, cause, args);
   va_end(args);
-  printf(RESET);
   mcu_send_interrupt(RESET_vect);
-  if (mcu.exception_handler != NULL) {
-    mcu.exception_handler();
+  if (mcu->exception_handler != NULL) {
+    mcu->exception_handler();
   }
 }
\ No newline at end of file
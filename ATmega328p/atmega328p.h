@@ -18,8 +18,26 @@ typedef uint16_t word;
 #define BOOTLOADER_SIZE (KB / 2)
 #define RAM_SIZE (2 * KB)
 #define DATA_MEMORY_SIZE (REGISTER_COUNT + IO_REGISTER_COUNT + EXT_IO_REGISTER_COUNT + RAM_SIZE)
+#define RAM_START (REGISTER_COUNT + IO_REGISTER_COUNT + EXT_IO_REGISTER_COUNT)
 #define KB 1024
 #define LOOKUP_SIZE 0xFFFF
+#define DEBUG_POINTS 64
+#define FUSE_MAX_RUN 8 // longest PUSH or POP run executed as one group
+#define CPU_FREQUENCY 16000000ULL // clock the cycle counter stands for, timed peripherals are scaled to it
+#define ADC_CHANNELS 9 // ADC0-ADC7 and the temperature sensor
+#define PORT_COUNT 3 // B, C and D
+#define BUS_DEVICES 8 // per bus
+#define MCU_ABI_VERSION 5 // raised whenever ATmega328p_t or the accessor API changes
+
+// Stimulus levels
+#define STIMULUS_LOW 0
+#define STIMULUS_HIGH 1
+#define STIMULUS_RELEASE 2 // not driven any more, floats low or follows the pull-up
+
+// Watchpoint kinds, breakpoints have none
+#define WATCH_READ 1
+#define WATCH_WRITE 2
+#define WATCH_VALUE 4 // a write of the given value
 
 typedef union {
   // Status register flags
@@ -61,6 +79,178 @@ typedef struct {
   uint16_t length; // in WORDs
 } Instruction_t;
 
+typedef enum {
+  STOP_NONE = 0,
+  STOP_BREAK, // BREAK instruction
+  STOP_BREAKPOINT,
+  STOP_WATCHPOINT,
+  STOP_HOST // requested through the inbox
+} Stop_reason_t;
+
+typedef enum {
+  LOG_ERROR = 0, // exceptions
+  LOG_INFO, // loading, resets, interrupts and stops
+  LOG_VERBOSE // every executed instruction
+} Log_level_t;
+
+typedef struct {
+  uint16_t address; // flash word for breakpoints, data memory address for watchpoints
+  byte kind; // WATCH_* flags, 0 for breakpoints
+  byte value; // for WATCH_VALUE
+  uint32_t ignore; // hits left to ignore before stopping
+  uint32_t hits;
+} Debug_point_t;
+
+typedef struct {
+  uint64_t breakpoints[PROGRAM_MEMORY_SIZE / WORD_SIZE / 64]; // one bit per flash word
+  uint64_t watchpoints[(DATA_MEMORY_SIZE + 63) / 64]; // one bit per data memory address
+  Debug_point_t points[DEBUG_POINTS];
+  uint32_t point_count;
+  bool skip_breakpoint; // lets the instruction under the breakpoint run after resuming
+  uint16_t stop_address; // breakpoint or watched address the MCU stopped at
+} Debug_t;
+
+typedef struct {
+  uint64_t executed[PROGRAM_MEMORY_SIZE / WORD_SIZE / 64]; // one bit per flash word
+  uint64_t taken[PROGRAM_MEMORY_SIZE / WORD_SIZE / 64]; // branches and skips, by the word of the instruction
+  uint64_t not_taken[PROGRAM_MEMORY_SIZE / WORD_SIZE / 64];
+} Coverage_t;
+
+typedef enum {
+  FUSE_UNKNOWN = 0, // not looked at yet
+  FUSE_NONE,
+  FUSE_CP_BRANCH, // CP, CPC or CPI followed by BRBS/BRBC
+  FUSE_CPC_BRANCH,
+  FUSE_CPI_BRANCH,
+  FUSE_CP_CPC_BRANCH, // 16 bit comparison
+  FUSE_CPI_CPC_BRANCH,
+  FUSE_SBIW_BRANCH, // countdown loop
+  FUSE_LDI_PAIR, // 16 bit constant
+  FUSE_PUSH_RUN, // prologue
+  FUSE_POP_RUN // epilogue
+} Fuse_kind_t;
+
+typedef struct {
+  byte kind; // Fuse_kind_t
+  byte count; // instructions in the group
+  byte cycles; // without the extra cycle of a taken branch
+} Fused_t;
+
+typedef struct {
+  Fused_t groups[PROGRAM_MEMORY_SIZE / WORD_SIZE]; // by the word of the first instruction
+} Fusion_t;
+
+typedef enum {
+  ADC_INT16 = 0, // ADC results, 0 to 1023
+  ADC_FLOAT // volts
+} Adc_format_t;
+
+typedef struct {
+  const void *samples; // mapped sample file, NULL reads 0 V
+  uint64_t count;
+  uint64_t size; // of the mapping
+  uint32_t rate; // samples per second of emulated time
+  Adc_format_t format;
+} Adc_channel_t;
+
+typedef struct {
+  Adc_channel_t channels[ADC_CHANNELS];
+  float avcc; // volts, also used for AREF
+} Adc_input_t;
+
+typedef struct {
+  uint64_t cycle;
+  byte pin; // port * 8 + bit, ports B, C and D
+  byte level; // STIMULUS_LOW, STIMULUS_HIGH or STIMULUS_RELEASE
+  byte reserved[6];
+} Stimulus_record_t;
+
+typedef struct {
+  const Stimulus_record_t *records; // mapped, sorted by cycle
+  uint64_t count;
+  uint64_t size; // of the mapping
+} Stimulus_t;
+
+typedef struct {
+  byte select_pin; // port * 8 + bit of the chip select, active low
+  void *context;
+  byte (*transfer)(void *context, byte mosi); // one byte, most significant bit first, returns MISO
+  void (*select)(void *context, bool selected); // chip select changed, may be NULL
+} Spi_device_t;
+
+typedef struct {
+  byte address; // 7 bit
+  void *context;
+  bool (*start)(void *context, bool read); // addressed after a START, returns ACK
+  bool (*write)(void *context, byte value); // returns ACK
+  byte (*read)(void *context, bool ack); // ack is false for the last byte
+  void (*stop)(void *context); // may be NULL
+} Twi_device_t;
+
+typedef struct {
+  Spi_device_t spi[BUS_DEVICES];
+  uint32_t spi_count;
+  Twi_device_t twi[BUS_DEVICES];
+  uint32_t twi_count;
+} Bus_t;
+
+typedef enum {
+  EVENT_WATCHDOG = 0, // watchdog timeout
+  EVENT_ADC, // end of a conversion
+  EVENT_STIMULUS, // next external pin transition
+  EVENT_SPI, // end of a byte transfer
+  EVENT_TWI, // end of a bus action
+  EVENT_INTERRUPTS, // retries interrupt flags raised while the I flag was clear
+  EVENT_SNAPSHOT, // publication of the state for other threads
+  EVENT_COUNT
+} Event_t;
+
+typedef enum {
+  REGION_REGISTERS = 0, // R0-R31
+  REGION_IO, // the 64 IO registers
+  REGION_EXT_IO,
+  REGION_RAM,
+  REGION_DATA_MEMORY, // all of the above in one
+  REGION_FLASH, // the program memory executed from
+  REGION_EEPROM,
+  REGION_COUNT
+} Region_t;
+
+typedef struct {
+  byte *data; // inside the instance, valid until it is destroyed
+  uint32_t size;
+  bool writable; // false for a flash image shared through mcu_load_image
+} Memory_region_t;
+
+typedef struct {
+  // The scalar part of the state, for hosts that read memory through regions
+  uint64_t cycle_count;
+  uint16_t pc;
+  uint16_t sp;
+  byte SREG;
+  byte stop_reason;
+  bool stopped;
+  bool sleeping;
+  int16_t data_memory_change;
+  uint32_t opcode; // of the instruction executed last
+} Mcu_status_t;
+
+// Attached by the host, kept by mcu_init and mcu_restore and left out by mcu_get_copy
+typedef struct {
+  Debug_t *debug; // breakpoints and watchpoints, NULL while there are none
+  struct Trace_t *trace; // execution trace, NULL while not tracing
+  Coverage_t *coverage; // owned by the caller, NULL while not collecting
+  Fusion_t *fusion; // superinstructions found so far, NULL while fusion is off
+  const Adc_input_t *adc; // owned by the caller, NULL while the analog inputs are unconnected
+  struct Vcd_t *vcd; // waveform export, NULL while not recording
+  const Stimulus_t *stimulus; // owned by the caller, NULL while nothing drives the pins
+  const Bus_t *bus; // SPI and TWI devices, owned by the caller, NULL while nothing is connected
+  struct Log_t *log; // messages go to stdout while it is NULL
+  struct Snapshot_t *snapshot; // state published for other threads, NULL while nobody reads it
+  struct Inbox_t *inbox; // events posted by other threads, NULL while there are none
+  void (*uart_output)(byte value); // gets the bytes USART0 transmits, NULL drops them
+} Attachments_t;
+
 typedef struct {
   SREG_t SREG;
   MCUSR_t SR; // MCU status register
@@ -77,35 +267,126 @@ typedef struct {
   bool skip_next;
   bool sleeping;
   bool stopped;
+  Stop_reason_t stop_reason;
   bool handle_interrupt;
   bool auto_execute;
   uint16_t interrupt_address;
   int16_t data_memory_change; // -1 if there was no change, data_memory address otherwise
-  uint16_t cycles;
+  uint16_t cycles; // left to wait for the current instruction when running at the clock speed
+  uint64_t cycle_count; // cycles executed since mcu_init
+  uint64_t events[EVENT_COUNT]; // cycle each peripheral event is due at, UINT64_MAX while idle
+  uint64_t next_event; // earliest of events, the only check made on every step
+  uint64_t watchdog_start; // cycle the watchdog counter was last cleared at
+  uint64_t watchdog_change; // WDE and the prescaler can be changed before this cycle
+  uint64_t adc_sample; // cycle the running conversion samples its input at
+  bool adc_ready; // the first conversion after enabling the ADC is done
+  byte pin_levels[PORT_COUNT]; // levels driven on the pins from outside
+  byte pin_driven[PORT_COUNT]; // pins driven from outside
+  uint64_t stimulus_next; // index of the next stimulus record
+  bool spi_status_read; // SPSR was read with SPIF set, accessing SPDR clears it
+  byte twi_action; // running on the bus
+  int8_t twi_device; // addressed device, -1 for none
+  bool twi_bus_owned; // between START and STOP
   uint32_t opcode;
   const Instruction_t *instruction;
   void (*exception_handler)(void);
+  const byte *flash; // program memory used for execution, either program_memory or a shared image
+  Attachments_t host;
 } ATmega328p_t;
 
 // API
 void mcu_init(void);
 bool mcu_load_ihex(const char *filename);
+bool mcu_load_elf(const char *filename); // as built by avr-gcc, EEPROM contents included
 bool mcu_load_asm(const char *code);
 bool mcu_load_c(const char *code);
+void mcu_load_image(const byte *image); // PROGRAM_MEMORY_SIZE bytes, shared and never written
 void mcu_run(void);
 bool mcu_execute_cycle(void);
+bool mcu_step(void);
+bool mcu_run_cycles(uint64_t cycles); // steps at full speed for at least that many cycles, false once stopped
 void mcu_resume(void);
 void mcu_get_copy(ATmega328p_t *mcu);
+void mcu_restore(const ATmega328p_t *state); // state taken with mcu_get_copy
 void mcu_send_interrupt(Interrupt_vector_t vector);
 void mcu_set_exception_handler(void (*handler)(void));
+void mcu_set_uart_output(void (*output)(byte value)); // called on the emulating thread for every byte sent
+void mcu_select(ATmega328p_t *instance); // NULL selects the default instance
+ATmega328p_t *mcu_create(void); // initialized, for hosts that cannot allocate the struct themselves
+void mcu_destroy(ATmega328p_t *instance); // frees debug points and fused groups but not the host attachments, select another instance first
+bool mcu_add_breakpoint(uint16_t address, uint32_t ignore); // address in words, like the PC
+bool mcu_remove_breakpoint(uint16_t address);
+bool mcu_add_watchpoint(uint16_t address, byte kind, byte value, uint32_t ignore);
+bool mcu_remove_watchpoint(uint16_t address);
+void mcu_clear_debug(void);
+const Instruction_t *mcu_decode(uint16_t opcode); // first word of the instruction
+bool mcu_set_fusion(bool enabled); // runs common instruction sequences as one step
+void mcu_set_stimulus(const Stimulus_t *stimulus); // continues at the current cycle, NULL detaches
+bool mcu_spi_slave_transfer(byte mosi, byte *miso); // the host is the master while SPI is in slave mode
+void mcu_set_log(struct Log_t *log); // NULL prints to stdout again
+uint32_t mcu_abi_version(void); // MCU_ABI_VERSION the library was built with
+uint32_t mcu_state_size(void); // sizeof(ATmega328p_t), for hosts that mirror the struct
+Memory_region_t mcu_region(Region_t region); // memory of the instance itself, no copy, data is NULL for unknown regions
+void mcu_get_status(Mcu_status_t *status);
+void mcu_set_snapshot(struct Snapshot_t *snapshot); // publishes now and then every interval cycles, NULL stops
+void mcu_publish(void); // right away, the final state after a stop for instance
+void mcu_set_inbox(struct Inbox_t *inbox); // NULL detaches, queued events wait for the next one
 
 static inline void execute_instruction(void);
+static inline bool execute_fused(void);
+static void find_group(const uint16_t pc);
+static inline void invalidate_fusion(void);
+static inline bool execute_step(const bool fast_forward);
+static inline uint16_t sleep_cycles(void);
+static void clear_events(void);
+static void reset_io(void);
+static void schedule_event(const Event_t event, const uint64_t cycle);
+static void run_events(void);
+static void io_write(const uint16_t address, byte value);
+static inline bool single_bit_register(const uint16_t address);
+static inline uint64_t watchdog_period(const byte control);
+static void watchdog_write(const byte value);
+static void watchdog_timeout(void);
+static void watchdog_reset(void);
+static void adc_write(const byte value);
+static void adc_start(void);
+static void adc_complete(void);
+static uint16_t adc_convert(void);
+static void schedule_stimulus(void);
+static void apply_stimulus(void);
+static void update_pins(const byte port);
+static void pin_change(const byte port, const byte old, const byte pins);
+static inline uint64_t spi_byte_cycles(void);
+static inline byte reverse_bits(byte value);
+static inline bool device_selected(const Spi_device_t *device);
+static void spi_clear_flags(void);
+static void spi_write_data(const byte value);
+static void spi_complete(void);
+static void select_devices(const byte port, const byte changed, const byte pins);
+static inline uint64_t twi_bit_cycles(void);
+static void twi_release(void);
+static void twi_write_control(const byte value);
+static void twi_complete(void);
+static void raise_interrupts(void);
+static void schedule_snapshot(void);
+static void take_inbox(void);
+static uint32_t read_little_endian(const byte *bytes, const byte size);
+static void uart_receive(const byte value);
+static bool uart_transmit(const byte value);
+static void uart_fill(void);
+static void publish_snapshot(void);
 static inline void set_mcu_pointers(ATmega328p_t *const mcu);
 static void create_lookup_table(void);
 static const Instruction_t *find_instruction(const uint16_t opcode);
 static inline uint16_t get_opcode16(void);
 static inline uint32_t get_opcode32(void);
 static inline bool check_interrupts(void);
+static inline byte data_read(const uint16_t address);
+static void io_read(const uint16_t address);
+static inline void data_write(const uint16_t address, const byte value);
+static bool breakpoint_hit(void);
+static void watchpoint_access(const uint16_t address, const byte access, const byte value);
+static void cover_instruction(const uint16_t pc, const bool taken);
 static inline void handle_interrupt(void);
 
 static inline void stack_push16(const uint16_t value);
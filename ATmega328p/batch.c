@@ -0,0 +1,437 @@
+#include "batch.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define SPM_OPCODE 0b1001010111101000
+#define SCALAR_NEXT 1 // skip, interrupt or event pending
+#define SCALAR_ALWAYS 2 // the lane rewrote its flash and cannot share fetches any more
+
+typedef uint8_t lanes8_t __attribute__((vector_size(BATCH_VECTOR)));
+
+typedef enum {
+  K_NONE = 0,
+  K_NOP, K_LDI, K_MOV,
+  K_ADD, K_ADC, K_SUB, K_SUBI, K_SBC, K_SBCI,
+  K_AND, K_ANDI, K_OR, K_ORI, K_EOR,
+  K_INC, K_DEC, K_CP, K_CPC, K_CPI,
+  K_RJMP, K_BRBS, K_BRBC
+} Kernel_t;
+
+// Same masks and order as the opcode table of the core, for the instructions that have a kernel
+static const struct {
+  uint16_t mask1;
+  uint16_t mask2;
+  Kernel_t kernel;
+} kernel_table[] = {
+  {0b1111110000000000, 0b0000110000000000, K_ADD},
+  {0b1111110000000000, 0b0001110000000000, K_ADC},
+  {0b1111110000000000, 0b0001100000000000, K_SUB},
+  {0b1111000000000000, 0b0101000000000000, K_SUBI},
+  {0b1111110000000000, 0b0000100000000000, K_SBC},
+  {0b1111000000000000, 0b0100000000000000, K_SBCI},
+  {0b1111110000000000, 0b0010000000000000, K_AND},
+  {0b1111000000000000, 0b0111000000000000, K_ANDI},
+  {0b1111110000000000, 0b0010100000000000, K_OR},
+  {0b1111000000000000, 0b0110000000000000, K_ORI},
+  {0b1111110000000000, 0b0010010000000000, K_EOR},
+  {0b1111111000001111, 0b1001010000000011, K_INC},
+  {0b1111111000001111, 0b1001010000001010, K_DEC},
+  {0b1111111100001111, 0b1110111100001111, K_LDI}, // SER
+  {0b1111000000000000, 0b1100000000000000, K_RJMP},
+  {0b1111110000000000, 0b0001010000000000, K_CP},
+  {0b1111110000000000, 0b0000010000000000, K_CPC},
+  {0b1111000000000000, 0b0011000000000000, K_CPI},
+  {0b1111110000000000, 0b1111000000000000, K_BRBS},
+  {0b1111110000000000, 0b1111010000000000, K_BRBC},
+  {0b1111110000000000, 0b0010110000000000, K_MOV},
+  {0b1111000000000000, 0b1110000000000000, K_LDI},
+  {0b1111111111111111, 0b0000000000000000, K_NOP}
+};
+
+static void *lanes_alloc(uint32_t stride, size_t size) {
+  void *array = aligned_alloc(BATCH_VECTOR, stride * size);
+  if (array != NULL) {
+    memset(array, 0, stride * size);
+  }
+  return array;
+}
+
+static void create_kernel_table(Batch_t *batch) {
+  // Opcodes claimed by an earlier entry of the core table keep going through the core
+  static const uint16_t claimed_masks[][2] = {
+    {0b1111111100000000, 0b1001011000000000}, // ADIW
+    {0b1111111100000000, 0b1001011100000000}, // SBIW
+    {0b1111111000001111, 0b1001010000000000}, // COM
+    {0b1111111000001111, 0b1001010000000001}, // NEG
+    {0b1111110000000000, 0b1001110000000000}, // MUL
+    {0b1111111100000000, 0b0000001000000000}, // MULS
+    {0b1111111100000000, 0b0000001100000000} // MULSU and FMUL*
+  };
+  for (uint32_t opcode = 0; opcode <= LOOKUP_SIZE; opcode++) {
+    batch->kernels[opcode] = K_NONE;
+    bool claimed = false;
+    for (int i = 0; i < sizeof(claimed_masks) / sizeof(claimed_masks[0]); i++) {
+      claimed |= (opcode & claimed_masks[i][0]) == claimed_masks[i][1];
+    }
+    if (claimed) {
+      continue;
+    }
+    for (int i = 0; i < sizeof(kernel_table) / sizeof(kernel_table[0]); i++) {
+      if ((opcode & kernel_table[i].mask1) == kernel_table[i].mask2) {
+        batch->kernels[opcode] = kernel_table[i].kernel;
+        break;
+      }
+    }
+  }
+}
+
+Batch_t *batch_create(uint32_t lanes, bool (*load)(const char *source), const char *source) {
+  Batch_t *batch = calloc(1, sizeof(Batch_t));
+  if (batch == NULL || lanes == 0) {
+    free(batch);
+    return NULL;
+  }
+  batch->lanes = lanes;
+  batch->stride = (lanes + BATCH_VECTOR - 1) / BATCH_VECTOR * BATCH_VECTOR;
+  batch->R = lanes_alloc(batch->stride, REGISTER_COUNT);
+  batch->SREG = lanes_alloc(batch->stride, 1);
+  batch->pc = lanes_alloc(batch->stride, sizeof(uint16_t));
+  batch->sp = lanes_alloc(batch->stride, sizeof(uint16_t));
+  batch->stopped = lanes_alloc(batch->stride, 1);
+  batch->sleeping = lanes_alloc(batch->stride, 1);
+  batch->scalar = lanes_alloc(batch->stride, 1);
+  batch->active = lanes_alloc(batch->stride, 1);
+  batch->executed = lanes_alloc(batch->stride, sizeof(uint64_t));
+  batch->cycles = lanes_alloc(batch->stride, sizeof(uint64_t));
+  batch->instances = calloc(lanes, sizeof(ATmega328p_t));
+  batch->program_memory = malloc(PROGRAM_MEMORY_SIZE);
+  batch->vectorize = true;
+  if (batch->R == NULL || batch->SREG == NULL || batch->pc == NULL || batch->sp == NULL || batch->stopped == NULL ||
+    batch->sleeping == NULL || batch->scalar == NULL || batch->active == NULL || batch->executed == NULL || batch->instances == NULL ||
+    batch->cycles == NULL || batch->program_memory == NULL) {
+    batch_destroy(batch);
+    return NULL;
+  }
+  mcu_select(batch->instances);
+  mcu_init();
+  bool loaded = load(source);
+  for (uint32_t lane = 1; loaded && lane < lanes; lane++) {
+    mcu_get_copy(batch->instances + lane);
+  }
+  mcu_select(NULL);
+  if (!loaded) {
+    batch_destroy(batch);
+    return NULL;
+  }
+  for (uint32_t lane = 0; lane < lanes; lane++) {
+    const ATmega328p_t *instance = batch->instances + lane;
+    for (int r = 0; r < REGISTER_COUNT; r++) {
+      batch->R[r * batch->stride + lane] = instance->data_memory[r];
+    }
+    batch->SREG[lane] = instance->SREG.value;
+    batch->pc[lane] = instance->pc;
+    batch->sp[lane] = instance->sp;
+  }
+  memcpy(batch->program_memory, batch->instances->program_memory, PROGRAM_MEMORY_SIZE);
+  for (uint32_t lane = lanes; lane < batch->stride; lane++) {
+    batch->stopped[lane] = true; // padding
+  }
+  create_kernel_table(batch);
+  return batch;
+}
+
+void batch_destroy(Batch_t *batch) {
+  if (batch == NULL) {
+    return;
+  }
+  free(batch->R);
+  free(batch->SREG);
+  free(batch->pc);
+  free(batch->sp);
+  free(batch->stopped);
+  free(batch->sleeping);
+  free(batch->scalar);
+  free(batch->active);
+  free(batch->executed);
+  free(batch->cycles);
+  free(batch->instances);
+  free(batch->program_memory);
+  free(batch);
+}
+
+static void lane_store(const Batch_t *batch, uint32_t lane) {
+  // Lane arrays -> instance
+  ATmega328p_t *instance = batch->instances + lane;
+  for (int r = 0; r < REGISTER_COUNT; r++) {
+    instance->data_memory[r] = batch->R[r * batch->stride + lane];
+  }
+  instance->SREG.value = batch->SREG[lane];
+  instance->pc = batch->pc[lane];
+  instance->sp = batch->sp[lane];
+  instance->cycle_count = batch->cycles[lane];
+}
+
+static bool observed(const ATmega328p_t *instance) {
+  // Debug points, the trace and coverage are only handled by the reference core
+  return instance->host.debug != NULL || instance->host.trace != NULL || instance->host.coverage != NULL;
+}
+
+static void lane_load(Batch_t *batch, uint32_t lane) {
+  // Instance -> lane arrays
+  const ATmega328p_t *instance = batch->instances + lane;
+  for (int r = 0; r < REGISTER_COUNT; r++) {
+    batch->R[r * batch->stride + lane] = instance->data_memory[r];
+  }
+  batch->SREG[lane] = instance->SREG.value;
+  batch->pc[lane] = instance->pc;
+  batch->sp[lane] = instance->sp;
+  batch->cycles[lane] = instance->cycle_count;
+  batch->stopped[lane] = instance->stopped;
+  batch->sleeping[lane] = instance->sleeping && !instance->handle_interrupt && instance->next_event == UINT64_MAX;
+  if (instance->skip_next || instance->handle_interrupt || instance->next_event != UINT64_MAX || observed(instance)) {
+    batch->scalar[lane] |= SCALAR_NEXT;
+  }
+}
+
+static void scalar_step(Batch_t *batch, uint32_t lane, uint16_t opcode) {
+  byte always = batch->scalar[lane] & SCALAR_ALWAYS;
+  lane_store(batch, lane);
+  mcu_select(batch->instances + lane);
+  mcu_step();
+  mcu_select(NULL);
+  batch->scalar[lane] = always | (opcode == SPM_OPCODE ? SCALAR_ALWAYS : 0);
+  lane_load(batch, lane);
+  batch->executed[lane]++;
+  batch->scalar_instructions++;
+}
+
+#define LANES(array) (*(lanes8_t *)(array))
+#define BIT(v, n) (((v) >> (n)) & 1)
+#define IS_ZERO(v) ((lanes8_t)((v) == 0) & 1)
+#define SREG_C 0
+#define SREG_Z 1
+#define SREG_N 2
+#define SREG_V 3
+#define SREG_S 4
+#define SREG_H 5
+
+__attribute__((target_clones("avx2", "default")))
+void batch_vector_kernel(Batch_t *batch, Kernel_t kernel, uint16_t opcode) {
+  // Flag formulas follow the reference handlers exactly, quirks included
+  const uint32_t stride = batch->stride;
+  uint8_t d = (opcode & 0b111110000) >> 4;
+  uint8_t r = (opcode & 0xF) | ((opcode & 0x200) >> 5);
+  uint8_t k = (opcode & 0xF) | ((opcode & 0xF00) >> 4);
+  uint8_t d_high = ((opcode & 0xF0) >> 4) + 16;
+  for (uint32_t lane = 0; lane < stride; lane += BATCH_VECTOR) {
+    lanes8_t m = LANES(batch->active + lane);
+    bool any = false;
+    for (int i = 0; i < BATCH_VECTOR; i++) {
+      any |= m[i] != 0;
+    }
+    if (!any) {
+      continue;
+    }
+    lanes8_t sreg = LANES(batch->SREG + lane);
+    lanes8_t c_in = BIT(sreg, SREG_C);
+    lanes8_t z_in = BIT(sreg, SREG_Z);
+    byte *target = NULL;
+    lanes8_t rd, rr, res = {0}, h = {0}, v = {0}, n = {0}, z = {0}, c = {0}, affected = {0};
+    switch (kernel) {
+      case K_LDI:
+        target = batch->R + d_high * stride + lane;
+        res = (lanes8_t){0} + k;
+        break;
+      case K_MOV:
+        target = batch->R + d * stride + lane;
+        res = LANES(batch->R + r * stride + lane);
+        break;
+      case K_ADD:
+      case K_ADC:
+        target = batch->R + d * stride + lane;
+        rd = LANES(target);
+        rr = LANES(batch->R + r * stride + lane);
+        res = rd + rr + (kernel == K_ADC ? c_in : (lanes8_t){0});
+        h = BIT(rd & rr | rr & ~res | ~res & rd, 3);
+        v = BIT(rd & rr & ~res | ~rd & ~rr & res, 7);
+        c = BIT(rd & rr | rr & ~res | ~res & rd, 7);
+        n = BIT(res, 7);
+        z = IS_ZERO(res);
+        affected = (lanes8_t){0} + 0b00111111;
+        break;
+      case K_SUB:
+      case K_SBC:
+      case K_SUBI:
+      case K_SBCI:
+      case K_CP:
+      case K_CPC:
+      case K_CPI:
+        if (kernel == K_SUBI || kernel == K_SBCI || kernel == K_CPI) {
+          target = batch->R + d_high * stride + lane;
+          rr = (lanes8_t){0} + k;
+        } else {
+          target = batch->R + d * stride + lane;
+          rr = LANES(batch->R + r * stride + lane);
+        }
+        rd = LANES(target);
+        res = rd - rr - (kernel == K_SBC || kernel == K_SBCI || kernel == K_CPC ? c_in : (lanes8_t){0});
+        h = BIT(~rd & rr | rr & res | res & ~rd, 3);
+        if (kernel == K_CP || kernel == K_CPC) {
+          v = BIT(rd & ~rr & res | ~rd & rr & res, 7);
+        } else {
+          v = BIT(rd & ~rr & ~res | ~rd & rr & res, 7);
+        }
+        c = BIT(~rd & rr | rr & res | res & ~rd, 7);
+        n = BIT(res, 7);
+        z = IS_ZERO(res);
+        if (kernel == K_SBC || kernel == K_SBCI || kernel == K_CPC) {
+          z &= z_in;
+        }
+        if (kernel == K_CP || kernel == K_CPC || kernel == K_CPI) {
+          res = rd; // compare only
+        }
+        affected = (lanes8_t){0} + 0b00111111;
+        break;
+      case K_AND:
+      case K_OR:
+      case K_EOR:
+      case K_ANDI:
+      case K_ORI:
+        if (kernel == K_ANDI || kernel == K_ORI) {
+          target = batch->R + d_high * stride + lane;
+          rr = (lanes8_t){0} + k;
+        } else {
+          target = batch->R + d * stride + lane;
+          rr = LANES(batch->R + r * stride + lane);
+        }
+        rd = LANES(target);
+        res = kernel == K_AND || kernel == K_ANDI ? rd & rr : kernel == K_EOR ? rd ^ rr : rd | rr;
+        v = (lanes8_t){0};
+        n = BIT(res, 7);
+        z = IS_ZERO(res);
+        c = c_in;
+        h = BIT(sreg, SREG_H);
+        affected = (lanes8_t){0} + 0b00011110;
+        break;
+      case K_INC:
+      case K_DEC:
+        target = batch->R + d * stride + lane;
+        rd = LANES(target);
+        res = kernel == K_INC ? rd + 1 : rd - 1;
+        v = (lanes8_t)(res == (uint8_t)(kernel == K_INC ? 0x80 : 0x7F)) & 1;
+        n = BIT(res, 7);
+        z = IS_ZERO(res);
+        c = c_in;
+        h = BIT(sreg, SREG_H);
+        affected = (lanes8_t){0} + 0b00011110;
+        break;
+      default:
+        break;
+    }
+    if (target != NULL) {
+      LANES(target) = (res & m) | (LANES(target) & ~m);
+    }
+    lanes8_t affected_m = affected & m;
+    if (affected[0] != 0) {
+      lanes8_t s = n ^ v;
+      lanes8_t flags = c | z << SREG_Z | n << SREG_N | v << SREG_V | s << SREG_S | h << SREG_H;
+      LANES(batch->SREG + lane) = (flags & affected_m) | (sreg & ~affected_m);
+    }
+  }
+}
+
+static void advance(Batch_t *batch, Kernel_t kernel, uint16_t opcode, uint16_t pc) {
+  int16_t offset = 1;
+  uint8_t cycles = 1;
+  if (kernel == K_RJMP) {
+    offset = (int16_t)((opcode & 0x0FFF) << 4) >> 4;
+    offset += 1;
+    cycles = 2;
+  }
+  int8_t branch = (int8_t)(((opcode & 0b1111111000) >> 3) << 1) >> 1;
+  uint8_t s = opcode & 0b111;
+  for (uint32_t lane = 0; lane < batch->stride; lane++) {
+    uint16_t next = pc + offset;
+    uint8_t taken = 0;
+    if (kernel == K_BRBS || kernel == K_BRBC) {
+      bool set = (batch->SREG[lane] >> s) & 1;
+      taken = set == (kernel == K_BRBS);
+      next += taken ? branch : 0;
+    }
+    batch->pc[lane] = batch->active[lane] ? next : batch->pc[lane];
+    batch->executed[lane] += batch->active[lane] & 1;
+    batch->cycles[lane] += batch->active[lane] & (cycles + taken);
+  }
+}
+
+uint64_t batch_run(Batch_t *batch, uint64_t max_instructions) {
+  uint64_t executed = 0;
+  for (uint32_t lane = 0; lane < batch->lanes; lane++) {
+    // Attached after the lane was last loaded
+    batch->scalar[lane] |= observed(batch->instances + lane) ? SCALAR_NEXT : 0;
+  }
+  while (true) {
+    // Lanes with the lowest PC go first, so lanes that took a different path converge again
+    uint32_t pc = UINT32_MAX;
+    for (uint32_t lane = 0; lane < batch->stride; lane++) {
+      bool eligible = !batch->stopped[lane] && !batch->sleeping[lane] && batch->executed[lane] < max_instructions;
+      uint32_t key = eligible ? batch->pc[lane] : UINT32_MAX;
+      pc = key < pc ? key : pc;
+    }
+    if (pc == UINT32_MAX) {
+      break;
+    }
+    bool in_bounds = (pc + 1) * WORD_SIZE < PROGRAM_MEMORY_SIZE - 1;
+    uint16_t opcode = in_bounds ? *(uint16_t *)(batch->program_memory + pc * WORD_SIZE) : 0;
+    Kernel_t kernel = batch->vectorize && in_bounds ? batch->kernels[opcode] : K_NONE;
+    uint32_t vector_lanes = 0;
+    for (uint32_t lane = 0; lane < batch->stride; lane++) {
+      bool eligible = !batch->stopped[lane] && !batch->sleeping[lane] && batch->executed[lane] < max_instructions;
+      bool at_pc = eligible && batch->pc[lane] == pc;
+      if (at_pc && (kernel == K_NONE || batch->scalar[lane])) {
+        scalar_step(batch, lane, opcode);
+        executed++;
+        at_pc = false;
+      }
+      batch->active[lane] = at_pc ? 0xFF : 0;
+      vector_lanes += at_pc;
+    }
+    if (vector_lanes > 0) {
+      batch_vector_kernel(batch, kernel, opcode);
+      advance(batch, kernel, opcode, pc);
+      batch->vector_instructions += vector_lanes;
+      executed += vector_lanes;
+    }
+  }
+  return executed;
+}
+
+void batch_get_copy(const Batch_t *batch, uint32_t lane, ATmega328p_t *mcu) {
+  lane_store(batch, lane);
+  mcu_select(batch->instances + lane);
+  mcu_get_copy(mcu);
+  mcu_select(NULL);
+}
+
+byte batch_read(const Batch_t *batch, uint32_t lane, uint16_t address) {
+  if (address < REGISTER_COUNT) {
+    return batch->R[address * batch->stride + lane];
+  }
+  return batch->instances[lane].data_memory[address % DATA_MEMORY_SIZE];
+}
+
+void batch_write(Batch_t *batch, uint32_t lane, uint16_t address, byte value) {
+  if (address < REGISTER_COUNT) {
+    batch->R[address * batch->stride + lane] = value;
+    return;
+  }
+  batch->instances[lane].data_memory[address % DATA_MEMORY_SIZE] = value;
+}
+
+void batch_send_interrupt(Batch_t *batch, uint32_t lane, Interrupt_vector_t vector) {
+  lane_store(batch, lane);
+  mcu_select(batch->instances + lane);
+  mcu_send_interrupt(vector);
+  mcu_select(NULL);
+  lane_load(batch, lane);
+}
@@ -0,0 +1,46 @@
+#ifndef __BATCH_
+#define __BATCH_
+
+/*
+  Runs many instances of the same firmware together. Registers, SREG, PC and SP
+  are kept as lane arrays, lanes that share a PC execute register instructions
+  with vector kernels, everything else goes through the reference core one lane at a time
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "atmega328p.h"
+
+#define BATCH_VECTOR 32 // lanes per vector, one AVX2 register of bytes
+
+typedef struct {
+  uint32_t lanes;
+  uint32_t stride; // lanes rounded up to BATCH_VECTOR
+  byte *R; // R[register * stride + lane]
+  byte *SREG;
+  uint16_t *pc;
+  uint16_t *sp;
+  byte *stopped;
+  byte *sleeping;
+  byte *scalar; // next instruction has to go through the reference core (skip, interrupt, own flash)
+  byte *active; // 0xFF for lanes taking part in the current vector instruction
+  uint64_t *executed; // instructions per lane
+  uint64_t *cycles; // cycle counter per lane
+  ATmega328p_t *instances; // everything else, one per lane
+  byte *program_memory; // flash image shared by the lanes for fetching
+  byte kernels[LOOKUP_SIZE + 1]; // vector kernel for each opcode, 0 if there is none
+  bool vectorize;
+  uint64_t vector_instructions; // lane instructions executed by vector kernels
+  uint64_t scalar_instructions; // lane instructions executed by the reference core
+} Batch_t;
+
+Batch_t *batch_create(uint32_t lanes, bool (*load)(const char *source), const char *source);
+void batch_destroy(Batch_t *batch);
+uint64_t batch_run(Batch_t *batch, uint64_t max_instructions); // per lane, returns lane instructions executed
+void batch_get_copy(const Batch_t *batch, uint32_t lane, ATmega328p_t *mcu);
+byte batch_read(const Batch_t *batch, uint32_t lane, uint16_t address);
+void batch_write(Batch_t *batch, uint32_t lane, uint16_t address, byte value);
+void batch_send_interrupt(Batch_t *batch, uint32_t lane, Interrupt_vector_t vector);
+
+#endif // __BATCH_
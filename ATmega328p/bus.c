@@ -0,0 +1,164 @@
+#include "bus.h"
+#include <stdlib.h>
+#include <string.h>
+
+// SPI flash commands
+#define FLASH_WRITE_DISABLE 0x04
+#define FLASH_WRITE_ENABLE 0x06
+#define FLASH_READ_STATUS 0x05
+#define FLASH_READ 0x03
+#define FLASH_PAGE_PROGRAM 0x02
+#define FLASH_SECTOR_ERASE 0x20
+#define FLASH_CHIP_ERASE 0xC7
+#define FLASH_READ_ID 0x9F
+#define FLASH_STATUS_WEL (1 << 1)
+#define FLASH_PAGE 256
+#define FLASH_SECTOR 4096
+#define FLASH_ADDRESS_BYTES 3
+
+Bus_t *bus_create(void) {
+  return calloc(1, sizeof(Bus_t));
+}
+
+bool bus_add_spi(Bus_t *bus, const Spi_device_t *device) {
+  if (bus->spi_count == BUS_DEVICES || device->transfer == NULL) {
+    return false;
+  }
+  bus->spi[bus->spi_count++] = *device;
+  return true;
+}
+
+bool bus_add_twi(Bus_t *bus, const Twi_device_t *device) {
+  if (bus->twi_count == BUS_DEVICES || device->start == NULL || device->write == NULL || device->read == NULL) {
+    return false;
+  }
+  bus->twi[bus->twi_count++] = *device;
+  return true;
+}
+
+void bus_attach(ATmega328p_t *instance, const Bus_t *bus) {
+  instance->host.bus = bus;
+}
+
+void bus_destroy(Bus_t *bus) {
+  free(bus);
+}
+
+static byte log2_size(uint32_t size) {
+  byte bits = 0;
+  while ((1U << bits) < size) {
+    bits++;
+  }
+  return bits;
+}
+
+static void flash_select(void *context, bool selected) {
+  // Commands are framed by the chip select, a finished program or erase drops the write enable
+  Spi_flash_t *flash = context;
+  if (!selected && flash->count > FLASH_ADDRESS_BYTES && (flash->command == FLASH_PAGE_PROGRAM || flash->command == FLASH_SECTOR_ERASE)) {
+    flash->write_enabled = false;
+  }
+  flash->count = 0;
+}
+
+static byte flash_transfer(void *context, byte mosi) {
+  Spi_flash_t *flash = context;
+  uint32_t index = flash->count++;
+  if (index == 0) {
+    flash->command = mosi;
+    flash->address = 0;
+    if (mosi == FLASH_WRITE_ENABLE || mosi == FLASH_WRITE_DISABLE) {
+      flash->write_enabled = mosi == FLASH_WRITE_ENABLE;
+    } else if (mosi == FLASH_CHIP_ERASE && flash->write_enabled) {
+      memset(flash->memory, 0xFF, flash->size);
+      flash->write_enabled = false;
+    }
+    return 0xFF;
+  }
+  if (flash->command == FLASH_READ_ID) {
+    byte id[] = {SPI_FLASH_ID, SPI_FLASH_TYPE, log2_size(flash->size)};
+    return index <= sizeof(id) ? id[index - 1] : 0xFF;
+  }
+  if (flash->command == FLASH_READ_STATUS) {
+    return flash->write_enabled ? FLASH_STATUS_WEL : 0; // programming is instant, never busy
+  }
+  if (index <= FLASH_ADDRESS_BYTES) {
+    flash->address = ((flash->address << 8) | mosi) & (flash->size - 1);
+    if (index == FLASH_ADDRESS_BYTES && flash->command == FLASH_SECTOR_ERASE && flash->write_enabled) {
+      memset(flash->memory + (flash->address & ~(FLASH_SECTOR - 1) & (flash->size - 1)), 0xFF, FLASH_SECTOR < flash->size ? FLASH_SECTOR : flash->size);
+    }
+    return 0xFF;
+  }
+  if (flash->command == FLASH_READ) {
+    byte value = flash->memory[flash->address];
+    flash->address = (flash->address + 1) & (flash->size - 1);
+    return value;
+  }
+  if (flash->command == FLASH_PAGE_PROGRAM && flash->write_enabled) {
+    // Programming only clears bits and wraps around within the page
+    flash->memory[flash->address] &= mosi;
+    flash->address = (flash->address & ~(FLASH_PAGE - 1)) | ((flash->address + 1) & (FLASH_PAGE - 1));
+  }
+  return 0xFF;
+}
+
+Spi_flash_t *spi_flash_create(uint32_t size) {
+  if (size == 0 || (size & (size - 1)) != 0) {
+    return NULL;
+  }
+  Spi_flash_t *flash = calloc(1, sizeof(Spi_flash_t) + size);
+  if (flash != NULL) {
+    flash->size = size;
+    memset(flash->memory, 0xFF, size);
+  }
+  return flash;
+}
+
+Spi_device_t spi_flash_device(Spi_flash_t *flash, byte select_pin) {
+  Spi_device_t device = {select_pin, flash, flash_transfer, flash_select};
+  return device;
+}
+
+static bool memory_start(void *context, bool read) {
+  I2c_memory_t *memory = context;
+  if (!read) {
+    memory->received = 0; // a write starts with the address, a read continues at the pointer
+  }
+  return true;
+}
+
+static bool memory_write(void *context, byte value) {
+  I2c_memory_t *memory = context;
+  if (memory->received < memory->address_bytes) {
+    memory->pointer = memory->received++ == 0 ? value : (memory->pointer << 8) | value;
+    memory->pointer %= memory->size;
+    return true;
+  }
+  memory->memory[memory->pointer] = value;
+  memory->pointer = (memory->pointer + 1) % memory->size;
+  return true;
+}
+
+static byte memory_read(void *context, bool ack) {
+  I2c_memory_t *memory = context;
+  byte value = memory->memory[memory->pointer];
+  memory->pointer = (memory->pointer + 1) % memory->size;
+  return value;
+}
+
+I2c_memory_t *i2c_memory_create(uint32_t size, byte address_bytes) {
+  if (size == 0) {
+    return NULL;
+  }
+  I2c_memory_t *memory = calloc(1, sizeof(I2c_memory_t) + size);
+  if (memory != NULL) {
+    memory->size = size;
+    memory->address_bytes = address_bytes;
+  }
+  return memory;
+}
+
+Twi_device_t i2c_memory_device(I2c_memory_t *memory, byte address) {
+  Twi_device_t device = {address, memory, memory_start, memory_write, memory_read, NULL};
+  return device;
+}
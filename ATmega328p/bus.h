@@ -0,0 +1,47 @@
+#ifndef __BUS_
+#define __BUS_
+
+/*
+  SPI and TWI devices. A bus holds the device models the firmware talks to, the emulator
+  calls them in-process when a byte or bus action completes, so they run at emulation speed.
+  A SPI NOR flash and an I2C memory are included, the memory covers 24Cxx EEPROMs with two
+  address bytes and register mapped sensors with one, whose registers the host updates
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "atmega328p.h"
+
+#define SPI_FLASH_ID 0xEF // JEDEC manufacturer
+#define SPI_FLASH_TYPE 0x40
+
+typedef struct {
+  uint32_t size; // power of two
+  byte command;
+  uint32_t count; // bytes since the chip was selected
+  uint32_t address;
+  bool write_enabled;
+  byte memory[];
+} Spi_flash_t;
+
+typedef struct {
+  uint32_t size;
+  byte address_bytes; // sent before data in a write
+  byte received; // address bytes of the current write
+  uint32_t pointer;
+  byte memory[];
+} I2c_memory_t;
+
+Bus_t *bus_create(void);
+bool bus_add_spi(Bus_t *bus, const Spi_device_t *device);
+bool bus_add_twi(Bus_t *bus, const Twi_device_t *device);
+void bus_attach(ATmega328p_t *instance, const Bus_t *bus); // NULL disconnects, buses can be shared
+void bus_destroy(Bus_t *bus); // the devices are not freed
+
+Spi_flash_t *spi_flash_create(uint32_t size); // erased, released with free
+Spi_device_t spi_flash_device(Spi_flash_t *flash, byte select_pin); // port * 8 + bit
+I2c_memory_t *i2c_memory_create(uint32_t size, byte address_bytes); // released with free
+Twi_device_t i2c_memory_device(I2c_memory_t *memory, byte address); // 7 bit
+
+#endif // __BUS_
@@ -0,0 +1,257 @@
+#include "coverage.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define COVERAGE_MAGIC "AVRCOV1"
+#define COVERAGE_WORDS (PROGRAM_MEMORY_SIZE / WORD_SIZE)
+#define ADDR2LINE_BATCH 256 // addresses per avr-addr2line call
+#define LOCATION_LENGTH 1024
+
+typedef struct {
+  uint32_t file;
+  uint32_t line;
+  uint16_t pc;
+  bool executed;
+  bool conditional;
+  bool taken;
+  bool not_taken;
+} Line_t;
+
+typedef struct {
+  Line_t *lines;
+  uint32_t count;
+  char **files;
+  uint32_t file_count;
+} Lines_t;
+
+static inline bool bitmap_get(const uint64_t *bitmap, const uint16_t index) {
+  return (bitmap[index / 64] >> (index % 64)) & 1;
+}
+
+static inline uint16_t flash_word(const byte *flash, const uint16_t pc) {
+  return flash[pc * WORD_SIZE] | (flash[pc * WORD_SIZE + 1] << 8);
+}
+
+static bool conditional(const Instruction_t *instruction) {
+  static const char *const names[] = {"BRBS", "BRBC", "CPSE", "SBRC", "SBRS", "SBIC", "SBIS"};
+  for (int i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if (strcmp(instruction->name, names[i]) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static uint16_t program_end(const Coverage_t *coverage, const byte *flash) {
+  // Flash is erased to zeros after the program, executed words there still count
+  uint16_t end = COVERAGE_WORDS;
+  while (end > 0 && flash_word(flash, end - 1) == 0 && !bitmap_get(coverage->executed, end - 1)) {
+    end--;
+  }
+  return end;
+}
+
+static uint16_t instruction_length(const Coverage_t *coverage, const Instruction_t *instruction, const uint16_t pc) {
+  // Data in flash can decode as a two word instruction that hides real code behind it
+  if (instruction->length == 2 && !bitmap_get(coverage->executed, pc) && bitmap_get(coverage->executed, pc + 1)) {
+    return 1;
+  }
+  return instruction->length;
+}
+
+Coverage_t *coverage_create(void) {
+  return calloc(1, sizeof(Coverage_t));
+}
+
+void coverage_attach(ATmega328p_t *instance, Coverage_t *coverage) {
+  instance->host.coverage = coverage;
+}
+
+void coverage_merge(Coverage_t *into, const Coverage_t *from) {
+  for (int i = 0; i < COVERAGE_WORDS / 64; i++) {
+    if (from->executed[i]) {
+      __atomic_fetch_or(&into->executed[i], from->executed[i], __ATOMIC_RELAXED);
+    }
+    if (from->taken[i]) {
+      __atomic_fetch_or(&into->taken[i], from->taken[i], __ATOMIC_RELAXED);
+    }
+    if (from->not_taken[i]) {
+      __atomic_fetch_or(&into->not_taken[i], from->not_taken[i], __ATOMIC_RELAXED);
+    }
+  }
+}
+
+bool coverage_save(const Coverage_t *coverage, const char *filename) {
+  FILE *file = fopen(filename, "wb");
+  if (file == NULL) {
+    return false;
+  }
+  bool written = fwrite(COVERAGE_MAGIC, sizeof(COVERAGE_MAGIC), 1, file) == 1;
+  written &= fwrite(coverage, sizeof(Coverage_t), 1, file) == 1;
+  return fclose(file) == 0 && written;
+}
+
+bool coverage_load(Coverage_t *coverage, const char *filename) {
+  FILE *file = fopen(filename, "rb");
+  if (file == NULL) {
+    return false;
+  }
+  char magic[sizeof(COVERAGE_MAGIC)];
+  Coverage_t *loaded = malloc(sizeof(Coverage_t));
+  bool read = loaded != NULL && fread(magic, sizeof(magic), 1, file) == 1;
+  read = read && memcmp(magic, COVERAGE_MAGIC, sizeof(magic)) == 0;
+  read = read && fread(loaded, sizeof(Coverage_t), 1, file) == 1;
+  fclose(file);
+  if (read) {
+    coverage_merge(coverage, loaded);
+  }
+  free(loaded);
+  return read;
+}
+
+void coverage_report(const Coverage_t *coverage, const byte *flash, FILE *file) {
+  uint32_t instructions = 0, executed = 0, outcomes = 0, covered = 0;
+  uint16_t end = program_end(coverage, flash);
+  for (uint16_t pc = 0; pc < end;) {
+    const Instruction_t *instruction = mcu_decode(flash_word(flash, pc));
+    bool hit = bitmap_get(coverage->executed, pc);
+    fprintf(file, "%05x  %c  %s", (unsigned)(pc * WORD_SIZE), hit ? '*' : '-', instruction->name);
+    if (conditional(instruction)) {
+      bool taken = bitmap_get(coverage->taken, pc), not_taken = bitmap_get(coverage->not_taken, pc);
+      fprintf(file, "  %s, %s", taken ? "taken" : "never taken", not_taken ? "not taken" : "always taken");
+      outcomes += 2;
+      covered += taken + not_taken;
+    }
+    fprintf(file, "\n");
+    instructions++;
+    executed += hit;
+    pc += instruction_length(coverage, instruction, pc);
+  }
+  fprintf(file, "%u/%u instructions, %u/%u branch outcomes\n", executed, instructions, covered, outcomes);
+}
+
+static uint32_t find_file(Lines_t *lines, const char *name) {
+  for (uint32_t i = 0; i < lines->file_count; i++) {
+    if (strcmp(lines->files[i], name) == 0) {
+      return i;
+    }
+  }
+  char **files = realloc(lines->files, (lines->file_count + 1) * sizeof(char *));
+  char *copy = strdup(name);
+  if (files == NULL || copy == NULL) {
+    free(copy);
+    lines->files = files != NULL ? files : lines->files;
+    return UINT32_MAX;
+  }
+  lines->files = files;
+  lines->files[lines->file_count] = copy;
+  return lines->file_count++;
+}
+
+static bool locate(Lines_t *lines, uint32_t first, uint32_t count, const char *elf) {
+  // One avr-addr2line call per batch, it prints file:line or ??:0 for every address
+  char command[LOCATION_LENGTH + ADDR2LINE_BATCH * 8];
+  char location[LOCATION_LENGTH];
+  int length = snprintf(command, LOCATION_LENGTH, COVERAGE_ADDR2LINE " -e '%s'", elf);
+  if (length < 0 || length >= LOCATION_LENGTH) {
+    return false; // the path does not fit
+  }
+  for (uint32_t i = first; i < first + count; i++) {
+    length += snprintf(command + length, sizeof(command) - length, " 0x%x", (unsigned)(lines->lines[i].pc * WORD_SIZE));
+  }
+  FILE *output = popen(command, "r");
+  if (output == NULL) {
+    return false;
+  }
+  uint32_t located = 0;
+  while (located < count && fgets(location, sizeof(location), output) != NULL) {
+    Line_t *line = lines->lines + first + located++;
+    char *end = strstr(location, " (discriminator");
+    if (end == NULL) {
+      end = location + strcspn(location, "\r\n");
+    }
+    *end = '\0';
+    char *colon = strrchr(location, ':');
+    line->file = UINT32_MAX;
+    if (colon != NULL && strncmp(location, "??", 2) != 0) {
+      *colon = '\0';
+      line->line = strtoul(colon + 1, NULL, 10);
+      line->file = line->line > 0 ? find_file(lines, location) : UINT32_MAX;
+    }
+  }
+  return pclose(output) == 0 && located == count;
+}
+
+static int compare_lines(const void *a, const void *b) {
+  const Line_t *x = a, *y = b;
+  if (x->file != y->file) {
+    return x->file < y->file ? -1 : 1;
+  }
+  if (x->line != y->line) {
+    return x->line < y->line ? -1 : 1;
+  }
+  return x->pc - y->pc;
+}
+
+static void write_lcov(const Lines_t *lines, FILE *file) {
+  fprintf(file, "TN:\n");
+  for (uint32_t i = 0; i < lines->count && lines->lines[i].file != UINT32_MAX;) {
+    uint32_t current = lines->lines[i].file;
+    uint32_t found = 0, hit = 0, branches = 0, branches_hit = 0;
+    fprintf(file, "SF:%s\n", lines->files[current]);
+    for (; i < lines->count && lines->lines[i].file == current;) {
+      // A source line is hit when any of its instructions ran
+      uint32_t first = i;
+      bool executed = false;
+      for (; i < lines->count && lines->lines[i].file == current && lines->lines[i].line == lines->lines[first].line; i++) {
+        executed |= lines->lines[i].executed;
+      }
+      for (uint32_t j = first; j < i; j++) {
+        const Line_t *line = lines->lines + j;
+        if (line->conditional) {
+          if (line->executed) {
+            fprintf(file, "BRDA:%u,%u,0,%d\nBRDA:%u,%u,1,%d\n", line->line, line->pc, line->taken, line->line, line->pc, line->not_taken);
+          } else {
+            fprintf(file, "BRDA:%u,%u,0,-\nBRDA:%u,%u,1,-\n", line->line, line->pc, line->line, line->pc);
+          }
+          branches += 2;
+          branches_hit += line->taken + line->not_taken;
+        }
+      }
+      fprintf(file, "DA:%u,%d\n", lines->lines[first].line, executed);
+      found++;
+      hit += executed;
+    }
+    fprintf(file, "BRF:%u\nBRH:%u\nLF:%u\nLH:%u\nend_of_record\n", branches, branches_hit, found, hit);
+  }
+}
+
+bool coverage_export_lcov(const Coverage_t *coverage, const byte *flash, const char *elf, const char *source, FILE *file) {
+  // Without the ELF file every instruction is a line of source, numbered by its word address + 1
+  if (elf != NULL && strchr(elf, '\'') != NULL) {
+    return false;
+  }
+  Lines_t lines = {0};
+  uint16_t end = program_end(coverage, flash);
+  lines.lines = malloc((end + 1) * sizeof(Line_t));
+  bool exported = lines.lines != NULL && (elf != NULL || find_file(&lines, source) == 0);
+  for (uint16_t pc = 0; exported && pc < end;) {
+    const Instruction_t *instruction = mcu_decode(flash_word(flash, pc));
+    Line_t line = {0, pc + 1U, pc, bitmap_get(coverage->executed, pc), conditional(instruction), bitmap_get(coverage->taken, pc), bitmap_get(coverage->not_taken, pc)};
+    lines.lines[lines.count++] = line;
+    pc += instruction_length(coverage, instruction, pc);
+  }
+  for (uint32_t i = 0; exported && elf != NULL && i < lines.count; i += ADDR2LINE_BATCH) {
+    exported = locate(&lines, i, lines.count - i < ADDR2LINE_BATCH ? lines.count - i : ADDR2LINE_BATCH, elf);
+  }
+  if (exported) {
+    qsort(lines.lines, lines.count, sizeof(Line_t), compare_lines); // unknown locations sort last
+    write_lcov(&lines, file);
+  }
+  for (uint32_t i = 0; i < lines.file_count; i++) {
+    free(lines.files[i]);
+  }
+  free(lines.files);
+  free(lines.lines);
+  return exported;
+}
@@ -0,0 +1,27 @@
+#ifndef __COVERAGE_
+#define __COVERAGE_
+
+/*
+  Flash code coverage. An attached Coverage_t gets a bit for every executed instruction
+  and taken/not taken bits for branches and skips. Merging is a bitwise OR, so results
+  of any number of runs and workers can be combined, saved and exported to lcov.
+  Source lines come from avr-addr2line when the ELF file is given
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "atmega328p.h"
+
+#define COVERAGE_ADDR2LINE "avr-addr2line"
+
+Coverage_t *coverage_create(void); // free with free()
+void coverage_attach(ATmega328p_t *instance, Coverage_t *coverage); // NULL stops collecting
+void coverage_merge(Coverage_t *into, const Coverage_t *from); // atomic, workers can merge into one total at once
+bool coverage_save(const Coverage_t *coverage, const char *filename);
+bool coverage_load(Coverage_t *coverage, const char *filename); // merged into coverage
+void coverage_report(const Coverage_t *coverage, const byte *flash, FILE *file); // one line per instruction
+bool coverage_export_lcov(const Coverage_t *coverage, const byte *flash, const char *elf, const char *source, FILE *file);
+
+#endif // __COVERAGE_
@@ -0,0 +1,322 @@
+#include "farm.h"
+#include "coverage.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define DEQUE_INITIAL_CAPACITY 64
+
+typedef struct {
+  const byte *image;
+  const Farm_input_t *inputs;
+  uint32_t input_count;
+  uint64_t cycle_budget;
+  Farm_callback_t callback;
+  void *user;
+} Job_t;
+
+typedef struct {
+  pthread_mutex_t lock;
+  Job_t **jobs; // ring buffer, the owner works at the bottom and thieves take from the top
+  uint32_t capacity;
+  uint32_t top;
+  uint32_t count;
+} Deque_t;
+
+typedef struct {
+  Farm_t *farm;
+  uint32_t index;
+  uint32_t seed;
+  pthread_t thread;
+  Deque_t deque;
+  ATmega328p_t *instance;
+  Coverage_t *coverage; // collected by the worker, merged into the farm total
+} Worker_t;
+
+struct Farm_t {
+  uint32_t thread_count;
+  Worker_t *workers;
+  pthread_mutex_t lock;
+  pthread_cond_t work; // signalled when a job is queued or the farm shuts down
+  pthread_cond_t done; // signalled when the last pending job finishes
+  uint32_t queued; // jobs sitting in deques, atomic
+  uint64_t pending; // submitted but not finished yet
+  uint32_t next_worker;
+  bool shutdown;
+  Coverage_t *coverage; // NULL unless collecting
+};
+
+static __thread Worker_t *current_worker = NULL;
+
+static bool deque_push(Deque_t *deque, Job_t *job) {
+  pthread_mutex_lock(&deque->lock);
+  if (deque->count == deque->capacity) {
+    uint32_t capacity = deque->capacity ? deque->capacity * 2 : DEQUE_INITIAL_CAPACITY;
+    Job_t **jobs = malloc(capacity * sizeof(Job_t *));
+    if (jobs == NULL) {
+      pthread_mutex_unlock(&deque->lock);
+      return false;
+    }
+    for (uint32_t i = 0; i < deque->count; i++) {
+      jobs[i] = deque->jobs[(deque->top + i) % deque->capacity];
+    }
+    free(deque->jobs);
+    deque->jobs = jobs;
+    deque->capacity = capacity;
+    deque->top = 0;
+  }
+  deque->jobs[(deque->top + deque->count) % deque->capacity] = job;
+  deque->count++;
+  pthread_mutex_unlock(&deque->lock);
+  return true;
+}
+
+static Job_t *deque_pop_bottom(Deque_t *deque) {
+  Job_t *job = NULL;
+  pthread_mutex_lock(&deque->lock);
+  if (deque->count > 0) {
+    deque->count--;
+    job = deque->jobs[(deque->top + deque->count) % deque->capacity];
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return job;
+}
+
+static Job_t *deque_steal_top(Deque_t *deque) {
+  Job_t *job = NULL;
+  if (pthread_mutex_trylock(&deque->lock) != 0) {
+    return NULL; // busy, try another victim
+  }
+  if (deque->count > 0) {
+    job = deque->jobs[deque->top];
+    deque->top = (deque->top + 1) % deque->capacity;
+    deque->count--;
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return job;
+}
+
+static Job_t *next_job(Worker_t *worker) {
+  Farm_t *farm = worker->farm;
+  while (true) {
+    Job_t *job = deque_pop_bottom(&worker->deque);
+    uint32_t start = rand_r(&worker->seed);
+    for (uint32_t i = 0; job == NULL && i < farm->thread_count; i++) {
+      Worker_t *victim = farm->workers + (start + i) % farm->thread_count;
+      if (victim != worker) {
+        job = deque_steal_top(&victim->deque);
+      }
+    }
+    if (job != NULL) {
+      __atomic_sub_fetch(&farm->queued, 1, __ATOMIC_SEQ_CST);
+      return job;
+    }
+    pthread_mutex_lock(&farm->lock);
+    if (__atomic_load_n(&farm->queued, __ATOMIC_SEQ_CST) == 0) {
+      if (farm->shutdown) {
+        pthread_mutex_unlock(&farm->lock);
+        return NULL;
+      }
+      pthread_cond_wait(&farm->work, &farm->lock);
+    }
+    pthread_mutex_unlock(&farm->lock);
+  }
+}
+
+static void run_job(Worker_t *worker, const Job_t *job) {
+  ATmega328p_t *state = worker->instance;
+  Coverage_t *total = worker->farm->coverage;
+  coverage_attach(state, total != NULL ? worker->coverage : NULL);
+  mcu_init();
+  mcu_load_image(job->image);
+  Farm_result_t result = {0};
+  uint32_t next_input = 0;
+  while (result.cycles < job->cycle_budget) {
+    while (next_input < job->input_count && job->inputs[next_input].cycle <= result.cycles) {
+      mcu_send_interrupt(job->inputs[next_input].vector);
+      next_input++;
+    }
+    bool running = mcu_step();
+    result.cycles = state->cycle_count;
+    if (!running) {
+      result.stopped = true;
+      break;
+    }
+    result.instructions++;
+  }
+  if (total != NULL) {
+    coverage_merge(total, worker->coverage);
+  }
+  if (job->callback != NULL) {
+    job->callback(state, &result, job->user);
+  }
+}
+
+static void *worker_main(void *arg) {
+  Worker_t *worker = arg;
+  Farm_t *farm = worker->farm;
+  current_worker = worker;
+  mcu_select(worker->instance);
+  Job_t *job;
+  while ((job = next_job(worker)) != NULL) {
+    run_job(worker, job);
+    free(job);
+    pthread_mutex_lock(&farm->lock);
+    farm->pending--;
+    if (farm->pending == 0) {
+      pthread_cond_broadcast(&farm->done);
+    }
+    pthread_mutex_unlock(&farm->lock);
+  }
+  return NULL;
+}
+
+static void stop_workers(Farm_t *farm, uint32_t started) {
+  pthread_mutex_lock(&farm->lock);
+  farm->shutdown = true;
+  pthread_cond_broadcast(&farm->work);
+  pthread_mutex_unlock(&farm->lock);
+  for (uint32_t i = 0; i < started; i++) {
+    pthread_join(farm->workers[i].thread, NULL);
+  }
+}
+
+static void free_farm(Farm_t *farm) {
+  for (uint32_t i = 0; i < farm->thread_count; i++) {
+    Worker_t *worker = farm->workers + i;
+    pthread_mutex_destroy(&worker->deque.lock);
+    free(worker->deque.jobs);
+    free(worker->instance);
+    free(worker->coverage);
+  }
+  pthread_mutex_destroy(&farm->lock);
+  pthread_cond_destroy(&farm->work);
+  pthread_cond_destroy(&farm->done);
+  free(farm->workers);
+  free(farm);
+}
+
+Farm_t *farm_create(uint32_t threads) {
+  if (threads == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? (uint32_t)cpus : 1;
+  }
+  Farm_t *farm = calloc(1, sizeof(Farm_t));
+  if (farm == NULL) {
+    return NULL;
+  }
+  farm->workers = calloc(threads, sizeof(Worker_t));
+  if (farm->workers == NULL) {
+    free(farm);
+    return NULL;
+  }
+  pthread_mutex_init(&farm->lock, NULL);
+  pthread_cond_init(&farm->work, NULL);
+  pthread_cond_init(&farm->done, NULL);
+  farm->thread_count = threads;
+  bool ready = true;
+  for (uint32_t i = 0; i < threads; i++) {
+    Worker_t *worker = farm->workers + i;
+    worker->farm = farm;
+    worker->index = i;
+    worker->seed = i * 2654435761U + 1;
+    worker->instance = calloc(1, sizeof(ATmega328p_t));
+    pthread_mutex_init(&worker->deque.lock, NULL);
+    ready &= worker->instance != NULL;
+  }
+  uint32_t started = 0;
+  while (ready && started < threads && pthread_create(&farm->workers[started].thread, NULL, worker_main, farm->workers + started) == 0) {
+    started++;
+  }
+  if (started < threads) {
+    stop_workers(farm, started);
+    free_farm(farm);
+    return NULL;
+  }
+  return farm;
+}
+
+bool farm_submit(
+  Farm_t *farm, const byte *image,
+  const Farm_input_t *inputs, uint32_t input_count,
+  uint64_t cycle_budget, Farm_callback_t callback, void *user
+) {
+  Job_t *job = malloc(sizeof(Job_t));
+  if (job == NULL) {
+    return false;
+  }
+  *job = (Job_t){image, inputs, input_count, cycle_budget, callback, user};
+  Worker_t *worker = current_worker;
+  if (worker == NULL || worker->farm != farm) {
+    // Outside of the pool jobs are spread round robin, idle workers steal the rest
+    worker = farm->workers + __atomic_fetch_add(&farm->next_worker, 1, __ATOMIC_RELAXED) % farm->thread_count;
+  }
+  pthread_mutex_lock(&farm->lock);
+  farm->pending++;
+  pthread_mutex_unlock(&farm->lock);
+  if (!deque_push(&worker->deque, job)) {
+    pthread_mutex_lock(&farm->lock);
+    farm->pending--;
+    pthread_mutex_unlock(&farm->lock);
+    free(job);
+    return false;
+  }
+  __atomic_add_fetch(&farm->queued, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_lock(&farm->lock);
+  pthread_cond_signal(&farm->work);
+  pthread_mutex_unlock(&farm->lock);
+  return true;
+}
+
+void farm_wait(Farm_t *farm) {
+  pthread_mutex_lock(&farm->lock);
+  while (farm->pending > 0) {
+    pthread_cond_wait(&farm->done, &farm->lock);
+  }
+  pthread_mutex_unlock(&farm->lock);
+}
+
+void farm_destroy(Farm_t *farm) {
+  if (farm == NULL) {
+    return;
+  }
+  stop_workers(farm, farm->thread_count);
+  free_farm(farm);
+}
+
+uint32_t farm_threads(const Farm_t *farm) {
+  return farm->thread_count;
+}
+
+bool farm_collect_coverage(Farm_t *farm, Coverage_t *coverage) {
+  // Workers look at the total when a job starts, so it is only changed while the farm is idle
+  farm_wait(farm);
+  for (uint32_t i = 0; i < farm->thread_count; i++) {
+    Worker_t *worker = farm->workers + i;
+    if (worker->coverage == NULL && (worker->coverage = coverage_create()) == NULL) {
+      return false;
+    }
+  }
+  farm->coverage = coverage;
+  return true;
+}
+
+byte *farm_load_image(bool (*load)(const char *source), const char *source) {
+  ATmega328p_t *instance = calloc(1, sizeof(ATmega328p_t));
+  byte *image = malloc(PROGRAM_MEMORY_SIZE);
+  bool loaded = false;
+  if (instance != NULL && image != NULL) {
+    mcu_select(instance);
+    mcu_init();
+    loaded = load(source);
+    memcpy(image, instance->program_memory, PROGRAM_MEMORY_SIZE);
+    mcu_select(NULL);
+  }
+  free(instance);
+  if (!loaded) {
+    free(image);
+    return NULL;
+  }
+  return image;
+}
@@ -0,0 +1,43 @@
+#ifndef __FARM_
+#define __FARM_
+
+/*
+  Runs independent firmware jobs on a work-stealing pool of threads.
+  Every worker owns one MCU instance, flash images are shared read-only between jobs
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "atmega328p.h"
+
+typedef struct {
+  uint64_t cycle; // sent once this many cycles have been executed
+  Interrupt_vector_t vector;
+} Farm_input_t;
+
+typedef struct {
+  uint64_t cycles;
+  uint64_t instructions;
+  bool stopped; // reached BREAK before the cycle budget ran out
+} Farm_result_t;
+
+// Called on the worker thread, state is only valid during the call
+typedef void (*Farm_callback_t)(const ATmega328p_t *state, const Farm_result_t *result, void *user);
+
+typedef struct Farm_t Farm_t;
+
+Farm_t *farm_create(uint32_t threads); // 0 starts one thread per CPU
+bool farm_submit(
+  Farm_t *farm, const byte *image,
+  const Farm_input_t *inputs, uint32_t input_count, // sorted by cycle, kept alive until the callback
+  uint64_t cycle_budget, Farm_callback_t callback, void *user
+);
+void farm_wait(Farm_t *farm); // blocks until every submitted job has finished
+void farm_destroy(Farm_t *farm);
+uint32_t farm_threads(const Farm_t *farm);
+bool farm_collect_coverage(Farm_t *farm, Coverage_t *coverage); // merged after every job, set before submitting
+
+byte *farm_load_image(bool (*load)(const char *source), const char *source); // free with free()
+
+#endif // __FARM_
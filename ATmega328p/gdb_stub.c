@@ -0,0 +1,364 @@
+#include "gdb_stub.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define REGISTER_SREG 32
+#define REGISTER_SP 33
+#define REGISTER_PC 34
+#define SIGINT_REPLY "S02"
+#define SIGTRAP_REPLY "S05"
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+static char *put_hex(char *out, uint32_t value, int bytes) {
+  // Little endian, like GDB wants registers
+  for (int i = 0; i < bytes; i++) {
+    byte b = (value >> (i * 8)) & 0xFF;
+    *out++ = hex_digits[b >> 4];
+    *out++ = hex_digits[b & 0xF];
+  }
+  *out = '\0';
+  return out;
+}
+
+static uint32_t get_hex(const char *in, int bytes) {
+  uint32_t value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value |= (uint32_t)(hex_value(in[i * 2]) << 4 | hex_value(in[i * 2 + 1])) << (i * 8);
+  }
+  return value;
+}
+
+static byte *memory_at(ATmega328p_t *state, uint32_t address, bool write) {
+  // NULL outside of flash and data memory
+  if (address >= GDB_DATA_OFFSET) {
+    address -= GDB_DATA_OFFSET;
+    return address < DATA_MEMORY_SIZE ? state->data_memory + address : NULL;
+  }
+  if (address >= PROGRAM_MEMORY_SIZE) {
+    return NULL;
+  }
+  if (write && state->flash != state->program_memory) {
+    memcpy(state->program_memory, state->flash, PROGRAM_MEMORY_SIZE); // the image may be shared
+    state->flash = state->program_memory;
+  }
+  return write ? state->program_memory + address : (byte *)state->flash + address;
+}
+
+static uint32_t read_register(const ATmega328p_t *state, int number) {
+  if (number < REGISTER_COUNT) {
+    return state->data_memory[number];
+  }
+  if (number == REGISTER_SREG) {
+    return state->SREG.value;
+  }
+  if (number == REGISTER_SP) {
+    return RAM_START + state->sp; // the emulator keeps SP relative to RAM
+  }
+  return state->pc * WORD_SIZE;
+}
+
+static void write_register(ATmega328p_t *state, int number, uint32_t value) {
+  if (number < REGISTER_COUNT) {
+    state->data_memory[number] = value;
+  } else if (number == REGISTER_SREG) {
+    state->SREG.value = value;
+  } else if (number == REGISTER_SP) {
+    state->sp = value - RAM_START;
+  } else {
+    state->pc = value / WORD_SIZE;
+  }
+}
+
+static int register_size(int number) {
+  return number < REGISTER_SP ? 1 : number == REGISTER_SP ? 2 : 4;
+}
+
+static void stop_reply(const ATmega328p_t *state, char *reply) {
+  if (state->stop_reason != STOP_WATCHPOINT || state->host.debug == NULL) {
+    strcpy(reply, SIGTRAP_REPLY);
+    return;
+  }
+  const char *name = "awatch";
+  for (uint32_t i = 0; i < state->host.debug->point_count; i++) {
+    const Debug_point_t *point = state->host.debug->points + i;
+    if (point->kind != 0 && point->address == state->host.debug->stop_address) {
+      name = point->kind == WATCH_READ ? "rwatch" : point->kind & WATCH_READ ? "awatch" : "watch";
+    }
+  }
+  sprintf(reply, "T05%s:%x;", name, GDB_DATA_OFFSET + state->host.debug->stop_address);
+}
+
+static bool interrupted(const Gdb_session_t *session) {
+  char c = 0;
+  return session->fd != -1 && recv(session->fd, &c, 1, MSG_DONTWAIT) == 1 && c == '\x03';
+}
+
+static void resume(ATmega328p_t *state) {
+  if (state->stopped) {
+    state->auto_execute = false; // mcu_resume must not start the paced loop
+    mcu_resume();
+  }
+}
+
+static void run(Gdb_session_t *session, char *reply) {
+  // Runs locally without pacing, the socket is only polled for Ctrl-C now and then
+  ATmega328p_t *state = session->instance;
+  resume(state);
+  for (uint32_t count = 1; mcu_step(); count++) {
+    if (count % GDB_INTERRUPT_INTERVAL == 0 && interrupted(session)) {
+      strcpy(reply, SIGINT_REPLY);
+      return;
+    }
+  }
+  stop_reply(state, reply);
+}
+
+static bool set_point(char type, uint32_t address, uint32_t length, bool insert) {
+  if (type == '0' || type == '1') {
+    uint16_t word = address / WORD_SIZE;
+    return insert ? mcu_add_breakpoint(word, 0) : mcu_remove_breakpoint(word);
+  }
+  if (type < '2' || type > '4' || address < GDB_DATA_OFFSET) {
+    return false;
+  }
+  byte kind = type == '2' ? WATCH_WRITE : type == '3' ? WATCH_READ : WATCH_READ | WATCH_WRITE;
+  bool done = true;
+  for (uint32_t i = 0; i < length; i++) {
+    uint16_t data = address - GDB_DATA_OFFSET + i;
+    done &= insert ? mcu_add_watchpoint(data, kind, 0, 0) : mcu_remove_watchpoint(data);
+  }
+  return done;
+}
+
+void gdb_handle_packet(Gdb_session_t *session, const char *packet, char *reply) {
+  ATmega328p_t *state = session->instance;
+  uint32_t address = 0, length = 0, value = 0, number = 0;
+  char type = 0;
+  *reply = '\0';
+  mcu_select(state);
+  switch (packet[0]) {
+    case '?':
+      stop_reply(state, reply);
+      break;
+    case 'g': {
+      char *out = reply;
+      for (int i = 0; i <= REGISTER_PC; i++) {
+        out = put_hex(out, read_register(state, i), register_size(i));
+      }
+      break;
+    }
+    case 'G': {
+      const char *in = packet + 1;
+      for (int i = 0; i <= REGISTER_PC && strlen(in) >= register_size(i) * 2; i++) {
+        write_register(state, i, get_hex(in, register_size(i)));
+        in += register_size(i) * 2;
+      }
+      strcpy(reply, "OK");
+      break;
+    }
+    case 'p':
+      if (sscanf(packet + 1, "%x", &number) == 1 && number <= REGISTER_PC) {
+        put_hex(reply, read_register(state, number), register_size(number));
+      } else {
+        strcpy(reply, "E01");
+      }
+      break;
+    case 'P': {
+      const char *equals = strchr(packet, '=');
+      if (sscanf(packet + 1, "%x", &number) == 1 && number <= REGISTER_PC && equals != NULL) {
+        write_register(state, number, get_hex(equals + 1, register_size(number)));
+        strcpy(reply, "OK");
+      } else {
+        strcpy(reply, "E01");
+      }
+      break;
+    }
+    case 'm':
+      if (sscanf(packet + 1, "%x,%x", &address, &length) != 2 || length * 2 >= GDB_BUFFER_SIZE) {
+        strcpy(reply, "E01");
+        break;
+      }
+      for (uint32_t i = 0; i < length; i++) {
+        const byte *memory = memory_at(state, address + i, false);
+        if (memory == NULL) {
+          strcpy(reply, "E01");
+          break;
+        }
+        put_hex(reply + i * 2, *memory, 1);
+      }
+      break;
+    case 'M': {
+      const char *data = strchr(packet, ':');
+      if (sscanf(packet + 1, "%x,%x", &address, &length) != 2 || data == NULL || strlen(data + 1) < length * 2) {
+        strcpy(reply, "E01");
+        break;
+      }
+      strcpy(reply, "OK");
+      for (uint32_t i = 0; i < length; i++) {
+        byte *memory = memory_at(state, address + i, true);
+        if (memory == NULL) {
+          strcpy(reply, "E01");
+          break;
+        }
+        *memory = get_hex(data + 1 + i * 2, 1);
+      }
+      break;
+    }
+    case 'c':
+      if (sscanf(packet + 1, "%x", &address) == 1) {
+        state->pc = address / WORD_SIZE;
+      }
+      run(session, reply);
+      break;
+    case 's':
+      if (sscanf(packet + 1, "%x", &address) == 1) {
+        state->pc = address / WORD_SIZE;
+      }
+      resume(state);
+      mcu_step();
+      stop_reply(state, reply);
+      break;
+    case 'Z':
+    case 'z':
+      if (sscanf(packet + 1, "%c,%x,%x", &type, &address, &value) == 3 && set_point(type, address, value, packet[0] == 'Z')) {
+        strcpy(reply, "OK");
+      } else if (type >= '0' && type <= '4') {
+        strcpy(reply, "E01");
+      }
+      break;
+    case 'H':
+      strcpy(reply, "OK"); // there is only one thread
+      break;
+    case 'k':
+    case 'D':
+      session->attached = false;
+      strcpy(reply, "OK");
+      break;
+    case 'q':
+      if (strncmp(packet, "qSupported", 10) == 0) {
+        sprintf(reply, "PacketSize=%x", GDB_BUFFER_SIZE - 1);
+      } else if (strcmp(packet, "qAttached") == 0) {
+        strcpy(reply, "1");
+      } else if (strcmp(packet, "qC") == 0) {
+        strcpy(reply, "QC1");
+      } else if (strcmp(packet, "qOffsets") == 0) {
+        strcpy(reply, "Text=0;Data=0;Bss=0");
+      }
+      break;
+    default:
+      break; // empty reply, not supported
+  }
+  mcu_select(NULL);
+}
+
+static bool send_packet(int fd, const char *data) {
+  static char frame[GDB_BUFFER_SIZE + 4];
+  byte checksum = 0;
+  size_t length = strlen(data);
+  frame[0] = '$';
+  for (size_t i = 0; i < length; i++) {
+    frame[i + 1] = data[i];
+    checksum += data[i];
+  }
+  sprintf(frame + length + 1, "#%02x", checksum);
+  return write(fd, frame, length + 4) == (ssize_t)(length + 4);
+}
+
+static bool receive_packet(int fd, char *packet) {
+  // Skips acks and stray Ctrl-C, answers every packet with + or - depending on its checksum
+  char c;
+  while (true) {
+    do {
+      if (read(fd, &c, 1) != 1) {
+        return false;
+      }
+    } while (c != '$');
+    size_t length = 0;
+    byte checksum = 0;
+    while (read(fd, &c, 1) == 1 && c != '#') {
+      if (length < GDB_BUFFER_SIZE - 1) {
+        packet[length++] = c;
+        checksum += c;
+      }
+    }
+    packet[length] = '\0';
+    char sum[2];
+    if (read(fd, sum, 1) != 1 || read(fd, sum + 1, 1) != 1) {
+      return false;
+    }
+    bool valid = (hex_value(sum[0]) << 4 | hex_value(sum[1])) == checksum;
+    if (write(fd, valid ? "+" : "-", 1) != 1) {
+      return false;
+    }
+    if (valid) {
+      return true;
+    }
+  }
+}
+
+bool gdb_serve(ATmega328p_t *instance, int fd) {
+  static char packet[GDB_BUFFER_SIZE];
+  static char reply[GDB_BUFFER_SIZE];
+  Gdb_session_t session = {instance, fd, true};
+  int yes = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)); // fails harmlessly on Unix sockets
+  while (session.attached) {
+    if (!receive_packet(fd, packet)) {
+      return false;
+    }
+    gdb_handle_packet(&session, packet, reply);
+    if (!send_packet(fd, reply)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int gdb_listen(const char *address) {
+  bool unix_socket = strchr(address, '/') != NULL;
+  int fd = socket(unix_socket ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  int bound = -1;
+  if (unix_socket) {
+    struct sockaddr_un local = {.sun_family = AF_UNIX};
+    strncpy(local.sun_path, address, sizeof(local.sun_path) - 1);
+    unlink(address);
+    bound = bind(fd, (struct sockaddr *)&local, sizeof(local));
+  } else {
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    struct sockaddr_in local = {
+      .sin_family = AF_INET,
+      .sin_port = htons(atoi(address)),
+      .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+    bound = bind(fd, (struct sockaddr *)&local, sizeof(local));
+  }
+  if (bound == -1 || listen(fd, 1) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
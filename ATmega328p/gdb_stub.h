@@ -0,0 +1,29 @@
+#ifndef __GDB_STUB_
+#define __GDB_STUB_
+
+/*
+  GDB remote serial protocol server for avr-gdb.
+  Flash is at 0x000000 and data memory at 0x800000, like avr-gdb expects.
+  Continue runs the MCU locally at full speed and only checks the socket for Ctrl-C every few instructions
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "atmega328p.h"
+
+#define GDB_BUFFER_SIZE 4096
+#define GDB_DATA_OFFSET 0x800000
+#define GDB_INTERRUPT_INTERVAL 65536 // instructions between checks for Ctrl-C while running
+
+typedef struct {
+  ATmega328p_t *instance;
+  int fd; // -1 without a connection, continue then runs until the MCU stops
+  bool attached;
+} Gdb_session_t;
+
+int gdb_listen(const char *address); // TCP port or a Unix socket path, returns the listening socket or -1
+bool gdb_serve(ATmega328p_t *instance, int fd); // serves one connection until GDB detaches or kills
+void gdb_handle_packet(Gdb_session_t *session, const char *packet, char *reply); // reply holds GDB_BUFFER_SIZE bytes
+
+#endif // __GDB_STUB_
@@ -0,0 +1,64 @@
+#include "inbox.h"
+#include <stdlib.h>
+#include <string.h>
+
+Inbox_t *inbox_create(uint32_t size) {
+  if (size == 0 || (size & (size - 1)) != 0) {
+    return NULL;
+  }
+  size_t bytes = (sizeof(Inbox_t) + size * sizeof(Inbox_cell_t) + 63) & ~(size_t)63;
+  Inbox_t *inbox = aligned_alloc(64, bytes);
+  if (inbox != NULL) {
+    memset(inbox, 0, bytes);
+    inbox->size = size;
+    for (uint32_t i = 0; i < size; i++) {
+      inbox->cells[i].sequence = i;
+    }
+  }
+  return inbox;
+}
+
+bool inbox_post(Inbox_t *inbox, const Inbox_event_t *event) {
+  uint64_t tail = __atomic_load_n(&inbox->tail, __ATOMIC_RELAXED);
+  Inbox_cell_t *cell;
+  while (true) {
+    cell = inbox->cells + (tail & (inbox->size - 1));
+    int64_t ready = (int64_t)(__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - tail);
+    if (ready == 0) {
+      if (__atomic_compare_exchange_n(&inbox->tail, &tail, tail + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (ready < 0) {
+      return false; // the emulator has not taken the event a lap ago yet
+    } else {
+      tail = __atomic_load_n(&inbox->tail, __ATOMIC_RELAXED);
+    }
+  }
+  cell->event = *event;
+  __atomic_store_n(&cell->sequence, tail + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+bool inbox_interrupt(Inbox_t *inbox, Interrupt_vector_t vector) {
+  Inbox_event_t event = {INBOX_INTERRUPT, 0, vector};
+  return inbox_post(inbox, &event);
+}
+
+bool inbox_pin(Inbox_t *inbox, byte pin, byte level) {
+  Inbox_event_t event = {INBOX_PIN, pin, level};
+  return inbox_post(inbox, &event);
+}
+
+bool inbox_uart(Inbox_t *inbox, byte value) {
+  Inbox_event_t event = {INBOX_UART, 0, value};
+  return inbox_post(inbox, &event);
+}
+
+bool inbox_stop(Inbox_t *inbox) {
+  Inbox_event_t event = {INBOX_STOP, 0, 0};
+  return inbox_post(inbox, &event);
+}
+
+void inbox_destroy(Inbox_t *inbox) {
+  free(inbox);
+}
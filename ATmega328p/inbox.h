@@ -0,0 +1,71 @@
+#ifndef __INBOX_
+#define __INBOX_
+
+/*
+  Events from the host for a running instance: interrupts, pin levels, UART bytes and stop
+  requests. Any number of threads post into a bounded ring without locks (Vyukov's queue, each
+  cell carries the position it is ready for), the emulator takes them between instructions.
+  The emulator's only cost while nothing arrives is one atomic load per step.
+  Events taken from an inbox are not recorded, so it cannot be combined with a replay
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "atmega328p.h"
+
+#define INBOX_UART_BUFFER 64 // received bytes waiting for UDR0 to be read
+
+typedef enum {
+  INBOX_INTERRUPT = 0,
+  INBOX_PIN,
+  INBOX_UART,
+  INBOX_STOP
+} Inbox_kind_t;
+
+typedef struct {
+  byte kind; // Inbox_kind_t
+  byte pin; // port * 8 + bit for INBOX_PIN
+  byte value; // the vector, a STIMULUS_* level or the byte
+} Inbox_event_t;
+
+typedef struct {
+  uint64_t sequence; // position + 1 once the event is written, position + size once it is taken
+  Inbox_event_t event;
+} Inbox_cell_t;
+
+typedef struct Inbox_t {
+  uint32_t size; // power of two
+  uint64_t tail __attribute__((aligned(64))); // claimed by the producers
+  uint64_t head __attribute__((aligned(64))); // emulator only from here on
+  byte uart[INBOX_UART_BUFFER];
+  uint32_t uart_first;
+  uint32_t uart_count;
+  Inbox_cell_t cells[] __attribute__((aligned(64)));
+} Inbox_t;
+
+static inline bool inbox_pending(const Inbox_t *inbox) {
+  return __atomic_load_n(&inbox->cells[inbox->head & (inbox->size - 1)].sequence, __ATOMIC_ACQUIRE) == inbox->head + 1;
+}
+
+static inline bool inbox_take(Inbox_t *inbox, Inbox_event_t *event) {
+  // Single consumer, in the order the events were posted
+  Inbox_cell_t *cell = inbox->cells + (inbox->head & (inbox->size - 1));
+  if (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) != inbox->head + 1) {
+    return false;
+  }
+  *event = cell->event;
+  __atomic_store_n(&cell->sequence, inbox->head + inbox->size, __ATOMIC_RELEASE);
+  inbox->head++;
+  return true;
+}
+
+Inbox_t *inbox_create(uint32_t size); // events, a power of two
+bool inbox_post(Inbox_t *inbox, const Inbox_event_t *event); // from any thread, false while full
+bool inbox_interrupt(Inbox_t *inbox, Interrupt_vector_t vector);
+bool inbox_pin(Inbox_t *inbox, byte pin, byte level); // like a stimulus record
+bool inbox_uart(Inbox_t *inbox, byte value); // received by USART0 if its receiver is on
+bool inbox_stop(Inbox_t *inbox); // stops with STOP_HOST after the current instruction
+void inbox_destroy(Inbox_t *inbox); // detach it first
+
+#endif // __INBOX_
@@ -0,0 +1,244 @@
+#include "lockstep.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <inttypes.h>
+
+#define FNV_OFFSET 0xCBF29CE484222325LLU
+#define FNV_PRIME 0x100000001B3LLU
+
+typedef struct {
+  ATmega328p_t *a, *b;
+  const Lockstep_engine_t *engine_a, *engine_b;
+  const Lockstep_config_t *config;
+  uint32_t next_input;
+  uint64_t executed;
+  bool a_running, b_running;
+} Pair_t;
+
+static void fused_prepare(void) {
+  mcu_set_fusion(true);
+}
+
+const Lockstep_engine_t lockstep_reference_engine = {.name = "reference", .prepare = NULL, .step = mcu_step, .fused = false};
+const Lockstep_engine_t lockstep_fused_engine = {.name = "fused", .prepare = fused_prepare, .step = mcu_step, .fused = true};
+
+static inline uint64_t fnv_bytes(uint64_t hash, const byte *bytes, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    hash ^= bytes[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+uint64_t lockstep_state_hash(const ATmega328p_t *state) {
+  uint64_t hash = fnv_bytes(FNV_OFFSET, state->data_memory, REGISTER_COUNT);
+  hash = fnv_bytes(hash, &state->SREG.value, 1);
+  hash = fnv_bytes(hash, (const byte *)&state->sp, sizeof(state->sp));
+  hash = fnv_bytes(hash, (const byte *)&state->pc, sizeof(state->pc));
+  return hash;
+}
+
+static int32_t first_difference(const byte *a, const byte *b, int32_t length) {
+  if (memcmp(a, b, length) == 0) {
+    return -1;
+  }
+  for (int32_t i = 0; i < length; i++) {
+    if (a[i] != b[i]) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static bool memory_differs(const Pair_t *pair, Lockstep_report_t *report) {
+  const struct {
+    const char *name;
+    int32_t offset;
+    int32_t size;
+  } regions[] = {
+    {"data", offsetof(ATmega328p_t, data_memory), DATA_MEMORY_SIZE},
+    {"ROM", offsetof(ATmega328p_t, ROM), KB},
+    {"program", offsetof(ATmega328p_t, program_memory), PROGRAM_MEMORY_SIZE}
+  };
+  for (int i = 0; i < sizeof(regions) / sizeof(regions[0]); i++) {
+    int32_t address = first_difference(
+      (const byte *)pair->a + regions[i].offset, (const byte *)pair->b + regions[i].offset, regions[i].size
+    );
+    if (address != -1) {
+      report->address = address;
+      report->region = regions[i].name;
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool start_pair(Pair_t *pair, bool (*load)(const char *), const char *source) {
+  ATmega328p_t *instances[] = {pair->a, pair->b};
+  const Lockstep_engine_t *engines[] = {pair->engine_a, pair->engine_b};
+  for (int i = 0; i < 2; i++) {
+    mcu_select(instances[i]);
+    mcu_init();
+    if (!load(source)) {
+      mcu_select(NULL);
+      return false;
+    }
+    if (engines[i]->prepare != NULL) {
+      engines[i]->prepare();
+    }
+  }
+  pair->next_input = 0;
+  pair->executed = 0;
+  pair->a_running = pair->b_running = true;
+  return true;
+}
+
+static void step_pair(Pair_t *pair) {
+  const Lockstep_config_t *config = pair->config;
+  while (pair->next_input < config->input_count && config->inputs[pair->next_input].instruction <= pair->executed) {
+    Interrupt_vector_t vector = config->inputs[pair->next_input].vector;
+    mcu_select(pair->a);
+    mcu_send_interrupt(vector);
+    mcu_select(pair->b);
+    mcu_send_interrupt(vector);
+    pair->next_input++;
+  }
+  if (pair->a_running) {
+    mcu_select(pair->a);
+    pair->a_running = pair->engine_a->step();
+  }
+  if (pair->b_running) {
+    mcu_select(pair->b);
+    pair->b_running = pair->engine_b->step();
+  }
+  bool fused = pair->engine_a->fused || pair->engine_b->fused;
+  for (int i = 0; fused && i < LOCKSTEP_CATCH_UP && pair->a_running && pair->b_running && pair->a->cycle_count != pair->b->cycle_count; i++) {
+    // Both reach the same cycle count at the end of a fused group, unless they diverged
+    bool a_behind = pair->a->cycle_count < pair->b->cycle_count;
+    mcu_select(a_behind ? pair->a : pair->b);
+    if (a_behind) {
+      pair->a_running = pair->engine_a->step();
+    } else {
+      pair->b_running = pair->engine_b->step();
+    }
+  }
+  pair->executed++;
+}
+
+static void capture(const Pair_t *pair, Lockstep_report_t *report) {
+  report->instructions = pair->executed;
+  mcu_select(pair->a);
+  mcu_get_copy(&report->a);
+  mcu_select(pair->b);
+  mcu_get_copy(&report->b);
+}
+
+static bool locate_memory_divergence(Pair_t *pair, uint64_t last_match, bool (*load)(const char *), const char *source, Lockstep_report_t *report) {
+  // Memory is only compared every few instructions, replay from the last match to find the exact one
+  if (!start_pair(pair, load, source)) {
+    return false;
+  }
+  while (pair->executed < last_match) {
+    step_pair(pair);
+  }
+  do {
+    step_pair(pair);
+  } while (!memory_differs(pair, report) && (pair->a_running || pair->b_running));
+  report->instruction = pair->executed;
+  return true;
+}
+
+bool lockstep_run(
+  bool (*load)(const char *source), const char *source,
+  const Lockstep_engine_t *a, const Lockstep_engine_t *b,
+  const Lockstep_config_t *config, Lockstep_report_t *report
+) {
+  memset(report, 0, sizeof(*report));
+  report->address = -1;
+  Pair_t pair = {
+    .a = calloc(1, sizeof(ATmega328p_t)),
+    .b = calloc(1, sizeof(ATmega328p_t)),
+    .engine_a = a,
+    .engine_b = b,
+    .config = config
+  };
+  bool started = pair.a != NULL && pair.b != NULL && start_pair(&pair, load, source);
+  uint64_t last_match = 0;
+  while (started && (pair.a_running || pair.b_running)) {
+    if (config->max_instructions != 0 && pair.executed >= config->max_instructions) {
+      break;
+    }
+    step_pair(&pair);
+    if (pair.a_running != pair.b_running) {
+      report->result = LOCKSTEP_STOPPED;
+    } else if (lockstep_state_hash(pair.a) != lockstep_state_hash(pair.b)) {
+      report->result = LOCKSTEP_REGISTERS;
+    } else if (config->memory_interval != 0 && pair.executed % config->memory_interval == 0) {
+      if (memory_differs(&pair, report)) {
+        report->result = LOCKSTEP_MEMORY;
+      } else {
+        last_match = pair.executed;
+      }
+    }
+    if (report->result != LOCKSTEP_MATCH) {
+      break;
+    }
+  }
+  if (started && report->result == LOCKSTEP_MATCH && memory_differs(&pair, report)) {
+    report->result = LOCKSTEP_MEMORY;
+  }
+  report->instruction = pair.executed;
+  if (started && report->result == LOCKSTEP_MEMORY) {
+    started = locate_memory_divergence(&pair, last_match, load, source, report);
+  }
+  if (started) {
+    capture(&pair, report);
+  }
+  for (int i = 0; i < 2; i++) {
+    ATmega328p_t *instance = i == 0 ? pair.a : pair.b;
+    if (instance != NULL) {
+      mcu_select(instance);
+      mcu_set_fusion(false);
+    }
+  }
+  mcu_select(NULL);
+  free(pair.a);
+  free(pair.b);
+  return started;
+}
+
+static void print_state(FILE *file, const char *name, const ATmega328p_t *state) {
+  fprintf(file, "%s:\n", name);
+  for (int i = 0; i < REGISTER_COUNT; i++) {
+    fprintf(file, "R[%.02d] = 0x%.2X%s", i, state->data_memory[i], i % 4 == 3 ? "\n" : "  ");
+  }
+  fprintf(file, "SREG = 0x%.2X  SP = 0x%.4X  PC = 0x%.4X  stopped = %d\n",
+    state->SREG.value, state->sp, (unsigned)(state->pc * WORD_SIZE), state->stopped);
+}
+
+void lockstep_print_report(FILE *file, const Lockstep_report_t *report, const Lockstep_engine_t *a, const Lockstep_engine_t *b) {
+  if (report->result == LOCKSTEP_MATCH) {
+    fprintf(file, "%s and %s match after %" PRIu64 " instructions\n", a->name, b->name, report->instructions);
+    return;
+  }
+  const char *causes[] = {"", "registers", "memory", "stop state"};
+  fprintf(file, "%s and %s diverged (%s) at instruction %" PRIu64 "\n", a->name, b->name, causes[report->result], report->instruction);
+  if (report->result == LOCKSTEP_MEMORY) {
+    const ATmega328p_t *states[] = {&report->a, &report->b};
+    const byte *memories[2];
+    for (int i = 0; i < 2; i++) {
+      if (strcmp(report->region, "data") == 0) {
+        memories[i] = states[i]->data_memory;
+      } else if (strcmp(report->region, "ROM") == 0) {
+        memories[i] = states[i]->ROM;
+      } else {
+        memories[i] = states[i]->program_memory;
+      }
+    }
+    fprintf(file, "%s memory at 0x%.4X: %s = 0x%.2X, %s = 0x%.2X\n", report->region, report->address,
+      a->name, memories[0][report->address], b->name, memories[1][report->address]);
+  }
+  print_state(file, a->name, &report->a);
+  print_state(file, b->name, &report->b);
+}
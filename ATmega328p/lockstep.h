@@ -0,0 +1,64 @@
+#ifndef __LOCKSTEP_
+#define __LOCKSTEP_
+
+/*
+  Runs two engines on separate MCU instances, instruction by instruction,
+  and reports the first point where their states differ.
+  When an engine runs several instructions per step, the other one catches up on cycles
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "atmega328p.h"
+
+#define LOCKSTEP_CATCH_UP 16 // steps an engine may take to reach the cycle count of a fused one
+
+typedef struct {
+  const char *name;
+  void (*prepare)(void); // called on the selected instance after the firmware is loaded, may be NULL
+  bool (*step)(void); // executes one instruction on the selected instance
+  bool fused; // may execute several instructions in one step
+} Lockstep_engine_t;
+
+typedef struct {
+  uint64_t instruction; // sent right before this instruction is executed
+  Interrupt_vector_t vector;
+} Lockstep_input_t;
+
+typedef struct {
+  uint64_t max_instructions; // 0 runs until both engines stop
+  uint32_t memory_interval; // full memory comparison every N instructions, 0 only at the end
+  const Lockstep_input_t *inputs; // sorted by instruction
+  uint32_t input_count;
+} Lockstep_config_t;
+
+typedef enum {
+  LOCKSTEP_MATCH = 0,
+  LOCKSTEP_REGISTERS, // registers, SREG, SP or PC
+  LOCKSTEP_MEMORY, // data memory, ROM or program memory
+  LOCKSTEP_STOPPED // one engine stopped while the other kept running
+} Lockstep_result_t;
+
+typedef struct {
+  Lockstep_result_t result;
+  uint64_t instructions; // executed by each engine
+  uint64_t instruction; // index of the first instruction after which the states differ
+  int32_t address; // first differing memory address for LOCKSTEP_MEMORY, -1 otherwise
+  const char *region; // memory region of the address
+  ATmega328p_t a, b; // both states at the point of divergence
+} Lockstep_report_t;
+
+extern const Lockstep_engine_t lockstep_reference_engine;
+extern const Lockstep_engine_t lockstep_fused_engine;
+
+bool lockstep_run(
+  bool (*load)(const char *source), const char *source,
+  const Lockstep_engine_t *a, const Lockstep_engine_t *b,
+  const Lockstep_config_t *config, Lockstep_report_t *report
+);
+void lockstep_print_report(FILE *file, const Lockstep_report_t *report, const Lockstep_engine_t *a, const Lockstep_engine_t *b);
+uint64_t lockstep_state_hash(const ATmega328p_t *state);
+
+#endif // __LOCKSTEP_
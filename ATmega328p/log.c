@@ -0,0 +1,46 @@
+#include "log.h"
+#include <stdlib.h>
+
+Log_t *log_create(uint32_t size, byte level) {
+  if (size < LOG_RECORD_HEADER + 1024 || (size & (size - 1)) != 0) {
+    return NULL;
+  }
+  Log_t *log = calloc(1, sizeof(Log_t) + size);
+  if (log != NULL) {
+    log->size = size;
+    log->level = level;
+  }
+  return log;
+}
+
+uint32_t log_read(Log_t *log, char *output, uint32_t size) {
+  // Stops before the first record that does not fit into the output
+  uint64_t tail = log->tail;
+  uint64_t head = __atomic_load_n(&log->head, __ATOMIC_ACQUIRE);
+  uint32_t copied = 0;
+  while (tail < head) {
+    byte header[LOG_RECORD_HEADER];
+    for (int i = 0; i < LOG_RECORD_HEADER; i++) {
+      header[i] = log->buffer[(tail + i) & (log->size - 1)];
+    }
+    uint32_t length = LOG_RECORD_HEADER + (header[1] | header[2] << 8);
+    if (copied + length > size) {
+      break;
+    }
+    for (uint32_t i = 0; i < length; i++) {
+      output[copied + i] = log->buffer[(tail + i) & (log->size - 1)];
+    }
+    copied += length;
+    tail += length;
+  }
+  __atomic_store_n(&log->tail, tail, __ATOMIC_RELEASE);
+  return copied;
+}
+
+uint64_t log_dropped(Log_t *log) {
+  return __atomic_exchange_n(&log->dropped, 0, __ATOMIC_RELAXED);
+}
+
+void log_destroy(Log_t *log) {
+  free(log);
+}
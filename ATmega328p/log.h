@@ -0,0 +1,52 @@
+#ifndef __LOG_
+#define __LOG_
+
+/*
+  Message log of an instance. The emulator appends records to a ring buffer without locks
+  or system calls, the host drains them in batches with log_read, from any one thread.
+  A record is its Log_level_t, a 16 bit little endian length and the text without a NUL.
+  Records that do not fit are dropped and counted, the emulator never waits for the host
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "atmega328p.h"
+
+#define LOG_RECORD_HEADER 3
+
+typedef struct Log_t {
+  uint32_t size; // power of two
+  byte level; // highest Log_level_t recorded
+  uint64_t head; // written by the emulator
+  uint64_t tail; // read by the host
+  uint64_t dropped;
+  char buffer[];
+} Log_t;
+
+static inline void log_copy(Log_t *log, const uint64_t position, const char *data, const uint32_t length) {
+  uint32_t offset = position & (log->size - 1);
+  uint32_t first = length < log->size - offset ? length : log->size - offset;
+  memcpy(log->buffer + offset, data, first);
+  memcpy(log->buffer, data + first, length - first);
+}
+
+static inline void log_write(Log_t *log, const byte level, const char *text, const uint16_t length) {
+  uint64_t head = log->head;
+  if (head - __atomic_load_n(&log->tail, __ATOMIC_ACQUIRE) + LOG_RECORD_HEADER + length > log->size) {
+    __atomic_add_fetch(&log->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  char header[LOG_RECORD_HEADER] = {level, length & 0xFF, length >> 8};
+  log_copy(log, head, header, LOG_RECORD_HEADER);
+  log_copy(log, head + LOG_RECORD_HEADER, text, length);
+  __atomic_store_n(&log->head, head + LOG_RECORD_HEADER + length, __ATOMIC_RELEASE);
+}
+
+Log_t *log_create(uint32_t size, byte level); // size is a power of two and holds the longest message
+uint32_t log_read(Log_t *log, char *output, uint32_t size); // whole records, returns the bytes copied
+uint64_t log_dropped(Log_t *log); // since the last call
+void log_destroy(Log_t *log); // detach it first
+
+#endif // __LOG_
@@ -0,0 +1,67 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "atmega328p.h"
+#include "coverage.h"
+
+static ATmega328p_t target;
+
+static int run(const char *filename, uint64_t max_cycles) {
+  // Adds this run to the file, so a whole test suite can share one
+  Coverage_t *coverage = coverage_create();
+  if (coverage == NULL) {
+    return 2;
+  }
+  coverage_load(coverage, filename);
+  coverage_attach(&target, coverage);
+  while (target.cycle_count < max_cycles && mcu_step());
+  coverage_attach(&target, NULL);
+  bool saved = coverage_save(coverage, filename);
+  free(coverage);
+  if (!saved) {
+    fprintf(stderr, "Could not write %s\n", filename);
+    return 2;
+  }
+  return 0;
+}
+
+static int export(const char *mode, const char *program, const char *filename, const char *elf) {
+  Coverage_t *coverage = coverage_create();
+  if (coverage == NULL || !coverage_load(coverage, filename)) {
+    fprintf(stderr, "Could not read %s\n", filename);
+    free(coverage);
+    return 2;
+  }
+  bool exported = true;
+  if (strcmp(mode, "lcov") == 0) {
+    exported = coverage_export_lcov(coverage, target.program_memory, elf, program, stdout);
+  } else {
+    coverage_report(coverage, target.program_memory, stdout);
+  }
+  free(coverage);
+  if (!exported) {
+    fprintf(stderr, "Could not map %s to source lines\n", elf);
+    return 2;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 4 || (strcmp(argv[1], "run") != 0 && strcmp(argv[1], "report") != 0 && strcmp(argv[1], "lcov") != 0)) {
+    fprintf(stderr, "Usage: %s run program.hex coverage.bin [max cycles]\n", argv[0]);
+    fprintf(stderr, "       %s report program.hex coverage.bin\n", argv[0]);
+    fprintf(stderr, "       %s lcov program.hex coverage.bin [program.elf] > coverage.info\n", argv[0]);
+    return 2;
+  }
+  mcu_select(&target);
+  mcu_init();
+  if (!mcu_load_ihex(argv[2])) {
+    fprintf(stderr, "Could not load %s\n", argv[2]);
+    return 2;
+  }
+  if (strcmp(argv[1], "run") == 0) {
+    return run(argv[3], argc > 4 ? strtoull(argv[4], NULL, 10) : 10000000);
+  }
+  return export(argv[1], argv[2], argv[3], argc > 4 ? argv[4] : NULL);
+}
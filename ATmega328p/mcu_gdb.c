@@ -0,0 +1,40 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "atmega328p.h"
+#include "gdb_stub.h"
+
+static ATmega328p_t target;
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s program.hex [port or socket path]\n", argv[0]);
+    return 2;
+  }
+  const char *address = argc > 2 ? argv[2] : "1234";
+  mcu_select(&target);
+  mcu_init();
+  if (!mcu_load_ihex(argv[1])) {
+    fprintf(stderr, "Could not load %s\n", argv[1]);
+    return 2;
+  }
+  int server = gdb_listen(address);
+  if (server == -1) {
+    fprintf(stderr, "Could not listen on %s\n", address);
+    return 2;
+  }
+  printf("Waiting for GDB on %s\n", address);
+  bool detached = false;
+  while (!detached) {
+    int client = accept(server, NULL, NULL);
+    if (client == -1) {
+      break;
+    }
+    detached = gdb_serve(&target, client);
+    close(client);
+  }
+  close(server);
+  return 0;
+}
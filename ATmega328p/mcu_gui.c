@@ -5,17 +5,31 @@
 #include <unistd.h>
 
 #include "atmega328p.h"
+#include "replay.h"
+#include "snapshot.h"
 
-static ATmega328p_t mcu;
+#define CHECKPOINT_INTERVAL 100000
+#define SNAPSHOT_INTERVAL 10000 // cycles
+
+static ATmega328p_t target;
+static Replay_t *replay;
+static Snapshot_t *snapshot;
+static bool quit; // atomic, checked by the emulator loop between instructions
 
 static void show_state(void) {
-  mcu_get_copy(&mcu);
+  // Read from the published state, the emulator keeps running on the main thread
+  static Snapshot_state_t state;
+  if (!snapshot_read(snapshot, &state)) {
+    return;
+  }
+  uint16_t opcode = state.status.opcode > 0xFFFF ? state.status.opcode >> 16 : state.status.opcode;
   printf("Registers:\n");
   for (int i = 0; i < 32; i++) {
-    printf("R[%.02d] = %*d%s", i, 3, mcu.R[i], i % 2 ? "\n" : "  ");
+    printf("R[%.02d] = %*d%s", i, 3, state.data_memory[i], i % 2 ? "\n" : "  ");
   }
-  printf("PC    = 0x%*x  Opcode = 0x%.4X\n", 3, mcu.pc * 2, mcu.opcode);
-  printf("Instruction = %s\n", mcu.instruction->name);
+  printf("PC    = 0x%*x  Opcode = 0x%.4X\n", 3, state.status.pc * 2, state.status.opcode);
+  printf("Instruction = %s\n", mcu_decode(opcode)->name);
+  printf("Cycles = %llu\n", (unsigned long long)state.status.cycle_count);
 }
 
 void *handle_stdin(void *arg) {
@@ -28,9 +42,16 @@ void *handle_stdin(void *arg) {
       if (sc == 0) {
         continue;
       }
-      mcu_send_interrupt((Interrupt_vector_t)vector);
+      replay_send_interrupt(replay, (Interrupt_vector_t)vector); // recorded with the cycle it takes effect at
+    }
+    if (c == 'p') {
+      show_state();
+    }
+    if (c == 's') {
+      printf(replay_save(replay, "program.replay") ? "Saved program.replay\n" : "Could not save the replay\n");
     }
-    if (c == 'q') {
+    if (c == 'q' || c == EOF) {
+      __atomic_store_n(&quit, true, __ATOMIC_RELEASE); // the emulator loop ends after the current instruction
       break;
     }
   }
@@ -39,9 +60,22 @@ void *handle_stdin(void *arg) {
 
 int main(void) {
   pthread_t thread;
-  pthread_create(&thread, NULL, handle_stdin, NULL);
+  mcu_select(&target);
   mcu_init();
-  mcu_load_ihex("program.hex");
-  mcu_run();
+  if (!mcu_load_ihex("program.hex")) {
+    fprintf(stderr, "Could not load program.hex\n");
+    return 1;
+  }
+  snapshot = snapshot_create(SNAPSHOT_INTERVAL);
+  mcu_set_snapshot(snapshot);
+  // Every input goes through the replay, an inbox would bypass the recording
+  replay = replay_create(&target, CHECKPOINT_INTERVAL);
+  if (snapshot == NULL || replay == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  replay->paced = true;
+  pthread_create(&thread, NULL, handle_stdin, NULL);
+  while (!__atomic_load_n(&quit, __ATOMIC_ACQUIRE) && replay_step(replay));
   return 0;
 }
\ No newline at end of file
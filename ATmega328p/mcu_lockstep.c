@@ -0,0 +1,41 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "atmega328p.h"
+#include "lockstep.h"
+
+static const Lockstep_engine_t *const engines[] = {
+  &lockstep_reference_engine,
+  &lockstep_fused_engine
+};
+
+static const Lockstep_engine_t *find_engine(const char *name) {
+  for (int i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+    if (strcmp(engines[i]->name, name) == 0) {
+      return engines[i];
+    }
+  }
+  fprintf(stderr, "Unknown engine %s\n", name);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s program.hex [engine a] [engine b] [max instructions] [memory interval]\n", argv[0]);
+    return 2;
+  }
+  const Lockstep_engine_t *a = find_engine(argc > 2 ? argv[2] : "reference");
+  const Lockstep_engine_t *b = find_engine(argc > 3 ? argv[3] : "reference");
+  Lockstep_config_t config = {
+    .max_instructions = argc > 4 ? strtoull(argv[4], NULL, 10) : 1000000,
+    .memory_interval = argc > 5 ? strtoul(argv[5], NULL, 10) : 1000
+  };
+  static Lockstep_report_t report;
+  if (!lockstep_run(mcu_load_ihex, argv[1], a, b, &config, &report)) {
+    fprintf(stderr, "Could not load %s\n", argv[1]);
+    return 2;
+  }
+  lockstep_print_report(stdout, &report, a, b);
+  return report.result == LOCKSTEP_MATCH ? 0 : 1;
+}
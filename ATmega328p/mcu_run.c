@@ -0,0 +1,250 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "atmega328p.h"
+#include "stimulus.h"
+#include "log.h"
+#include "inbox.h"
+
+#define SLICE_CYCLES (1 << 16) // between checks of the budgets and stdin
+#define LOG_SIZE (1 << 16)
+#define UCSR0B_ADDRESS 0xC1
+#define UCSR0B_RXEN0 (1 << 4)
+
+// Exit codes
+#define EXIT_DONE 0 // stopped at BREAK, or used up the budget when not waiting for BREAK
+#define EXIT_TIMEOUT 1 // the budget ran out before BREAK
+#define EXIT_USAGE 2 // bad arguments or files
+#define EXIT_EXCEPTION 3 // the emulator raised an exception
+
+typedef struct {
+  uint64_t max_cycles; // 0 for no limit
+  double max_seconds; // 0 for no limit
+  bool stop_on_break;
+  bool uart; // stdin to RX, TX to stdout
+  const char *stimulus;
+  const char *report; // JSON, - for stdout
+} Options_t;
+
+static ATmega328p_t target;
+static Log_t *messages;
+static Inbox_t *inbox;
+static bool exception;
+static uint64_t uart_sent;
+static uint64_t uart_received;
+
+static void uart_output(byte value) {
+  putchar(value);
+  uart_sent++;
+}
+
+static void on_exception(void) {
+  // The core has already reset the MCU, stopping shows the state right after that
+  exception = true;
+  inbox_stop(inbox);
+}
+
+static double seconds_since(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static bool is_elf(const char *filename) {
+  char magic[4] = {0};
+  FILE *file = fopen(filename, "rb");
+  if (file == NULL) {
+    return false;
+  }
+  size_t read = fread(magic, 1, sizeof(magic), file);
+  fclose(file);
+  return read == sizeof(magic) && memcmp(magic, "\x7F" "ELF", sizeof(magic)) == 0;
+}
+
+static Stimulus_t *open_stimulus(const char *filename) {
+  // Tried as text first, the records are mapped so the converted file can go right away
+  char converted[] = "/tmp/mcu_run_XXXXXX";
+  int file = mkstemp(converted);
+  if (file == -1) {
+    return stimulus_open(filename);
+  }
+  close(file);
+  Stimulus_t *stimulus = stimulus_convert(filename, converted) ? stimulus_open(converted) : stimulus_open(filename);
+  remove(converted);
+  return stimulus;
+}
+
+static void feed_uart(bool *open) {
+  // Only as much as the receive buffer takes, so input is never lost while the firmware is busy
+  if (!*open || !(target.data_memory[UCSR0B_ADDRESS] & UCSR0B_RXEN0)) {
+    return;
+  }
+  struct pollfd input = {STDIN_FILENO, POLLIN, 0};
+  uint32_t space = INBOX_UART_BUFFER - inbox->uart_count;
+  if (space == 0 || poll(&input, 1, 0) != 1) {
+    return;
+  }
+  byte bytes[INBOX_UART_BUFFER];
+  ssize_t count = read(STDIN_FILENO, bytes, space);
+  if (count <= 0) {
+    *open = false;
+    return;
+  }
+  for (ssize_t i = 0; i < count; i++) {
+    inbox_uart(inbox, bytes[i]);
+  }
+  uart_received += count;
+}
+
+static void drain_messages(void) {
+  static char records[LOG_SIZE];
+  uint32_t length = log_read(messages, records, sizeof(records));
+  for (uint32_t i = 0; i < length;) {
+    uint32_t size = (records[i + 1] & 0xFF) | (records[i + 2] & 0xFF) << 8;
+    fprintf(stderr, "%.*s", (int)size, records + i + LOG_RECORD_HEADER);
+    i += LOG_RECORD_HEADER + size;
+  }
+}
+
+static const char *run(const Options_t *options, double *seconds) {
+  // Returns why the run ended
+  struct timespec start;
+  bool input_open = options->uart;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (true) {
+    uint64_t slice = SLICE_CYCLES;
+    if (options->max_cycles > 0) {
+      if (target.cycle_count >= options->max_cycles) {
+        *seconds = seconds_since(&start);
+        return "cycles";
+      }
+      slice = options->max_cycles - target.cycle_count < slice ? options->max_cycles - target.cycle_count : slice;
+    }
+    feed_uart(&input_open);
+    bool running = mcu_run_cycles(slice);
+    drain_messages();
+    *seconds = seconds_since(&start);
+    if (exception) {
+      return "exception";
+    }
+    if (!running && target.stop_reason == STOP_BREAK) {
+      if (options->stop_on_break) {
+        return "break";
+      }
+      mcu_resume();
+    }
+    if (options->max_seconds > 0 && *seconds >= options->max_seconds) {
+      return "time";
+    }
+  }
+}
+
+static bool write_report(const char *filename, const char *program, const char *reason, double seconds) {
+  FILE *file = strcmp(filename, "-") == 0 ? stdout : fopen(filename, "w");
+  if (file == NULL) {
+    return false;
+  }
+  fprintf(file, "{\n  \"program\": \"");
+  for (const char *c = program; *c; c++) {
+    fprintf(file, *c == '"' || *c == '\\' ? "\\%c" : "%c", *c);
+  }
+  fprintf(file, "\",\n  \"stop\": \"%s\",\n", reason);
+  fprintf(file, "  \"cycles\": %llu,\n", (unsigned long long)target.cycle_count);
+  fprintf(file, "  \"seconds\": %.6f,\n", seconds);
+  fprintf(file, "  \"mhz\": %.3f,\n", seconds > 0 ? target.cycle_count / seconds / 1e6 : 0);
+  fprintf(file, "  \"uart_sent\": %llu,\n", (unsigned long long)uart_sent);
+  fprintf(file, "  \"uart_received\": %llu,\n", (unsigned long long)uart_received);
+  fprintf(file, "  \"log_dropped\": %llu,\n", (unsigned long long)log_dropped(messages));
+  fprintf(file, "  \"pc\": %u,\n", (unsigned)(target.pc * WORD_SIZE)); // in bytes like avr-objdump
+  fprintf(file, "  \"sp\": %u,\n", RAM_START + target.sp); // the AVR address, the emulator keeps SP relative to RAM
+  fprintf(file, "  \"SREG\": %u,\n", target.SREG.value);
+  fprintf(file, "  \"registers\": [");
+  for (int i = 0; i < REGISTER_COUNT; i++) {
+    fprintf(file, "%s%u", i ? ", " : "", target.data_memory[i]);
+  }
+  fprintf(file, "],\n  \"data_memory\": \"");
+  for (int i = 0; i < DATA_MEMORY_SIZE; i++) {
+    fprintf(file, "%02x", target.data_memory[i]);
+  }
+  fprintf(file, "\",\n  \"eeprom\": \"");
+  for (int i = 0; i < KB; i++) {
+    fprintf(file, "%02x", target.ROM[i]);
+  }
+  fprintf(file, "\"\n}\n");
+  fflush(file);
+  return file == stdout || fclose(file) == 0;
+}
+
+static int usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-c max cycles] [-t max seconds] [-b] [-u] [-s stimulus] [-j report.json] program.hex|program.elf\n", name);
+  fprintf(stderr, "  -b  stop at the first BREAK instead of stepping over it\n");
+  fprintf(stderr, "  -u  feed stdin to the USART receiver and write what it transmits to stdout\n");
+  fprintf(stderr, "  -s  pin stimulus, binary records or the text format of stimulus_convert\n");
+  fprintf(stderr, "  -j  final state and statistics as JSON, - for stdout\n");
+  fprintf(stderr, "Exits with 0 when done, 1 when the budget ran out before BREAK with -b, 2 on bad input, 3 on emulator exceptions\n");
+  return EXIT_USAGE;
+}
+
+int main(int argc, char **argv) {
+  Options_t options = {0, 0, false, false, NULL, NULL};
+  int option;
+  while ((option = getopt(argc, argv, "c:t:bus:j:")) != -1) {
+    switch (option) {
+      case 'c': options.max_cycles = strtoull(optarg, NULL, 0); break;
+      case 't': options.max_seconds = strtod(optarg, NULL); break;
+      case 'b': options.stop_on_break = true; break;
+      case 'u': options.uart = true; break;
+      case 's': options.stimulus = optarg; break;
+      case 'j': options.report = optarg; break;
+      default: return usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1) {
+    return usage(argv[0]);
+  }
+  const char *program = argv[optind];
+  messages = log_create(LOG_SIZE, LOG_ERROR); // the core does not write to stdout then
+  inbox = inbox_create(INBOX_UART_BUFFER);
+  if (messages == NULL || inbox == NULL) {
+    return EXIT_USAGE;
+  }
+  mcu_select(&target);
+  mcu_set_log(messages);
+  mcu_set_inbox(inbox);
+  mcu_init();
+  if (!(is_elf(program) ? mcu_load_elf(program) : mcu_load_ihex(program))) {
+    fprintf(stderr, "Could not load %s\n", program);
+    return EXIT_USAGE;
+  }
+  Stimulus_t *stimulus = NULL;
+  if (options.stimulus != NULL) {
+    stimulus = open_stimulus(options.stimulus);
+    if (stimulus == NULL) {
+      fprintf(stderr, "Could not read the stimulus %s\n", options.stimulus);
+      return EXIT_USAGE;
+    }
+    mcu_set_stimulus(stimulus);
+  }
+  if (options.uart) {
+    mcu_set_uart_output(uart_output);
+  }
+  mcu_set_exception_handler(on_exception);
+  mcu_set_fusion(true); // the fastest engine, nothing here needs single instructions
+  double seconds = 0;
+  const char *reason = run(&options, &seconds);
+  fflush(stdout);
+  if (options.report != NULL && !write_report(options.report, program, reason, seconds)) {
+    fprintf(stderr, "Could not write %s\n", options.report);
+    return EXIT_USAGE;
+  }
+  mcu_set_stimulus(NULL);
+  stimulus_close(stimulus);
+  if (strcmp(reason, "exception") == 0) {
+    return EXIT_EXCEPTION;
+  }
+  return options.stop_on_break && strcmp(reason, "break") != 0 ? EXIT_TIMEOUT : EXIT_DONE;
+}
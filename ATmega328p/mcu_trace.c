@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "atmega328p.h"
+#include "trace.h"
+
+static ATmega328p_t target;
+
+typedef struct {
+  uint64_t from;
+  uint64_t to;
+  int32_t pc; // in bytes like avr-objdump, -1 for any
+  int32_t address; // data memory, -1 for any
+  const char *kinds; // s(teps) w(rites) i(nterrupts) o(ther)
+} Filter_t;
+
+static int record(const char *program, const char *filename, uint64_t max_cycles) {
+  mcu_select(&target);
+  mcu_init();
+  if (!mcu_load_ihex(program)) {
+    fprintf(stderr, "Could not load %s\n", program);
+    return 2;
+  }
+  if (trace_start(&target, filename, 0) == NULL) {
+    fprintf(stderr, "Could not create %s\n", filename);
+    return 2;
+  }
+  while (target.cycle_count < max_cycles && mcu_step());
+  uint64_t steps = target.host.trace->steps, dropped = target.host.trace->dropped;
+  if (!trace_stop(&target)) {
+    fprintf(stderr, "Could not write %s\n", filename);
+    return 2;
+  }
+  printf("%llu cycles, %llu steps traced, %llu dropped\n",
+    (unsigned long long)target.cycle_count, (unsigned long long)steps, (unsigned long long)dropped);
+  return 0;
+}
+
+static bool matches(const Filter_t *filter, const Trace_record_t *record) {
+  char kind = 'o';
+  if (record->kind == TRACE_STEP || record->kind == TRACE_STEP_LONG || record->kind == TRACE_SKIP) {
+    kind = 's';
+  } else if (record->kind == TRACE_WRITE) {
+    kind = 'w';
+  } else if (record->kind == TRACE_INTERRUPT) {
+    kind = 'i';
+  }
+  return strchr(filter->kinds, kind) != NULL
+    && record->cycle >= filter->from && record->cycle <= filter->to
+    && (filter->pc == -1 || record->pc * WORD_SIZE == (uint32_t)filter->pc)
+    && (filter->address == -1 || (record->kind == TRACE_WRITE && record->address == filter->address));
+}
+
+static void print_record(const Trace_record_t *record) {
+  printf("%12llu  %05x  ", (unsigned long long)record->cycle, (unsigned)(record->pc * WORD_SIZE));
+  switch (record->kind) {
+    case TRACE_STEP:
+      printf("%04x       %u\n", record->opcode, record->cycles);
+      break;
+    case TRACE_STEP_LONG:
+      printf("%08x   %u\n", record->opcode, record->cycles);
+      break;
+    case TRACE_SKIP:
+      printf("skipped    %u\n", record->cycles);
+      break;
+    case TRACE_WRITE:
+      printf("[0x%03x] = 0x%02x\n", record->address, record->value);
+      break;
+    case TRACE_INTERRUPT:
+      printf("interrupt %u\n", record->vector);
+      break;
+    case TRACE_SYNC:
+      printf("sync\n");
+      break;
+    case TRACE_LOST:
+      printf("%llu steps lost\n", (unsigned long long)record->count);
+      break;
+    case TRACE_STOP:
+      printf("stopped (%d)\n", (int)record->reason);
+      break;
+  }
+}
+
+static int show(const char *filename, const Filter_t *filter) {
+  Trace_reader_t *reader = trace_open(filename);
+  if (reader == NULL) {
+    fprintf(stderr, "Could not open %s\n", filename);
+    return 2;
+  }
+  Trace_record_t record;
+  uint64_t shown = 0;
+  while (trace_next(reader, &record)) {
+    if (matches(filter, &record)) {
+      print_record(&record);
+      shown++;
+    }
+  }
+  bool failed = trace_failed(reader);
+  trace_close(reader);
+  if (failed) {
+    fprintf(stderr, "%s is truncated or corrupted\n", filename);
+    return 1;
+  }
+  fprintf(stderr, "%llu records\n", (unsigned long long)shown);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc >= 4 && strcmp(argv[1], "record") == 0) {
+    return record(argv[2], argv[3], argc > 4 ? strtoull(argv[4], NULL, 10) : 10000000);
+  }
+  if (argc >= 3 && strcmp(argv[1], "show") == 0) {
+    Filter_t filter = {0, UINT64_MAX, -1, -1, "swio"};
+    int option;
+    optind = 3;
+    while ((option = getopt(argc, argv, "f:t:p:a:k:")) != -1) {
+      switch (option) {
+        case 'f': filter.from = strtoull(optarg, NULL, 0); break;
+        case 't': filter.to = strtoull(optarg, NULL, 0); break;
+        case 'p': filter.pc = (int32_t)strtol(optarg, NULL, 0); break;
+        case 'a': filter.address = (int32_t)strtol(optarg, NULL, 0); break;
+        case 'k': filter.kinds = optarg; break;
+        default: return 2;
+      }
+    }
+    return show(argv[2], &filter);
+  }
+  fprintf(stderr, "Usage: %s record program.hex trace.bin [max cycles]\n", argv[0]);
+  fprintf(stderr, "       %s show trace.bin [-f from cycle] [-t to cycle] [-p pc] [-a data address] [-k swio]\n", argv[0]);
+  return 2;
+}
@@ -0,0 +1,333 @@
+#include "replay.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+
+#define REPLAY_MAGIC "AVRRPL1"
+
+static bool append_input(Replay_t *replay, Replay_input_t input) {
+  if (replay->input_count == replay->input_capacity) {
+    uint32_t capacity = replay->input_capacity ? replay->input_capacity * 2 : 64;
+    Replay_input_t *inputs = realloc(replay->inputs, capacity * sizeof(Replay_input_t));
+    if (inputs == NULL) {
+      return false;
+    }
+    replay->inputs = inputs;
+    replay->input_capacity = capacity;
+  }
+  replay->inputs[replay->input_count++] = input;
+  return true;
+}
+
+static bool append_checkpoint(Replay_t *replay, Replay_checkpoint_t checkpoint) {
+  if (replay->checkpoint_count == replay->checkpoint_capacity) {
+    uint32_t capacity = replay->checkpoint_capacity ? replay->checkpoint_capacity * 2 : 64;
+    Replay_checkpoint_t *checkpoints = realloc(replay->checkpoints, capacity * sizeof(Replay_checkpoint_t));
+    if (checkpoints == NULL) {
+      return false;
+    }
+    replay->checkpoints = checkpoints;
+    replay->checkpoint_capacity = capacity;
+  }
+  replay->checkpoints[replay->checkpoint_count++] = checkpoint;
+  return true;
+}
+
+static bool take_checkpoint(Replay_t *replay) {
+  mcu_get_copy(replay->scratch);
+  replay->scratch->data_memory_change = -1; // depends on whether the last instruction was paced
+  uLongf size = compressBound(sizeof(ATmega328p_t));
+  byte *data = malloc(size);
+  if (data == NULL) {
+    return false;
+  }
+  if (compress2(data, &size, (const Bytef *)replay->scratch, sizeof(ATmega328p_t), Z_BEST_SPEED) != Z_OK) {
+    free(data);
+    return false;
+  }
+  byte *shrunk = realloc(data, size);
+  Replay_checkpoint_t checkpoint = {
+    replay->cycle, replay->instructions, replay->next_input, (uint32_t)size, shrunk != NULL ? shrunk : data
+  };
+  pthread_mutex_lock(&replay->lock); // the array may move, replay_save reads it from another thread
+  bool appended = append_checkpoint(replay, checkpoint);
+  pthread_mutex_unlock(&replay->lock);
+  if (!appended) {
+    free(checkpoint.data);
+  }
+  return appended;
+}
+
+static bool restore_checkpoint(Replay_t *replay, const Replay_checkpoint_t *checkpoint) {
+  uLongf size = sizeof(ATmega328p_t);
+  if (uncompress((Bytef *)replay->scratch, &size, checkpoint->data, checkpoint->size) != Z_OK || size != sizeof(ATmega328p_t)) {
+    return false;
+  }
+  mcu_restore(replay->scratch);
+  replay->cycle = checkpoint->cycle;
+  replay->instructions = checkpoint->instructions;
+  replay->next_input = checkpoint->next_input;
+  return true;
+}
+
+static void apply_input(const Replay_input_t *input) {
+  if (input->kind == REPLAY_RESUME) {
+    mcu_resume();
+  } else {
+    mcu_send_interrupt(input->vector);
+  }
+}
+
+static void take_queue(Replay_t *replay) {
+  // Live inputs after a seek into the past start a new timeline, the old future is dropped
+  pthread_mutex_lock(&replay->lock);
+  uint32_t queued = __atomic_load_n(&replay->queued, __ATOMIC_ACQUIRE);
+  if (queued > 0 && replay->next_input < replay->input_count) {
+    replay->input_count = replay->next_input;
+    while (replay->checkpoint_count > 1 && replay->checkpoints[replay->checkpoint_count - 1].instructions > replay->instructions) {
+      free(replay->checkpoints[--replay->checkpoint_count].data);
+    }
+  }
+  for (uint32_t i = 0; i < queued; i++) {
+    Replay_input_t input = replay->queue[i];
+    input.cycle = replay->cycle;
+    if (append_input(replay, input)) {
+      apply_input(&input);
+      replay->next_input = replay->input_count;
+    }
+  }
+  __atomic_store_n(&replay->queued, 0, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&replay->lock);
+}
+
+static bool advance(Replay_t *replay, bool live) {
+  // Expects the replayed instance to be selected
+  ATmega328p_t *state = replay->instance;
+  if (replay->cycle >= replay->checkpoints[replay->checkpoint_count - 1].cycle + replay->checkpoint_interval) {
+    take_checkpoint(replay);
+  }
+  while (replay->next_input < replay->input_count && replay->inputs[replay->next_input].cycle <= replay->cycle) {
+    apply_input(replay->inputs + replay->next_input);
+    replay->next_input++;
+  }
+  if (live && __atomic_load_n(&replay->queued, __ATOMIC_ACQUIRE) > 0) {
+    take_queue(replay);
+  }
+  if (state->stopped) {
+    return false;
+  }
+  uint64_t start = state->cycle_count;
+  if (replay->paced) {
+    do {
+      mcu_execute_cycle();
+    } while (state->cycles > 0);
+  } else {
+    mcu_step();
+  }
+  replay->cycle += state->cycle_count - start;
+  replay->instructions++;
+  return !state->stopped;
+}
+
+static void advance_until(Replay_t *replay, uint64_t cycle, uint64_t instructions, bool live) {
+  // Keeps going after BREAK if a recorded resume follows, stops once nothing executes anymore
+  while (replay->cycle < cycle && replay->instructions < instructions) {
+    uint64_t executed = replay->instructions;
+    advance(replay, live);
+    if (replay->instructions == executed) {
+      break;
+    }
+  }
+}
+
+static Replay_t *allocate(ATmega328p_t *instance, uint64_t checkpoint_interval) {
+  if (instance->host.inbox != NULL) {
+    return NULL; // its events would not be recorded
+  }
+  Replay_t *replay = calloc(1, sizeof(Replay_t));
+  if (replay == NULL) {
+    return NULL;
+  }
+  replay->scratch = malloc(sizeof(ATmega328p_t));
+  if (replay->scratch == NULL) {
+    free(replay);
+    return NULL;
+  }
+  replay->instance = instance;
+  replay->checkpoint_interval = checkpoint_interval ? checkpoint_interval : 1;
+  pthread_mutex_init(&replay->lock, NULL);
+  return replay;
+}
+
+Replay_t *replay_create(ATmega328p_t *instance, uint64_t checkpoint_interval) {
+  Replay_t *replay = allocate(instance, checkpoint_interval);
+  if (replay == NULL) {
+    return NULL;
+  }
+  instance->auto_execute = false; // mcu_resume must not start running on its own
+  instance->cycles = 0;
+  mcu_select(instance);
+  bool taken = take_checkpoint(replay);
+  mcu_select(NULL);
+  if (!taken) {
+    replay_destroy(replay);
+    return NULL;
+  }
+  return replay;
+}
+
+void replay_destroy(Replay_t *replay) {
+  if (replay == NULL) {
+    return;
+  }
+  for (uint32_t i = 0; i < replay->checkpoint_count; i++) {
+    free(replay->checkpoints[i].data);
+  }
+  pthread_mutex_destroy(&replay->lock);
+  free(replay->checkpoints);
+  free(replay->inputs);
+  free(replay->scratch);
+  free(replay);
+}
+
+static bool enqueue(Replay_t *replay, Replay_input_kind_t kind, Interrupt_vector_t vector) {
+  pthread_mutex_lock(&replay->lock);
+  uint32_t queued = __atomic_load_n(&replay->queued, __ATOMIC_ACQUIRE);
+  bool fits = queued < REPLAY_QUEUE_SIZE;
+  if (fits) {
+    replay->queue[queued] = (Replay_input_t){0, kind, vector};
+    __atomic_store_n(&replay->queued, queued + 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&replay->lock);
+  return fits;
+}
+
+bool replay_send_interrupt(Replay_t *replay, Interrupt_vector_t vector) {
+  return enqueue(replay, REPLAY_INTERRUPT, vector);
+}
+
+bool replay_resume(Replay_t *replay) {
+  return enqueue(replay, REPLAY_RESUME, 0);
+}
+
+bool replay_step(Replay_t *replay) {
+  mcu_select(replay->instance);
+  bool running = advance(replay, true);
+  mcu_select(NULL);
+  return running;
+}
+
+bool replay_run(Replay_t *replay, uint64_t cycle) {
+  mcu_select(replay->instance);
+  advance_until(replay, cycle, UINT64_MAX, true);
+  mcu_select(NULL);
+  return !replay->instance->stopped;
+}
+
+static uint32_t checkpoint_before(const Replay_t *replay, uint64_t cycle, uint64_t instructions) {
+  // Last checkpoint at or before both positions, checkpoint 0 always qualifies
+  uint32_t low = 0, high = replay->checkpoint_count - 1;
+  while (low < high) {
+    uint32_t middle = (low + high + 1) / 2;
+    const Replay_checkpoint_t *checkpoint = replay->checkpoints + middle;
+    if (checkpoint->cycle <= cycle && checkpoint->instructions <= instructions) {
+      low = middle;
+    } else {
+      high = middle - 1;
+    }
+  }
+  return low;
+}
+
+bool replay_seek(Replay_t *replay, uint64_t cycle) {
+  const Replay_checkpoint_t *checkpoint = replay->checkpoints + checkpoint_before(replay, cycle, UINT64_MAX);
+  mcu_select(replay->instance);
+  bool restored = true;
+  if (cycle < replay->cycle || checkpoint->cycle > replay->cycle) {
+    restored = restore_checkpoint(replay, checkpoint);
+  }
+  if (restored) {
+    advance_until(replay, cycle, UINT64_MAX, false);
+  }
+  mcu_select(NULL);
+  return restored;
+}
+
+bool replay_step_back(Replay_t *replay) {
+  if (replay->instructions == 0) {
+    return false;
+  }
+  uint64_t target = replay->instructions - 1;
+  mcu_select(replay->instance);
+  bool restored = restore_checkpoint(replay, replay->checkpoints + checkpoint_before(replay, UINT64_MAX, target));
+  if (restored) {
+    advance_until(replay, UINT64_MAX, target, false);
+  }
+  mcu_select(NULL);
+  return restored;
+}
+
+bool replay_save(Replay_t *replay, const char *filename) {
+  // Can be called while another thread runs the replay, the lock keeps the arrays in place
+  FILE *file = fopen(filename, "wb");
+  if (file == NULL) {
+    return false;
+  }
+  pthread_mutex_lock(&replay->lock);
+  const Replay_checkpoint_t *start = replay->checkpoints;
+  bool written = fwrite(REPLAY_MAGIC, sizeof(REPLAY_MAGIC), 1, file) == 1;
+  written &= fwrite(&replay->checkpoint_interval, sizeof(uint64_t), 1, file) == 1;
+  written &= fwrite(&replay->input_count, sizeof(uint32_t), 1, file) == 1;
+  for (uint32_t i = 0; i < replay->input_count; i++) {
+    byte kind = replay->inputs[i].kind, vector = replay->inputs[i].vector;
+    written &= fwrite(&replay->inputs[i].cycle, sizeof(uint64_t), 1, file) == 1;
+    written &= fwrite(&kind, 1, 1, file) == 1;
+    written &= fwrite(&vector, 1, 1, file) == 1;
+  }
+  written &= fwrite(&start->size, sizeof(uint32_t), 1, file) == 1;
+  written &= fwrite(start->data, start->size, 1, file) == 1;
+  pthread_mutex_unlock(&replay->lock);
+  return fclose(file) == 0 && written;
+}
+
+Replay_t *replay_load(ATmega328p_t *instance, const char *filename) {
+  FILE *file = fopen(filename, "rb");
+  if (file == NULL) {
+    return NULL;
+  }
+  char magic[sizeof(REPLAY_MAGIC)];
+  uint64_t interval = 0;
+  uint32_t count = 0;
+  bool read = fread(magic, sizeof(magic), 1, file) == 1 && memcmp(magic, REPLAY_MAGIC, sizeof(magic)) == 0;
+  read = read && fread(&interval, sizeof(uint64_t), 1, file) == 1;
+  read = read && fread(&count, sizeof(uint32_t), 1, file) == 1;
+  Replay_t *replay = read ? allocate(instance, interval) : NULL;
+  for (uint32_t i = 0; replay != NULL && read && i < count; i++) {
+    Replay_input_t input = {0};
+    byte kind = 0, vector = 0;
+    read = fread(&input.cycle, sizeof(uint64_t), 1, file) == 1;
+    read = read && fread(&kind, 1, 1, file) == 1 && fread(&vector, 1, 1, file) == 1;
+    input.kind = (Replay_input_kind_t)kind;
+    input.vector = (Interrupt_vector_t)vector;
+    read = read && append_input(replay, input);
+  }
+  Replay_checkpoint_t start = {0};
+  read = read && replay != NULL && fread(&start.size, sizeof(uint32_t), 1, file) == 1;
+  start.data = read ? malloc(start.size) : NULL;
+  read = read && start.data != NULL && fread(start.data, start.size, 1, file) == 1;
+  fclose(file);
+  if (read && append_checkpoint(replay, start)) {
+    mcu_select(instance);
+    read = restore_checkpoint(replay, replay->checkpoints);
+    mcu_select(NULL);
+    instance->auto_execute = false;
+    if (read) {
+      return replay;
+    }
+  } else {
+    free(start.data);
+  }
+  replay_destroy(replay);
+  return NULL;
+}
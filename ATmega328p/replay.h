@@ -0,0 +1,69 @@
+#ifndef __REPLAY_
+#define __REPLAY_
+
+/*
+  Records every external input together with the cycle it took effect at,
+  so a run can be reproduced exactly. Compressed checkpoints of the whole state
+  are taken every few cycles, seeking restores the closest one and replays from there.
+  Inputs have to go through the replay: an instance with an inbox is refused, and one
+  must not be attached while the replay owns the instance
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "atmega328p.h"
+
+#define REPLAY_QUEUE_SIZE 64
+
+typedef enum {
+  REPLAY_INTERRUPT = 0,
+  REPLAY_RESUME // continue after BREAK
+} Replay_input_kind_t;
+
+typedef struct {
+  uint64_t cycle; // applied right before the instruction starting at this cycle
+  Replay_input_kind_t kind;
+  Interrupt_vector_t vector;
+} Replay_input_t;
+
+typedef struct {
+  uint64_t cycle;
+  uint64_t instructions;
+  uint32_t next_input; // first input that was not applied yet
+  uint32_t size;
+  byte *data; // zlib compressed ATmega328p_t
+} Replay_checkpoint_t;
+
+typedef struct {
+  ATmega328p_t *instance;
+  ATmega328p_t *scratch; // state being compressed or restored
+  uint64_t cycle;
+  uint64_t instructions;
+  uint64_t checkpoint_interval; // in cycles
+  bool paced; // runs at the clock speed through mcu_execute_cycle
+  Replay_input_t *inputs;
+  uint32_t input_count;
+  uint32_t input_capacity;
+  uint32_t next_input;
+  Replay_checkpoint_t *checkpoints;
+  uint32_t checkpoint_count;
+  uint32_t checkpoint_capacity;
+  pthread_mutex_t lock; // guards the queue and the growth of inputs and checkpoints, other threads send inputs and save
+  Replay_input_t queue[REPLAY_QUEUE_SIZE];
+  uint32_t queued; // atomic
+} Replay_t;
+
+Replay_t *replay_create(ATmega328p_t *instance, uint64_t checkpoint_interval); // instance has the firmware loaded
+void replay_destroy(Replay_t *replay);
+bool replay_send_interrupt(Replay_t *replay, Interrupt_vector_t vector); // false if the queue is full
+bool replay_resume(Replay_t *replay);
+bool replay_step(Replay_t *replay); // false while the MCU is stopped
+bool replay_run(Replay_t *replay, uint64_t cycle); // runs until the cycle is reached or the MCU stops
+bool replay_seek(Replay_t *replay, uint64_t cycle); // goes to the first instruction starting at or after the cycle
+bool replay_step_back(Replay_t *replay);
+bool replay_save(Replay_t *replay, const char *filename); // from any thread
+Replay_t *replay_load(ATmega328p_t *instance, const char *filename);
+
+#endif // __REPLAY_
@@ -0,0 +1,37 @@
+#include "snapshot.h"
+#include <stdlib.h>
+
+Snapshot_t *snapshot_create(uint64_t interval) {
+  if (interval == 0) {
+    return NULL;
+  }
+  Snapshot_t *snapshot = aligned_alloc(64, sizeof(Snapshot_t)); // a multiple of 64 through the slots
+  if (snapshot != NULL) {
+    memset(snapshot, 0, sizeof(Snapshot_t));
+    snapshot->interval = interval;
+  }
+  return snapshot;
+}
+
+bool snapshot_read(Snapshot_t *snapshot, Snapshot_state_t *state) {
+  // Any number of readers, none of them is ever waited for
+  if (__atomic_load_n(&snapshot->published, __ATOMIC_ACQUIRE) == 0) {
+    return false;
+  }
+  while (true) {
+    const Snapshot_slot_t *slot = snapshot->slots + __atomic_load_n(&snapshot->latest, __ATOMIC_ACQUIRE);
+    uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    if (sequence & 1) {
+      continue;
+    }
+    memcpy(state, &slot->state, sizeof(Snapshot_state_t));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == sequence) {
+      return true;
+    }
+  }
+}
+
+void snapshot_destroy(Snapshot_t *snapshot) {
+  free(snapshot);
+}
@@ -0,0 +1,55 @@
+#ifndef __SNAPSHOT_
+#define __SNAPSHOT_
+
+/*
+  State published by the emulator for other threads. Every interval cycles the emulator
+  copies the status and memories into one of three slots under a seqlock and never waits,
+  readers copy the newest slot and retry in the rare case it was rewritten meanwhile.
+  The slot written next is never the newest one, so a reader has two publications of time
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "atmega328p.h"
+
+#define SNAPSHOT_SLOTS 3
+
+typedef struct {
+  Mcu_status_t status;
+  byte data_memory[DATA_MEMORY_SIZE];
+  byte eeprom[KB];
+} Snapshot_state_t;
+
+typedef struct {
+  uint64_t sequence; // odd while the emulator writes the slot
+  Snapshot_state_t state;
+} __attribute__((aligned(64))) Snapshot_slot_t;
+
+typedef struct Snapshot_t {
+  uint64_t interval; // cycles between publications
+  uint32_t latest; // slot of the newest publication
+  uint64_t published; // publications so far, 0 while there is nothing to read
+  Snapshot_slot_t slots[SNAPSHOT_SLOTS];
+} Snapshot_t;
+
+static inline void snapshot_write(Snapshot_t *snapshot, const Mcu_status_t *status, const byte *data_memory, const byte *eeprom) {
+  uint32_t index = (snapshot->latest + 1) % SNAPSHOT_SLOTS;
+  Snapshot_slot_t *slot = snapshot->slots + index;
+  uint64_t sequence = slot->sequence;
+  __atomic_store_n(&slot->sequence, sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  slot->state.status = *status;
+  memcpy(slot->state.data_memory, data_memory, DATA_MEMORY_SIZE);
+  memcpy(slot->state.eeprom, eeprom, KB);
+  __atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+  __atomic_store_n(&snapshot->latest, index, __ATOMIC_RELEASE);
+  __atomic_store_n(&snapshot->published, snapshot->published + 1, __ATOMIC_RELEASE);
+}
+
+Snapshot_t *snapshot_create(uint64_t interval); // interval in cycles, at least 1
+bool snapshot_read(Snapshot_t *snapshot, Snapshot_state_t *state); // newest consistent state, false before the first publication
+void snapshot_destroy(Snapshot_t *snapshot); // detach it first
+
+#endif // __SNAPSHOT_
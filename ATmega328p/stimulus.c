@@ -0,0 +1,102 @@
+#include "stimulus.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define LINE_LENGTH 256
+
+Stimulus_t *stimulus_open(const char *filename) {
+  int file = open(filename, O_RDONLY);
+  if (file == -1) {
+    return NULL;
+  }
+  struct stat info;
+  Stimulus_t *stimulus = calloc(1, sizeof(Stimulus_t));
+  if (stimulus == NULL || fstat(file, &info) != 0 || info.st_size % sizeof(Stimulus_record_t) != 0) {
+    close(file);
+    free(stimulus);
+    return NULL;
+  }
+  stimulus->count = info.st_size / sizeof(Stimulus_record_t);
+  stimulus->size = info.st_size;
+  if (stimulus->count > 0) {
+    void *records = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    if (records == MAP_FAILED) {
+      close(file);
+      free(stimulus);
+      return NULL;
+    }
+    madvise(records, info.st_size, MADV_SEQUENTIAL);
+    stimulus->records = records;
+  }
+  close(file);
+  for (uint64_t i = 1; i < stimulus->count; i++) {
+    if (stimulus->records[i].cycle < stimulus->records[i - 1].cycle) {
+      stimulus_close(stimulus); // the scheduler relies on the order
+      return NULL;
+    }
+  }
+  return stimulus;
+}
+
+void stimulus_close(Stimulus_t *stimulus) {
+  if (stimulus == NULL) {
+    return;
+  }
+  if (stimulus->records != NULL) {
+    munmap((void *)stimulus->records, stimulus->size);
+  }
+  free(stimulus);
+}
+
+static bool parse_line(const char *line, Stimulus_record_t *record) {
+  unsigned long long cycle;
+  char port, level;
+  int bit;
+  if (sscanf(line, "%llu P%c%d %c", &cycle, &port, &bit, &level) != 4) {
+    return false;
+  }
+  if (port < 'B' || port > 'D' || bit < 0 || bit > 7 || strchr("01zZ", level) == NULL) {
+    return false;
+  }
+  memset(record, 0, sizeof(*record));
+  record->cycle = cycle;
+  record->pin = (port - 'B') * 8 + bit;
+  record->level = level == '0' ? STIMULUS_LOW : level == '1' ? STIMULUS_HIGH : STIMULUS_RELEASE;
+  return true;
+}
+
+bool stimulus_convert(const char *text, const char *filename) {
+  // Empty lines and lines starting with # are skipped, cycles have to be in order
+  FILE *input = fopen(text, "r");
+  if (input == NULL) {
+    return false;
+  }
+  FILE *output = fopen(filename, "wb");
+  if (output == NULL) {
+    fclose(input);
+    return false;
+  }
+  char line[LINE_LENGTH];
+  uint64_t last = 0;
+  bool converted = true;
+  while (converted && fgets(line, sizeof(line), input) != NULL) {
+    Stimulus_record_t record;
+    if (line[strspn(line, " \t\r\n")] == '\0' || line[0] == '#') {
+      continue;
+    }
+    converted = parse_line(line, &record) && record.cycle >= last;
+    converted = converted && fwrite(&record, sizeof(record), 1, output) == 1;
+    last = record.cycle;
+  }
+  fclose(input);
+  converted &= fclose(output) == 0;
+  if (!converted) {
+    remove(filename);
+  }
+  return converted;
+}
@@ -0,0 +1,20 @@
+#ifndef __STIMULUS_
+#define __STIMULUS_
+
+/*
+  External pin stimulus. A stimulus file is an array of Stimulus_record_t sorted by cycle,
+  it is memory mapped and consumed by the event scheduler through mcu_set_stimulus.
+  Text files with one "cycle pin level" transition per line, like "1600 PD2 0",
+  can be converted with stimulus_convert, the level is 0, 1 or z to release the pin
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "atmega328p.h"
+
+Stimulus_t *stimulus_open(const char *filename);
+void stimulus_close(Stimulus_t *stimulus); // detach it from every instance first
+bool stimulus_convert(const char *text, const char *filename);
+
+#endif // __STIMULUS_
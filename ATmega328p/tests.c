@@ -1,6 +1,23 @@
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "atmega328p.h"
+#include "lockstep.h"
+#include "batch.h"
+#include "farm.h"
+#include "replay.h"
+#include "gdb_stub.h"
+#include "trace.h"
+#include "coverage.h"
+#include "adc.h"
+#include "vcd.h"
+#include "stimulus.h"
+#include "bus.h"
+#include "log.h"
+#include "snapshot.h"
+#include "inbox.h"
 #include "tests.h"
 
 void handler(void) {
@@ -16,6 +33,102 @@ static void execute(const char *code) {
   mcu_run();
 }
 
+static void interrupted_prepare(void) {
+  mcu_send_interrupt(INT0_vect);
+}
+
+static uint32_t exceptions;
+
+static void count_exception(void) {
+  exceptions++;
+}
+
+static const Lockstep_engine_t interrupted_engine = {.name = "interrupted", .prepare = interrupted_prepare, .step = mcu_step, .fused = false};
+
+static void farm_test_callback(const ATmega328p_t *state, const Farm_result_t *result, void *user) {
+  *(Farm_result_t *)user = *result;
+}
+
+static Snapshot_t *test_snapshot;
+static volatile bool snapshot_done;
+
+static void *snapshot_reader(void *arg) {
+  // R17 follows R16 one instruction later, a torn state breaks that
+  Snapshot_state_t state; // one per reader
+  uint64_t *reads = arg;
+  uint64_t last = 0;
+  while (!snapshot_done) {
+    assert(snapshot_read(test_snapshot, &state));
+    byte r16 = state.data_memory[16], r17 = state.data_memory[17];
+    assert(r17 == r16 || r17 == (byte)(r16 - 1));
+    assert(state.status.cycle_count >= last);
+    last = state.status.cycle_count;
+    (*reads)++;
+  }
+  return NULL;
+}
+
+#define INBOX_TEST_EVENTS 100000
+
+static Inbox_t *test_inbox;
+
+static void *inbox_producer(void *arg) {
+  // Each producer numbers its events, the pin tells the producers apart
+  byte producer = (byte)(intptr_t)arg;
+  for (uint32_t i = 0; i < INBOX_TEST_EVENTS; i++) {
+    while (!inbox_pin(test_inbox, producer, (byte)i)) {
+      sched_yield(); // full, the consumer may share the core
+    }
+  }
+  return NULL;
+}
+
+static byte uart_sent[16];
+static uint32_t uart_sent_count;
+
+static void uart_collect(byte value) {
+  uart_sent[uart_sent_count++ % sizeof(uart_sent)] = value;
+}
+
+static void put_little_endian(byte *bytes, uint32_t value, byte size) {
+  for (byte i = 0; i < size; i++) {
+    bytes[i] = value >> (i * 8);
+  }
+}
+
+static bool write_elf(const char *filename, const byte *flash, uint32_t flash_size, const byte *eeprom, uint32_t eeprom_size) {
+  // Segments for flash, .data that is skipped as it has a RAM address, and EEPROM
+  const uint32_t addresses[] = {0, 0x800100, 0x810000};
+  const byte *contents[] = {flash, flash, eeprom};
+  const uint32_t sizes[] = {flash_size, 2, eeprom_size};
+  byte header[52 + 3 * 32] = {0x7F, 'E', 'L', 'F', 1, 1, 1};
+  uint32_t offset = sizeof(header);
+  put_little_endian(header + 16, 2, 2); // executable
+  put_little_endian(header + 18, 83, 2); // AVR
+  put_little_endian(header + 28, 52, 4);
+  put_little_endian(header + 42, 32, 2);
+  put_little_endian(header + 44, 3, 2);
+  for (int i = 0; i < 3; i++) {
+    byte *segment = header + 52 + i * 32;
+    put_little_endian(segment, 1, 4); // PT_LOAD
+    put_little_endian(segment + 4, offset, 4);
+    put_little_endian(segment + 8, addresses[i], 4);
+    put_little_endian(segment + 12, addresses[i], 4);
+    put_little_endian(segment + 16, sizes[i], 4);
+    put_little_endian(segment + 20, sizes[i], 4);
+    offset += sizes[i];
+  }
+  FILE *file = fopen(filename, "wb");
+  if (file == NULL) {
+    return false;
+  }
+  bool written = fwrite(header, 1, sizeof(header), file) == sizeof(header);
+  for (int i = 0; i < 3; i++) {
+    written &= fwrite(contents[i], 1, sizes[i], file) == sizes[i];
+  }
+  return (fclose(file) == 0) & written;
+}
+
 int main(void) {
   ATmega328p_t mcu;
   run_test("LDI",
@@ -535,6 +648,883 @@ int main(void) {
     mcu_get_copy(&mcu);
     assert(mcu.R[16] == 5);
   )
+  run_test("Lockstep",
+    static Lockstep_report_t report;
+    const char *code =
+      "LDI R20, 5\n"
+      "LDI R21, 10\n"
+      "loop: ADD R20, R21\n"
+      "PUSH R20\n"
+      "DEC R21\n"
+      "BRNE loop\n"
+      "BREAK";
+    Lockstep_config_t config = {.memory_interval = 3};
+    assert(lockstep_run(mcu_load_asm, code, &lockstep_reference_engine, &lockstep_reference_engine, &config, &report));
+    assert(report.result == LOCKSTEP_MATCH);
+    assert(report.instructions == 43); // including BREAK
+    assert(lockstep_run(mcu_load_asm, code, &lockstep_reference_engine, &interrupted_engine, &config, &report));
+    assert(report.result == LOCKSTEP_REGISTERS);
+    assert(report.instruction == 1);
+    assert(report.a.pc == 1);
+    assert(report.b.pc == INT0_vect * 2 + 1);
+  )
+  run_test("Fusion",
+    static Lockstep_report_t report;
+    const char *code =
+      "LDI R24, 0x00\n"
+      "LDI R25, 0x01\n"
+      "LDI R16, 0\n"
+      "LDI R17, 0\n"
+      "loop: PUSH R16\n"
+      "PUSH R17\n"
+      "SUBI R16, 0xFF\n"
+      "SBCI R17, 0xFF\n"
+      "POP R19\n"
+      "POP R18\n"
+      "CPI R16, 0x40\n"
+      "CPC R17, R1\n"
+      "BRNE next\n"
+      "LDI R20, 1\n"
+      "next: CP R18, R16\n"
+      "BREQ loop\n"
+      "SBIW R24, 1\n"
+      "BRNE loop\n"
+      "BREAK";
+    Lockstep_config_t config = {.memory_interval = 1};
+    assert(lockstep_run(mcu_load_asm, code, &lockstep_reference_engine, &lockstep_fused_engine, &config, &report));
+    assert(report.result == LOCKSTEP_MATCH);
+    assert(report.a.cycle_count == report.b.cycle_count);
+    const char *interrupted =
+      "RJMP main\n"
+      ".ORG 0x002A\n" // ADC_vect
+      "INC R20\n"
+      "STS 0x7A, R21\n"
+      "RETI\n"
+      "main: LDI R21, 0xC9\n" // ADEN | ADSC | ADIE, clock / 2, conversions end mid-group
+      "STS 0x7A, R21\n"
+      "SEI\n"
+      "loop: PUSH R16\n"
+      "PUSH R17\n"
+      "POP R17\n"
+      "POP R16\n"
+      "LDI R18, 1\n"
+      "LDI R19, 2\n"
+      "CPI R20, 40\n"
+      "BRNE loop\n"
+      "BREAK";
+    assert(lockstep_run(mcu_load_asm, interrupted, &lockstep_reference_engine, &lockstep_fused_engine, &config, &report));
+    assert(report.result == LOCKSTEP_MATCH);
+    assert(report.a.R[20] == 40);
+    const char *watchdog =
+      "RJMP main\n"
+      ".ORG 0x000C\n" // WDT_vect
+      "INC R20\n"
+      "RETI\n"
+      "main: LDI R16, 0x18\n" // WDCE | WDE
+      "STS 0x60, R16\n"
+      "LDI R16, 0x40\n" // WDIE, 16 ms
+      "STS 0x60, R16\n"
+      "SEI\n"
+      "loop: LDI R18, 1\n"
+      "LDI R19, 2\n"
+      "PUSH R18\n"
+      "PUSH R19\n"
+      "POP R19\n"
+      "POP R18\n"
+      "CPI R20, 2\n"
+      "BRNE loop\n"
+      "BREAK";
+    config.memory_interval = 64;
+    assert(lockstep_run(mcu_load_asm, watchdog, &lockstep_reference_engine, &lockstep_fused_engine, &config, &report));
+    assert(report.result == LOCKSTEP_MATCH);
+    assert(report.a.R[20] == 2 && report.a.cycle_count == report.b.cycle_count);
+    mcu_init();
+    assert(mcu_load_asm("LDI R30, 0xFF\nLDI R31, 0xFF\nIJMP")); // to the end of the address space
+    mcu_set_fusion(true);
+    mcu_set_exception_handler(count_exception);
+    for (int i = 0; i < 4; i++) {
+      mcu_step();
+    }
+    assert(exceptions == 1); // out of memory bounds, like without fusion
+    mcu_set_exception_handler(NULL);
+    mcu_set_fusion(false);
+    FILE *file = fopen("./tmp/_t.hex", "w");
+    assert(file != NULL);
+    fprintf(file, ":06000000EFEFFFEF099491\n:00000001FF\n"); // the same program
+    fclose(file);
+    int status = system("./mcu_run -c 1000 ./tmp/_t.hex 2> /dev/null"); // runs fused, the group table ends before the jump target
+    remove("./tmp/_t.hex");
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 3);
+  )
+  run_test("Batch",
+    const char *code =
+      "LDS R16, 0x100\n"
+      "LDI R17, 0\n"
+      "LDI R18, 20\n"
+      "loop: ADD R17, R16\n"
+      "SBRC R17, 0\n"
+      "INC R17\n"
+      "DEC R18\n"
+      "BRNE loop\n"
+      "BREAK";
+    Batch_t *vector = batch_create(40, mcu_load_asm, code);
+    Batch_t *scalar = batch_create(40, mcu_load_asm, code);
+    assert(vector != NULL && scalar != NULL);
+    scalar->vectorize = false;
+    for (uint32_t lane = 0; lane < 40; lane++) {
+      batch_write(vector, lane, 0x100, lane * 7);
+      batch_write(scalar, lane, 0x100, lane * 7);
+    }
+    assert(batch_run(vector, 1000) == batch_run(scalar, 1000));
+    assert(vector->vector_instructions > 0);
+    assert(scalar->vector_instructions == 0);
+    ATmega328p_t other;
+    for (uint32_t lane = 0; lane < 40; lane++) {
+      batch_get_copy(vector, lane, &mcu);
+      batch_get_copy(scalar, lane, &other);
+      assert(mcu.stopped);
+      assert(mcu.R[17] == other.R[17]);
+      assert(mcu.SREG.value == other.SREG.value);
+      assert(mcu.pc == other.pc);
+    }
+    batch_destroy(vector);
+    batch_destroy(scalar);
+  )
+  run_test("Farm",
+    const char *code =
+      "LDI R16, 0\n"
+      "loop: INC R16\n"
+      "CPI R16, 100\n"
+      "BRNE loop\n"
+      "BREAK";
+    byte *image = farm_load_image(mcu_load_asm, code);
+    assert(image != NULL);
+    Farm_t *farm = farm_create(4);
+    assert(farm != NULL && farm_threads(farm) == 4);
+    Farm_result_t results[16];
+    for (uint32_t i = 0; i < 16; i++) {
+      // half of the jobs run out of cycles before the loop ends
+      assert(farm_submit(farm, image, NULL, 0, i % 2 ? 1000 : 50, farm_test_callback, results + i));
+    }
+    farm_wait(farm);
+    for (uint32_t i = 0; i < 16; i++) {
+      assert(results[i].stopped == (i % 2));
+      assert(i % 2 ? results[i].instructions == 301 : results[i].cycles >= 50);
+    }
+    farm_destroy(farm);
+    free(image);
+  )
+  run_test("Replay",
+    const char *code =
+      "RJMP main\n"
+      ".ORG 0x0002\n"
+      "INC R20\n"
+      "RETI\n"
+      "main: SEI\n"
+      "loop: INC R16\n"
+      "ADD R17, R16\n"
+      "PUSH R17\n"
+      "POP R18\n"
+      "RJMP loop";
+    static ATmega328p_t target;
+    static ATmega328p_t other;
+    mcu_select(&target);
+    mcu_init();
+    assert(mcu_load_asm(code));
+    mcu_select(NULL);
+    Replay_t *replay = replay_create(&target, 500);
+    assert(replay != NULL);
+    for (int i = 0; i < 2000; i++) {
+      if (i % 300 == 7) {
+        assert(replay_send_interrupt(replay, INT0_vect));
+      }
+      replay_step(replay);
+    }
+    uint64_t end = replay->cycle;
+    mcu_select(&target);
+    mcu_get_copy(&mcu);
+    mcu_select(NULL);
+    assert(mcu.R[20] == 7);
+    assert(replay->checkpoint_count > 1);
+    assert(replay_step_back(replay));
+    assert(replay->instructions == 1999);
+    assert(replay_seek(replay, 100));
+    assert(replay_seek(replay, end));
+    assert(memcmp(target.data_memory, mcu.data_memory, DATA_MEMORY_SIZE) == 0);
+    assert(target.pc == mcu.pc);
+    assert(replay_save(replay, "./tmp/_t.replay"));
+    Replay_t *loaded = replay_load(&other, "./tmp/_t.replay");
+    remove("./tmp/_t.replay");
+    assert(loaded != NULL);
+    replay_run(loaded, end);
+    assert(memcmp(other.data_memory, mcu.data_memory, DATA_MEMORY_SIZE) == 0);
+    replay_destroy(loaded);
+    replay_destroy(replay);
+  )
+  run_test("Cycle counter",
+    const char *code =
+      "LDI R16, 1\n" // 1
+      "CPI R16, 1\n" // 1
+      "BRNE end\n" // 1, not taken
+      "BREQ next\n" // 2, taken
+      "next: SBRC R16, 1\n" // 1, skips
+      "LDS R17, 0x100\n" // 2, skipped 2-word instruction
+      "CPSE R16, R17\n" // 1, no skip
+      "RJMP end\n" // 2
+      "end: SLEEP\n" // 1
+      "BREAK";
+    mcu_init();
+    assert(mcu_load_asm(code));
+    for (int i = 0; i < 9; i++) {
+      assert(mcu_step());
+    }
+    mcu_get_copy(&mcu);
+    assert(mcu.cycle_count == 12);
+    assert(mcu_step()); // sleeping
+    mcu_send_interrupt(INT0_vect);
+    mcu_step(); // entry, wake-up and the instruction at the vector
+    mcu_get_copy(&mcu);
+    assert(mcu.cycle_count == 13 + 4 + 4 + mcu.instruction->cycles);
+    assert(!mcu.SREG.flags.I);
+  )
+  run_test("Watchdog",
+    const char *code =
+      "RJMP main\n"
+      "NOP\n" "NOP\n" "NOP\n" "NOP\n" "NOP\n" "NOP\n" "NOP\n" "NOP\n" "NOP\n" "NOP\n" "NOP\n"
+      "INC R20\n" // WDT_vect
+      "RETI\n"
+      "main: LDS R17, 0x54\n"
+      "SBRC R17, 3\n" // WDRF
+      "BREAK\n"
+      "LDI R16, 0x18\n" // WDCE | WDE
+      "STS 0x60, R16\n"
+      "LDI R16, 0x40\n" // WDIE, 16 ms
+      "STS 0x60, R16\n"
+      "SEI\n"
+      "loop: SLEEP\n"
+      "CPI R20, 3\n"
+      "BRNE loop\n"
+      "LDI R16, 0x08\n" // WDE can be set without the timed sequence, reset mode
+      "STS 0x60, R16\n"
+      "wait: SLEEP\n"
+      "RJMP wait";
+    const uint64_t period = 2048 * CPU_FREQUENCY / 128000;
+    mcu_init();
+    assert(mcu_load_asm(code));
+    uint32_t steps = 0;
+    while (mcu_step()) {
+      steps++;
+    }
+    mcu_get_copy(&mcu);
+    assert(steps < 100); // each sleep lasts until the next timeout
+    assert(mcu.cycle_count >= 4 * period && mcu.cycle_count < 4 * period + 64);
+    assert(mcu.SR.flags.WDRF && (mcu.R[17] & 0x08));
+    assert(mcu.R[20] == 0); // cleared by the reset
+    assert(mcu.data_memory[0x60] == 0x08);
+    assert(mcu.data_memory[0xC0] == 0x20); // UDRE0, the transmitter is ready again
+  )
+  run_test("ADC",
+    const char *code =
+      "LDI R16, 0x40\n" // AVcc reference, ADC0
+      "STS 0x7C, R16\n"
+      "LDI R16, 0xC7\n" // ADEN | ADSC, clock / 128
+      "STS 0x7A, R16\n"
+      "wait: LDS R16, 0x7A\n"
+      "SBRC R16, 6\n" // ADSC
+      "RJMP wait\n"
+      "LDS R18, 0x78\n"
+      "LDS R19, 0x79\n"
+      "BREAK";
+    int16_t samples[1024];
+    for (int i = 0; i < 1024; i++) {
+      samples[i] = i;
+    }
+    FILE *file = fopen("./tmp/_t.adc", "wb");
+    assert(file != NULL && fwrite(samples, sizeof(samples), 1, file) == 1);
+    fclose(file);
+    Adc_input_t *input = adc_create();
+    assert(adc_map(input, 0, "./tmp/_t.adc", ADC_INT16, 1000000));
+    remove("./tmp/_t.adc"); // stays mapped
+    static ATmega328p_t target;
+    mcu_select(&target);
+    mcu_init();
+    assert(mcu_load_asm(code));
+    adc_attach(&target, input);
+    while (mcu_step());
+    adc_attach(&target, NULL);
+    adc_destroy(input);
+    assert(((target.R[19] << 8) | target.R[18]) == (4 + 13 * 128 + 64) / 16); // held 13.5 ADC clocks after the start
+    assert(target.cycle_count >= 4 + 25 * 128 && target.cycle_count < 4 + 25 * 128 + 16);
+    assert(target.data_memory[0x7A] & 0x10); // ADIF
+  )
+  run_test("VCD",
+    const char *code =
+      "LDI R16, 0x20\n"
+      "OUT 0x04, R16\n" // DDRB5
+      "LDI R17, 3\n"
+      "loop: SBI 0x05, 5\n"
+      "CBI 0x05, 5\n"
+      "OUT 0x05, R1\n" // no change, not logged
+      "DEC R17\n"
+      "BRNE loop\n"
+      "LDI R16, 0x68\n"
+      "STS 0xC6, R16\n"
+      "STS 0xC6, R16\n"
+      "BREAK";
+    static ATmega328p_t target;
+    char line[64];
+    mcu_select(&target);
+    mcu_init();
+    assert(mcu_load_asm(code));
+    assert(vcd_start(&target, "./tmp/_t.vcd", VCD_PORT_B | VCD_UART_TX) != NULL);
+    while (mcu_step());
+    assert(vcd_stop(&target));
+    FILE *file = fopen("./tmp/_t.vcd", "r");
+    assert(file != NULL);
+    uint32_t definitions = 0;
+    uint32_t rising = 0;
+    uint32_t falling = 0;
+    uint32_t bytes = 0;
+    bool dumped = false;
+    while (fgets(line, sizeof(line), file) != NULL) {
+      definitions += strncmp(line, "$var", 4) == 0;
+      dumped |= strcmp(line, "$end\n") == 0;
+      rising += dumped && strcmp(line, "16\n") == 0; // PORTB5, '!' + 2 * 8 + 5
+      falling += dumped && strcmp(line, "06\n") == 0;
+      bytes += dumped && strcmp(line, "b01101000 i\n") == 0;
+    }
+    fclose(file);
+    remove("./tmp/_t.vcd");
+    assert(definitions == 3 * 8 + 2);
+    assert(rising == 3 && falling == 3);
+    assert(bytes == 2); // every UDR0 write
+  )
+  run_test("Pin stimulus",
+    const char *code =
+      "RJMP main\n"
+      "NOP\n"
+      "RJMP int0\n" // INT0_vect
+      "NOP\n"
+      "NOP\n"
+      "NOP\n"
+      "RJMP pcint0\n" // PCINT0_vect
+      "NOP\n"
+      "int0: INC R20\n"
+      "IN R21, 0x09\n" // PIND
+      "RETI\n"
+      "pcint0: INC R22\n"
+      "RETI\n"
+      "main: LDI R16, 0x02\n" // INT0 on the falling edge
+      "STS 0x69, R16\n"
+      "LDI R16, 0x01\n"
+      "OUT 0x1D, R16\n" // EIMSK
+      "STS 0x68, R16\n" // PCICR, port B
+      "STS 0x6B, R16\n" // PCMSK0, PB0
+      "SEI\n"
+      "loop: SLEEP\n"
+      "CPI R22, 1\n"
+      "BRNE loop\n"
+      "BREAK";
+    FILE *file = fopen("./tmp/_t.txt", "w");
+    assert(file != NULL);
+    fprintf(file, "# cycle pin level\n100 PD2 1\n200 PD2 0\n300 PD2 1\n300 PD2 0\n400 PD2 z\n1000 PB0 1\n");
+    fclose(file);
+    assert(stimulus_convert("./tmp/_t.txt", "./tmp/_t.stim"));
+    Stimulus_t *stimulus = stimulus_open("./tmp/_t.stim");
+    remove("./tmp/_t.txt");
+    remove("./tmp/_t.stim");
+    assert(stimulus != NULL && stimulus->count == 6);
+    static ATmega328p_t target;
+    mcu_select(&target);
+    mcu_init();
+    assert(mcu_load_asm(code));
+    mcu_set_stimulus(stimulus);
+    uint32_t steps = 0;
+    while (mcu_step()) {
+      steps++;
+    }
+    mcu_set_stimulus(NULL);
+    stimulus_close(stimulus);
+    assert(steps < 100); // sleeping until each transition
+    assert(target.R[20] == 2); // both falling edges, even within one step
+    assert(!(target.R[21] & 0x04));
+    assert(target.R[22] == 1);
+    assert(target.cycle_count >= 1000 && target.cycle_count < 1020);
+    assert(target.data_memory[0x23] == 0x01); // PINB
+    const char *single_bits =
+      "LDI R16, 0x0F\n"
+      "OUT 0x05, R16\n" // PORTB
+      "SBI 0x03, 4\n" // PINB, toggles PB4 only
+      "CBI 0x03, 0\n" // no effect
+      "SBI 0x1C, 0\n" // EIFR, clears INTF0 only
+      "BREAK";
+    mcu_init();
+    assert(mcu_load_asm(single_bits));
+    target.data_memory[0x3C] = 0x03; // INTF1 and INTF0 pending, INT0 and INT1 masked
+    while (mcu_step());
+    assert(target.data_memory[0x25] == 0x1F);
+    assert(target.data_memory[0x3C] == 0x02);
+  )
+  run_test("SPI and TWI",
+    const char *code =
+      "LDI R16, 0x2C\n"
+      "OUT 0x04, R16\n" // DDRB, SS, MOSI and SCK are outputs
+      "SBI 0x05, 2\n" // flash not selected
+      "LDI R16, 0x50\n" // SPE, MSTR, clock / 4
+      "OUT 0x2C, R16\n"
+      "CBI 0x05, 2\n"
+      "LDI R16, 0x9F\n" // read ID
+      "RCALL spi\n"
+      "RCALL spi\n"
+      "MOV R20, R16\n"
+      "RCALL spi\n"
+      "MOV R21, R16\n"
+      "SBI 0x05, 2\n"
+      "CBI 0x05, 2\n"
+      "LDI R16, 0x06\n" // write enable
+      "RCALL spi\n"
+      "SBI 0x05, 2\n"
+      "CBI 0x05, 2\n"
+      "LDI R16, 0x02\n" // program 0xA5 at 0x10
+      "RCALL spi\n"
+      "LDI R16, 0\n"
+      "RCALL spi\n"
+      "LDI R16, 0\n"
+      "RCALL spi\n"
+      "LDI R16, 0x10\n"
+      "RCALL spi\n"
+      "LDI R16, 0xA5\n"
+      "RCALL spi\n"
+      "SBI 0x05, 2\n"
+      "LDI R26, 0x00\n"
+      "LDI R27, 0x02\n" // TWI status codes go to 0x200
+      "LDI R16, 72\n" // 100 kHz
+      "STS 0xB8, R16\n"
+      "LDI R16, 0xA4\n" // START
+      "RCALL twi\n"
+      "LDI R19, 0xA0\n" // EEPROM at 0x50, write
+      "RCALL twi_data\n"
+      "LDI R19, 0x00\n"
+      "RCALL twi_data\n"
+      "LDI R19, 0x05\n"
+      "RCALL twi_data\n"
+      "LDI R19, 0x42\n"
+      "RCALL twi_data\n"
+      "LDI R16, 0xB4\n" // STOP and START
+      "RCALL twi\n"
+      "LDI R19, 0xA0\n"
+      "RCALL twi_data\n"
+      "LDI R19, 0x00\n"
+      "RCALL twi_data\n"
+      "LDI R19, 0x05\n"
+      "RCALL twi_data\n"
+      "LDI R16, 0xA4\n" // repeated START
+      "RCALL twi\n"
+      "LDI R19, 0xA1\n" // read
+      "RCALL twi_data\n"
+      "LDI R16, 0x84\n" // last byte, NACK
+      "RCALL twi\n"
+      "LDS R24, 0xBB\n"
+      "LDI R16, 0xB4\n"
+      "RCALL twi\n"
+      "LDI R19, 0xA2\n" // nothing at 0x51
+      "RCALL twi_data\n"
+      "LDI R16, 0x94\n" // STOP
+      "STS 0xBC, R16\n"
+      "BREAK\n"
+      "spi: OUT 0x2E, R16\n"
+      "spi_wait: IN R17, 0x2D\n"
+      "SBRS R17, 7\n"
+      "RJMP spi_wait\n"
+      "IN R16, 0x2E\n"
+      "RET\n"
+      "twi_data: STS 0xBB, R19\n"
+      "LDI R16, 0x84\n"
+      "twi: STS 0xBC, R16\n"
+      "twi_wait: LDS R17, 0xBC\n"
+      "SBRS R17, 7\n"
+      "RJMP twi_wait\n"
+      "LDS R18, 0xB9\n"
+      "ST X+, R18\n"
+      "RET";
+    const char *statuses = "\x08\x18\x28\x28\x28\x08\x18\x28\x28\x10\x40\x58\x08\x20";
+    Spi_flash_t *flash = spi_flash_create(64 * KB);
+    I2c_memory_t *eeprom = i2c_memory_create(4 * KB, 2);
+    Bus_t *bus = bus_create();
+    Spi_device_t flash_device = spi_flash_device(flash, 2);
+    Twi_device_t eeprom_device = i2c_memory_device(eeprom, 0x50);
+    assert(bus_add_spi(bus, &flash_device) && bus_add_twi(bus, &eeprom_device));
+    static ATmega328p_t target;
+    mcu_select(&target);
+    mcu_init();
+    assert(mcu_load_asm(code));
+    bus_attach(&target, bus);
+    mcu_run();
+    bus_attach(&target, NULL);
+    assert(target.R[20] == SPI_FLASH_ID && target.R[21] == SPI_FLASH_TYPE);
+    assert(flash->memory[0x10] == 0xA5 && flash->memory[0x11] == 0xFF && !flash->write_enabled);
+    assert(eeprom->memory[5] == 0x42 && target.R[24] == 0x42);
+    assert(memcmp(target.data_memory + 0x200, statuses, strlen(statuses)) == 0);
+    assert(target.cycle_count > 10 * 9 * 160 + 4 * 160); // bytes take 9 SCL periods, STARTs one
+    assert(!(target.data_memory[0xBC] & 0x10) && target.data_memory[0xB9] == 0xF8);
+    free(flash);
+    free(eeprom);
+    bus_destroy(bus);
+  )
+  run_test("Run cycles",
+    const char *code =
+      "loop: INC R16\n"
+      "CPI R16, 200\n"
+      "BRNE loop\n"
+      "BREAK";
+    static ATmega328p_t target;
+    mcu_select(&target);
+    mcu_init();
+    assert(mcu_load_asm(code));
+    assert(mcu_run_cycles(100));
+    assert(target.cycle_count >= 100 && target.cycle_count < 102); // an instruction is never split
+    assert(!mcu_run_cycles(1000000));
+    uint64_t cycles = target.cycle_count;
+    assert(target.stopped && target.R[16] == 200 && cycles < 1000);
+    assert(!mcu_run_cycles(10) && target.cycle_count == cycles);
+    ATmega328p_t *created = mcu_create();
+    assert(created != NULL && created->sp == RAM_SIZE - 1 && created->R == created->data_memory);
+    assert(!mcu_run_cycles(10)); // still on the stopped instance
+    mcu_destroy(created);
+  )
+  run_test("Log",
+    const char *code =
+      "LDI R16, 100\n"
+      "loop: DEC R16\n"
+      "BRNE loop\n"
+      "BREAK";
+    char output[4096];
+    static ATmega328p_t target;
+    mcu_select(&target);
+    Log_t *log = log_create(2048, LOG_INFO);
+    assert(log != NULL && log_create(3000, LOG_INFO) == NULL);
+    mcu_set_log(log);
+    mcu_init();
+    assert(mcu_load_asm(code));
+    while (mcu_step());
+    uint32_t length = log_read(log, output, sizeof(output));
+    assert(length > LOG_RECORD_HEADER && output[0] == LOG_INFO);
+    assert(memcmp(output + LOG_RECORD_HEADER, "MCU initialized\n", output[1]) == 0);
+    for (uint32_t i = 0; i < length; i += LOG_RECORD_HEADER + (byte)output[i + 1] + ((byte)output[i + 2] << 8)) {
+      assert(output[i] == LOG_INFO); // no instructions
+    }
+    assert(log_read(log, output, sizeof(output)) == 0 && log_dropped(log) == 0);
+    log->level = LOG_VERBOSE;
+    mcu_init();
+    assert(mcu_load_asm(code));
+    while (mcu_step());
+    assert(log_dropped(log) > 0); // more than fits, nothing waits for the reader
+    length = log_read(log, output, 64);
+    assert(length > 0 && length <= 64);
+    assert(log_read(log, output, sizeof(output)) > 0);
+    mcu_set_log(NULL);
+    log_destroy(log);
+  )
+  run_test("GUI",
+    FILE *file = fopen("./tmp/program.hex", "w");
+    assert(file != NULL);
+    fprintf(file, ":020000000000FE\n:00000001FF\n"); // NOPs all the way
+    fclose(file);
+    assert(system("cd ./tmp && printf q | ../mcu_gui > /dev/null") == 0); // starts paced and quits on q
+    remove("./tmp/program.hex");
+  )
+  run_test("Snapshots",
+    static ATmega328p_t target;
+    static Snapshot_state_t state;
+    pthread_t readers[2];
+    uint64_t reads[2] = {0};
+    Log_t *log = log_create(4096, LOG_ERROR); // instructions are not printed
+    mcu_select(&target);
+    mcu_set_log(log);
+    mcu_init();
+    assert(mcu_load_asm("loop: INC R16\nMOV R17, R16\nRJMP loop"));
+    test_snapshot = snapshot_create(100);
+    assert(test_snapshot != NULL && snapshot_create(0) == NULL);
+    assert(!snapshot_read(test_snapshot, &state));
+    mcu_set_snapshot(test_snapshot);
+    assert(snapshot_read(test_snapshot, &state) && state.status.cycle_count == 0 && state.status.sp == RAM_SIZE - 1);
+    assert(mcu_run_cycles(1000));
+    assert(test_snapshot->published >= 10 && snapshot_read(test_snapshot, &state));
+    assert(state.status.cycle_count >= 900 && state.status.cycle_count <= target.cycle_count);
+    mcu_publish();
+    assert(snapshot_read(test_snapshot, &state) && state.status.cycle_count == target.cycle_count && state.status.pc == target.pc);
+    assert(memcmp(state.data_memory, target.data_memory, DATA_MEMORY_SIZE) == 0);
+    test_snapshot->interval = 3; // often enough for the readers to race the writer
+    for (int i = 0; i < 2; i++) {
+      pthread_create(readers + i, NULL, snapshot_reader, reads + i);
+    }
+    assert(mcu_run_cycles(20000000));
+    snapshot_done = true;
+    for (int i = 0; i < 2; i++) {
+      pthread_join(readers[i], NULL);
+      assert(reads[i] > 0);
+    }
+    mcu_set_snapshot(NULL);
+    snapshot_destroy(test_snapshot);
+    mcu_set_log(NULL);
+    log_destroy(log);
+  )
+  run_test("Inbox",
+    const char *code =
+      "LDI R16, 0x10\n" // RXEN0
+      "STS 0xC1, R16\n"
+      "LDI R26, 0x00\n"
+      "LDI R27, 0x03\n"
+      "loop: LDS R17, 0xC0\n"
+      "SBRS R17, 7\n"
+      "RJMP loop\n"
+      "LDS R18, 0xC6\n"
+      "ST X+, R18\n"
+      "RJMP loop";
+    static ATmega328p_t target;
+    pthread_t producers[4];
+    byte expected[4] = {0};
+    Inbox_event_t event;
+    mcu_select(&target);
+    mcu_init();
+    assert(mcu_load_asm(code));
+    test_inbox = inbox_create(64);
+    assert(test_inbox != NULL && inbox_create(100) == NULL);
+    mcu_set_inbox(test_inbox);
+    assert(replay_create(&target, 500) == NULL); // the events would bypass the recording
+    assert(mcu_run_cycles(100));
+    assert(inbox_uart(test_inbox, 'o') && inbox_uart(test_inbox, 'k'));
+    assert(inbox_pin(test_inbox, 2 * 8 + 3, STIMULUS_HIGH)); // PD3
+    assert(mcu_run_cycles(200));
+    assert(target.RAM[0x300 - RAM_START] == 'o' && target.RAM[0x301 - RAM_START] == 'k' && target.data_memory[27] == 0x03 && target.data_memory[26] == 0x02);
+    assert(target.pin_driven[2] == 1 << 3 && (target.data_memory[0x29] & (1 << 3))); // PIND
+    assert(inbox_stop(test_inbox));
+    assert(!mcu_step() && target.stopped && target.stop_reason == STOP_HOST);
+    mcu_resume();
+    assert(mcu_step());
+    for (int i = 0; i < 64; i++) {
+      assert(inbox_interrupt(test_inbox, INT0_vect));
+    }
+    assert(!inbox_interrupt(test_inbox, INT0_vect)); // full
+    mcu_set_inbox(NULL);
+    for (int i = 0; i < 64; i++) {
+      assert(inbox_take(test_inbox, &event) && event.kind == INBOX_INTERRUPT);
+    }
+    for (intptr_t i = 0; i < 4; i++) {
+      pthread_create(producers + i, NULL, inbox_producer, (void *)i);
+    }
+    for (uint32_t taken = 0; taken < 4 * INBOX_TEST_EVENTS;) {
+      if (inbox_take(test_inbox, &event)) {
+        assert(event.kind == INBOX_PIN && event.pin < 4 && event.value == expected[event.pin]++); // in order per producer
+        taken++;
+      } else {
+        sched_yield();
+      }
+    }
+    for (int i = 0; i < 4; i++) {
+      pthread_join(producers[i], NULL);
+    }
+    assert(!inbox_pending(test_inbox));
+    inbox_destroy(test_inbox);
+  )
+  run_test("USART transmitter and ELF files",
+    const char *code =
+      "LDI R16, 0x08\n" // TXEN0
+      "STS 0xC1, R16\n"
+      "LDI R17, 0x68\n"
+      "STS 0xC6, R17\n"
+      "LDS R18, 0xC0\n"
+      "LDI R16, 0x28\n" // UDRIE0 too
+      "STS 0xC1, R16\n"
+      "SEI\n"
+      "loop: RJMP loop";
+    static ATmega328p_t target;
+    static byte program[64];
+    const byte *eeprom = (const byte *)"\x01\x02\x03\x04";
+    mcu_select(&target);
+    mcu_init();
+    assert(target.data_memory[0xC0] == 0x20); // UDRE0
+    assert(mcu_load_asm(code));
+    memcpy(program, target.program_memory, sizeof(program));
+    mcu_set_uart_output(uart_collect);
+    assert(mcu_run_cycles(7));
+    assert(uart_sent_count == 1 && uart_sent[0] == 0x68);
+    assert(target.data_memory[18] == 0x60); // UDRE0 and TXC0
+    assert(target.data_memory[0xC6] == 0); // the register reads the receiver
+    assert(mcu_run_cycles(20));
+    assert(target.sp == RAM_SIZE - 3 && target.pc > USART_UDRE_vect * 2 && target.pc < 0x40); // in the handler, an empty one
+    assert(write_elf("./tmp/_t.elf", program, sizeof(program), eeprom, 4));
+    mcu_init();
+    assert(target.host.uart_output == uart_collect); // kept like the attachments
+    assert(mcu_load_elf("./tmp/_t.elf"));
+    assert(memcmp(target.program_memory, program, sizeof(program)) == 0 && memcmp(target.ROM, eeprom, 4) == 0);
+    assert(target.RAM[0] == 0);
+    assert(mcu_run_cycles(7));
+    assert(uart_sent_count == 2 && uart_sent[1] == 0x68);
+    FILE *file = fopen("./tmp/_t.elf", "r+b");
+    fseek(file, 18, SEEK_SET);
+    fputc(0x28, file); // ARM
+    fclose(file);
+    assert(!mcu_load_elf("./tmp/_t.elf"));
+    remove("./tmp/_t.elf");
+    mcu_set_uart_output(NULL);
+  )
+  run_test("Memory regions",
+    static ATmega328p_t target;
+    static byte image[PROGRAM_MEMORY_SIZE];
+    mcu_select(&target);
+    mcu_init();
+    assert(mcu_abi_version() == MCU_ABI_VERSION && mcu_state_size() == sizeof(ATmega328p_t));
+    assert(mcu_load_asm("LDI R16, 0x42\nSTS 0x300, R16\nBREAK"));
+    while (mcu_step());
+    Memory_region_t registers = mcu_region(REGION_REGISTERS);
+    Memory_region_t ram = mcu_region(REGION_RAM);
+    assert(registers.data == target.data_memory && registers.size == REGISTER_COUNT && registers.data[16] == 0x42);
+    assert(ram.size == RAM_SIZE && ram.data[0x300 - RAM_START] == 0x42);
+    assert(mcu_region(REGION_DATA_MEMORY).size == DATA_MEMORY_SIZE && mcu_region(REGION_EEPROM).data == target.ROM);
+    assert(mcu_region(REGION_FLASH).writable && mcu_region(REGION_COUNT).data == NULL);
+    registers.data[17] = 7; // no copy either way
+    assert(target.R[17] == 7);
+    Mcu_status_t status;
+    mcu_get_status(&status);
+    assert(status.stopped && status.stop_reason == STOP_BREAK && status.pc == target.pc && status.cycle_count == target.cycle_count);
+    mcu_load_image(image);
+    assert(mcu_region(REGION_FLASH).data == image && !mcu_region(REGION_FLASH).writable);
+  )
+  run_test("Breakpoints",
+    const char *code =
+      "LDI R16, 0\n"
+      "loop: INC R16\n"
+      "STS 0x200, R16\n"
+      "CPI R16, 10\n"
+      "BRNE loop\n"
+      "BREAK";
+    mcu_init();
+    assert(mcu_load_asm(code));
+    assert(mcu_add_breakpoint(2, 2)); // STS, the first two hits are ignored
+    while (mcu_step());
+    mcu_get_copy(&mcu);
+    assert(mcu.stop_reason == STOP_BREAKPOINT);
+    assert(mcu.pc == 2 && mcu.R[16] == 3);
+    mcu_resume();
+    while (mcu_step());
+    mcu_get_copy(&mcu);
+    assert(mcu.pc == 2 && mcu.R[16] == 4);
+    assert(mcu_remove_breakpoint(2));
+    assert(mcu_add_watchpoint(0x200, WATCH_WRITE | WATCH_VALUE, 7, 0)); // 5 and 6 are written first
+    mcu_resume();
+    while (mcu_step());
+    mcu_get_copy(&mcu);
+    assert(mcu.stop_reason == STOP_WATCHPOINT);
+    assert(mcu.data_memory[0x200] == 7 && mcu.pc == 4);
+    mcu_clear_debug();
+    mcu_resume();
+    while (mcu_step());
+    mcu_get_copy(&mcu);
+    assert(mcu.stop_reason == STOP_BREAK && mcu.R[16] == 10);
+  )
+  run_test("GDB stub",
+    const char *code =
+      "LDI R16, 0\n"
+      "loop: INC R16\n"
+      "STS 0x200, R16\n"
+      "CPI R16, 10\n"
+      "BRNE loop\n"
+      "BREAK";
+    static ATmega328p_t target;
+    static char reply[GDB_BUFFER_SIZE];
+    mcu_select(&target);
+    mcu_init();
+    assert(mcu_load_asm(code));
+    Gdb_session_t session = {.instance = &target};
+    session.fd = -1; // no connection, continue runs until the MCU stops
+    session.attached = true;
+    gdb_handle_packet(&session, "m0,2", reply);
+    assert(strcmp(reply, "00e0") == 0); // LDI R16, 0
+    gdb_handle_packet(&session, "Z0,4,2", reply);
+    assert(strcmp(reply, "OK") == 0);
+    gdb_handle_packet(&session, "c", reply);
+    assert(strcmp(reply, "S05") == 0);
+    gdb_handle_packet(&session, "p22", reply);
+    assert(strcmp(reply, "04000000") == 0); // PC in bytes
+    gdb_handle_packet(&session, "z0,4,2", reply);
+    gdb_handle_packet(&session, "Z2,800200,1", reply);
+    gdb_handle_packet(&session, "c", reply);
+    assert(strcmp(reply, "T05watch:800200;") == 0);
+    gdb_handle_packet(&session, "m800200,1", reply);
+    assert(strcmp(reply, "01") == 0);
+    gdb_handle_packet(&session, "P10=05", reply);
+    assert(target.R[16] == 5);
+    gdb_handle_packet(&session, "D", reply);
+    assert(!session.attached);
+  )
+  run_test("Trace",
+    const char *code =
+      "LDI R16, 0\n"
+      "loop: INC R16\n"
+      "STS 0x200, R16\n"
+      "CPI R16, 10\n"
+      "BRNE loop\n"
+      "BREAK";
+    static ATmega328p_t target;
+    mcu_select(&target);
+    mcu_init();
+    assert(mcu_load_asm(code));
+    assert(trace_start(&target, "./tmp/_t.trace", 0) != NULL);
+    while (mcu_step());
+    assert(trace_stop(&target));
+    Trace_reader_t *reader = trace_open("./tmp/_t.trace");
+    assert(reader != NULL);
+    Trace_record_t record;
+    uint32_t steps = 0;
+    uint32_t writes = 0;
+    while (trace_next(reader, &record)) {
+      steps += record.kind == TRACE_STEP || record.kind == TRACE_STEP_LONG;
+      if (record.kind == TRACE_WRITE) {
+        assert(record.address == 0x200 && record.value == ++writes);
+        assert(record.pc == 2);
+      }
+    }
+    assert(!trace_failed(reader));
+    trace_close(reader);
+    remove("./tmp/_t.trace");
+    assert(steps == 42 && writes == 10);
+    assert(record.kind == TRACE_STOP && record.reason == STOP_BREAK);
+  )
+  run_test("Coverage",
+    const char *code =
+      "LDI R16, 0\n"
+      "loop: INC R16\n"
+      "SBRS R16, 7\n"
+      "CPI R16, 10\n"
+      "BRNE loop\n"
+      "BREAK\n"
+      "NOP";
+    static ATmega328p_t target;
+    Coverage_t *coverage = coverage_create();
+    Coverage_t *total = coverage_create();
+    mcu_select(&target);
+    mcu_init();
+    assert(mcu_load_asm(code));
+    coverage_attach(&target, coverage);
+    while (mcu_step());
+    coverage_merge(total, coverage);
+    assert(total->executed[0] == 0b111111); // everything up to BREAK
+    assert(total->taken[0] == 0b10000 && total->not_taken[0] == 0b10100); // SBRS never skips
+    Batch_t *batch = batch_create(BATCH_VECTOR, mcu_load_asm, code);
+    assert(batch != NULL);
+    memset(coverage, 0, sizeof(Coverage_t));
+    coverage_attach(batch->instances + 1, coverage); // the other lanes still run vectorized
+    batch_run(batch, 1000);
+    assert(coverage->executed[0] == 0b111111);
+    assert(batch->vector_instructions > 0);
+    batch_destroy(batch);
+    static char long_path[2048];
+    memset(long_path, 'a', sizeof(long_path) - 1);
+    assert(!coverage_export_lcov(total, target.program_memory, long_path, NULL, stdout)); // does not fit the command
+    free(coverage);
+    free(total);
+  )
   tests_summary();
   return 0;
 }
\ No newline at end of file
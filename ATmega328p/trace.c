@@ -0,0 +1,288 @@
+#include "trace.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#define TRACE_MAGIC "AVRTRC1"
+#define TRACE_CHUNK (64 * 1024)
+#define TRACE_IDLE_SLEEP 1000 // us the writer waits when the ring is empty
+
+struct Trace_writer_t {
+  FILE *file;
+  z_stream stream;
+  pthread_t thread;
+  bool stopping; // atomic
+  bool failed;
+  byte out[TRACE_CHUNK];
+};
+
+struct Trace_reader_t {
+  FILE *file;
+  z_stream stream;
+  bool ended;
+  bool failed;
+  uint16_t next_pc;
+  uint16_t pc;
+  uint64_t cycle;
+  uint64_t step_cycle; // start of the step or interrupt the writes belong to
+  uint32_t position;
+  uint32_t size;
+  byte in[TRACE_CHUNK];
+  byte out[TRACE_CHUNK];
+};
+
+static void deflate_chunk(struct Trace_writer_t *writer, const byte *data, uint32_t size, int flush) {
+  writer->stream.next_in = (Bytef *)data;
+  writer->stream.avail_in = size;
+  do {
+    writer->stream.next_out = writer->out;
+    writer->stream.avail_out = TRACE_CHUNK;
+    deflate(&writer->stream, flush);
+    size_t produced = TRACE_CHUNK - writer->stream.avail_out;
+    if (produced > 0 && fwrite(writer->out, produced, 1, writer->file) != 1) {
+      writer->failed = true;
+    }
+  } while (writer->stream.avail_out == 0);
+}
+
+static void *writer_main(void *arg) {
+  Trace_t *trace = arg;
+  struct Trace_writer_t *writer = trace->writer;
+  while (true) {
+    // stopping is read first, the last records are published before it is set
+    bool stopping = __atomic_load_n(&writer->stopping, __ATOMIC_ACQUIRE);
+    uint32_t head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = trace->tail;
+    if (head == tail) {
+      if (stopping) {
+        break;
+      }
+      usleep(TRACE_IDLE_SLEEP);
+      continue;
+    }
+    uint32_t start = tail & trace->mask;
+    uint32_t size = head - tail;
+    if (start + size > trace->mask + 1) {
+      size = trace->mask + 1 - start; // up to the end of the ring, the rest follows
+    }
+    deflate_chunk(writer, trace->buffer + start, size, Z_NO_FLUSH);
+    __atomic_store_n(&trace->tail, tail + size, __ATOMIC_RELEASE);
+  }
+  deflate_chunk(writer, NULL, 0, Z_FINISH);
+  return NULL;
+}
+
+static void free_trace(Trace_t *trace) {
+  if (trace->writer != NULL && trace->writer->file != NULL) {
+    fclose(trace->writer->file);
+  }
+  free(trace->writer);
+  free(trace->buffer);
+  free(trace);
+}
+
+Trace_t *trace_start(ATmega328p_t *instance, const char *filename, uint32_t buffer_size) {
+  uint32_t size = 1024;
+  while (size < (buffer_size ? buffer_size : TRACE_BUFFER_SIZE) && size < (1U << 31)) {
+    size *= 2;
+  }
+  Trace_t *trace = calloc(1, sizeof(Trace_t));
+  if (trace == NULL) {
+    return NULL;
+  }
+  trace->buffer = malloc(size);
+  trace->writer = calloc(1, sizeof(struct Trace_writer_t));
+  if (trace->buffer == NULL || trace->writer == NULL || (trace->writer->file = fopen(filename, "wb")) == NULL) {
+    free_trace(trace);
+    return NULL;
+  }
+  trace->mask = size - 1;
+  trace->next_pc = instance->pc;
+  trace->cycle = instance->cycle_count;
+  struct Trace_writer_t *writer = trace->writer;
+  bool written = fwrite(TRACE_MAGIC, sizeof(TRACE_MAGIC), 1, writer->file) == 1;
+  written &= fwrite(&trace->next_pc, sizeof(uint16_t), 1, writer->file) == 1;
+  written &= fwrite(&trace->cycle, sizeof(uint64_t), 1, writer->file) == 1;
+  if (!written || deflateInit(&writer->stream, Z_BEST_SPEED) != Z_OK) {
+    free_trace(trace);
+    return NULL;
+  }
+  if (pthread_create(&writer->thread, NULL, writer_main, trace) != 0) {
+    deflateEnd(&writer->stream);
+    free_trace(trace);
+    return NULL;
+  }
+  instance->host.trace = trace;
+  return trace;
+}
+
+bool trace_stop(ATmega328p_t *instance) {
+  Trace_t *trace = instance->host.trace;
+  if (trace == NULL) {
+    return false;
+  }
+  // Waiting is fine here, the last cycle count always makes it into the file
+  while (__atomic_load_n(&trace->tail, __ATOMIC_ACQUIRE) != trace->head) {
+    usleep(TRACE_IDLE_SLEEP);
+  }
+  trace_begin(trace, instance->cycle_count);
+  trace_end(trace, 0, false, STOP_NONE);
+  instance->host.trace = NULL;
+  struct Trace_writer_t *writer = trace->writer;
+  __atomic_store_n(&writer->stopping, true, __ATOMIC_RELEASE);
+  pthread_join(writer->thread, NULL);
+  deflateEnd(&writer->stream);
+  bool written = !writer->failed && fclose(writer->file) == 0;
+  writer->file = NULL;
+  free_trace(trace);
+  return written;
+}
+
+Trace_reader_t *trace_open(const char *filename) {
+  Trace_reader_t *reader = calloc(1, sizeof(Trace_reader_t));
+  if (reader == NULL) {
+    return NULL;
+  }
+  char magic[sizeof(TRACE_MAGIC)];
+  reader->file = fopen(filename, "rb");
+  bool read = reader->file != NULL && fread(magic, sizeof(magic), 1, reader->file) == 1;
+  read = read && memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0;
+  read = read && fread(&reader->next_pc, sizeof(uint16_t), 1, reader->file) == 1;
+  read = read && fread(&reader->cycle, sizeof(uint64_t), 1, reader->file) == 1;
+  if (!read || inflateInit(&reader->stream) != Z_OK) {
+    if (reader->file != NULL) {
+      fclose(reader->file);
+    }
+    free(reader);
+    return NULL;
+  }
+  reader->pc = reader->next_pc;
+  return reader;
+}
+
+static bool read_byte(Trace_reader_t *reader, byte *value) {
+  while (reader->position == reader->size) {
+    if (reader->ended) {
+      return false;
+    }
+    if (reader->stream.avail_in == 0) {
+      reader->stream.next_in = reader->in;
+      reader->stream.avail_in = fread(reader->in, 1, TRACE_CHUNK, reader->file);
+      if (reader->stream.avail_in == 0) {
+        reader->failed = reader->ended = true; // the writer did not finish the stream
+        return false;
+      }
+    }
+    reader->stream.next_out = reader->out;
+    reader->stream.avail_out = TRACE_CHUNK;
+    int status = inflate(&reader->stream, Z_NO_FLUSH);
+    if (status != Z_OK && status != Z_STREAM_END) {
+      reader->failed = reader->ended = true;
+      return false;
+    }
+    reader->ended = status == Z_STREAM_END;
+    reader->position = 0;
+    reader->size = TRACE_CHUNK - reader->stream.avail_out;
+  }
+  *value = reader->out[reader->position++];
+  return true;
+}
+
+static bool read_varint(Trace_reader_t *reader, uint64_t *value) {
+  *value = 0;
+  byte part = 0x80;
+  for (int shift = 0; shift < 64 && (part & 0x80); shift += 7) {
+    if (!read_byte(reader, &part)) {
+      return false;
+    }
+    *value |= (uint64_t)(part & 0x7F) << shift;
+  }
+  return true;
+}
+
+static bool read_record(Trace_reader_t *reader, const byte tag, Trace_record_t *record) {
+  byte part;
+  uint64_t number;
+  memset(record, 0, sizeof(*record));
+  record->kind = (Trace_kind_t)(tag & 7);
+  record->cycle = reader->cycle;
+  record->pc = reader->pc;
+  switch (record->kind) {
+    case TRACE_STEP:
+    case TRACE_STEP_LONG:
+    case TRACE_SKIP: {
+      uint16_t pc = reader->next_pc;
+      if (tag & TRACE_JUMP) {
+        if (!read_varint(reader, &number)) {
+          return false;
+        }
+        pc += (uint16_t)((number >> 1) ^ -(number & 1));
+      }
+      uint16_t length = record->kind == TRACE_STEP_LONG ? 2 : 1;
+      for (int i = 0; record->kind != TRACE_SKIP && i < length * 2; i++) {
+        if (!read_byte(reader, &part)) {
+          return false;
+        }
+        record->opcode |= (uint32_t)part << (i * 8);
+      }
+      record->pc = reader->pc = pc;
+      record->cycles = tag >> 4;
+      reader->step_cycle = reader->cycle;
+      reader->cycle += record->cycles;
+      reader->next_pc = pc + length; // a skipped two word instruction is followed by a jump of one word
+      return true;
+    }
+    case TRACE_WRITE: {
+      byte low = 0, high = 0; // left as they are when the record is cut short
+      bool read = read_byte(reader, &low) && read_byte(reader, &high) && read_byte(reader, &record->value);
+      record->address = low | (high << 8);
+      record->cycle = reader->step_cycle;
+      return read;
+    }
+    case TRACE_INTERRUPT:
+      reader->step_cycle = reader->cycle;
+      return read_byte(reader, &record->vector);
+    case TRACE_SYNC:
+      if (!read_varint(reader, &number)) {
+        return false;
+      }
+      record->cycle = reader->cycle = number;
+      return true;
+    case TRACE_LOST:
+      return read_varint(reader, &record->count);
+    case TRACE_STOP:
+      if (!read_byte(reader, &part)) {
+        return false;
+      }
+      record->reason = (Stop_reason_t)part;
+      return true;
+  }
+  return false;
+}
+
+bool trace_next(Trace_reader_t *reader, Trace_record_t *record) {
+  byte tag;
+  if (!read_byte(reader, &tag)) {
+    return false;
+  }
+  if (!read_record(reader, tag, record)) {
+    reader->failed = true; // truncated record
+    return false;
+  }
+  return true;
+}
+
+bool trace_failed(const Trace_reader_t *reader) {
+  return reader->failed;
+}
+
+void trace_close(Trace_reader_t *reader) {
+  if (reader == NULL) {
+    return;
+  }
+  inflateEnd(&reader->stream);
+  fclose(reader->file);
+  free(reader);
+}
@@ -0,0 +1,192 @@
+#ifndef __TRACE_
+#define __TRACE_
+
+/*
+  Compact binary execution trace. The emulator appends the records of every step
+  to a single producer ring buffer and never waits, a background thread compresses
+  them with zlib and streams them to disk. A step that does not fit is dropped
+  and a TRACE_LOST record marks the gap.
+
+  Every record starts with a tag byte, the low 3 bits are the kind:
+    TRACE_STEP, TRACE_STEP_LONG  bit 3 (TRACE_JUMP): the PC is not the next instruction, a zigzag varint delta follows
+                                 bits 4-7: cycles of the step, 0 if there were more and a TRACE_SYNC follows
+                                 then the opcode, 2 or 4 bytes little endian
+    TRACE_SKIP                   like TRACE_STEP without the opcode, the instruction was skipped
+    TRACE_WRITE                  data memory address (2 bytes) and value, belongs to the record before it
+    TRACE_INTERRUPT              vector
+    TRACE_SYNC                   varint cycle count, after sleeping, resets and restores
+    TRACE_LOST                   varint number of dropped steps
+    TRACE_STOP                   Stop_reason_t
+  Register writes are not recorded
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "atmega328p.h"
+
+#define TRACE_BUFFER_SIZE (4 * 1024 * 1024) // default ring size, rounded up to a power of two
+#define TRACE_MAX_STEP_RECORD 8 // tag, PC delta and a 32 bit opcode
+#define TRACE_JUMP 0x08
+
+typedef enum {
+  TRACE_STEP = 0,
+  TRACE_STEP_LONG,
+  TRACE_SKIP,
+  TRACE_WRITE,
+  TRACE_INTERRUPT,
+  TRACE_SYNC,
+  TRACE_LOST,
+  TRACE_STOP
+} Trace_kind_t;
+
+typedef struct Trace_t {
+  byte *buffer;
+  uint32_t mask; // buffer size - 1
+  uint32_t head; // published end, written by the emulator, atomic
+  uint32_t tail; // consumed start, written by the writer thread, atomic
+  uint32_t reserve; // end of the records of the current step
+  uint32_t tail_cache; // last tail seen by the emulator
+  uint32_t step; // tag of the current step record
+  bool step_written;
+  bool overflow; // the current step did not fit and is dropped
+  uint16_t next_pc; // PC the reader expects for the next step
+  uint64_t cycle; // cycle count the reader arrives at
+  uint64_t lost; // steps dropped since the last TRACE_LOST
+  uint64_t dropped; // all dropped steps
+  uint64_t steps;
+  struct {
+    uint16_t next_pc;
+    uint64_t cycle;
+    uint64_t lost;
+  } saved; // restored when the step is dropped
+  struct Trace_writer_t *writer;
+} Trace_t;
+
+typedef struct {
+  Trace_kind_t kind;
+  uint64_t cycle; // when the record happened, writes have the cycle their step started at
+  uint16_t pc; // in words, the PC of the last step for other records
+  uint32_t opcode;
+  byte cycles; // of the step
+  uint16_t address;
+  byte value;
+  byte vector;
+  uint64_t count; // dropped steps
+  Stop_reason_t reason;
+} Trace_record_t;
+
+typedef struct Trace_reader_t Trace_reader_t;
+
+Trace_t *trace_start(ATmega328p_t *instance, const char *filename, uint32_t buffer_size); // 0 uses TRACE_BUFFER_SIZE
+bool trace_stop(ATmega328p_t *instance); // flushes and detaches, false if writing failed
+Trace_reader_t *trace_open(const char *filename);
+bool trace_next(Trace_reader_t *reader, Trace_record_t *record); // false at the end of the trace
+bool trace_failed(const Trace_reader_t *reader); // the file was truncated or corrupted
+void trace_close(Trace_reader_t *reader);
+
+// Used by the emulator while a trace is attached
+
+static inline bool trace_reserve(Trace_t *trace, const uint32_t size) {
+  if (trace->overflow) {
+    return false;
+  }
+  if (trace->reserve + size - trace->tail_cache > trace->mask + 1) {
+    trace->tail_cache = __atomic_load_n(&trace->tail, __ATOMIC_ACQUIRE);
+    if (trace->reserve + size - trace->tail_cache > trace->mask + 1) {
+      trace->overflow = true;
+      return false;
+    }
+  }
+  return true;
+}
+
+static inline void trace_put(Trace_t *trace, const byte value) {
+  trace->buffer[trace->reserve++ & trace->mask] = value;
+}
+
+static inline void trace_put_varint(Trace_t *trace, uint64_t value) {
+  while (value >= 0x80) {
+    trace_put(trace, (byte)(value | 0x80));
+    value >>= 7;
+  }
+  trace_put(trace, (byte)value);
+}
+
+static inline void trace_begin(Trace_t *trace, const uint64_t cycle_count) {
+  trace->saved.next_pc = trace->next_pc;
+  trace->saved.cycle = trace->cycle;
+  trace->saved.lost = trace->lost;
+  trace->step_written = false;
+  trace->overflow = false;
+  if (trace->lost > 0 && trace_reserve(trace, 11)) {
+    trace_put(trace, TRACE_LOST);
+    trace_put_varint(trace, trace->lost);
+    trace->lost = 0;
+  }
+  if (trace->cycle != cycle_count && trace_reserve(trace, 11)) {
+    trace_put(trace, TRACE_SYNC);
+    trace_put_varint(trace, cycle_count);
+    trace->cycle = cycle_count;
+  }
+}
+
+static inline void trace_interrupt(Trace_t *trace, const uint16_t vector) {
+  if (trace_reserve(trace, 2)) {
+    trace_put(trace, TRACE_INTERRUPT);
+    trace_put(trace, (byte)vector);
+  }
+}
+
+static inline void trace_instruction(Trace_t *trace, const uint16_t pc, const uint32_t opcode, const uint16_t length, const bool skipped) {
+  if (!trace_reserve(trace, TRACE_MAX_STEP_RECORD)) {
+    return;
+  }
+  byte tag = skipped ? TRACE_SKIP : length == 2 ? TRACE_STEP_LONG : TRACE_STEP;
+  int16_t delta = (int16_t)(pc - trace->next_pc);
+  trace->step = trace->reserve;
+  trace->step_written = true;
+  trace_put(trace, delta != 0 ? tag | TRACE_JUMP : tag);
+  if (delta != 0) {
+    trace_put_varint(trace, (uint16_t)((delta << 1) ^ (delta >> 15)));
+  }
+  if (!skipped) {
+    for (int i = 0; i < length * 2; i++) {
+      trace_put(trace, (byte)(opcode >> (i * 8)));
+    }
+  }
+  trace->next_pc = pc + (skipped ? 1 : length); // the reader does not know the length of skipped instructions
+}
+
+static inline void trace_write(Trace_t *trace, const uint16_t address, const byte value) {
+  if (trace_reserve(trace, 4)) {
+    trace_put(trace, TRACE_WRITE);
+    trace_put(trace, (byte)address);
+    trace_put(trace, (byte)(address >> 8));
+    trace_put(trace, value);
+  }
+}
+
+static inline void trace_end(Trace_t *trace, const uint16_t cycles, const bool stopped, const Stop_reason_t reason) {
+  if (trace->step_written && cycles < 16) {
+    trace->buffer[trace->step & trace->mask] |= cycles << 4;
+    trace->cycle += cycles;
+  }
+  if (stopped && trace_reserve(trace, 2)) {
+    trace_put(trace, TRACE_STOP);
+    trace_put(trace, (byte)reason);
+  }
+  if (trace->overflow) {
+    trace->reserve = trace->head;
+    trace->next_pc = trace->saved.next_pc;
+    trace->cycle = trace->saved.cycle;
+    trace->lost = trace->saved.lost + 1;
+    trace->dropped++;
+    return;
+  }
+  __atomic_store_n(&trace->head, trace->reserve, __ATOMIC_RELEASE);
+  trace->steps++;
+}
+
+#endif // __TRACE_
@@ -0,0 +1,111 @@
+#include "vcd.h"
+#include <stdlib.h>
+
+#define VCD_FILE_BUFFER (1024 * 1024)
+#define VCD_FIRST_ID '!' // identifiers are single printable characters
+
+static const struct {
+  const char *name;
+  uint16_t address;
+  uint32_t group;
+} registers[VCD_REGISTERS] = {
+  {"PINB", 0x23, VCD_PORT_B},
+  {"DDRB", 0x24, VCD_PORT_B},
+  {"PORTB", 0x25, VCD_PORT_B},
+  {"PINC", 0x26, VCD_PORT_C},
+  {"DDRC", 0x27, VCD_PORT_C},
+  {"PORTC", 0x28, VCD_PORT_C},
+  {"PIND", 0x29, VCD_PORT_D},
+  {"DDRD", 0x2A, VCD_PORT_D},
+  {"PORTD", 0x2B, VCD_PORT_D},
+  {"UDR0", 0xC6, VCD_UART_TX}
+};
+
+static inline char wire_id(const byte index, const byte bit) {
+  return VCD_FIRST_ID + index * 8 + bit;
+}
+
+static void write_value(Vcd_t *vcd, const byte index, const byte value, const bool all) {
+  if (index == VCD_UDR0) {
+    fprintf(vcd->file, "b");
+    for (int bit = 7; bit >= 0; bit--) {
+      fputc('0' + ((value >> bit) & 1), vcd->file);
+    }
+    fprintf(vcd->file, " %c\n%d%c\n", wire_id(index, 0), vcd->strobe, wire_id(index, 1));
+  } else {
+    for (byte bit = 0; bit < 8; bit++) {
+      if (all || ((value ^ vcd->written[index]) >> bit) & 1) {
+        fprintf(vcd->file, "%d%c\n", (value >> bit) & 1, wire_id(index, bit));
+      }
+    }
+  }
+  vcd->written[index] = value;
+}
+
+static void flush_changes(Vcd_t *vcd) {
+  // Restores can move the cycle counter back, the file keeps its time monotonic
+  for (uint32_t i = 0; i < vcd->count; i++) {
+    const Vcd_change_t *change = vcd->changes + i;
+    uint64_t time = change->cycle * VCD_PICOSECONDS;
+    if (time > vcd->time) {
+      vcd->time = time;
+      fprintf(vcd->file, "#%llu\n", (unsigned long long)time);
+    }
+    if (change->index == VCD_UDR0) {
+      vcd->strobe = !vcd->strobe;
+    }
+    write_value(vcd, change->index, change->value, false);
+  }
+  vcd->count = 0;
+}
+
+Vcd_t *vcd_start(ATmega328p_t *instance, const char *filename, uint32_t signals) {
+  Vcd_t *vcd = calloc(1, sizeof(Vcd_t));
+  if (vcd == NULL || (vcd->file = fopen(filename, "w")) == NULL) {
+    free(vcd);
+    return NULL;
+  }
+  setvbuf(vcd->file, NULL, _IOFBF, VCD_FILE_BUFFER);
+  vcd->flush = flush_changes;
+  vcd->time = instance->cycle_count * VCD_PICOSECONDS;
+  fprintf(vcd->file, "$version ATmega328p emulator $end\n$timescale 1 ps $end\n$scope module atmega328p $end\n");
+  for (byte index = 0; index < VCD_REGISTERS; index++) {
+    if (!(registers[index].group & (signals ? signals : VCD_ALL))) {
+      continue;
+    }
+    vcd->registers[registers[index].address] = index + 1;
+    vcd->values[index] = vcd->written[index] = instance->data_memory[registers[index].address];
+    if (index == VCD_UDR0) {
+      fprintf(vcd->file, "$var wire 8 %c UDR0 $end\n$var wire 1 %c UDR0_write $end\n", wire_id(index, 0), wire_id(index, 1));
+      continue;
+    }
+    for (byte bit = 0; bit < 8; bit++) {
+      fprintf(vcd->file, "$var wire 1 %c %s%d $end\n", wire_id(index, bit), registers[index].name, bit);
+    }
+  }
+  fprintf(vcd->file, "$upscope $end\n$enddefinitions $end\n#%llu\n$dumpvars\n", (unsigned long long)vcd->time);
+  for (byte index = 0; index < VCD_REGISTERS; index++) {
+    if (registers[index].group & (signals ? signals : VCD_ALL)) {
+      write_value(vcd, index, vcd->values[index], true);
+    }
+  }
+  fprintf(vcd->file, "$end\n");
+  instance->host.vcd = vcd;
+  return vcd;
+}
+
+bool vcd_stop(ATmega328p_t *instance) {
+  Vcd_t *vcd = instance->host.vcd;
+  if (vcd == NULL) {
+    return false;
+  }
+  instance->host.vcd = NULL;
+  flush_changes(vcd);
+  if (instance->cycle_count * VCD_PICOSECONDS > vcd->time) {
+    fprintf(vcd->file, "#%llu\n", (unsigned long long)(instance->cycle_count * VCD_PICOSECONDS)); // end of the run
+  }
+  bool written = !ferror(vcd->file);
+  written &= fclose(vcd->file) == 0;
+  free(vcd);
+  return written;
+}
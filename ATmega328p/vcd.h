@@ -0,0 +1,75 @@
+#ifndef __VCD_
+#define __VCD_
+
+/*
+  VCD waveform export. The emulator reports IO writes to the recorded registers,
+  only values that changed are buffered and formatted later, one wire per port bit.
+  Timestamps are the cycle counter scaled to picoseconds at CPU_FREQUENCY, a write
+  is logged at the cycle its instruction started at
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "atmega328p.h"
+
+#define VCD_BUFFER 4096 // changes kept before they are written
+#define VCD_PICOSECONDS (1000000000000ULL / CPU_FREQUENCY) // per cycle
+#define VCD_REGISTERS 10
+#define VCD_UDR0 9 // register index of the UART data register
+
+// Signal groups
+#define VCD_PORT_B 1 // PINB, DDRB and PORTB
+#define VCD_PORT_C 2
+#define VCD_PORT_D 4
+#define VCD_UART_TX 8 // bytes written to UDR0 and a wire that toggles with each of them
+#define VCD_ALL 0xF
+
+typedef struct {
+  uint64_t cycle;
+  byte index; // register
+  byte value;
+} Vcd_change_t;
+
+typedef struct Vcd_t {
+  byte registers[RAM_START]; // register index + 1 for each recorded IO address, 0 for the others
+  byte values[VCD_REGISTERS]; // last value seen by the emulator
+  uint32_t count;
+  Vcd_change_t changes[VCD_BUFFER];
+  void (*flush)(struct Vcd_t *vcd); // writes the buffered changes, called when the buffer is full
+  FILE *file;
+  byte written[VCD_REGISTERS]; // last value in the file
+  bool strobe;
+  uint64_t time; // last timestamp in the file
+} Vcd_t;
+
+static inline void vcd_change(Vcd_t *vcd, const uint64_t cycle, const uint16_t address, const byte value) {
+  byte index = address < RAM_START ? vcd->registers[address] : 0;
+  if (index-- == 0 || (value == vcd->values[index] && index != VCD_UDR0)) {
+    return;
+  }
+  if (vcd->count == VCD_BUFFER) {
+    vcd->flush(vcd);
+  }
+  Vcd_change_t *change = vcd->changes + vcd->count++;
+  change->cycle = cycle;
+  change->index = index;
+  change->value = value;
+  vcd->values[index] = value;
+}
+
+static inline void vcd_sync(Vcd_t *vcd, const uint64_t cycle, const byte *data_memory) {
+  // After a reset or restore changed registers without writes
+  for (uint16_t address = 0; address < RAM_START; address++) {
+    byte index = vcd->registers[address];
+    if (index != 0 && index - 1 != VCD_UDR0) {
+      vcd_change(vcd, cycle, address, data_memory[address]);
+    }
+  }
+}
+
+Vcd_t *vcd_start(ATmega328p_t *instance, const char *filename, uint32_t signals); // VCD_* groups
+bool vcd_stop(ATmega328p_t *instance);
+
+#endif // __VCD_
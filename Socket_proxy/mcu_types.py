@@ -1,62 +1,137 @@
 import ctypes
-import json
-
-def getdict(struct):
-  return dict((field, getattr(struct, field)) for field, _ in struct._fields_)
-
-def bytes_to_int(bytes_array):
-  output = []
-  for byte in bytearray(bytes_array):
-    output.append(byte)
-  return output
-
-def to_string(struct):
-  dict_struct = getdict(struct)
-  dict_struct['data_memory'] = bytes_to_int(dict_struct['data_memory'])
-  dict_struct['ROM'] = bytes_to_int(dict_struct['ROM'])
-  dict_struct['boot_section'] = (32 * 1024) - 512
-  dict_struct['R'] = 0
-  dict_struct['IO'] = 32 + dict_struct['R']
-  dict_struct['ext_IO'] = 64 + dict_struct['IO']
-  dict_struct['RAM'] = 160 + dict_struct['ext_IO']
-  del dict_struct['program_memory']
-  del dict_struct['exeption_handler']
-  del dict_struct['instruction']
-  return json.dumps(dict_struct)
-
-class Instruction_t(ctypes.Structure):
+import struct as pack
+
+MCU_ABI_VERSION = 5 # has to match the library, see atmega328p.h
+REGION_REGISTERS, REGION_IO, REGION_EXT_IO, REGION_RAM, REGION_DATA_MEMORY, REGION_FLASH, REGION_EEPROM = range(7)
+
+try:
+  import numpy
+except ImportError:
+  numpy = None
+
+# Binary state frames, little endian. A frame is a header followed by ranges of data memory,
+# each a u16 start, a u16 length and the bytes. A keyframe carries all of data memory,
+# a delta only the blocks that changed since the previous frame sent on the same socket
+STATE_KEYFRAME = 0
+STATE_DELTA = 1
+STATE_STOPPED = 1 # flags
+STATE_SLEEPING = 2
+STATE_HEADER = pack.Struct('<BBHHBBQhH') # type, flags, pc, sp, SREG, stop_reason, cycle_count, data_memory_change, ranges
+STATE_RANGE = pack.Struct('<HH')
+STATE_FLASH = 2 # program memory, a u8 type and a u16 range count followed by ranges of flash
+FLASH_HEADER = pack.Struct('<BH')
+DELTA_BLOCK = 32 # bytes compared at once
+
+def snapshot(status, data_memory):
+  # The parts of the state that frames are made of, safe to hand to another thread.
+  # Takes an Mcu_status_t and a view of data memory, copying only the memory
+  return {
+    'flags': (STATE_STOPPED if status.stopped else 0) | (STATE_SLEEPING if status.sleeping else 0),
+    'pc': status.pc,
+    'sp': status.sp,
+    'SREG': status.SREG,
+    'stop_reason': status.stop_reason,
+    'cycle_count': status.cycle_count,
+    'data_memory_change': status.data_memory_change,
+    'data_memory': bytes(data_memory)
+  }
+
+class StateEncoder:
+  def __init__(self):
+    self.memory = None # data memory as of the last frame
+
+  def reset(self):
+    self.memory = None # the next frame is a keyframe
+
+  def encode(self, state):
+    memory = state['data_memory']
+    if self.memory is None:
+      kind, ranges = STATE_KEYFRAME, [(0, len(memory))]
+    else:
+      kind, ranges = STATE_DELTA, changed_ranges(self.memory, memory)
+    self.memory = memory
+    return pack_frame(kind, state, ranges)
+
+  def keyframe(self, state):
+    # For a socket that missed frames, the encoder goes on with its deltas
+    return pack_frame(STATE_KEYFRAME, state, [(0, len(state['data_memory']))])
+
+def pack_frame(kind, state, ranges):
+  memory = state['data_memory']
+  parts = [STATE_HEADER.pack(kind, state['flags'], state['pc'], state['sp'], state['SREG'], state['stop_reason'],
+    state['cycle_count'], state['data_memory_change'], len(ranges))]
+  for start, end in ranges:
+    parts.append(STATE_RANGE.pack(start, end - start))
+    parts.append(memory[start:end])
+  return b''.join(parts)
+
+def flash_frame(flash):
+  # Sent when a program is loaded, blocks that are still blank are left out
+  ranges = changed_ranges(bytes(len(flash)), flash)
+  parts = [FLASH_HEADER.pack(STATE_FLASH, len(ranges))]
+  for start, end in ranges:
+    parts.append(STATE_RANGE.pack(start, end - start))
+    parts.append(flash[start:end])
+  return b''.join(parts)
+
+def changed_ranges(old, new):
+  # Adjacent changed blocks are merged into one range
+  ranges = []
+  start = None
+  for offset in range(0, len(new), DELTA_BLOCK):
+    if old[offset:offset + DELTA_BLOCK] != new[offset:offset + DELTA_BLOCK]:
+      start = offset if start is None else start
+    elif start is not None:
+      ranges.append((start, offset))
+      start = None
+  if start is not None:
+    ranges.append((start, len(new)))
+  return ranges
+
+class Memory_region_t(ctypes.Structure):
   _fields_ = [
-    ("name", ctypes.POINTER(ctypes.c_char)),
-    ("execute", ctypes.POINTER(ctypes.c_int)),
-    ("mask1", ctypes.c_uint16),
-    ("mask2", ctypes.c_uint16),
-    ("cycles", ctypes.c_uint16),
-    ("length", ctypes.c_uint16)
+    ("data", ctypes.POINTER(ctypes.c_uint8)),
+    ("size", ctypes.c_uint32),
+    ("writable", ctypes.c_bool)
   ]
 
-class ATmega328p_t(ctypes.Structure):
+class Mcu_status_t(ctypes.Structure):
   _fields_ = [
-    ("SREG", ctypes.c_uint8),
-    ("SR", ctypes.c_uint8),
-    ("data_memory", ctypes.c_uint8 * 0x900),
-    ("ROM", ctypes.c_uint8 * 1024),
-    ("program_memory", ctypes.c_uint8 * 32 * 1024),
-    ("boot_section", ctypes.POINTER(ctypes.c_uint8)),
-    ("R", ctypes.POINTER(ctypes.c_uint8)),
-    ("IO", ctypes.POINTER(ctypes.c_uint8)),
-    ("ext_IO", ctypes.POINTER(ctypes.c_uint8)),
-    ("RAM", ctypes.POINTER(ctypes.c_uint8)),
-    ("sp", ctypes.c_uint16),
+    ("cycle_count", ctypes.c_uint64),
     ("pc", ctypes.c_uint16),
-    ("skip_next", ctypes.c_bool),
-    ("sleeping", ctypes.c_bool),
+    ("sp", ctypes.c_uint16),
+    ("SREG", ctypes.c_uint8),
+    ("stop_reason", ctypes.c_uint8),
     ("stopped", ctypes.c_bool),
-    ("handle_interrupt", ctypes.c_bool),
-    ("auto_execute", ctypes.c_bool),
-    ("interrupt_address", ctypes.c_uint16),
+    ("sleeping", ctypes.c_bool),
     ("data_memory_change", ctypes.c_int16),
-    ("cycles", ctypes.c_uint16),
-    ("opcode", ctypes.c_uint32),
-    ("instruction", ctypes.POINTER(Instruction_t)),
-    ("exeption_handler", ctypes.POINTER(ctypes.c_int))
-  ]
\ No newline at end of file
+    ("opcode", ctypes.c_uint32)
+  ]
+
+def bind(library):
+  # Declares the accessor API of a loaded library and refuses one built from another ABI version.
+  # The state struct itself is never mirrored here, only the accessors are used
+  library.mcu_abi_version.argtypes = []
+  library.mcu_abi_version.restype = ctypes.c_uint32
+  library.mcu_region.argtypes = [ctypes.c_int]
+  library.mcu_region.restype = Memory_region_t
+  library.mcu_get_status.argtypes = [ctypes.POINTER(Mcu_status_t)]
+  library.mcu_get_status.restype = None
+  version = library.mcu_abi_version()
+  if version != MCU_ABI_VERSION:
+    raise RuntimeError(f'MCU library ABI version {version}, expected {MCU_ABI_VERSION}')
+
+def region_view(library, region):
+  # Memory of the selected instance without copying, read only where the library says so.
+  # The view is only valid while the instance exists
+  result = library.mcu_region(region)
+  if not result.data:
+    raise ValueError(f'Unknown region {region}')
+  view = memoryview((ctypes.c_uint8 * result.size).from_address(ctypes.addressof(result.data.contents))).cast('B')
+  return view if result.writable else view.toreadonly()
+
+def region_array(library, region):
+  # The same memory as a NumPy uint8 array
+  if numpy is None:
+    raise ImportError('NumPy is not installed, use region_view')
+  return numpy.frombuffer(region_view(library, region), dtype=numpy.uint8)
@@ -3,9 +3,30 @@
   const get = selector => document.querySelector(selector);
   const getAll = selector => document.querySelectorAll(selector);
 
-  let runInterval = undefined;
-
   const MCU_SP_START = 1024 * 2 - 1;
+  const DATA_MEMORY_SIZE = 0x900;
+  const FLASH_SIZE = 1024 * 32;
+  const STATE_KEYFRAME = 0;
+  const STATE_FLASH = 2;
+  const STATE_HEADER_SIZE = 20;
+  const FLASH_HEADER_SIZE = 3;
+  const HEX_ROW_HEIGHT = 16; // px, the height of .hex-view .row
+
+  // Mirror of the MCU state, patched by the binary frames of the server
+  let state = {
+    pc: 0,
+    sp: MCU_SP_START,
+    SREG: 0,
+    flags: 0,
+    cycle_count: 0n,
+    data_memory_change: -1,
+    data_memory: new Uint8Array(DATA_MEMORY_SIZE),
+    flash: new Uint8Array(FLASH_SIZE),
+    R: 0,
+    IO: 32,
+    ext_IO: 96,
+    RAM: 256
+  };
 
   let tabs = {code: true};
   let tabsCount = 1;
@@ -41,18 +62,13 @@
     localStorage.lastCode = editor.getValue();
   }, 1000);
 
-  const runMCU = () => {
-    runInterval = setInterval(() => {
-      socket.emit('execute cycle');
-    }, 1000 * (1 / +localStorage.frequency));
-  }
-
-  const getStack = state => {
-    let stack = [];
-    for (let i = MCU_SP_START - 1; i >= state.sp; i--) {
-      stack.push(state.data_memory[state.RAM + 1 + i]);
-    }
-    return stack;
+  // The server runs the MCU on its own thread and sends frames at a capped rate
+  const runMCU = (mode = 'run') => {
+    socket.emit('run', {
+      mode,
+      cycles: +get('.run-cycles-count').value,
+      frequency: +localStorage.frequency
+    });
   }
 
   const terminalAppend = (terminal, text) => {
@@ -118,7 +134,126 @@
     get('.registers').appendChild(reg);
   }
 
-  const socket = new WebSocket('ws://localhost:3000');
+  const registers = Array.from(getAll('.registers .value'));
+  const registerValues = new Array(32).fill(-1);
+
+  const hex = (value, digits) => value.toString(16).padStart(digits, '0');
+
+  // Views are redrawn once per animation frame, however many frames the server sent meanwhile
+  const dirtyViews = new Set();
+
+  const scheduleView = view => {
+    if (dirtyViews.size === 0) {
+      requestAnimationFrame(() => {
+        dirtyViews.forEach(view => view.render());
+        dirtyViews.clear();
+      });
+    }
+    dirtyViews.add(view);
+  }
+
+  // Virtualized hex dump of length bytes of a memory from start on. Only the rows in sight exist
+  // and are reused while scrolling, a patch rewrites just the cells whose bytes it changed
+  const createHexView = (wrap, memory, columns) => {
+    let space = create('div', {class: 'space'});
+    let rows = [];
+    let view = {start: 0, length: 0, dirtyStart: 0, dirtyEnd: 0, redraw: true};
+
+    view.setRange = (start, length) => {
+      if (start === view.start && length === view.length) return;
+      view.start = start;
+      view.length = length;
+      view.redraw = true;
+      space.style.height = Math.ceil(length / columns) * HEX_ROW_HEIGHT + 'px';
+      wrap.classList.toggle('empty', length === 0);
+      scheduleView(view);
+    }
+
+    view.patch = (start, end) => {
+      start = Math.max(start, view.start);
+      end = Math.min(end, view.start + view.length);
+      if (start >= end) return;
+      if (view.dirtyStart < view.dirtyEnd) {
+        start = Math.min(start, view.dirtyStart);
+        end = Math.max(end, view.dirtyEnd);
+      }
+      view.dirtyStart = start;
+      view.dirtyEnd = end;
+      scheduleView(view);
+    }
+
+    view.render = () => {
+      let bytes = memory();
+      let first = Math.floor(wrap.scrollTop / HEX_ROW_HEIGHT);
+      let count = Math.min(Math.ceil(wrap.clientHeight / HEX_ROW_HEIGHT) + 1, Math.ceil(view.length / columns) - first);
+      while (rows.length < count) {
+        let row = {element: create('div', {class: 'row'}), address: create('span', {class: 'address'}), cells: [], values: [], index: -1};
+        row.element.appendChild(row.address);
+        for (let i = 0; i < columns; i++) {
+          row.cells.push(row.element.appendChild(create('span')));
+          row.values.push(-1);
+        }
+        space.appendChild(row.element);
+        rows.push(row);
+      }
+      rows.forEach((row, i) => {
+        let index = first + i;
+        let address = view.start + index * columns;
+        if (i >= count) {
+          row.element.style.display = 'none';
+          row.index = -1;
+          return;
+        }
+        if (row.index !== index || view.redraw) {
+          row.index = index;
+          row.element.style.display = '';
+          row.element.style.top = index * HEX_ROW_HEIGHT + 'px';
+          row.address.textContent = hex(address, 4);
+        } else if (address >= view.dirtyEnd || address + columns <= view.dirtyStart) {
+          return;
+        }
+        for (let j = 0; j < columns; j++) {
+          let value = address + j < view.start + view.length ? bytes[address + j] : -1;
+          if (row.values[j] !== value) {
+            row.values[j] = value;
+            row.cells[j].textContent = value === -1 ? '' : hex(value, 2);
+          }
+        }
+      });
+      view.dirtyStart = view.dirtyEnd = 0;
+      view.redraw = false;
+    }
+
+    wrap.classList.add('hex-view');
+    wrap.appendChild(space);
+    wrap.on('scroll', () => scheduleView(view));
+    return view;
+  }
+
+  // The stack grows down, its top is the first row
+  const stackView = createHexView(get('.stack'), () => state.data_memory, 1);
+  const dataMemoryView = createHexView(get('.data-memory'), () => state.data_memory, 16);
+  const flashView = createHexView(get('.flash'), () => state.flash, 16);
+  dataMemoryView.setRange(0, DATA_MEMORY_SIZE);
+  flashView.setRange(0, FLASH_SIZE);
+  stackView.setRange(state.RAM + 1 + state.sp, MCU_SP_START - state.sp);
+
+  // After the tiles were resized, more rows may be in sight
+  const redrawViews = () => [stackView, dataMemoryView, flashView].forEach(view => {
+    view.redraw = true;
+    scheduleView(view);
+  });
+
+  window.addEventListener('resize', redrawViews);
+
+  // ?watch=<session> follows someone else's MCU read only, ?fps=N limits the frames it sends
+  const params = new URLSearchParams(location.search);
+  const watching = params.get('watch');
+  const socket = new WebSocket('ws://localhost:3000' + (watching ? `/watch/${encodeURIComponent(watching)}?fps=${params.get('fps') || 30}` : ''));
+  if (watching) {
+    document.body.classList.add('watching');
+  }
+  socket.binaryType = 'arraybuffer';
   const log = console.log;
   window.test = () => socket.emit('test', 'test');
 
@@ -140,11 +275,14 @@
   });
 
   socket.addEventListener('close', (event) => {
-    clearInterval(runInterval);
     terminalAppend(get('.log-output'), 'Connection closed');
   });
 
   socket.addEventListener('message', (event) => {
+    if (event.data instanceof ArrayBuffer) {
+      applyFrame(event.data);
+      return;
+    }
     let message = null;
     try {
       message = JSON.parse(event.data);
@@ -170,6 +308,10 @@
     log('Python test:', data);
   });
 
+  socket.on('session', id => {
+    terminalAppend(get('.log-output'), `Others can watch at ${location.origin}${location.pathname}?watch=${id}\n`);
+  });
+
   socket.on('log', data => {
     terminalAppend(get('.log-output'), data);
   });
@@ -178,37 +320,21 @@
     terminalAppend(get('.mcu-output'), data);
   });
 
+  socket.on('terminal', data => updateTerminal(data));
+
   socket.on('execute stop', () => {
-    log('Stopping');
-    clearInterval(runInterval);
+    log('Stopped');
   });
 
-  socket.on('mcu resumed', runMCU);
-
-  let stackPointer = -1;
-
-  let updateStack = state => {
-    let stack = getStack(state);
-    let wrap = get('.stack');
-    while (wrap.firstChild) {
-      wrap.firstChild.remove();
-    }
-    if (stack.length === 0) {
-      return wrap.appendChild(
-        create('div', {class: 'value'}, 'Empty')
-      );
-    }
-    let fragment = document.createDocumentFragment();
-    stack.forEach(value => {
-      let element = create('div', {class: 'value'}, `0x${value.toString(16)}`);
-      fragment.appendChild(element);
-    });
-    wrap.appendChild(fragment);
-  }
+  socket.on('mcu resumed', () => runMCU());
 
   let updateRegisters = state => {
     for (let i = 0; i < 32; i++) {
-      get('.reg-' + (i + 1) + ' .value').innerText = '0x' + state.data_memory[state.R + i].toString(16);
+      let value = state.data_memory[state.R + i];
+      if (registerValues[i] !== value) {
+        registerValues[i] = value;
+        registers[i].textContent = '0x' + value.toString(16);
+      }
     }
   }
 
@@ -221,28 +347,80 @@
     }
   }
 
-  let updateTerminal = char => {
-    if (!char) return;
-    char = String.fromCharCode(char);
+  // What USART0 transmitted, every byte of it however many went out between two frames
+  let updateTerminal = text => {
     let terminal = get('.mcu-terminal');
-    terminal.innerText += char;
+    terminal.innerText += text;
     terminal.scrollDown(terminal.scrollHeight * 10);
   }
 
-  socket.on('mcu state', state => {
-    state = JSON.parse(state);
+  // Header: type, flags, pc, sp, SREG, stop reason, cycle count, last written address, range count,
+  // followed by ranges of data memory, each a start, a length and the bytes. Little endian
+  const decodeFrame = buffer => {
+    let view = new DataView(buffer);
+    let frame = {
+      keyframe: view.getUint8(0) === STATE_KEYFRAME,
+      flags: view.getUint8(1),
+      pc: view.getUint16(2, true),
+      sp: view.getUint16(4, true),
+      SREG: view.getUint8(6),
+      stop_reason: view.getUint8(7),
+      cycle_count: view.getBigUint64(8, true),
+      data_memory_change: view.getInt16(16, true),
+      ranges: decodeRanges(buffer, STATE_HEADER_SIZE, view.getUint16(18, true))
+    };
+    return frame;
+  }
+
+  const decodeRanges = (buffer, offset, count) => {
+    let view = new DataView(buffer);
+    let ranges = [];
+    for (let i = 0; i < count; i++) {
+      let start = view.getUint16(offset, true);
+      let length = view.getUint16(offset + 2, true);
+      ranges.push({start, bytes: new Uint8Array(buffer, offset + 4, length)});
+      offset += 4 + length;
+    }
+    return ranges;
+  }
+
+  // Header: type and range count, followed by the ranges of flash that are not blank
+  const applyFlash = buffer => {
+    state.flash.fill(0);
+    decodeRanges(buffer, FLASH_HEADER_SIZE, new DataView(buffer).getUint16(1, true)).forEach(range => {
+      state.flash.set(range.bytes, range.start);
+    });
+    flashView.patch(0, FLASH_SIZE);
+  }
+
+  const touches = (frame, start, end) => frame.keyframe || frame.ranges.some(range => {
+    return range.start < end && range.start + range.bytes.length > start;
+  });
+
+  // Only the views whose memory changed are redrawn, and of those only the cells in sight
+  const applyFrame = buffer => {
+    if (new DataView(buffer).getUint8(0) === STATE_FLASH) {
+      return applyFlash(buffer);
+    }
+    let frame = decodeFrame(buffer);
+    for (let key of ['flags', 'pc', 'sp', 'SREG', 'cycle_count', 'data_memory_change']) {
+      state[key] = frame[key];
+    }
+    stackView.setRange(state.RAM + 1 + state.sp, MCU_SP_START - state.sp);
+    frame.ranges.forEach(range => {
+      let end = range.start + range.bytes.length;
+      state.data_memory.set(range.bytes, range.start);
+      dataMemoryView.patch(range.start, end);
+      stackView.patch(range.start, end);
+    });
     get('.pc').innerText = '0x' + (state.pc * 2).toString(16);
-    updateRegisters(state);
-    if (stackPointer !== state.sp) {
-      updateStack(state);
+    if (touches(frame, state.R, state.R + 32)) {
+      updateRegisters(state);
     }
-    stackPointer = state.sp;
-    updateLEDs(state);
-    if (state.data_memory_change !== -1 && state.data_memory_change >= state.ext_IO + 1) {
-      updateTerminal(state.data_memory[state.data_memory_change]);
+    if (touches(frame, state.ext_IO, state.ext_IO + 1)) {
+      updateLEDs(state);
     }
-    log('MCU state', state);
-  });
+  }
 
   get('.compile-asm').on('click', e => {
     let code = editor.getValue();
@@ -258,10 +436,14 @@
     socket.emit('execute cycle');
   });
 
-  get('.mcu-run').on('click', runMCU);
+  get('.mcu-run').on('click', () => runMCU());
+
+  get('.mcu-run-break').on('click', () => runMCU('until break'));
+
+  get('.mcu-run-cycles').on('click', () => runMCU('cycles'));
 
   get('.mcu-stop').on('click', e => {
-    clearInterval(runInterval);
+    socket.emit('stop');
   });
 
   get('.mcu-resume').on('click', () => {
@@ -285,6 +467,7 @@
     tabsCount++;
     setManagerName();
     tile.style.display = 'block';
+    redrawViews();
   });
 
   getAll('.tile .x').on('click', function() {
@@ -295,6 +478,7 @@
     let tile = get('.tile[tab='+tab+']');
     setManagerName();
     tile.style.display = 'none';
+    redrawViews();
   });
 
   get('.theme-select').on('change', function() {
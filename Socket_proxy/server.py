@@ -4,25 +4,178 @@ import json
 import http.server
 import socketserver
 import threading
+import queue
+import time
 import ctypes
-import wurlitzer
+import collections
+import secrets
+import urllib.parse
 import mcu_types
 
 ws_port = 3000
 http_port = 3080
 host = 'localhost'
 handlers = {}
-ws = None
-mcu_t = mcu_types.ATmega328p_t
-mcu_ptr = ctypes.POINTER(mcu_t)
-mcu = mcu_t()
-mcu_running = True
+loop = None
+max_fps = 30 # state frames per second while running, whatever the emulation rate
+slice_time = 0.005 # seconds of host time per call into the emulator
+max_sessions = 32 # one emulator instance per connection
+workers = 4 # threads running the emulators, sessions take turns slice by slice
+cycle_quota = 16000000 * 600 # emulated cycles per session, ten minutes at 16 MHz
+idle_timeout = 600 # seconds without messages before a stopped session is closed
+max_viewers = 64 # connections watching one session besides its owner
+max_messages = 256 # messages queued for a subscriber, older ones are dropped
+sessions = {} # by id
+run_queue = queue.Queue() # (session, generation) of runs that want another slice
+LOG_ERROR, LOG_INFO, LOG_VERBOSE = 0, 1, 2
+active = threading.local() # session whose instance the thread is running, for the UART callback
 
-async def log(message):
-  await ws.send(json.dumps({'event': 'log', 'data': message}))
+class Subscriber:
+  # A socket that gets the messages and frames of a session. Messages queue up to a limit, frames
+  # never do: one that was not sent yet is replaced, and then the subscriber is sent a keyframe
+  def __init__(self, ws, fps):
+    self.ws = ws
+    self.interval = 1 / max(1, min(fps, max_fps))
+    self.messages = collections.deque(maxlen=max_messages)
+    self.frame = None # newest frame, not sent yet
+    self.tick = None # of the last frame handed to the socket, None if the next one has to be a keyframe
+    self.last_frame = 0
+    self.closing = False
+    self.wake = asyncio.Event()
+    self.task = asyncio.ensure_future(self.sender())
 
-async def web_console(message):
-  await ws.send(json.dumps({'event': 'console', 'data': message}))
+  def post(self, message):
+    self.messages.append(message)
+    self.wake.set()
+
+  def close(self):
+    # After what is queued has been sent
+    self.closing = True
+    self.wake.set()
+
+  async def sender(self):
+    try:
+      while not (self.closing and not self.messages and self.frame is None):
+        await self.wake.wait()
+        self.wake.clear()
+        while self.messages:
+          await self.ws.send(self.messages.popleft())
+        if self.frame is not None:
+          frame, self.frame = self.frame, None
+          await self.ws.send(frame)
+      await self.ws.close()
+    except Exception:
+      pass # the connection is gone, its handler cleans up
+
+class Session:
+  # An emulator instance, the connection that owns and controls it and the ones watching it.
+  # Calls into the core select the instance on the calling thread first, the lock keeps
+  # workers and handlers apart
+  def __init__(self, ws):
+    self.id = secrets.token_urlsafe(6)
+    self.owner = Subscriber(ws, max_fps)
+    self.subscribers = [self.owner]
+    self.tick = 0 # frames encoded so far
+    self.lock = threading.Lock()
+    self.instance = mcu_fn.mcu_create()
+    # Instructions are not logged, formatting one message per cycle would slow the emulator down
+    self.log = mcu_fn.log_create(1 << 20, LOG_INFO)
+    self.log_lock = threading.Lock() # the log has a single reader at a time
+    self.log_buffer = ctypes.create_string_buffer(1 << 16)
+    self.call(mcu_fn.mcu_set_log, self.log)
+    self.inbox = mcu_fn.inbox_create(256) # input that reaches a running instance without waiting for the lock
+    self.call(mcu_fn.mcu_set_inbox, self.inbox)
+    self.uart = bytearray() # transmitted by USART0 since the last flush, guarded by lock
+    self.call(mcu_fn.mcu_set_uart_output, uart_output)
+    self.status = mcu_types.Mcu_status_t()
+    self.data_memory = self.call(mcu_types.region_view, mcu_fn, mcu_types.REGION_DATA_MEMORY)
+    self.flash = self.call(mcu_types.region_view, mcu_fn, mcu_types.REGION_FLASH)
+    self.flash_frame = None # last one sent, new subscribers get it too
+    self.encoder = mcu_types.StateEncoder() # deltas from one tick to the next
+    self.running = True
+    self.run_mode = None # 'run', 'until break' or 'cycles' while a worker runs it
+    self.run_generation = 0 # every command starts a new run
+    self.run_cycles = 0
+    self.run_frequency = 0 # emulated Hz, 0 for full speed
+    self.run_start = 0
+    self.run_executed = 0
+    self.slice_cycles = 1000
+    self.last_frame = 0
+    self.frame_pending = False
+    self.cycles_used = 0
+    self.last_active = time.monotonic()
+    self.closed = False
+
+  def call(self, function, *args):
+    with self.lock:
+      mcu_fn.mcu_select(self.instance)
+      active.session = self
+      return function(*args)
+
+  def close(self):
+    for subscriber in self.subscribers:
+      if subscriber is not self.owner:
+        subscriber.post(json.dumps({'event': 'log', 'data': 'The session has ended\n'}))
+      subscriber.close()
+    self.closed = True
+    self.run_mode = None
+    self.run_generation += 1
+    with self.lock, self.log_lock:
+      mcu_fn.mcu_select(None)
+      mcu_fn.mcu_destroy(self.instance)
+      mcu_fn.log_destroy(self.log)
+      mcu_fn.inbox_destroy(self.inbox)
+      self.instance = self.log = self.inbox = self.data_memory = self.flash = None
+
+async def log(session, message):
+  await emit(session, 'log', message)
+
+async def web_console(session, message):
+  await emit(session, 'console', message)
+
+def read_log(session):
+  # Messages the core logged since the last call, joined into one chunk for the console
+  chunks = []
+  with session.log_lock:
+    if session.closed:
+      return ''
+    buffer = session.log_buffer
+    while True:
+      length = mcu_fn.log_read(session.log, buffer, len(buffer))
+      if length == 0:
+        break
+      data = buffer.raw[:length]
+      offset = 0
+      while offset < length:
+        level, size = data[offset], data[offset + 1] | data[offset + 2] << 8
+        text = data[offset + 3:offset + 3 + size].decode('utf-8', 'replace')
+        chunks.append('MCU exception! ' + text if level == LOG_ERROR else text)
+        offset += 3 + size
+    dropped = mcu_fn.log_dropped(session.log)
+  if dropped:
+    chunks.append(f'({dropped} messages dropped)\n')
+  return ''.join(chunks)
+
+async def flush_log(session):
+  data = read_log(session)
+  if data:
+    await web_console(session, data)
+  await flush_terminal(session)
+
+@ctypes.CFUNCTYPE(None, ctypes.c_uint8)
+def uart_output(value):
+  # Every byte, however many a slice transmits. Called with the session lock held
+  active.session.uart.append(value)
+
+def read_terminal(session):
+  with session.lock:
+    data, session.uart = session.uart, bytearray()
+  return data.decode('latin-1')
+
+async def flush_terminal(session):
+  data = read_terminal(session)
+  if data:
+    await emit(session, 'terminal', data)
 
 def start_http(arg):
   Handler = http.server.SimpleHTTPRequestHandler
@@ -30,117 +183,305 @@ def start_http(arg):
   with socketserver.TCPServer(("", http_port), Handler) as httpd:
     httpd.serve_forever()
 
-async def execute_c(function, check_state=False):
-  global mcu_running
-  with wurlitzer.pipes() as (out, err):
-    if check_state:
-      state = function()
-      mcu_running = state == 1
-      if not mcu_running:
-        await emit('execute stop', None)
-        await log('MCU has been stopped\n')
-    else:
-      function()
-  data = out.read()
-  if data:
-    await web_console(data)
+async def execute_c(session, function, check_state=False):
+  state = session.call(function)
+  await flush_log(session)
+  if check_state:
+    session.running = state == 1
+    if not session.running:
+      await emit(session, 'execute stop', None)
+      await log(session, 'MCU has been stopped\n')
 
 def on(event, callback):
   handlers[event] = callback
 
-async def emit(event, data):
-  await ws.send(json.dumps({'event': event, 'data': data}))
+async def emit(session, event, data):
+  # To everyone in the session, without waiting for slow sockets
+  if not session.closed:
+    message = json.dumps({'event': event, 'data': data})
+    for subscriber in session.subscribers:
+      subscriber.post(message)
 
-async def send_pong(data):
-  await emit('pong', 'pong')
+async def send_pong(session, data):
+  await emit(session, 'pong', 'pong')
 
-async def do_test(data):
-  global mcu
+async def do_test(session, data):
   print('Test data = ', data)
   string = 'This is a test'.encode('utf-8')
-  with wurlitzer.pipes() as (out, err):
-    mcu_fn.mcu_load_asm(string)
-  data = out.read()
-  if data:
-    await web_console(data)
+  session.call(mcu_fn.mcu_load_asm, string)
+  await flush_log(session)
 
-async def compile_asm(code):
-  string = code.encode('utf-8')
-  with wurlitzer.pipes() as (out, err):
-    result = mcu_fn.mcu_load_asm(string)
-  data = out.read()
-  if data:
-    await web_console(data)
+async def compile_asm(session, code):
+  session.call(mcu_fn.mcu_load_asm, code.encode('utf-8'))
+  await flush_log(session)
+  await send_flash(session)
 
-async def compile_c(code):
-  string = code.encode('utf-8')
-  with wurlitzer.pipes() as (out, err):
-    result = mcu_fn.mcu_load_c(string)
-  data = out.read()
-  if data:
-    await web_console(data)
-
-async def resume_mcu():
-  global mcu_running
-  mcu_fn.mcu_resume()
-  mcu_running = True
-  await emit('mcu resumed', None)
-  await log('MCU has been resumed\n')
-
-async def execute_cycle():
-  global mcu_running
-  if mcu_running:
-   await execute_c(mcu_fn.mcu_execute_cycle, True)
-   mcu_fn.mcu_get_copy(mcu)
-   await emit('mcu state', mcu_types.to_string(mcu))
-
-async def reset_mcu():
-  await execute_c(mcu_fn.mcu_init)
-  mcu_fn.mcu_get_copy(mcu)
-  await emit('mcu state', mcu_types.to_string(mcu))
-  await log('MCU resetted\n')
-
-async def interrupt_mcu(vect):
-  await log('Received interrupt (' + str(vect) + ')\n')
-  with wurlitzer.pipes() as (out, err):
-    mcu_fn.mcu_send_interrupt(vect)
-  data = out.read()
-  await log('MCU interrupted\n')
-  if data:
-    await web_console(data)
+async def compile_c(session, code):
+  session.call(mcu_fn.mcu_load_c, code.encode('utf-8'))
+  await flush_log(session)
+  await send_flash(session)
+
+async def resume_mcu(session):
+  session.call(mcu_fn.mcu_resume)
+  session.running = True
+  await emit(session, 'mcu resumed', None)
+  await log(session, 'MCU has been resumed\n')
+
+def take_state(session):
+  # Reads the instance in place, only data memory is copied
+  with session.lock:
+    if session.instance is None:
+      return None
+    mcu_fn.mcu_select(session.instance)
+    mcu_fn.mcu_get_status(session.status)
+    return mcu_types.snapshot(session.status, session.data_memory)
+
+async def send_flash(session):
+  # Program memory is not part of the state frames, it is sent on its own when it changed
+  with session.lock:
+    if session.instance is None:
+      return
+    frame = mcu_types.flash_frame(bytes(session.flash))
+  if frame != session.flash_frame:
+    session.flash_frame = frame
+    for subscriber in session.subscribers:
+      subscriber.post(frame)
+
+async def send_state(session):
+  state = take_state(session)
+  if state is not None:
+    broadcast(session, state, True)
+
+async def execute_cycle(session):
+  if session.running and session.run_mode is None:
+    if session.cycles_used >= cycle_quota:
+      await log(session, 'Cycle quota of this session used up\n')
+      return
+    session.cycles_used += 1
+    await execute_c(session, mcu_fn.mcu_execute_cycle, True)
+    await send_state(session)
+
+async def reset_mcu(session):
+  await execute_c(session, mcu_fn.mcu_init)
+  await send_flash(session)
+  await send_state(session)
+  await log(session, 'MCU resetted\n')
+
+async def interrupt_mcu(session, vect):
+  await log(session, 'Received interrupt (' + str(vect) + ')\n')
+  if not mcu_fn.inbox_interrupt(session.inbox, int(vect)): # entered before the next instruction, even mid-slice
+    await log(session, 'Too many pending inputs, interrupt dropped\n')
+    return
+  await log(session, 'MCU interrupted\n')
+  await flush_log(session)
+
+def broadcast(session, state, final=False):
+  # One tick. Subscribers that got the previous frame get the delta, the others the keyframe,
+  # each encoded once however many subscribers there are. A subscriber skips ticks that come
+  # sooner than its own frame rate allows, unless the frame is a final one.
+  # Runs on the event loop, so ticks are encoded in the order they were taken
+  session.frame_pending = False
+  if session.closed:
+    return
+  session.tick += 1
+  delta = session.encoder.encode(state)
+  keyframe = None
+  now = time.monotonic()
+  for subscriber in session.subscribers:
+    if not final and now - subscriber.last_frame < subscriber.interval - 0.5 / max_fps: # ticks jitter
+      subscriber.tick = None
+      continue
+    if subscriber.frame is None and subscriber.tick == session.tick - 1:
+      frame = delta
+    else:
+      keyframe = keyframe or session.encoder.keyframe(state)
+      frame = keyframe
+    subscriber.frame, subscriber.tick, subscriber.last_frame = frame, session.tick, now
+    subscriber.wake.set()
+
+def publish(session, final=False):
+  # Called on the worker threads
+  if session.frame_pending and not final or session.closed:
+    return
+  state = take_state(session)
+  if state is None:
+    return
+  session.frame_pending = True
+  output = read_log(session) # the console gets the log at the frame rate too
+  if output:
+    asyncio.run_coroutine_threadsafe(web_console(session, output), loop)
+  terminal = read_terminal(session) # sent ahead of the frame, it is a message
+  if terminal:
+    asyncio.run_coroutine_threadsafe(emit(session, 'terminal', terminal), loop)
+  loop.call_soon_threadsafe(broadcast, session, state, final)
+
+def finish(session, running, message=None):
+  session.run_mode = None
+  session.running = running
+  publish(session, True)
+  asyncio.run_coroutine_threadsafe(emit(session, 'execute stop', None), loop)
+  if not running:
+    message = 'MCU has been stopped\n'
+  if message:
+    asyncio.run_coroutine_threadsafe(log(session, message), loop)
+
+def run_slice(session, generation):
+  # One slice of emulated time sized to slice_time, paced to run_frequency if it is set.
+  # A run that wants more goes to the back of the queue, so sessions share the workers
+  item = (session, generation)
+  budget = session.slice_cycles
+  if session.run_mode == 'cycles':
+    budget = min(budget, session.run_cycles - session.run_executed)
+  if session.run_mode == 'run' and session.run_frequency > 0:
+    due = int((time.monotonic() - session.run_start) * session.run_frequency) - session.run_executed
+    if due <= 0:
+      delay = min(1 / max_fps, -due / session.run_frequency + 0.001)
+      loop.call_soon_threadsafe(loop.call_later, delay, run_queue.put, item)
+      return
+    budget = min(budget, due)
+  if budget <= 0:
+    finish(session, True)
+    return
+  if session.cycles_used >= cycle_quota:
+    finish(session, True, 'Cycle quota of this session used up\n')
+    return
+  budget = min(budget, cycle_quota - session.cycles_used)
+  with session.lock:
+    if generation != session.run_generation:
+      return # stopped or closed while queued
+    mcu_fn.mcu_select(session.instance)
+    active.session = session
+    slice_start = time.monotonic()
+    running = mcu_fn.mcu_run_cycles(budget) # runs over by less than an instruction
+    elapsed = time.monotonic() - slice_start
+  session.run_executed += budget
+  session.cycles_used += budget
+  session.slice_cycles = max(100, min(10000000, int(session.slice_cycles * slice_time / max(elapsed, 1e-6))))
+  if not running:
+    finish(session, False)
+    return
+  if time.monotonic() - session.last_frame >= 1 / max_fps:
+    session.last_frame = time.monotonic()
+    publish(session)
+  run_queue.put(item)
+
+def worker():
+  while True:
+    session, generation = run_queue.get()
+    if generation == session.run_generation and not session.closed:
+      run_slice(session, generation)
+
+async def run_mcu(session, data):
+  # data: {'mode': 'run' | 'until break' | 'cycles', 'cycles': N, 'frequency': Hz}
+  mode = data.get('mode', 'run') if isinstance(data, dict) else 'run'
+  if mode not in ('run', 'until break', 'cycles') or not session.running:
+    return
+  session.run_cycles = int(data.get('cycles', 0)) if isinstance(data, dict) else 0
+  session.run_frequency = float(data.get('frequency', 0) or 0) if isinstance(data, dict) else 0
+  session.run_start = session.last_frame = time.monotonic()
+  session.run_executed = 0
+  session.run_mode = mode
+  session.run_generation += 1
+  run_queue.put((session, session.run_generation))
+  await log(session, 'Running (' + mode + ')\n')
+
+async def stop_mcu(session):
+  if session.run_mode is None:
+    return
+  session.run_mode = None
+  session.run_generation += 1 # the queued slice is dropped
+  await emit(session, 'execute stop', None)
+  await flush_log(session)
+  await send_state(session) # where it stopped, after the slice in progress
 
 on('ping', send_pong)
 on('test', do_test)
 on('compile asm', compile_asm)
 on('compile c', compile_c)
 on('execute cycle', execute_cycle)
+on('run', run_mcu)
+on('stop', stop_mcu)
 on('mcu resume', resume_mcu)
 on('reset mcu', reset_mcu)
 on('interrupt', interrupt_mcu)
 
-async def ws_server(websocket, path):
-  global ws
-  global mcu_running
-  mcu_running = True
-  ws = websocket
-  await emit('ready', 'Hello')
-  await log('Connected with socket server\n')
-  await execute_c(mcu_fn.mcu_init)
+async def reap_idle():
+  # Stopped sessions that have not sent anything for idle_timeout are closed, which frees their instance
   while True:
-    try:
-      message = json.loads(await ws.recv())
-    except:
-      break
-    if message['event'] in handlers:
-      if 'data' in message:
-        await handlers[message['event']](message['data'])
-      else:
-        await handlers[message['event']]()
+    await asyncio.sleep(idle_timeout / 10)
+    now = time.monotonic()
+    for session in list(sessions.values()):
+      if session.run_mode is None and now - session.last_active > idle_timeout:
+        await log(session, 'Session closed after being idle\n')
+        await session.owner.ws.close()
+
+async def refuse(websocket, message):
+  await websocket.send(json.dumps({'event': 'log', 'data': message}))
+  await websocket.close()
+
+async def watch(websocket, session, fps):
+  # Read only, the viewer gets everything the owner gets at its own frame rate
+  subscriber = Subscriber(websocket, fps)
+  session.subscribers.append(subscriber)
+  try:
+    subscriber.post(json.dumps({'event': 'ready', 'data': 'Hello'}))
+    subscriber.post(json.dumps({'event': 'log', 'data': 'Watching session ' + session.id + '\n'}))
+    if session.flash_frame is not None:
+      subscriber.post(session.flash_frame)
+    await send_state(session) # a keyframe for the viewer, a delta for the others
+    while True:
+      try:
+        message = json.loads(await websocket.recv())
+      except:
+        break
+      if message['event'] == 'ping':
+        subscriber.post(json.dumps({'event': 'pong', 'data': 'pong'}))
+  finally:
+    if subscriber in session.subscribers:
+      session.subscribers.remove(subscriber)
+    subscriber.close()
+
+async def ws_server(websocket, path):
+  # ws://host/ starts a session, ws://host/watch/<id>?fps=N watches one
+  url = urllib.parse.urlsplit(path)
+  if url.path.startswith('/watch/'):
+    session = sessions.get(url.path[len('/watch/'):])
+    fps = urllib.parse.parse_qs(url.query).get('fps', [max_fps])[0]
+    if session is None or session.closed:
+      await refuse(websocket, 'No such session\n')
+    elif len(session.subscribers) > max_viewers:
+      await refuse(websocket, 'Too many viewers, try again later\n')
+    else:
+      await watch(websocket, session, float(fps))
+    return
+  if len(sessions) >= max_sessions:
+    await refuse(websocket, 'Server is full, try again later\n')
+    return
+  session = Session(websocket)
+  sessions[session.id] = session
+  try:
+    await emit(session, 'ready', 'Hello')
+    await emit(session, 'session', session.id)
+    await log(session, 'Connected with socket server\n')
+    await send_flash(session)
+    await send_state(session) # keyframe
+    while True:
+      try:
+        message = json.loads(await websocket.recv())
+      except:
+        break
+      session.last_active = time.monotonic()
+      if message['event'] in handlers:
+        if 'data' in message:
+          await handlers[message['event']](session, message['data'])
+        else:
+          await handlers[message['event']](session)
+  finally:
+    sessions.pop(session.id, None)
+    session.close()
 
 mcu_fn = ctypes.CDLL('../ATmega328p/mcu_shared.so')
-# void mcu_get_copy(ATmega328p_t *mcu);
-mcu_fn.mcu_get_copy.argtypes = [mcu_ptr]
-mcu_fn.mcu_get_copy.restypes = []
+mcu_types.bind(mcu_fn) # state accessors, fails on a library of another ABI version
 # bool mcu_load_asm(const char *code);
 mcu_fn.mcu_load_asm.argtypes = [ctypes.c_char_p]
 mcu_fn.mcu_load_asm.restypes = [ctypes.c_bool]
@@ -150,9 +491,48 @@ mcu_fn.mcu_load_c.restypes = [ctypes.c_bool]
 # bool mcu_execute_cycle(void);
 mcu_fn.mcu_execute_cycle.argtypes = []
 mcu_fn.mcu_execute_cycle.restypes = [ctypes.c_bool]
-# void mcu_send_interrupt(Interrupt_vector_t vector)
-mcu_fn.mcu_send_interrupt.argtypes = [ctypes.c_int]
-mcu_fn.mcu_send_interrupt.restypes = []
+# bool mcu_run_cycles(uint64_t cycles);
+mcu_fn.mcu_run_cycles.argtypes = [ctypes.c_uint64]
+mcu_fn.mcu_run_cycles.restype = ctypes.c_bool
+# Inbox_t *inbox_create(uint32_t size);
+mcu_fn.inbox_create.argtypes = [ctypes.c_uint32]
+mcu_fn.inbox_create.restype = ctypes.c_void_p
+# bool inbox_interrupt(Inbox_t *inbox, Interrupt_vector_t vector);
+mcu_fn.inbox_interrupt.argtypes = [ctypes.c_void_p, ctypes.c_int]
+mcu_fn.inbox_interrupt.restype = ctypes.c_bool
+# void inbox_destroy(Inbox_t *inbox);
+mcu_fn.inbox_destroy.argtypes = [ctypes.c_void_p]
+mcu_fn.inbox_destroy.restype = None
+# void mcu_set_inbox(struct Inbox_t *inbox);
+mcu_fn.mcu_set_inbox.argtypes = [ctypes.c_void_p]
+mcu_fn.mcu_set_inbox.restype = None
+# ATmega328p_t *mcu_create(void);
+mcu_fn.mcu_create.argtypes = []
+mcu_fn.mcu_create.restype = ctypes.c_void_p
+# void mcu_destroy(ATmega328p_t *instance);
+mcu_fn.mcu_destroy.argtypes = [ctypes.c_void_p]
+mcu_fn.mcu_destroy.restype = None
+# void mcu_select(ATmega328p_t *instance);
+mcu_fn.mcu_select.argtypes = [ctypes.c_void_p]
+mcu_fn.mcu_select.restype = None
+# Log_t *log_create(uint32_t size, byte level);
+mcu_fn.log_create.argtypes = [ctypes.c_uint32, ctypes.c_uint8]
+mcu_fn.log_create.restype = ctypes.c_void_p
+# uint32_t log_read(Log_t *log, char *output, uint32_t size);
+mcu_fn.log_read.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_uint32]
+mcu_fn.log_read.restype = ctypes.c_uint32
+# uint64_t log_dropped(Log_t *log);
+mcu_fn.log_dropped.argtypes = [ctypes.c_void_p]
+mcu_fn.log_dropped.restype = ctypes.c_uint64
+# void log_destroy(Log_t *log);
+mcu_fn.log_destroy.argtypes = [ctypes.c_void_p]
+mcu_fn.log_destroy.restype = None
+# void mcu_set_uart_output(void (*output)(byte value));
+mcu_fn.mcu_set_uart_output.argtypes = [type(uart_output)]
+mcu_fn.mcu_set_uart_output.restype = None
+# void mcu_set_log(struct Log_t *log);
+mcu_fn.mcu_set_log.argtypes = [ctypes.c_void_p]
+mcu_fn.mcu_set_log.restype = None
 
 http_thread = threading.Thread(target=start_http, args=(None, ), daemon=True)
 http_thread.start()
@@ -161,5 +541,10 @@ start_server = websockets.serve(ws_server, host, ws_port)
 
 print(f"HTTP server:{http_port}, socket server:{ws_port}")
 
-asyncio.get_event_loop().run_until_complete(start_server)
-asyncio.get_event_loop().run_forever()
\ No newline at end of file
+loop = asyncio.get_event_loop()
+for i in range(workers):
+  threading.Thread(target=worker, daemon=True).start()
+
+loop.run_until_complete(start_server)
+loop.create_task(reap_idle())
+asyncio.get_event_loop().run_forever()